@@ -90,6 +90,27 @@ const static uint8_t s_mds_supported_features[] = {
     //! Valid SNs used when sending data are 0-31
     #define MDS_TOTAL_SEQ_NUMBERS 32
 
+    //! MDS UUIDs, 54220000-f6a5-4007-a371-722f4ebd8436 with the 16-bit id in the 3rd and 4th
+    //! bytes, stored least significant byte first like ble_uuid_from_string() would produce
+    #define MDS_UUID128(id)                                                                   \
+      {                                                                                      \
+        .type = ATT_UUID_128,                                                                \
+        .uuid128 = { 0x36, 0x84, 0xbd, 0x4e, 0x2f, 0x72, 0x71, 0xa3, 0x07, 0x40, 0xa5, 0xf6, \
+                     (id) & 0xff, ((id) >> 8) & 0xff, 0x22, 0x54 },                         \
+      }
+
+//! Service definition, resolved at compile time instead of parsing UUID strings in mds_boot()
+static const att_uuid_t s_mds_svc_uuid = MDS_UUID128(0x0000);
+static const att_uuid_t s_mds_supported_features_uuid = MDS_UUID128(0x0001);
+static const att_uuid_t s_mds_device_id_uuid = MDS_UUID128(0x0002);
+static const att_uuid_t s_mds_data_uri_uuid = MDS_UUID128(0x0003);
+static const att_uuid_t s_mds_auth_uuid = MDS_UUID128(0x0004);
+static const att_uuid_t s_mds_data_export_uuid = MDS_UUID128(0x0005);
+static const att_uuid_t s_mds_cccd_uuid = {
+  .type = ATT_UUID_16,
+  .uuid16 = UUID_GATT_CLIENT_CHAR_CONFIGURATION,
+};
+
 typedef enum {
   kMdsDataExportMode_StreamingDisabled = 0x00,
   kMdsDataExportMode_FullStreamingEnabled = 0x01,
@@ -407,32 +428,26 @@ void *mds_boot(void) {
   const uint16_t num_descriptors = 1;
   uint16_t num_attr = ble_gatts_get_num_attr(num_includes, num_characteristics, num_descriptors);
 
-  att_uuid_t uuid;
-  ble_uuid_from_string("54220000-f6a5-4007-a371-722f4ebd8436", &uuid);
-  ble_gatts_add_service(&uuid, GATT_SERVICE_PRIMARY, num_attr);
+  ble_gatts_add_service(&s_mds_svc_uuid, GATT_SERVICE_PRIMARY, num_attr);
 
-  ble_uuid_from_string("54220001-f6a5-4007-a371-722f4ebd8436", &uuid);
-  ble_gatts_add_characteristic(&uuid, GATT_PROP_READ, ATT_PERM_RW, sizeof(uint8_t),
-                               GATTS_FLAG_CHAR_READ_REQ, NULL, &mds->supported_features_h);
+  ble_gatts_add_characteristic(&s_mds_supported_features_uuid, GATT_PROP_READ, ATT_PERM_RW,
+                               sizeof(uint8_t), GATTS_FLAG_CHAR_READ_REQ, NULL,
+                               &mds->supported_features_h);
 
-  ble_uuid_from_string("54220002-f6a5-4007-a371-722f4ebd8436", &uuid);
-  ble_gatts_add_characteristic(&uuid, GATT_PROP_READ, ATT_PERM_RW, sizeof(uint8_t),
+  ble_gatts_add_characteristic(&s_mds_device_id_uuid, GATT_PROP_READ, ATT_PERM_RW, sizeof(uint8_t),
                                GATTS_FLAG_CHAR_READ_REQ, NULL, &mds->device_id_h);
 
-  ble_uuid_from_string("54220003-f6a5-4007-a371-722f4ebd8436", &uuid);
-  ble_gatts_add_characteristic(&uuid, GATT_PROP_READ, ATT_PERM_RW, sizeof(uint8_t),
+  ble_gatts_add_characteristic(&s_mds_data_uri_uuid, GATT_PROP_READ, ATT_PERM_RW, sizeof(uint8_t),
                                GATTS_FLAG_CHAR_READ_REQ, NULL, &mds->data_uri_h);
 
-  ble_uuid_from_string("54220004-f6a5-4007-a371-722f4ebd8436", &uuid);
-  ble_gatts_add_characteristic(&uuid, GATT_PROP_READ, ATT_PERM_RW, sizeof(uint8_t),
+  ble_gatts_add_characteristic(&s_mds_auth_uuid, GATT_PROP_READ, ATT_PERM_RW, sizeof(uint8_t),
                                GATTS_FLAG_CHAR_READ_REQ, NULL, &mds->auth_h);
 
-  ble_uuid_from_string("54220005-f6a5-4007-a371-722f4ebd8436", &uuid);
-  ble_gatts_add_characteristic(&uuid, GATT_PROP_NOTIFY | GATT_PROP_WRITE, ATT_PERM_RW,
-                               sizeof(uint8_t), GATTS_FLAG_CHAR_READ_REQ, NULL, &mds->chunk_val_h);
+  ble_gatts_add_characteristic(&s_mds_data_export_uuid, GATT_PROP_NOTIFY | GATT_PROP_WRITE,
+                               ATT_PERM_RW, sizeof(uint8_t), GATTS_FLAG_CHAR_READ_REQ, NULL,
+                               &mds->chunk_val_h);
 
-  ble_uuid_create16(UUID_GATT_CLIENT_CHAR_CONFIGURATION, &uuid);
-  ble_gatts_add_descriptor(&uuid, ATT_PERM_RW, 2, 0, &mds->chunk_cccd_h);
+  ble_gatts_add_descriptor(&s_mds_cccd_uuid, ATT_PERM_RW, 2, 0, &mds->chunk_cccd_h);
 
   ble_gatts_register_service(&mds->svc.start_h, &mds->supported_features_h, &mds->device_id_h,
                              &mds->data_uri_h, &mds->auth_h, &mds->chunk_val_h, &mds->chunk_cccd_h,
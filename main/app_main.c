@@ -0,0 +1,68 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+#include "sdkconfig.h"
+
+#include "ble_bench.h"
+#include "ble_host.h"
+#include "gatts_demo.h"
+#if CONFIG_EXAMPLE_MDS_ENABLE
+#include "mds.h"
+#endif
+#if CONFIG_EXAMPLE_INGEST_ENABLE
+#include "ingest.h"
+#endif
+#if CONFIG_EXAMPLE_CONN_POLICY
+#include "conn_policy.h"
+#endif
+
+void app_main(void)
+{
+    esp_err_t ret;
+
+    // Initialize NVS.
+    ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK( ret );
+
+#if CONFIG_EXAMPLE_MDS_ENABLE
+    ret = mds_init();
+    if (ret){
+        ESP_LOGE(GATTS_TAG, "mds init error, error code = %x", ret);
+        return;
+    }
+#endif
+
+#if CONFIG_EXAMPLE_INGEST_ENABLE
+    ret = ingest_init();
+    if (ret){
+        ESP_LOGE(GATTS_TAG, "ingest init error, error code = %x", ret);
+        return;
+    }
+#endif
+
+#if CONFIG_EXAMPLE_CONN_POLICY
+    ret = conn_policy_init();
+    if (ret){
+        ESP_LOGE(GATTS_TAG, "conn policy init error, error code = %x", ret);
+        return;
+    }
+#endif
+
+    ble_bench_host_init_start();
+
+    ret = ble_host_init();
+    if (ret){
+        ESP_LOGE(GATTS_TAG, "%s ble host init failed: %s", __func__, esp_err_to_name(ret));
+        return;
+    }
+}
@@ -0,0 +1,229 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Host stack benchmark. Build once with Bluedroid and once with NimBLE (see
+* sdkconfig.nimble) and compare the BLE_BENCH lines: heap taken by the controller and
+* host, boot-to-advertising and boot-to-service-ready time, MDS notification goodput
+* while a gateway drains data and, on Bluedroid, the write pool usage next to the heap.
+*
+* The modules keep their own counters. The report timer only collects them through their
+* *_stats_get() calls and logs them.
+*
+****************************************************************************/
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+
+#include "ble_bench.h"
+#include "gatts_demo.h"
+#if CONFIG_EXAMPLE_MDS_ENABLE
+#include "mds.h"
+#endif
+#if CONFIG_EXAMPLE_CONN_POLICY
+#include "conn_policy.h"
+#endif
+#if CONFIG_BT_BLUEDROID_ENABLED
+#include "gatts_table.h"
+#endif
+
+static size_t s_heap_before_init;
+static int64_t s_init_start_us;
+static bool s_adv_reported;
+static esp_timer_handle_t s_report_timer;
+static int64_t s_report_start_us;
+// Link the goodput of the current report period was measured on
+static uint8_t s_link_phy = 1;
+static uint16_t s_link_tx_octets = 27;
+
+static const char *ble_bench_phy_str(uint8_t phy)
+{
+    switch (phy) {
+    case 1:
+        return "1M";
+    case 2:
+        return "2M";
+    case 3:
+        return "Coded";
+    default:
+        return "?";
+    }
+}
+
+static void ble_bench_report(void *arg)
+{
+#if CONFIG_EXAMPLE_CONN_POLICY
+    // Also reported while idle, that is where the slow profile pays off
+    conn_policy_stats_t policy;
+    conn_policy_stats_get(&policy);
+    if (policy.fast_ms || policy.idle_ms) {
+        ESP_LOGI(BLE_BENCH_TAG, "%s: conn params fast %u ms, idle %u ms, ~%u connection events; "
+                 "drained %u ms in %u burst(s); %u request(s), %u rejected", BLE_BENCH_BACKEND,
+                 (unsigned)policy.fast_ms, (unsigned)policy.idle_ms, (unsigned)policy.conn_events,
+                 (unsigned)policy.busy_ms, (unsigned)policy.busy_episodes, (unsigned)policy.requests,
+                 (unsigned)policy.rejections);
+    }
+#endif
+
+#if CONFIG_BT_BLUEDROID_ENABLED
+    // Writes come from the pools, the free heap and its largest block stay flat however long
+    // the clients keep writing
+    long_write_stats_t prepare;
+    mem_pool_stats_t rsp;
+    example_write_stats_get(&prepare, &rsp);
+    if (prepare.segs.allocs || rsp.allocs || prepare.segs.failures || rsp.failures) {
+        ESP_LOGI(BLE_BENCH_TAG, "%s: write pools: %u long write segment(s) (%u/%u in use, peak %u, %u refused), "
+                 "%u response(s) (peak %u/%u, %u refused); free heap %u, largest block %u", BLE_BENCH_BACKEND,
+                 (unsigned)prepare.segs.allocs, prepare.segs.in_use, prepare.segs.count, prepare.segs.high_water,
+                 (unsigned)prepare.segs.failures, (unsigned)rsp.allocs, rsp.high_water, rsp.count,
+                 (unsigned)rsp.failures, (unsigned)esp_get_free_heap_size(),
+                 (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    }
+    if (prepare.executed) {
+        ESP_LOGI(BLE_BENCH_TAG, "%s: %u long write(s), %u bytes in %u prepare write(s), %u ms, %u B/s",
+                 BLE_BENCH_BACKEND, (unsigned)prepare.executed, (unsigned)prepare.bytes,
+                 (unsigned)prepare.fragments, (unsigned)prepare.elapsed_ms,
+                 prepare.elapsed_ms ? (unsigned)(prepare.bytes * 1000ULL / prepare.elapsed_ms) : 0);
+    }
+
+    gatts_table_stats_t table;
+    gatts_table_stats_get(&table);
+    // Constant per event, however many services are registered
+    if (table.routed) {
+        ESP_LOGI(BLE_BENCH_TAG, "%s: %u attribute event(s) routed, %u cycles each", BLE_BENCH_BACKEND,
+                 (unsigned)table.routed, (unsigned)(table.route_cycles / table.routed));
+    }
+    // Reads of ESP_GATT_AUTO_RSP values are answered by the stack and cost the app nothing
+    if (table.app_reads) {
+        ESP_LOGI(BLE_BENCH_TAG, "%s: %u read(s) answered by the app, %u cycles each on the BTC task",
+                 BLE_BENCH_BACKEND, (unsigned)table.app_reads, (unsigned)(table.app_read_cycles / table.app_reads));
+    }
+#endif
+
+    value_cache_stats_t value;
+    notify_coalesce_stats_t co;
+    indicate_queue_stats_t ind;
+    example_char_a_stats_get(&value, &co, &ind);
+
+    // Unchanged updates cost no airtime, with the delta format neither do unchanged bytes
+    if (value.updates || value.notifications) {
+        ESP_LOGI(BLE_BENCH_TAG, "%s: %u cached value update(s), %u unchanged; %u notification(s) from %u "
+                 "buffer(s), %u B sent for %u B of full values", BLE_BENCH_BACKEND, (unsigned)value.updates,
+                 (unsigned)value.unchanged, (unsigned)value.notifications, (unsigned)value.tx_bufs,
+                 (unsigned)value.bytes, (unsigned)value.full_bytes);
+    }
+
+    // However fast the producer, one notification per subscriber and window
+    if (co.updates) {
+        ESP_LOGI(BLE_BENCH_TAG, "%s: %u update(s) coalesced into %u window(s), %u superseded, %u dropped; "
+                 "%u notification(s), latency %u us avg, %u us max", BLE_BENCH_BACKEND, (unsigned)co.updates,
+                 (unsigned)co.windows, (unsigned)co.superseded, (unsigned)co.dropped, (unsigned)co.notifications,
+                 co.windows ? (unsigned)(co.latency_us / co.windows) : 0, (unsigned)co.latency_max_us);
+    }
+
+    // A pipelined queue keeps the wait short, the latency is the client's round trip
+    const uint32_t ind_done = ind.confirmed + ind.stalled;
+    if (ind_done || ind.refused) {
+        ESP_LOGI(BLE_BENCH_TAG, "%s: %u indication(s) confirmed, %u stalled, %u refused, queued %u us avg; "
+                 "depth 0/1/2-3/4+: %u/%u/%u/%u", BLE_BENCH_BACKEND, (unsigned)ind.confirmed,
+                 (unsigned)ind.stalled, (unsigned)ind.refused, ind_done ? (unsigned)(ind.wait_us / ind_done) : 0,
+                 (unsigned)ind.depth[0], (unsigned)ind.depth[1], (unsigned)ind.depth[2], (unsigned)ind.depth[3]);
+        ESP_LOGI(BLE_BENCH_TAG, "%s: confirmation latency <10/<30/<100/<300/<1000/more ms: %u/%u/%u/%u/%u/%u",
+                 BLE_BENCH_BACKEND, (unsigned)ind.latency[0], (unsigned)ind.latency[1], (unsigned)ind.latency[2],
+                 (unsigned)ind.latency[3], (unsigned)ind.latency[4], (unsigned)ind.latency[5]);
+    }
+
+#if CONFIG_EXAMPLE_MDS_ENABLE
+    const int64_t now_us = esp_timer_get_time();
+    const int64_t elapsed_us = now_us - s_report_start_us;
+    mds_stats_t stats;
+
+    s_report_start_us = now_us;
+    mds_stats_get(&stats);
+    if (stats.tx_bytes == 0 || elapsed_us <= 0) {
+        return;
+    }
+
+    ESP_LOGI(BLE_BENCH_TAG, "%s: MDS pipeline depth %u/%u, %u.%02u notifications per connection event (interval %u)",
+             BLE_BENCH_BACKEND, stats.depth, stats.max_depth, (unsigned)(stats.pkts_per_event_x100 / 100),
+             (unsigned)(stats.pkts_per_event_x100 % 100), stats.conn_interval);
+    ESP_LOGI(BLE_BENCH_TAG, "%s: MDS congestion episodes %u, paused %u ms", BLE_BENCH_BACKEND,
+             (unsigned)stats.congest_episodes, (unsigned)stats.congest_paused_ms);
+    ESP_LOGI(BLE_BENCH_TAG, "%s: notification goodput %u B/s on %s PHY / %u B LL payload, %u bytes copied per chunk",
+             BLE_BENCH_BACKEND, (unsigned)(stats.tx_bytes * 1000000ULL / elapsed_us), ble_bench_phy_str(s_link_phy),
+             s_link_tx_octets, stats.tx_chunks ? (unsigned)(stats.tx_copied / stats.tx_chunks) : 0);
+
+    const uint32_t raw = stats.compress_raw;
+    const uint32_t out = stats.compress_out;
+    if (raw && out) {
+        // Raw bytes per second is what the gateway effectively drains
+        ESP_LOGI(BLE_BENCH_TAG, "%s: compression ratio %u.%02u, %u cycles/byte, drained %u raw B/s", BLE_BENCH_BACKEND,
+                 (unsigned)(raw / out), (unsigned)(raw * 100ULL / out % 100), (unsigned)(stats.compress_cycles / raw),
+                 (unsigned)(raw * 1000000ULL / elapsed_us));
+    }
+#endif
+}
+
+void ble_bench_host_init_start(void)
+{
+    s_heap_before_init = esp_get_free_heap_size();
+    s_init_start_us = esp_timer_get_time();
+    s_report_start_us = s_init_start_us;
+
+    const esp_timer_create_args_t report_timer_args = {
+        .callback = ble_bench_report,
+        .name = "ble_bench",
+    };
+    if (esp_timer_create(&report_timer_args, &s_report_timer) == ESP_OK) {
+        esp_timer_start_periodic(s_report_timer, CONFIG_EXAMPLE_BLE_BENCH_REPORT_INTERVAL_MS * 1000ULL);
+    }
+}
+
+void ble_bench_adv_started(void)
+{
+    if (s_adv_reported) {
+        return;
+    }
+    s_adv_reported = true;
+
+    const int64_t now_us = esp_timer_get_time();
+    const size_t free_heap = esp_get_free_heap_size();
+    ESP_LOGI(BLE_BENCH_TAG, "%s: boot to advertising %" PRId64 " ms (host init %" PRId64 " ms)",
+             BLE_BENCH_BACKEND, now_us / 1000, (now_us - s_init_start_us) / 1000);
+    ESP_LOGI(BLE_BENCH_TAG, "%s: controller + host heap %u bytes, free heap %u, min free heap %u",
+             BLE_BENCH_BACKEND, (unsigned)(s_heap_before_init - free_heap), (unsigned)free_heap,
+             (unsigned)esp_get_minimum_free_heap_size());
+}
+
+void ble_bench_service_ready(const char *name)
+{
+    const int64_t now_us = esp_timer_get_time();
+    ESP_LOGI(BLE_BENCH_TAG, "%s: %s service ready %" PRId64 " ms after boot (host init + %" PRId64 " ms)",
+             BLE_BENCH_BACKEND, name, now_us / 1000, (now_us - s_init_start_us) / 1000);
+}
+
+void ble_bench_link_update(uint8_t phy, uint16_t tx_octets)
+{
+    if ((phy == 0 || phy == s_link_phy) && (tx_octets == 0 || tx_octets == s_link_tx_octets)) {
+        return;
+    }
+
+    // Close the period measured on the previous link so each combination gets its own figure
+    ble_bench_report(NULL);
+    if (phy) {
+        s_link_phy = phy;
+    }
+    if (tx_octets) {
+        s_link_tx_octets = tx_octets;
+    }
+    ESP_LOGI(BLE_BENCH_TAG, "%s: link now %s PHY / %u B LL payload", BLE_BENCH_BACKEND,
+             ble_bench_phy_str(s_link_phy), s_link_tx_octets);
+}
@@ -0,0 +1,33 @@
+#ifndef BLE_BENCH_H
+#define BLE_BENCH_H
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+#define BLE_BENCH_TAG "BLE_BENCH"
+
+#if CONFIG_BT_NIMBLE_ENABLED
+#define BLE_BENCH_BACKEND "NimBLE"
+#else
+#define BLE_BENCH_BACKEND "Bluedroid"
+#endif
+
+#if CONFIG_EXAMPLE_BLE_BENCH
+// Call right before ble_host_init(), samples the free heap and the start time
+void ble_bench_host_init_start(void);
+// Call when advertising has started, logs boot-to-advertising time and host RAM usage once
+void ble_bench_adv_started(void);
+// Call when a service is started and fully populated, logs boot-to-service-ready time
+void ble_bench_service_ready(const char *name);
+// Call when the PHY (HCI value, 1 = 1M, 2 = 2M, 3 = Coded) or LL TX payload size of the link
+// changes, 0 keeps the current value. Goodput is reported per PHY/data length combination.
+void ble_bench_link_update(uint8_t phy, uint16_t tx_octets);
+#else
+static inline void ble_bench_host_init_start(void) {}
+static inline void ble_bench_adv_started(void) {}
+static inline void ble_bench_service_ready(const char *name) {}
+static inline void ble_bench_link_update(uint8_t phy, uint16_t tx_octets) {}
+#endif
+
+#endif // BLE_BENCH_H
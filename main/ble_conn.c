@@ -0,0 +1,95 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Per-connection context pool. The host stack backends fill the contexts from connection,
+* MTU, congestion, data length and PHY events, so the data path (MDS pump, notifications)
+* reads cached values instead of asking the stack.
+*
+* Slots are open addressed: conn_id % BLE_CONN_MAX is the home slot and only a collision
+* moves a connection further along. At most BLE_CONN_MAX connections are open, so a free
+* slot always exists for a new one.
+*
+****************************************************************************/
+
+#include <string.h>
+#include "esp_log.h"
+
+#include "ble_conn.h"
+
+#define BLE_CONN_TAG "BLE_CONN"
+
+static ble_conn_t s_conns[BLE_CONN_MAX];
+
+ble_conn_t *ble_conn_get(uint16_t conn_id)
+{
+    unsigned slot = conn_id % BLE_CONN_MAX;
+
+    for (int probe = 0; probe < BLE_CONN_MAX; probe++) {
+        ble_conn_t *conn = &s_conns[slot];
+
+        if (conn->in_use && conn->conn_id == conn_id) {
+            return conn;
+        }
+        slot = slot + 1 == BLE_CONN_MAX ? 0 : slot + 1;
+    }
+    return NULL;
+}
+
+ble_conn_t *ble_conn_open(uint16_t conn_id)
+{
+    ble_conn_t *conn = ble_conn_get(conn_id);
+    if (conn) {
+        return conn;
+    }
+
+    unsigned slot = conn_id % BLE_CONN_MAX;
+    for (int probe = 0; probe < BLE_CONN_MAX; probe++) {
+        conn = &s_conns[slot];
+
+        if (!conn->in_use) {
+            memset(conn, 0, sizeof(*conn));
+            conn->conn_id = conn_id;
+            conn->mtu = BLE_CONN_DEFAULT_MTU;
+            conn->phy = BLE_CONN_DEFAULT_PHY;
+            conn->tx_octets = BLE_CONN_DEFAULT_TX_OCTETS;
+            conn->in_use = true;
+            return conn;
+        }
+        slot = slot + 1 == BLE_CONN_MAX ? 0 : slot + 1;
+    }
+
+    ESP_LOGE(BLE_CONN_TAG, "No context left for conn_id %u", conn_id);
+    return NULL;
+}
+
+void ble_conn_close(uint16_t conn_id)
+{
+    ble_conn_t *conn = ble_conn_get(conn_id);
+
+    if (conn) {
+        conn->in_use = false;
+    }
+}
+
+ble_conn_t *ble_conn_slot_get(unsigned slot)
+{
+    if (slot >= BLE_CONN_MAX || !s_conns[slot].in_use) {
+        return NULL;
+    }
+    return &s_conns[slot];
+}
+
+ble_conn_t *ble_conn_find_by_addr(const uint8_t remote_bda[6])
+{
+    for (int i = 0; i < BLE_CONN_MAX; i++) {
+        if (s_conns[i].in_use && memcmp(s_conns[i].remote_bda, remote_bda, sizeof(s_conns[i].remote_bda)) == 0) {
+            return &s_conns[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,101 @@
+#ifndef BLE_CONN_H
+#define BLE_CONN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#if CONFIG_BT_NIMBLE_ENABLED
+#define BLE_CONN_MAX CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#else
+#define BLE_CONN_MAX CONFIG_BT_ACL_CONNECTIONS
+#endif
+
+// Defaults until the peer negotiates something else
+#define BLE_CONN_DEFAULT_MTU       23
+#define BLE_CONN_DEFAULT_TX_OCTETS 27
+#define BLE_CONN_DEFAULT_PHY       1    // HCI value, 1M
+
+// Client Characteristic Configuration descriptors tracked per connection
+typedef enum {
+    BLE_CONN_CCCD_DEMO,     // Demo characteristic 0xFF01
+    BLE_CONN_CCCD_MDS,      // MDS Data Export
+    BLE_CONN_CCCD_INGEST,   // Bulk ingest Control
+    BLE_CONN_CCCD_NB,
+} ble_conn_cccd_t;
+
+struct long_write_seg;
+
+// Long (prepared) write being reassembled as a chain of pooled segments, see long_write.h.
+// Bluedroid hands every Prepare Write Request to the application, NimBLE reassembles long
+// writes itself and leaves this unused.
+typedef struct {
+    struct long_write_seg *head;
+    struct long_write_seg *tail;
+    uint16_t handle;
+    uint32_t len;
+    uint32_t fragments;
+    int64_t start_us;
+} ble_conn_prepare_t;
+
+// Connection parameter policy of one connection, see conn_policy.c. Written under the
+// policy lock, the timer is created on connect and deleted on disconnect.
+#define BLE_CONN_POLICY_PROFILE_NB 2    // fast, idle
+typedef struct {
+    esp_timer_handle_t timer;   // Next decision: idle delay, backoff or response timeout
+    uint32_t busy;              // CONN_POLICY_BUSY_* reasons
+    int64_t idle_since_us;
+    uint8_t profile;            // Profile in effect and requested one, or none
+    uint8_t pending;
+    int64_t pending_since_us;
+    uint8_t rejects[BLE_CONN_POLICY_PROFILE_NB];
+    int64_t retry_us[BLE_CONN_POLICY_PROFILE_NB];
+    // Parameters in effect and time accounted so far, for the radio-on estimate
+    uint16_t interval;
+    uint16_t latency;
+    int64_t account_us;
+    int64_t event_rem_us;
+} ble_conn_policy_t;
+
+// State of one connection, owned by the host stack backend. Fields are written from the
+// host task and may be read from any task.
+typedef struct {
+    bool in_use;
+    uint16_t conn_id;
+    uint8_t remote_bda[6];
+
+    uint16_t mtu;
+    uint16_t conn_interval;     // 1.25 ms units
+    uint16_t conn_latency;
+    uint8_t phy;                // TX PHY, HCI value
+    uint16_t tx_octets;         // LL TX payload size
+    bool congested;
+
+    uint16_t cccd[BLE_CONN_CCCD_NB];
+    ble_conn_prepare_t prepare;
+    ble_conn_policy_t policy;
+} ble_conn_t;
+
+// Fixed pool of BLE_CONN_MAX connection contexts, indexed by conn_id. Bluedroid conn_ids are
+// below CONFIG_BT_ACL_CONNECTIONS, so every lookup hits its home slot; NimBLE conn handles
+// only probe further when two live handles collide modulo the pool size.
+
+// Take a context for a new connection, reset to the defaults. Returns the existing context
+// if conn_id is already open (Bluedroid reports a connection once per registered
+// profile) and NULL if the pool is full.
+ble_conn_t *ble_conn_open(uint16_t conn_id);
+// Release the context of conn_id, call after every user has seen the disconnect and released
+// what the context points to (the prepare segments)
+void ble_conn_close(uint16_t conn_id);
+// Context of an open connection, NULL if conn_id is unknown
+ble_conn_t *ble_conn_get(uint16_t conn_id);
+// Context by peer address, for Bluedroid GAP events that carry no conn_id. Scans the pool,
+// keep it off the data path.
+ble_conn_t *ble_conn_find_by_addr(const uint8_t remote_bda[6]);
+// Context in pool slot 0..BLE_CONN_MAX-1, NULL if the slot is free. For scans over all open
+// connections, keep it off the data path.
+ble_conn_t *ble_conn_slot_get(unsigned slot);
+
+#endif // BLE_CONN_H
@@ -0,0 +1,11 @@
+#ifndef BLE_HOST_H
+#define BLE_HOST_H
+
+#include "esp_err.h"
+
+// Bring up the controller and the configured host stack, register the demo and MDS
+// services and start advertising. Implemented by gatts_demo.c on Bluedroid and by
+// gatts_demo_nimble.c on NimBLE, so app_main is the same on both stacks.
+esp_err_t ble_host_init(void);
+
+#endif // BLE_HOST_H
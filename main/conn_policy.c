@@ -0,0 +1,385 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Connection parameter policy, stack-neutral. The host stack backends (gatts_demo.c and
+* gatts_demo_nimble.c) report connection and update events and provide
+* conn_policy_port_update; MDS and the demo service report when they have data to move.
+*
+* Two profiles: fast (short interval, no peripheral latency) while any busy reason is set,
+* idle (long interval with peripheral latency) once the link has been quiet for
+* CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS. The delay keeps bursts of events from bouncing
+* the link between profiles. Only one request per connection is outstanding at a time. A
+* profile the central rejects, answers with an interval outside the requested range or does
+* not answer within CONN_POLICY_RSP_TIMEOUT_MS is not asked for again before a per-profile
+* backoff expires, doubling from CONFIG_EXAMPLE_CONN_POLICY_RETRY_MS with every rejection in
+* a row.
+*
+* Every connection runs the policy on its own, with its state in its ble_conn context
+* (ble_conn_policy_t). All entry points run under one mutex, the pending decision of a
+* connection (idle delay, backoff, response timeout) is driven by its own one-shot esp_timer,
+* created on connect and deleted on disconnect. The statistics are summed over connections.
+*
+****************************************************************************/
+
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "sdkconfig.h"
+
+#include "ble_conn.h"
+#include "conn_policy.h"
+#if CONFIG_EXAMPLE_MDS_ENABLE
+#include "mds.h"
+#endif
+
+// Connection parameter procedures time out after 30 s on the peer side as well
+#define CONN_POLICY_RSP_TIMEOUT_MS 30000
+// Backoff stops doubling at 16 times CONFIG_EXAMPLE_CONN_POLICY_RETRY_MS
+#define CONN_POLICY_MAX_BACKOFF_SHIFT 4
+
+typedef enum {
+    CONN_POLICY_PROFILE_FAST,
+    CONN_POLICY_PROFILE_IDLE,
+    CONN_POLICY_PROFILE_NB,
+    // No profile requested yet or none pending
+    CONN_POLICY_PROFILE_NONE = CONN_POLICY_PROFILE_NB,
+} conn_policy_profile_t;
+
+/* Both profiles follow the Apple accessory guidelines: interval min >= 15 ms, max >= min +
+ * 15 ms, max * (latency + 1) <= 2 s and a supervision timeout of at most 6 s.
+ */
+static const conn_policy_params_t s_profiles[CONN_POLICY_PROFILE_NB] = {
+    [CONN_POLICY_PROFILE_FAST] = {
+        .min_int = 0x0c,    // 15 ms
+        .max_int = 0x18,    // 30 ms
+        .latency = 0,
+        .timeout = 400,     // 4 s
+    },
+    [CONN_POLICY_PROFILE_IDLE] = {
+        .min_int = 0x90,    // 180 ms
+        .max_int = 0xa8,    // 210 ms
+        .latency = 4,       // listen at least every 1050 ms
+        .timeout = 600,     // 6 s
+    },
+};
+
+static const char *const s_profile_names[CONN_POLICY_PROFILE_NB] = {
+    [CONN_POLICY_PROFILE_FAST] = "fast",
+    [CONN_POLICY_PROFILE_IDLE] = "idle",
+};
+
+_Static_assert(CONN_POLICY_PROFILE_NB == BLE_CONN_POLICY_PROFILE_NB, "ble_conn_policy_t is sized for the profiles");
+
+static SemaphoreHandle_t s_lock;
+
+static struct {
+    int64_t profile_us[CONN_POLICY_PROFILE_NB];
+    int64_t busy_us;
+    uint32_t busy_episodes;
+    uint32_t conn_events;
+    uint32_t requests;
+    uint32_t rejections;
+} s_stats;
+
+// Context of a connection the policy manages, NULL if it is unknown or already disconnected
+static ble_conn_policy_t *conn_policy_get(uint16_t conn_id)
+{
+    ble_conn_t *conn = ble_conn_get(conn_id);
+
+    return conn && conn->policy.timer ? &conn->policy : NULL;
+}
+
+static void conn_policy_account(ble_conn_policy_t *policy, int64_t now_us)
+{
+    const int64_t elapsed_us = now_us - policy->account_us;
+
+    policy->account_us = now_us;
+    if (elapsed_us <= 0) {
+        return;
+    }
+
+    if (policy->profile != CONN_POLICY_PROFILE_NONE) {
+        s_stats.profile_us[policy->profile] += elapsed_us;
+    }
+    if (policy->busy) {
+        s_stats.busy_us += elapsed_us;
+    }
+
+    // With data queued the peripheral can't use its latency and listens to every event
+    const int64_t event_us = policy->interval * 1250LL * (policy->busy ? 1 : policy->latency + 1);
+    if (event_us > 0) {
+        policy->event_rem_us += elapsed_us;
+        s_stats.conn_events += policy->event_rem_us / event_us;
+        policy->event_rem_us %= event_us;
+    }
+}
+
+static void conn_policy_reject(ble_conn_policy_t *policy, conn_policy_profile_t profile, int64_t now_us)
+{
+    const unsigned shift = policy->rejects[profile] < CONN_POLICY_MAX_BACKOFF_SHIFT ?
+                           policy->rejects[profile] : CONN_POLICY_MAX_BACKOFF_SHIFT;
+    const int64_t backoff_us = (CONFIG_EXAMPLE_CONN_POLICY_RETRY_MS * 1000LL) << shift;
+
+    policy->rejects[profile]++;
+    policy->retry_us[profile] = now_us + backoff_us;
+    s_stats.rejections++;
+    ESP_LOGW(CONN_POLICY_TAG, "%s profile rejected %u time(s), retry in %" PRId64 " ms",
+             s_profile_names[profile], policy->rejects[profile], backoff_us / 1000);
+}
+
+static void conn_policy_request(uint16_t conn_id, ble_conn_policy_t *policy, conn_policy_profile_t profile,
+                                int64_t now_us)
+{
+    const conn_policy_params_t *params = &s_profiles[profile];
+
+    s_stats.requests++;
+    esp_err_t err = conn_policy_port_update(conn_id, params);
+    if (err != ESP_OK) {
+        ESP_LOGW(CONN_POLICY_TAG, "Connection parameter update request failed, err %x", err);
+        conn_policy_reject(policy, profile, now_us);
+        return;
+    }
+
+    ESP_LOGI(CONN_POLICY_TAG, "Requesting %s profile, conn_id %u, interval %u-%u, latency %u",
+             s_profile_names[profile], conn_id, params->min_int, params->max_int, params->latency);
+    policy->pending = profile;
+    policy->pending_since_us = now_us;
+}
+
+static void conn_policy_timer_arm(ble_conn_policy_t *policy, int64_t at_us, int64_t now_us)
+{
+    esp_timer_start_once(policy->timer, at_us > now_us ? at_us - now_us : 0);
+}
+
+// Picks the profile the link should be on and requests it, or arms the timer for the next
+// point in time the decision may change
+static void conn_policy_evaluate(uint16_t conn_id, ble_conn_policy_t *policy, int64_t now_us)
+{
+    int64_t next_us = INT64_MAX;
+
+    esp_timer_stop(policy->timer);
+
+    if (policy->pending != CONN_POLICY_PROFILE_NONE) {
+        const int64_t deadline_us = policy->pending_since_us + CONN_POLICY_RSP_TIMEOUT_MS * 1000LL;
+
+        if (now_us < deadline_us) {
+            // conn_policy_on_update evaluates again
+            conn_policy_timer_arm(policy, deadline_us, now_us);
+            return;
+        }
+        ESP_LOGW(CONN_POLICY_TAG, "No answer to the %s profile request", s_profile_names[policy->pending]);
+        conn_policy_reject(policy, policy->pending, now_us);
+        policy->pending = CONN_POLICY_PROFILE_NONE;
+    }
+
+    conn_policy_profile_t want = CONN_POLICY_PROFILE_FAST;
+    if (policy->busy == 0) {
+        const int64_t idle_at_us = policy->idle_since_us + CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS * 1000LL;
+
+        if (now_us >= idle_at_us) {
+            want = CONN_POLICY_PROFILE_IDLE;
+        } else {
+            next_us = idle_at_us;
+        }
+    }
+
+    if (want != policy->profile) {
+        if (now_us < policy->retry_us[want]) {
+            next_us = policy->retry_us[want] < next_us ? policy->retry_us[want] : next_us;
+        } else {
+            conn_policy_request(conn_id, policy, want, now_us);
+            next_us = policy->pending != CONN_POLICY_PROFILE_NONE ?
+                      policy->pending_since_us + CONN_POLICY_RSP_TIMEOUT_MS * 1000LL : policy->retry_us[want];
+        }
+    }
+
+    if (next_us != INT64_MAX) {
+        conn_policy_timer_arm(policy, next_us, now_us);
+    }
+}
+
+static void conn_policy_timer_cb(void *arg)
+{
+    const uint16_t conn_id = (uintptr_t)arg;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // The timer may fire while the connection goes away
+    ble_conn_policy_t *policy = conn_policy_get(conn_id);
+    if (policy) {
+        conn_policy_evaluate(conn_id, policy, esp_timer_get_time());
+    }
+    xSemaphoreGive(s_lock);
+}
+
+void conn_policy_on_connect(uint16_t conn_id, uint16_t interval, uint16_t latency)
+{
+    const int64_t now_us = esp_timer_get_time();
+    ble_conn_t *conn = ble_conn_get(conn_id);
+
+    if (conn == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    ble_conn_policy_t *policy = &conn->policy;
+    if (policy->timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = conn_policy_timer_cb,
+            .arg = (void *)(uintptr_t)conn_id,
+            .name = "conn_policy",
+        };
+        if (esp_timer_create(&timer_args, &policy->timer) != ESP_OK) {
+            ESP_LOGE(CONN_POLICY_TAG, "%s create timer failed, conn_id %u", __func__, conn_id);
+            policy->timer = NULL;
+            xSemaphoreGive(s_lock);
+            return;
+        }
+    }
+
+    policy->busy = 0;
+    // Discovery and MTU exchange follow right away, start fast and let the idle delay run
+    policy->idle_since_us = now_us;
+    policy->profile = CONN_POLICY_PROFILE_NONE;
+    policy->pending = CONN_POLICY_PROFILE_NONE;
+    for (int i = 0; i < CONN_POLICY_PROFILE_NB; i++) {
+        policy->rejects[i] = 0;
+        policy->retry_us[i] = 0;
+    }
+    policy->interval = interval;
+    policy->latency = latency;
+    policy->account_us = now_us;
+    policy->event_rem_us = 0;
+    conn_policy_evaluate(conn_id, policy, now_us);
+    xSemaphoreGive(s_lock);
+}
+
+void conn_policy_on_disconnect(uint16_t conn_id)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    ble_conn_policy_t *policy = conn_policy_get(conn_id);
+    if (policy) {
+        conn_policy_account(policy, esp_timer_get_time());
+        esp_timer_stop(policy->timer);
+        esp_timer_delete(policy->timer);
+        policy->timer = NULL;
+    }
+    xSemaphoreGive(s_lock);
+}
+
+void conn_policy_on_update(uint16_t conn_id, bool accepted, uint16_t interval, uint16_t latency)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    ble_conn_policy_t *policy = conn_policy_get(conn_id);
+    if (policy == NULL) {
+        xSemaphoreGive(s_lock);
+        return;
+    }
+
+    conn_policy_account(policy, now_us);
+    if (accepted) {
+        policy->interval = interval;
+        policy->latency = latency;
+    }
+
+    // Updates started by the central are only accounted, the policy does not fight them
+    const conn_policy_profile_t requested = policy->pending;
+    if (requested != CONN_POLICY_PROFILE_NONE) {
+        const conn_policy_params_t *params = &s_profiles[requested];
+
+        policy->pending = CONN_POLICY_PROFILE_NONE;
+        if (accepted && interval >= params->min_int && interval <= params->max_int) {
+            ESP_LOGI(CONN_POLICY_TAG, "%s profile in effect, conn_id %u, interval %u, latency %u",
+                     s_profile_names[requested], conn_id, interval, latency);
+            policy->profile = requested;
+            policy->rejects[requested] = 0;
+        } else {
+            conn_policy_reject(policy, requested, now_us);
+        }
+        conn_policy_evaluate(conn_id, policy, now_us);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+void conn_policy_busy_set(uint16_t conn_id, uint32_t reason, bool busy)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    ble_conn_policy_t *policy = conn_policy_get(conn_id);
+    if (policy == NULL) {
+        xSemaphoreGive(s_lock);
+        return;
+    }
+
+    const uint32_t was_busy = policy->busy;
+    conn_policy_account(policy, now_us);
+    policy->busy = busy ? was_busy | reason : was_busy & ~reason;
+    if (!was_busy != !policy->busy) {
+        if (policy->busy) {
+            s_stats.busy_episodes++;
+        } else {
+            policy->idle_since_us = now_us;
+        }
+        conn_policy_evaluate(conn_id, policy, now_us);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+void conn_policy_stats_get(conn_policy_stats_t *stats)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (unsigned slot = 0; slot < BLE_CONN_MAX; slot++) {
+        ble_conn_t *conn = ble_conn_slot_get(slot);
+
+        if (conn && conn->policy.timer) {
+            conn_policy_account(&conn->policy, now_us);
+        }
+    }
+    stats->fast_ms = s_stats.profile_us[CONN_POLICY_PROFILE_FAST] / 1000;
+    stats->idle_ms = s_stats.profile_us[CONN_POLICY_PROFILE_IDLE] / 1000;
+    stats->busy_ms = s_stats.busy_us / 1000;
+    stats->busy_episodes = s_stats.busy_episodes;
+    stats->conn_events = s_stats.conn_events;
+    stats->requests = s_stats.requests;
+    stats->rejections = s_stats.rejections;
+
+    for (int i = 0; i < CONN_POLICY_PROFILE_NB; i++) {
+        s_stats.profile_us[i] = 0;
+    }
+    s_stats.busy_us = 0;
+    s_stats.busy_episodes = 0;
+    s_stats.conn_events = 0;
+    s_stats.requests = 0;
+    s_stats.rejections = 0;
+    xSemaphoreGive(s_lock);
+}
+
+#if CONFIG_EXAMPLE_MDS_ENABLE
+// Overrides the weak default in mds.c
+void mds_backlog_changed(uint16_t conn_id, bool pending)
+{
+    conn_policy_busy_set(conn_id, CONN_POLICY_BUSY_MDS, pending);
+}
+#endif
+
+esp_err_t conn_policy_init(void)
+{
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        ESP_LOGE(CONN_POLICY_TAG, "%s create lock failed", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
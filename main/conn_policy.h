@@ -0,0 +1,60 @@
+#ifndef CONN_POLICY_H
+#define CONN_POLICY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define CONN_POLICY_TAG "CONN_POLICY"
+
+// Reasons to keep the link on the fast profile, OR-ed together per connection
+#define CONN_POLICY_BUSY_MDS        (1 << 0)    // MDS data export backlog is non-empty
+#define CONN_POLICY_BUSY_LONG_WRITE (1 << 1)    // A prepared (long) write is in progress
+#define CONN_POLICY_BUSY_INGEST     (1 << 2)    // A bulk ingest transfer is in progress
+
+typedef struct {
+    uint16_t min_int;   // 1.25 ms units
+    uint16_t max_int;   // 1.25 ms units
+    uint16_t latency;   // Connection events the peripheral may skip while it has nothing to send
+    uint16_t timeout;   // 10 ms units
+} conn_policy_params_t;
+
+typedef struct {
+    // Time spent on each profile and with a busy reason set (drain time), since the last call
+    uint32_t fast_ms;
+    uint32_t idle_ms;
+    uint32_t busy_ms;
+    uint32_t busy_episodes;
+    // Connection events the peripheral listened to, estimated from the parameters in effect.
+    // This is what the radio-on time scales with.
+    uint32_t conn_events;
+    uint32_t requests;
+    uint32_t rejections;
+} conn_policy_stats_t;
+
+// Keeps the connection on a short interval while there is data to move and steps back to a
+// long interval with peripheral latency once the link has been idle for
+// CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS. Rejected or unanswered requests back off
+// exponentially per profile. Every connection is managed on its own, with its state kept in
+// its ble_conn context.
+esp_err_t conn_policy_init(void);
+
+// Called by the host stack backend, after ble_conn_open and before ble_conn_close. interval
+// (1.25 ms units) and latency are the parameters in effect.
+void conn_policy_on_connect(uint16_t conn_id, uint16_t interval, uint16_t latency);
+void conn_policy_on_disconnect(uint16_t conn_id);
+// Outcome of a connection parameter update, accepted is false when the peer rejected it
+void conn_policy_on_update(uint16_t conn_id, bool accepted, uint16_t interval, uint16_t latency);
+
+// Set or clear a CONN_POLICY_BUSY_* reason, callable from any task
+void conn_policy_busy_set(uint16_t conn_id, uint32_t reason, bool busy);
+
+// Summed over all connections
+void conn_policy_stats_get(conn_policy_stats_t *stats);
+
+// Implemented by the host stack backend: request params on conn_id, the outcome is reported
+// through conn_policy_on_update
+esp_err_t conn_policy_port_update(uint16_t conn_id, const conn_policy_params_t *params);
+
+#endif // CONN_POLICY_H
@@ -0,0 +1,55 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Simulated high-rate sensor, see demo_sensor.h. The sample is a slow sawtooth, the sequence
+* number makes every record unique so none is discarded as unchanged.
+*
+****************************************************************************/
+
+#include <stdint.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "sdkconfig.h"
+
+#include "demo_sensor.h"
+
+#define DEMO_SENSOR_TAG "DEMO_SENSOR"
+
+static esp_timer_handle_t s_sensor_timer;
+static uint16_t s_seq;
+
+static void demo_sensor_sample(void *arg)
+{
+    const uint16_t sample = s_seq / 16;
+    const uint8_t record[DEMO_SENSOR_RECORD_LEN] = {
+        s_seq & 0xff, s_seq >> 8, sample & 0xff, sample >> 8,
+    };
+
+    notify_coalesce_submit(arg, record, sizeof(record));
+    s_seq++;
+}
+
+esp_err_t demo_sensor_start(notify_coalesce_t *co)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback = demo_sensor_sample,
+        .arg = co,
+        .name = "demo_sensor",
+    };
+    esp_err_t ret = esp_timer_create(&timer_args, &s_sensor_timer);
+    if (ret == ESP_OK) {
+        ret = esp_timer_start_periodic(s_sensor_timer, 1000000ULL / CONFIG_EXAMPLE_NOTIFY_SENSOR_HZ);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(DEMO_SENSOR_TAG, "start failed: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    ESP_LOGI(DEMO_SENSOR_TAG, "%u Hz", CONFIG_EXAMPLE_NOTIFY_SENSOR_HZ);
+    return ESP_OK;
+}
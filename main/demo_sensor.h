@@ -0,0 +1,16 @@
+#ifndef DEMO_SENSOR_H
+#define DEMO_SENSOR_H
+
+#include "esp_err.h"
+
+#include "notify_coalesce.h"
+
+// Simulated sensor for the demo characteristic, updating at CONFIG_EXAMPLE_NOTIFY_SENSOR_HZ
+// from an esp_timer, far faster than a link notifies. Each update is a record
+// {seq u16, sample u16} (little endian), a gap in seq on the client shows coalescing.
+#define DEMO_SENSOR_RECORD_LEN 4
+
+// Start feeding records into co
+esp_err_t demo_sensor_start(notify_coalesce_t *co);
+
+#endif // DEMO_SENSOR_H
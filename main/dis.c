@@ -0,0 +1,45 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Device Information Service values, shared by the Bluedroid and NimBLE ports. Every value is
+* a string fixed at build time, the application and ESP-IDF versions are read from the app
+* descriptor in flash.
+*
+****************************************************************************/
+
+#include <string.h>
+#include "esp_app_desc.h"
+
+#include "dis.h"
+
+void dis_value_get(dis_char_t chr, const uint8_t **value, uint16_t *len)
+{
+    const esp_app_desc_t *app = esp_app_get_description();
+    const char *str;
+
+    switch (chr) {
+    case DIS_CHAR_MANUFACTURER:
+        str = CONFIG_EXAMPLE_DIS_MANUFACTURER_NAME;
+        break;
+    case DIS_CHAR_MODEL_NUMBER:
+        str = CONFIG_IDF_TARGET;
+        break;
+    case DIS_CHAR_FIRMWARE_REV:
+        str = app->version;
+        break;
+    case DIS_CHAR_SOFTWARE_REV:
+        str = app->idf_ver;
+        break;
+    default:
+        str = "";
+        break;
+    }
+
+    *value = (const uint8_t *)str;
+    *len = strnlen(str, DIS_MAX_VALUE_LEN);
+}
@@ -0,0 +1,43 @@
+#ifndef DIS_H
+#define DIS_H
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+#if CONFIG_BT_BLUEDROID_ENABLED
+#include "esp_gatts_api.h"
+#endif
+
+#define DIS_TAG "DIS"
+
+// Device Information Service, 16-bit UUIDs assigned by the Bluetooth SIG
+#define DIS_UUID_SVC              0x180A
+#define DIS_UUID_MODEL_NUMBER     0x2A24
+#define DIS_UUID_FIRMWARE_REV     0x2A26
+#define DIS_UUID_SOFTWARE_REV     0x2A28
+#define DIS_UUID_MANUFACTURER     0x2A29
+
+// Largest value served, the strings come from esp_app_desc_t fields of 32 bytes
+#define DIS_MAX_VALUE_LEN 32
+
+typedef enum {
+    DIS_CHAR_MANUFACTURER,  // CONFIG_EXAMPLE_DIS_MANUFACTURER_NAME
+    DIS_CHAR_MODEL_NUMBER,  // CONFIG_IDF_TARGET
+    DIS_CHAR_FIRMWARE_REV,  // Application version
+    DIS_CHAR_SOFTWARE_REV,  // ESP-IDF version
+    DIS_CHAR_NB,
+} dis_char_t;
+
+// Value of chr, fixed for the life of the firmware. Not NUL-terminated.
+void dis_value_get(dis_char_t chr, const uint8_t **value, uint16_t *len);
+
+#if CONFIG_BT_BLUEDROID_ENABLED
+// Profile callback, hooked into gl_profile_tab so gatts_event_handler routes DIS events here
+void dis_gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+#elif CONFIG_BT_NIMBLE_ENABLED
+// Adds the service to the NimBLE GATT server, call before the host is started
+int dis_nimble_gatt_svr_init(void);
+#endif
+
+#endif // DIS_H
@@ -0,0 +1,110 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Bluedroid port of the Device Information Service. Every value is ESP_GATT_AUTO_RSP and
+* stored in the stack's attribute database once the table is created, so reads are answered
+* by the stack and the service has no read or write handler at all.
+*
+****************************************************************************/
+
+#include "esp_log.h"
+
+#include "esp_gatts_api.h"
+
+#include "sdkconfig.h"
+
+#include "dis.h"
+#include "gatts_table.h"
+
+#define DIS_SVC_INST_ID 0
+
+// Attribute table indices, filled in from ESP_GATTS_CREAT_ATTR_TAB_EVT
+enum {
+    DIS_IDX_SVC,
+
+    DIS_IDX_CHAR_MANUFACTURER,
+    DIS_IDX_CHAR_VAL_MANUFACTURER,
+
+    DIS_IDX_CHAR_MODEL_NUMBER,
+    DIS_IDX_CHAR_VAL_MODEL_NUMBER,
+
+    DIS_IDX_CHAR_FIRMWARE_REV,
+    DIS_IDX_CHAR_VAL_FIRMWARE_REV,
+
+    DIS_IDX_CHAR_SOFTWARE_REV,
+    DIS_IDX_CHAR_VAL_SOFTWARE_REV,
+
+    DIS_IDX_NB,
+};
+
+static uint16_t s_handle_table[DIS_IDX_NB];
+
+static const esp_gatts_attr_db_t dis_gatt_db[DIS_IDX_NB] = {
+    GATTS_TABLE_SERVICE16(DIS_IDX_SVC, DIS_UUID_SVC),
+
+    GATTS_TABLE_CHAR_DECL(DIS_IDX_CHAR_MANUFACTURER, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_STATIC16(DIS_IDX_CHAR_VAL_MANUFACTURER, DIS_UUID_MANUFACTURER, DIS_MAX_VALUE_LEN, 0, NULL),
+
+    GATTS_TABLE_CHAR_DECL(DIS_IDX_CHAR_MODEL_NUMBER, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_STATIC16(DIS_IDX_CHAR_VAL_MODEL_NUMBER, DIS_UUID_MODEL_NUMBER, DIS_MAX_VALUE_LEN, 0, NULL),
+
+    GATTS_TABLE_CHAR_DECL(DIS_IDX_CHAR_FIRMWARE_REV, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_STATIC16(DIS_IDX_CHAR_VAL_FIRMWARE_REV, DIS_UUID_FIRMWARE_REV, DIS_MAX_VALUE_LEN, 0, NULL),
+
+    GATTS_TABLE_CHAR_DECL(DIS_IDX_CHAR_SOFTWARE_REV, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_STATIC16(DIS_IDX_CHAR_VAL_SOFTWARE_REV, DIS_UUID_SOFTWARE_REV, DIS_MAX_VALUE_LEN, 0, NULL),
+};
+
+static void dis_values_set(void);
+
+static const gatts_table_svc_t dis_svc = {
+    .name = "DIS",
+    .db = dis_gatt_db,
+    .num_attr = DIS_IDX_NB,
+    .inst_id = DIS_SVC_INST_ID,
+    .handles = s_handle_table,
+    // The values are in place before the service starts
+    .created_cb = dis_values_set,
+};
+
+// Value attribute of each dis_char_t
+static const uint8_t s_value_idx[DIS_CHAR_NB] = {
+    [DIS_CHAR_MANUFACTURER] = DIS_IDX_CHAR_VAL_MANUFACTURER,
+    [DIS_CHAR_MODEL_NUMBER] = DIS_IDX_CHAR_VAL_MODEL_NUMBER,
+    [DIS_CHAR_FIRMWARE_REV] = DIS_IDX_CHAR_VAL_FIRMWARE_REV,
+    [DIS_CHAR_SOFTWARE_REV] = DIS_IDX_CHAR_VAL_SOFTWARE_REV,
+};
+
+static void dis_values_set(void)
+{
+    for (int chr = 0; chr < DIS_CHAR_NB; chr++) {
+        const uint8_t *value;
+        uint16_t len;
+
+        dis_value_get(chr, &value, &len);
+        esp_err_t ret = gatts_table_value_set(&dis_svc, s_value_idx[chr], value, len);
+        if (ret) {
+            ESP_LOGE(DIS_TAG, "set value %d failed, error code = %x", chr, ret);
+        }
+    }
+}
+
+void dis_gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_GATTS_REG_EVT:
+        gatts_table_create(gatts_if, &dis_svc);
+        break;
+    case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+    case ESP_GATTS_START_EVT:
+        gatts_table_handle_event(&dis_svc, event, param);
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* NimBLE port of the Device Information Service. NimBLE always calls the access callback,
+* which appends the fixed value from dis.c.
+*
+****************************************************************************/
+
+#include <stdint.h>
+
+#include "host/ble_hs.h"
+#include "host/ble_uuid.h"
+
+#include "dis.h"
+
+static int dis_nimble_access(uint16_t conn_handle, uint16_t attr_handle,
+                             struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    const uint8_t *value;
+    uint16_t len;
+
+    if (ctxt->op != BLE_GATT_ACCESS_OP_READ_CHR) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    dis_value_get((dis_char_t)(intptr_t)arg, &value, &len);
+    return os_mbuf_append(ctxt->om, value, len) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static const struct ble_gatt_svc_def dis_gatt_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = BLE_UUID16_DECLARE(DIS_UUID_SVC),
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = BLE_UUID16_DECLARE(DIS_UUID_MANUFACTURER),
+                .access_cb = dis_nimble_access,
+                .arg = (void *)DIS_CHAR_MANUFACTURER,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                .uuid = BLE_UUID16_DECLARE(DIS_UUID_MODEL_NUMBER),
+                .access_cb = dis_nimble_access,
+                .arg = (void *)DIS_CHAR_MODEL_NUMBER,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                .uuid = BLE_UUID16_DECLARE(DIS_UUID_FIRMWARE_REV),
+                .access_cb = dis_nimble_access,
+                .arg = (void *)DIS_CHAR_FIRMWARE_REV,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                .uuid = BLE_UUID16_DECLARE(DIS_UUID_SOFTWARE_REV),
+                .access_cb = dis_nimble_access,
+                .arg = (void *)DIS_CHAR_SOFTWARE_REV,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                0, /* No more characteristics in this service */
+            }
+        },
+    },
+    {
+        0, /* No more services */
+    },
+};
+
+int dis_nimble_gatt_svr_init(void)
+{
+    int rc = ble_gatts_count_cfg(dis_gatt_svcs);
+    if (rc != 0) {
+        return rc;
+    }
+
+    return ble_gatts_add_svcs(dis_gatt_svcs);
+}
@@ -23,7 +23,6 @@
 #include "freertos/event_groups.h"
 #include "esp_system.h"
 #include "esp_log.h"
-#include "nvs_flash.h"
 #include "esp_bt.h"
 
 #include "esp_gap_ble_api.h"
@@ -35,7 +34,30 @@
 
 #include "sdkconfig.h"
 
+#include "ble_bench.h"
+#include "ble_conn.h"
+#include "ble_host.h"
 #include "gatts_demo.h"
+#include "gatts_table.h"
+#include "long_write.h"
+#include "mem_pool.h"
+#include "notify_coalesce.h"
+#include "value_cache.h"
+#if CONFIG_EXAMPLE_NOTIFY_SENSOR
+#include "demo_sensor.h"
+#endif
+#if CONFIG_EXAMPLE_MDS_ENABLE
+#include "mds.h"
+#endif
+#if CONFIG_EXAMPLE_INGEST_ENABLE
+#include "ingest.h"
+#endif
+#if CONFIG_EXAMPLE_DIS_ENABLE
+#include "dis.h"
+#endif
+#if CONFIG_EXAMPLE_CONN_POLICY
+#include "conn_policy.h"
+#endif
 
 static char test_device_name[ESP_BLE_ADV_NAME_LEN_MAX] = "ESP_GATTS_DEMO";
 
@@ -55,6 +77,19 @@ static esp_attr_value_t gatts_demo_char1_val =
 
 static uint8_t adv_config_done = 0;
 
+// Notified demo value, a connection is notified only when it is behind
+VALUE_CACHE_DEFINE(s_char_a_cache, GATTS_DEMO_NOTIFY_BATCH_MAX, GATTS_DEMO_NOTIFY_DELTA);
+#if CONFIG_EXAMPLE_NOTIFY_SENSOR
+NOTIFY_COALESCE_DEFINE(s_char_a_coalesce, GATTS_DEMO_NOTIFY_BATCH_MAX);
+#endif
+// Indicated demo value, one indication in flight per connection
+INDICATE_QUEUE_DEFINE(s_char_a_ind, GATTS_DEMO_INDICATE_LEN_MAX, CONFIG_EXAMPLE_INDICATE_QUEUE_DEPTH);
+
+// Prepare write and read responses built by the app, so neither path calls malloc or takes
+// the BTC task stack (long writes are kept in long_write.c segments). A response is back in
+// the pool as soon as esp_ble_gatts_send_response() has copied it.
+MEM_POOL_DEFINE(s_rsp_pool, sizeof(esp_gatt_rsp_t), CONFIG_EXAMPLE_GATTS_RSP_POOL_SIZE);
+
 #ifdef CONFIG_EXAMPLE_SET_RAW_ADV_DATA
 static uint8_t raw_adv_data[] = {
     /* Flags */
@@ -132,15 +167,79 @@ static struct gatts_profile_inst gl_profile_tab[PROFILE_NUM] = {
         .gatts_cb = gatts_profile_a_event_handler,
         .gatts_if = ESP_GATT_IF_NONE,
     },
+#if CONFIG_EXAMPLE_MDS_ENABLE
+    [PROFILE_MDS_APP_ID] = {
+        .gatts_cb = mds_gatts_event_handler,
+        .gatts_if = ESP_GATT_IF_NONE,
+    },
+#endif
+#if CONFIG_EXAMPLE_INGEST_ENABLE
+    [PROFILE_INGEST_APP_ID] = {
+        .gatts_cb = ingest_gatts_event_handler,
+        .gatts_if = ESP_GATT_IF_NONE,
+    },
+#endif
+#if CONFIG_EXAMPLE_DIS_ENABLE
+    [PROFILE_DIS_APP_ID] = {
+        .gatts_cb = dis_gatts_event_handler,
+        .gatts_if = ESP_GATT_IF_NONE,
+    },
+#endif
 };
 
-static prepare_type_env_t a_prepare_write_env;
+
+// Attribute indices of the demo service. Both paths create these four attributes, IDX_A_NB
+// is the handle count the chained path reserves.
+enum {
+    IDX_A_SVC,
+    IDX_A_CHAR,
+    IDX_A_CHAR_VAL,
+    IDX_A_CHAR_CFG,
+
+    IDX_A_NB,
+};
+
+#define CHAR_PROP_A (ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_NOTIFY | \
+                     ESP_GATT_CHAR_PROP_BIT_INDICATE)
+
+#if CONFIG_EXAMPLE_GATTS_ATTR_TABLE
+static uint16_t a_handle_table[IDX_A_NB];
+
+// Same layout the chained path builds, value and CCCD are still answered by the app
+static const esp_gatts_attr_db_t gatts_a_db[IDX_A_NB] = {
+    GATTS_TABLE_SERVICE16(IDX_A_SVC, GATTS_SERVICE_UUID_TEST_A),
+
+    GATTS_TABLE_CHAR_DECL(IDX_A_CHAR, CHAR_PROP_A),
+    GATTS_TABLE_ATTR(IDX_A_CHAR_VAL, ESP_GATT_RSP_BY_APP, ESP_UUID_LEN_16, &(const uint16_t){ GATTS_CHAR_UUID_TEST_A },
+                     ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, GATTS_DEMO_CHAR_VAL_LEN_MAX, sizeof(char1_str), char1_str),
+    GATTS_TABLE_CCCD(IDX_A_CHAR_CFG),
+};
+
+// The demo keeps one handler for all of its events, the attribute index is not needed
+static void gatts_a_attr_cb(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
+                            esp_ble_gatts_cb_param_t *param, uint8_t attr_idx)
+{
+    gatts_profile_a_event_handler(event, gatts_if, param);
+}
+
+static const gatts_table_svc_t gatts_a_svc = {
+    .name = "demo",
+    .db = gatts_a_db,
+    .num_attr = IDX_A_NB,
+    .inst_id = 0,
+    .handles = a_handle_table,
+    .attr_cb = gatts_a_attr_cb,
+};
+#endif
 
 void example_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param);
-void example_exec_write_event_env(prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param);
+esp_gatt_status_t example_exec_write_event_env(prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param);
+void example_prepare_write_env_free(prepare_type_env_t *prepare_write_env);
 
 static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
 {
+    ble_conn_t *conn;
+
     switch (event) {
 #ifdef CONFIG_SET_RAW_ADV_DATA
     case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
@@ -176,6 +275,7 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
             break;
         }
         ESP_LOGI(GATTS_TAG, "Advertising start successfully");
+        ble_bench_adv_started();
         break;
     case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
         if (param->adv_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
@@ -190,13 +290,49 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
                   param->update_conn_params.conn_int,
                   param->update_conn_params.latency,
                   param->update_conn_params.timeout);
+        conn = ble_conn_find_by_addr(param->update_conn_params.bda);
+        if (conn == NULL) {
+            break;
+        }
+        if (param->update_conn_params.status == ESP_BT_STATUS_SUCCESS) {
+            conn->conn_interval = param->update_conn_params.conn_int;
+            conn->conn_latency = param->update_conn_params.latency;
+        }
+#if CONFIG_EXAMPLE_CONN_POLICY
+        conn_policy_on_update(conn->conn_id, param->update_conn_params.status == ESP_BT_STATUS_SUCCESS,
+                              param->update_conn_params.conn_int, param->update_conn_params.latency);
+#endif
         break;
     case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
         ESP_LOGI(GATTS_TAG, "Packet length update, status %d, rx %d, tx %d",
                   param->pkt_data_length_cmpl.status,
                   param->pkt_data_length_cmpl.params.rx_len,
                   param->pkt_data_length_cmpl.params.tx_len);
+        if (param->pkt_data_length_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+            ESP_LOGW(GATTS_TAG, "Peer refused Data Length Extension, staying at %d bytes", BLE_CONN_DEFAULT_TX_OCTETS);
+            break;
+        }
+        conn = ble_conn_find_by_addr(param->pkt_data_length_cmpl.remote_addr);
+        if (conn) {
+            conn->tx_octets = param->pkt_data_length_cmpl.params.tx_len;
+        }
+        ble_bench_link_update(0, param->pkt_data_length_cmpl.params.tx_len);
         break;
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+    case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+        ESP_LOGI(GATTS_TAG, "PHY update, status %d, tx_phy %d, rx_phy %d",
+                 param->phy_update.status, param->phy_update.tx_phy, param->phy_update.rx_phy);
+        if (param->phy_update.status != ESP_BT_STATUS_SUCCESS) {
+            ESP_LOGW(GATTS_TAG, "Peer refused the 2M PHY, staying on 1M");
+            break;
+        }
+        conn = ble_conn_find_by_addr(param->phy_update.bda);
+        if (conn) {
+            conn->phy = param->phy_update.tx_phy;
+        }
+        ble_bench_link_update(param->phy_update.tx_phy, 0);
+        break;
+#endif
     default:
         break;
     }
@@ -206,21 +342,14 @@ void example_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t *prepare
     esp_gatt_status_t status = ESP_GATT_OK;
     if (param->write.need_rsp){
         if (param->write.is_prep) {
-            if (param->write.offset > PREPARE_BUF_MAX_SIZE) {
-                status = ESP_GATT_INVALID_OFFSET;
-            } else if ((param->write.offset + param->write.len) > PREPARE_BUF_MAX_SIZE) {
-                status = ESP_GATT_INVALID_ATTR_LEN;
-            }
-            if (status == ESP_GATT_OK && prepare_write_env->prepare_buf == NULL) {
-                prepare_write_env->prepare_buf = (uint8_t *)malloc(PREPARE_BUF_MAX_SIZE*sizeof(uint8_t));
-                prepare_write_env->prepare_len = 0;
-                if (prepare_write_env->prepare_buf == NULL) {
-                    ESP_LOGE(GATTS_TAG, "Gatt_server prep no mem");
-                    status = ESP_GATT_NO_RESOURCES;
-                }
+            if (prepare_write_env == NULL) {
+                status = ESP_GATT_NO_RESOURCES;
+            } else {
+                status = long_write_prepare(prepare_write_env, param->write.handle, param->write.offset,
+                                            param->write.value, param->write.len, PREPARE_BUF_MAX_SIZE);
             }
 
-            esp_gatt_rsp_t *gatt_rsp = (esp_gatt_rsp_t *)malloc(sizeof(esp_gatt_rsp_t));
+            esp_gatt_rsp_t *gatt_rsp = mem_pool_alloc(&s_rsp_pool);
             if (gatt_rsp) {
                 gatt_rsp->attr_value.len = param->write.len;
                 gatt_rsp->attr_value.handle = param->write.handle;
@@ -231,41 +360,107 @@ void example_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t *prepare
                 if (response_err != ESP_OK){
                     ESP_LOGE(GATTS_TAG, "Send response error\n");
                 }
-                free(gatt_rsp);
+                mem_pool_free(&s_rsp_pool, gatt_rsp);
             } else {
-                ESP_LOGE(GATTS_TAG, "malloc failed, no resource to send response error\n");
+                ESP_LOGE(GATTS_TAG, "No response structure left, no resource to send response error\n");
                 status = ESP_GATT_NO_RESOURCES;
             }
-            if (status != ESP_GATT_OK){
-                return;
-            }
-            memcpy(prepare_write_env->prepare_buf + param->write.offset,
-                   param->write.value,
-                   param->write.len);
-            prepare_write_env->prepare_len += param->write.len;
-
         }else{
             esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, NULL);
         }
     }
 }
 
-void example_exec_write_event_env(prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param){
+static esp_gatt_status_t example_long_write_sink(uint16_t conn_id, uint16_t handle, uint32_t offset,
+                                                 const uint8_t *data, uint16_t len, bool last, void *arg)
+{
+    ESP_LOG_BUFFER_HEX_LEVEL(GATTS_TAG, data, len, ESP_LOG_DEBUG);
+    if (last) {
+        ESP_LOGI(GATTS_TAG, "Long write to handle %d done, %" PRIu32 " bytes", handle, offset + len);
+    }
+    return ESP_GATT_OK;
+}
+
+esp_gatt_status_t example_exec_write_event_env(prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param){
     if (param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC){
-        ESP_LOG_BUFFER_HEX(GATTS_TAG, prepare_write_env->prepare_buf, prepare_write_env->prepare_len);
-    }else{
-        ESP_LOGI(GATTS_TAG,"Prepare write cancel");
+        return long_write_execute(prepare_write_env, param->exec_write.conn_id, example_long_write_sink, NULL);
+    }
+    ESP_LOGI(GATTS_TAG,"Prepare write cancel");
+    example_prepare_write_env_free(prepare_write_env);
+    return ESP_GATT_OK;
+}
+
+void example_prepare_write_env_free(prepare_type_env_t *prepare_write_env){
+    long_write_cancel(prepare_write_env);
+}
+
+esp_gatt_rsp_t *example_rsp_alloc(void)
+{
+    return mem_pool_alloc(&s_rsp_pool);
+}
+
+void example_rsp_free(esp_gatt_rsp_t *rsp)
+{
+    mem_pool_free(&s_rsp_pool, rsp);
+}
+
+void example_write_stats_get(long_write_stats_t *prepare, mem_pool_stats_t *rsp)
+{
+    long_write_stats_get(prepare);
+    mem_pool_stats_get(&s_rsp_pool, rsp);
+}
+
+void example_char_a_stats_get(value_cache_stats_t *value, notify_coalesce_stats_t *coalesce,
+                              indicate_queue_stats_t *indicate)
+{
+    value_cache_stats_get(&s_char_a_cache, value);
+#if CONFIG_EXAMPLE_NOTIFY_SENSOR
+    notify_coalesce_stats_get(&s_char_a_coalesce, coalesce);
+#else
+    memset(coalesce, 0, sizeof(*coalesce));
+#endif
+    indicate_queue_stats_get(&s_char_a_ind, indicate);
+}
+
+static esp_err_t gatts_demo_notify_send(uint16_t conn_id, const uint8_t *pdu, uint16_t len, void *ctx)
+{
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+
+    //a congested link is flushed again when the congestion ends
+    if (conn && conn->congested) {
+        return ESP_ERR_INVALID_STATE;
     }
-    if (prepare_write_env->prepare_buf) {
-        free(prepare_write_env->prepare_buf);
-        prepare_write_env->prepare_buf = NULL;
+    esp_err_t ret = esp_ble_gatts_send_indicate(gl_profile_tab[PROFILE_A_APP_ID].gatts_if, conn_id,
+                                                gl_profile_tab[PROFILE_A_APP_ID].char_handle, len, (uint8_t *)pdu, false);
+    if (ret) {
+        ESP_LOGE(GATTS_TAG, "Send notification failed");
+    }
+    return ret;
+}
+
+static esp_err_t gatts_demo_indicate_send(uint16_t conn_id, const uint8_t *value, uint16_t len, void *ctx)
+{
+    esp_err_t ret = esp_ble_gatts_send_indicate(gl_profile_tab[PROFILE_A_APP_ID].gatts_if, conn_id,
+                                                gl_profile_tab[PROFILE_A_APP_ID].char_handle, len, (uint8_t *)value, true);
+    if (ret) {
+        ESP_LOGE(GATTS_TAG, "Send indication failed");
     }
-    prepare_write_env->prepare_len = 0;
+    return ret;
 }
 
 static void gatts_profile_a_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param) {
     switch (event) {
-    case ESP_GATTS_REG_EVT:
+    case ESP_GATTS_REG_EVT: {
+        static const uint8_t notify_init[] = GATTS_DEMO_NOTIFY_INIT;
+        value_cache_set(&s_char_a_cache, notify_init, sizeof(notify_init));
+        indicate_queue_init(&s_char_a_ind, CONFIG_EXAMPLE_INDICATE_STALL_REPORT_MS, gatts_demo_indicate_send, NULL);
+#if CONFIG_EXAMPLE_NOTIFY_SENSOR
+        //sensor updates reach the cache once per coalescing window
+        if (notify_coalesce_init(&s_char_a_coalesce, &s_char_a_cache, GATTS_DEMO_COALESCE_MODE,
+                                 CONFIG_EXAMPLE_NOTIFY_WINDOW_MS, gatts_demo_notify_send, NULL) == ESP_OK) {
+            demo_sensor_start(&s_char_a_coalesce);
+        }
+#endif
         ESP_LOGI(GATTS_TAG, "GATT server register, status %d, app_id %d, gatts_if %d", param->reg.status, param->reg.app_id, gatts_if);
         gl_profile_tab[PROFILE_A_APP_ID].service_id.is_primary = true;
         gl_profile_tab[PROFILE_A_APP_ID].service_id.id.inst_id = 0x00;
@@ -302,40 +497,65 @@ static void gatts_profile_a_event_handler(esp_gatts_cb_event_t event, esp_gatt_i
         adv_config_done |= scan_rsp_config_flag;
 
 #endif
-        esp_ble_gatts_create_service(gatts_if, &gl_profile_tab[PROFILE_A_APP_ID].service_id, GATTS_NUM_HANDLE_TEST_A);
+#if CONFIG_EXAMPLE_GATTS_ATTR_TABLE
+        a_property = CHAR_PROP_A;
+        gatts_table_create(gatts_if, &gatts_a_svc);
+#else
+        esp_ble_gatts_create_service(gatts_if, &gl_profile_tab[PROFILE_A_APP_ID].service_id, IDX_A_NB);
+#endif
         break;
+    }
     case ESP_GATTS_READ_EVT: {
         ESP_LOGI(GATTS_TAG, "Characteristic read, conn_id %d, trans_id %" PRIu32 ", handle %d", param->read.conn_id, param->read.trans_id, param->read.handle);
-        esp_gatt_rsp_t rsp;
-        memset(&rsp, 0, sizeof(esp_gatt_rsp_t));
-        rsp.attr_value.handle = param->read.handle;
-        rsp.attr_value.len = 4;
-        rsp.attr_value.value[0] = 0xde;
-        rsp.attr_value.value[1] = 0xed;
-        rsp.attr_value.value[2] = 0xbe;
-        rsp.attr_value.value[3] = 0xef;
+        //the response comes from the pool rather than ~600 bytes of BTC task stack
+        esp_gatt_rsp_t *rsp = mem_pool_alloc(&s_rsp_pool);
+        if (rsp == NULL) {
+            esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id,
+                                        ESP_GATT_NO_RESOURCES, NULL);
+            break;
+        }
+        rsp->attr_value.handle = param->read.handle;
+        rsp->attr_value.offset = 0;
+        rsp->attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
+        rsp->attr_value.len = 4;
+        rsp->attr_value.value[0] = 0xde;
+        rsp->attr_value.value[1] = 0xed;
+        rsp->attr_value.value[2] = 0xbe;
+        rsp->attr_value.value[3] = 0xef;
         esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id,
-                                    ESP_GATT_OK, &rsp);
+                                    ESP_GATT_OK, rsp);
+        mem_pool_free(&s_rsp_pool, rsp);
         break;
     }
     case ESP_GATTS_WRITE_EVT: {
         ESP_LOGI(GATTS_TAG, "Characteristic write, conn_id %d, trans_id %" PRIu32 ", handle %d", param->write.conn_id, param->write.trans_id, param->write.handle);
+        ble_conn_t *conn = ble_conn_get(param->write.conn_id);
+#if CONFIG_EXAMPLE_CONN_POLICY
+        //keep the link fast until the long write is executed or cancelled
+        if (param->write.is_prep) {
+            conn_policy_busy_set(param->write.conn_id, CONN_POLICY_BUSY_LONG_WRITE, true);
+        }
+#endif
         if (!param->write.is_prep){
             ESP_LOGI(GATTS_TAG, "value len %d, value ", param->write.len);
             ESP_LOG_BUFFER_HEX(GATTS_TAG, param->write.value, param->write.len);
             if (gl_profile_tab[PROFILE_A_APP_ID].descr_handle == param->write.handle && param->write.len == 2){
                 uint16_t descr_value = param->write.value[1]<<8 | param->write.value[0];
+                if (conn) {
+                    conn->cccd[BLE_CONN_CCCD_DEMO] = descr_value;
+                }
+                if (descr_value != 0x0001) {
+                    value_cache_unsubscribe(&s_char_a_cache, param->write.conn_id);
+                }
+                if (descr_value != 0x0002) {
+                    indicate_queue_close(&s_char_a_ind, param->write.conn_id);
+                }
                 if (descr_value == 0x0001){
                     if (a_property & ESP_GATT_CHAR_PROP_BIT_NOTIFY){
                         ESP_LOGI(GATTS_TAG, "Notification enable");
-                        uint8_t notify_data[15];
-                        for (int i = 0; i < sizeof(notify_data); ++i)
-                        {
-                            notify_data[i] = i%0xff;
-                        }
-                        //the size of notify_data[] need less than MTU size
-                        esp_ble_gatts_send_indicate(gatts_if, param->write.conn_id, gl_profile_tab[PROFILE_A_APP_ID].char_handle,
-                                                sizeof(notify_data), notify_data, false);
+                        //a new subscriber is behind, the flush sends it the whole value
+                        value_cache_subscribe(&s_char_a_cache, param->write.conn_id);
+                        value_cache_flush(&s_char_a_cache, gatts_demo_notify_send, NULL);
                     }
                 }else if (descr_value == 0x0002){
                     if (a_property & ESP_GATT_CHAR_PROP_BIT_INDICATE){
@@ -345,9 +565,10 @@ static void gatts_profile_a_event_handler(esp_gatts_cb_event_t event, esp_gatt_i
                         {
                             indicate_data[i] = i%0xff;
                         }
-                        //the size of indicate_data[] need less than MTU size
-                        esp_ble_gatts_send_indicate(gatts_if, param->write.conn_id, gl_profile_tab[PROFILE_A_APP_ID].char_handle,
-                                                sizeof(indicate_data), indicate_data, true);
+                        //the size of indicate_data[] need less than MTU size, later ones wait for its confirmation
+                        if (indicate_queue_open(&s_char_a_ind, param->write.conn_id) == ESP_OK) {
+                            indicate_queue_send(&s_char_a_ind, param->write.conn_id, indicate_data, sizeof(indicate_data));
+                        }
                     }
                 }
                 else if (descr_value == 0x0000){
@@ -357,16 +578,30 @@ static void gatts_profile_a_event_handler(esp_gatts_cb_event_t event, esp_gatt_i
                     ESP_LOG_BUFFER_HEX(GATTS_TAG, param->write.value, param->write.len);
                 }
 
+            } else if (gl_profile_tab[PROFILE_A_APP_ID].char_handle == param->write.handle &&
+                       param->write.len <= GATTS_DEMO_NOTIFY_LEN_MAX) {
+                //subscribers hear about the value only if it changed
+                if (value_cache_set(&s_char_a_cache, param->write.value, param->write.len)) {
+                    value_cache_flush(&s_char_a_cache, gatts_demo_notify_send, NULL);
+                    indicate_queue_send_all(&s_char_a_ind, param->write.value, param->write.len);
+                }
             }
         }
-        example_write_event_env(gatts_if, &a_prepare_write_env, param);
+        //each connection reassembles its own long write
+        example_write_event_env(gatts_if, conn ? &conn->prepare : NULL, param);
         break;
     }
-    case ESP_GATTS_EXEC_WRITE_EVT:
+    case ESP_GATTS_EXEC_WRITE_EVT: {
         ESP_LOGI(GATTS_TAG,"Execute write");
-        esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
-        example_exec_write_event_env(&a_prepare_write_env, param);
+        //the consumer's verdict goes back in the Execute Write Response
+        ble_conn_t *conn = ble_conn_get(param->exec_write.conn_id);
+        esp_gatt_status_t status = conn ? example_exec_write_event_env(&conn->prepare, param) : ESP_GATT_OK;
+        esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, NULL);
+#if CONFIG_EXAMPLE_CONN_POLICY
+        conn_policy_busy_set(param->exec_write.conn_id, CONN_POLICY_BUSY_LONG_WRITE, false);
+#endif
         break;
+    }
     case ESP_GATTS_MTU_EVT:
         ESP_LOGI(GATTS_TAG, "MTU exchange, MTU %d", param->mtu.mtu);
         break;
@@ -379,7 +614,7 @@ static void gatts_profile_a_event_handler(esp_gatts_cb_event_t event, esp_gatt_i
         gl_profile_tab[PROFILE_A_APP_ID].char_uuid.uuid.uuid16 = GATTS_CHAR_UUID_TEST_A;
 
         esp_ble_gatts_start_service(gl_profile_tab[PROFILE_A_APP_ID].service_handle);
-        a_property = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_NOTIFY;
+        a_property = CHAR_PROP_A;
         esp_err_t add_char_ret = esp_ble_gatts_add_char(gl_profile_tab[PROFILE_A_APP_ID].service_handle, &gl_profile_tab[PROFILE_A_APP_ID].char_uuid,
                                                         ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,
                                                         a_property,
@@ -419,16 +654,38 @@ static void gatts_profile_a_event_handler(esp_gatts_cb_event_t event, esp_gatt_i
         gl_profile_tab[PROFILE_A_APP_ID].descr_handle = param->add_char_descr.attr_handle;
         ESP_LOGI(GATTS_TAG, "Descriptor add, status %d, attr_handle %d, service_handle %d",
                  param->add_char_descr.status, param->add_char_descr.attr_handle, param->add_char_descr.service_handle);
+        ble_bench_service_ready("demo");
         break;
+#if CONFIG_EXAMPLE_GATTS_ATTR_TABLE
+    case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+        if (gatts_table_handle_event(&gatts_a_svc, event, param) && param->add_attr_tab.status == ESP_GATT_OK) {
+            gl_profile_tab[PROFILE_A_APP_ID].service_handle = a_handle_table[IDX_A_SVC];
+            gl_profile_tab[PROFILE_A_APP_ID].char_handle = a_handle_table[IDX_A_CHAR_VAL];
+            gl_profile_tab[PROFILE_A_APP_ID].descr_handle = a_handle_table[IDX_A_CHAR_CFG];
+        }
+        break;
+#endif
     case ESP_GATTS_DELETE_EVT:
         break;
     case ESP_GATTS_START_EVT:
+#if CONFIG_EXAMPLE_GATTS_ATTR_TABLE
+        gatts_table_handle_event(&gatts_a_svc, event, param);
+#else
         ESP_LOGI(GATTS_TAG, "Service start, status %d, service_handle %d",
                  param->start.status, param->start.service_handle);
+#endif
         break;
     case ESP_GATTS_STOP_EVT:
         break;
     case ESP_GATTS_CONNECT_EVT: {
+        ESP_LOGI(GATTS_TAG, "Connected, conn_id %u, remote "ESP_BD_ADDR_STR"",
+                 param->connect.conn_id, ESP_BD_ADDR_HEX(param->connect.remote_bda));
+        gl_profile_tab[PROFILE_A_APP_ID].conn_id = param->connect.conn_id;
+#if CONFIG_EXAMPLE_CONN_POLICY
+        //the policy requests the connection parameters from here on
+        conn_policy_on_connect(param->connect.conn_id, param->connect.conn_params.interval,
+                               param->connect.conn_params.latency);
+#else
         esp_ble_conn_update_params_t conn_params = {0};
         memcpy(conn_params.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
         /* For the IOS system, please reference the apple official documents about the ble connection parameters restrictions. */
@@ -436,16 +693,32 @@ static void gatts_profile_a_event_handler(esp_gatts_cb_event_t event, esp_gatt_i
         conn_params.max_int = 0x20;    // max_int = 0x20*1.25ms = 40ms
         conn_params.min_int = 0x10;    // min_int = 0x10*1.25ms = 20ms
         conn_params.timeout = 400;    // timeout = 400*10ms = 4000ms
-        ESP_LOGI(GATTS_TAG, "Connected, conn_id %u, remote "ESP_BD_ADDR_STR"",
-                 param->connect.conn_id, ESP_BD_ADDR_HEX(param->connect.remote_bda));
-        gl_profile_tab[PROFILE_A_APP_ID].conn_id = param->connect.conn_id;
         //start sent the update connection parameters to the peer device.
         esp_ble_gap_update_conn_params(&conn_params);
+#endif
+        //ask for the largest LL payload, the controller settles on what the peer supports
+        ble_bench_link_update(BLE_CONN_DEFAULT_PHY, BLE_CONN_DEFAULT_TX_OCTETS);
+        if (esp_ble_gap_set_pkt_data_len(param->connect.remote_bda, GATTS_DEMO_MAX_TX_OCTETS)) {
+            ESP_LOGW(GATTS_TAG, "Set packet length failed");
+        }
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+        //and for the 2M PHY, peers without it stay on 1M
+        if (esp_ble_gap_set_preferred_phy(param->connect.remote_bda, 0,
+                                          ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_2M_PREF_MASK,
+                                          ESP_BLE_GAP_PHY_OPTIONS_NO_PREF)) {
+            ESP_LOGW(GATTS_TAG, "Set preferred PHY failed");
+        }
+#endif
         break;
     }
     case ESP_GATTS_DISCONNECT_EVT:
         ESP_LOGI(GATTS_TAG, "Disconnected, remote "ESP_BD_ADDR_STR", reason 0x%02x",
                  ESP_BD_ADDR_HEX(param->disconnect.remote_bda), param->disconnect.reason);
+#if CONFIG_EXAMPLE_CONN_POLICY
+        conn_policy_on_disconnect(param->disconnect.conn_id);
+#endif
+        value_cache_unsubscribe(&s_char_a_cache, param->disconnect.conn_id);
+        indicate_queue_close(&s_char_a_ind, param->disconnect.conn_id);
         esp_ble_gap_start_advertising(&adv_params);
         break;
     case ESP_GATTS_CONF_EVT:
@@ -453,17 +726,101 @@ static void gatts_profile_a_event_handler(esp_gatts_cb_event_t event, esp_gatt_i
         if (param->conf.status != ESP_GATT_OK){
             ESP_LOG_BUFFER_HEX(GATTS_TAG, param->conf.value, param->conf.len);
         }
+        //a connection either has notifications or indications enabled, the other call ignores it.
+        //Notifications are confirmed too, a released buffer lets subscribers left behind catch
+        //up. A confirmed indication lets the next queued one go out.
+        if (param->conf.handle == gl_profile_tab[PROFILE_A_APP_ID].char_handle) {
+            if (value_cache_confirm(&s_char_a_cache, param->conf.conn_id)) {
+                value_cache_flush(&s_char_a_cache, gatts_demo_notify_send, NULL);
+            }
+            indicate_queue_confirm(&s_char_a_ind, param->conf.conn_id);
+        }
         break;
     case ESP_GATTS_OPEN_EVT:
     case ESP_GATTS_CANCEL_OPEN_EVT:
     case ESP_GATTS_CLOSE_EVT:
     case ESP_GATTS_LISTEN_EVT:
+        break;
+    case ESP_GATTS_CONGEST_EVT:
+        ESP_LOGI(GATTS_TAG, "Congestion %s, conn_id %u", param->congest.congested ? "start" : "end",
+                 param->congest.conn_id);
+        //only the latest value goes out, whatever changed in the meantime
+        if (!param->congest.congested) {
+            value_cache_flush(&s_char_a_cache, gatts_demo_notify_send, NULL);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+#if CONFIG_EXAMPLE_CONN_POLICY
+esp_err_t conn_policy_port_update(uint16_t conn_id, const conn_policy_params_t *params)
+{
+    esp_ble_conn_update_params_t conn_params = {
+        .min_int = params->min_int,
+        .max_int = params->max_int,
+        .latency = params->latency,
+        .timeout = params->timeout,
+    };
+
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    if (conn == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memcpy(conn_params.bda, conn->remote_bda, sizeof(esp_bd_addr_t));
+    return esp_ble_gap_update_conn_params(&conn_params);
+}
+#endif
+
+/* Keeps the per-connection contexts in ble_conn.c current. Bluedroid reports connection
+ * events once per registered profile, the updates below are idempotent.
+ */
+static void gatts_conn_update(esp_gatts_cb_event_t event, esp_ble_gatts_cb_param_t *param)
+{
+    ble_conn_t *conn;
+
+    switch (event) {
+    case ESP_GATTS_CONNECT_EVT:
+        conn = ble_conn_open(param->connect.conn_id);
+        if (conn) {
+            memcpy(conn->remote_bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+            conn->conn_interval = param->connect.conn_params.interval;
+            conn->conn_latency = param->connect.conn_params.latency;
+        }
+        break;
+    case ESP_GATTS_MTU_EVT:
+        conn = ble_conn_get(param->mtu.conn_id);
+        if (conn) {
+            conn->mtu = param->mtu.mtu;
+        }
+        break;
     case ESP_GATTS_CONGEST_EVT:
+        conn = ble_conn_get(param->congest.conn_id);
+        if (conn) {
+            conn->congested = param->congest.congested;
+        }
+        break;
     default:
         break;
     }
 }
 
+/* Bluedroid reports a disconnect once per registered profile, walking the interfaces in
+ * ascending order, so the highest registered gatts_if sees it last */
+static bool gatts_profile_is_last(esp_gatt_if_t gatts_if)
+{
+    esp_gatt_if_t last = ESP_GATT_IF_NONE;
+
+    for (int idx = 0; idx < PROFILE_NUM; idx++) {
+        const esp_gatt_if_t profile_if = gl_profile_tab[idx].gatts_if;
+        if (profile_if != ESP_GATT_IF_NONE && (last == ESP_GATT_IF_NONE || profile_if > last)) {
+            last = profile_if;
+        }
+    }
+    return gatts_if == last;
+}
+
 static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
 {
     /* If event is register event, store the gatts_if for each profile */
@@ -478,6 +835,14 @@ static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_
         }
     }
 
+    gatts_conn_update(event, param);
+
+    /* Reads, writes and confirmations on table-created attributes go straight to the
+     * owning service */
+    if (gatts_table_dispatch(event, gatts_if, param)) {
+        return;
+    }
+
     /* If the gatts_if equal to profile A, call profile A cb handler,
      * so here call each profile's callback */
     do {
@@ -491,69 +856,96 @@ static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_
             }
         }
     } while (0);
+
+    // Once the last profile has seen the disconnect the context can go, together with a long
+    // write the client never executed
+    if (event == ESP_GATTS_DISCONNECT_EVT && gatts_profile_is_last(gatts_if)) {
+        ble_conn_t *conn = ble_conn_get(param->disconnect.conn_id);
+        if (conn) {
+            example_prepare_write_env_free(&conn->prepare);
+            ble_conn_close(param->disconnect.conn_id);
+        }
+    }
 }
 
-void app_main(void)
+esp_err_t ble_host_init(void)
 {
     esp_err_t ret;
 
-    // Initialize NVS.
-    ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK( ret );
-
     #if CONFIG_EXAMPLE_CI_PIPELINE_ID
     memcpy(test_device_name, esp_bluedroid_get_example_name(), ESP_BLE_ADV_NAME_LEN_MAX);
     #endif
 
-    ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
+    ret = esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT);
+    if (ret) {
+        ESP_LOGE(GATTS_TAG, "%s release classic bt memory failed: %s", __func__, esp_err_to_name(ret));
+        return ret;
+    }
 
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
     ret = esp_bt_controller_init(&bt_cfg);
     if (ret) {
         ESP_LOGE(GATTS_TAG, "%s initialize controller failed: %s", __func__, esp_err_to_name(ret));
-        return;
+        return ret;
     }
 
     ret = esp_bt_controller_enable(ESP_BT_MODE_BLE);
     if (ret) {
         ESP_LOGE(GATTS_TAG, "%s enable controller failed: %s", __func__, esp_err_to_name(ret));
-        return;
+        return ret;
     }
 
     ret = esp_bluedroid_init();
     if (ret) {
         ESP_LOGE(GATTS_TAG, "%s init bluetooth failed: %s", __func__, esp_err_to_name(ret));
-        return;
+        return ret;
     }
     ret = esp_bluedroid_enable();
     if (ret) {
         ESP_LOGE(GATTS_TAG, "%s enable bluetooth failed: %s", __func__, esp_err_to_name(ret));
-        return;
+        return ret;
     }
 
     ret = esp_ble_gatts_register_callback(gatts_event_handler);
     if (ret){
         ESP_LOGE(GATTS_TAG, "gatts register error, error code = %x", ret);
-        return;
+        return ret;
     }
     ret = esp_ble_gap_register_callback(gap_event_handler);
     if (ret){
         ESP_LOGE(GATTS_TAG, "gap register error, error code = %x", ret);
-        return;
+        return ret;
     }
     ret = esp_ble_gatts_app_register(PROFILE_A_APP_ID);
     if (ret){
         ESP_LOGE(GATTS_TAG, "gatts app register error, error code = %x", ret);
-        return;
+        return ret;
+    }
+#if CONFIG_EXAMPLE_MDS_ENABLE
+    ret = esp_ble_gatts_app_register(PROFILE_MDS_APP_ID);
+    if (ret){
+        ESP_LOGE(GATTS_TAG, "gatts mds app register error, error code = %x", ret);
+        return ret;
     }
+#endif
+#if CONFIG_EXAMPLE_INGEST_ENABLE
+    ret = esp_ble_gatts_app_register(PROFILE_INGEST_APP_ID);
+    if (ret){
+        ESP_LOGE(GATTS_TAG, "gatts ingest app register error, error code = %x", ret);
+        return ret;
+    }
+#endif
+#if CONFIG_EXAMPLE_DIS_ENABLE
+    ret = esp_ble_gatts_app_register(PROFILE_DIS_APP_ID);
+    if (ret){
+        ESP_LOGE(GATTS_TAG, "gatts dis app register error, error code = %x", ret);
+        return ret;
+    }
+#endif
     esp_err_t local_mtu_ret = esp_ble_gatt_set_local_mtu(500);
     if (local_mtu_ret){
         ESP_LOGE(GATTS_TAG, "set local  MTU failed, error code = %x", local_mtu_ret);
     }
 
-    return;
+    return ESP_OK;
 }
@@ -1,34 +1,87 @@
 #ifndef GATTS_DEMO_H
 #define GATTS_DEMO_H
 
+#include "sdkconfig.h"
+#include "indicate_queue.h"
+#include "notify_coalesce.h"
+#include "value_cache.h"
+#if CONFIG_BT_BLUEDROID_ENABLED
 #include "esp_gatts_api.h"
 #include "esp_gap_ble_api.h"
+#include "ble_conn.h"
+#include "long_write.h"
+#include "mem_pool.h"
+#endif
 
 #define GATTS_TAG "GATTS_DEMO"
 
 // Profile and service definitions
-#define PROFILE_NUM           1
-#define PROFILE_A_APP_ID     0
+enum {
+    PROFILE_A_APP_ID,
+#if CONFIG_EXAMPLE_MDS_ENABLE
+    PROFILE_MDS_APP_ID,
+#endif
+#if CONFIG_EXAMPLE_INGEST_ENABLE
+    PROFILE_INGEST_APP_ID,
+#endif
+#if CONFIG_EXAMPLE_DIS_ENABLE
+    PROFILE_DIS_APP_ID,
+#endif
+    PROFILE_NUM,
+};
 
 #define GATTS_SERVICE_UUID_TEST_A   0x00FF
 #define GATTS_CHAR_UUID_TEST_A      0xFF01
 #define GATTS_DESCR_UUID_TEST_A     0x3333
-#define GATTS_NUM_HANDLE_TEST_A     4
 
 // Buffer sizes and flags
 #define TEST_MANUFACTURER_DATA_LEN   17
 #define GATTS_DEMO_CHAR_VAL_LEN_MAX 0x40
-#define PREPARE_BUF_MAX_SIZE        1024
+#define PREPARE_BUF_MAX_SIZE        CONFIG_EXAMPLE_PREPARE_BUF_SIZE
+
+// Notified demo value, kept in a value cache (value_cache.h). Writes of up to
+// GATTS_DEMO_NOTIFY_LEN_MAX bytes replace it and are notified to subscribers if they change
+// it. The limit keeps a delta notification within the default ATT_MTU. Batches of sensor
+// records may fill an ATT_MTU that spans one full LL payload.
+#define GATTS_DEMO_NOTIFY_LEN_MAX   (BLE_CONN_DEFAULT_MTU - 3 - VALUE_CACHE_DELTA_HDR_LEN)
+#define GATTS_DEMO_NOTIFY_BATCH_MAX (GATTS_DEMO_MAX_TX_OCTETS - 4 - 3)    // Less L2CAP and ATT headers
+#define GATTS_DEMO_NOTIFY_INIT      {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, \
+                                     0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e}
+#if CONFIG_EXAMPLE_NOTIFY_DELTA
+#define GATTS_DEMO_NOTIFY_DELTA     true
+#else
+#define GATTS_DEMO_NOTIFY_DELTA     false
+#endif
+// Clients that enable indications instead are indicated the same writes, through a queue per
+// connection (indicate_queue.h) that sends each once the previous one is confirmed
+#define GATTS_DEMO_INDICATE_LEN_MAX GATTS_DEMO_NOTIFY_LEN_MAX
+#if CONFIG_EXAMPLE_NOTIFY_COALESCE_APPEND
+#define GATTS_DEMO_COALESCE_MODE    NOTIFY_COALESCE_APPEND
+#else
+#define GATTS_DEMO_COALESCE_MODE    NOTIFY_COALESCE_LATEST
+#endif
+
+// Link setup requested on every connection: largest LL payload (Data Length Extension) and,
+// where the controller has it, the 2M PHY. Peers that refuse keep BLE_CONN_DEFAULT_TX_OCTETS
+// and BLE_CONN_DEFAULT_PHY.
+#define GATTS_DEMO_MAX_TX_OCTETS    251
+#define GATTS_DEMO_MAX_TX_TIME      2120    // us, 251 bytes on the 1M PHY
+
+// Demo value cache, coalescing window and indication queue statistics, for
+// CONFIG_EXAMPLE_BLE_BENCH. coalesce stays zero without CONFIG_EXAMPLE_NOTIFY_SENSOR.
+void example_char_a_stats_get(value_cache_stats_t *value, notify_coalesce_stats_t *coalesce,
+                              indicate_queue_stats_t *indicate);
 
 #define adv_config_flag      (1 << 0)
 #define scan_rsp_config_flag (1 << 1)
 
+#if CONFIG_BT_BLUEDROID_ENABLED
 // Structure definitions
 struct gatts_profile_inst {
     esp_gatts_cb_t gatts_cb;
     uint16_t gatts_if;
     uint16_t app_id;
-    uint16_t conn_id;
+    uint16_t conn_id;           // Latest connection only, per-connection state is in ble_conn.h
     uint16_t service_handle;
     esp_gatt_srvc_id_t service_id;
     uint16_t char_handle;
@@ -39,13 +92,19 @@ struct gatts_profile_inst {
     esp_bt_uuid_t descr_uuid;
 };
 
-typedef struct {
-    uint8_t *prepare_buf;
-    int prepare_len;
-} prepare_type_env_t;
+// One per connection, kept in the ble_conn.h context
+typedef ble_conn_prepare_t prepare_type_env_t;
 
 // Function declarations
 void example_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param);
-void example_exec_write_event_env(prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param);
+esp_gatt_status_t example_exec_write_event_env(prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param);
+void example_prepare_write_env_free(prepare_type_env_t *prepare_write_env);
+// Response structure from the response pool instead of ~600 bytes of BTC task stack, NULL
+// when all are taken. Free it as soon as esp_ble_gatts_send_response() returned.
+esp_gatt_rsp_t *example_rsp_alloc(void);
+void example_rsp_free(esp_gatt_rsp_t *rsp);
+// Long writes with their segment pool, and response pool usage, for CONFIG_EXAMPLE_BLE_BENCH
+void example_write_stats_get(long_write_stats_t *prepare, mem_pool_stats_t *rsp);
+#endif // CONFIG_BT_BLUEDROID_ENABLED
 
 #endif // GATTS_DEMO_H
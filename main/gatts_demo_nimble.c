@@ -0,0 +1,473 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* NimBLE backend of the GATT server demo. It exposes the same demo service as the
+* Bluedroid backend in gatts_demo.c (0x00FF / 0xFF01 with notifications), the same device
+* name and the MDS service, so clients see the same GATT database on both stacks.
+* Selected with CONFIG_BT_NIMBLE_ENABLED, see sdkconfig.nimble.
+*
+****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "nimble/nimble_port.h"
+#include "nimble/nimble_port_freertos.h"
+#include "host/ble_hs.h"
+#include "host/util/util.h"
+#include "services/gap/ble_svc_gap.h"
+#include "services/gatt/ble_svc_gatt.h"
+
+#include "sdkconfig.h"
+
+#include "ble_bench.h"
+#include "ble_conn.h"
+#include "ble_host.h"
+#include "gatts_demo.h"
+#include "indicate_queue.h"
+#include "notify_coalesce.h"
+#include "value_cache.h"
+#if CONFIG_EXAMPLE_NOTIFY_SENSOR
+#include "demo_sensor.h"
+#endif
+#if CONFIG_EXAMPLE_MDS_ENABLE
+#include "mds.h"
+#endif
+#if CONFIG_EXAMPLE_INGEST_ENABLE
+#include "ingest.h"
+#endif
+#if CONFIG_EXAMPLE_DIS_ENABLE
+#include "dis.h"
+#endif
+#if CONFIG_EXAMPLE_CONN_POLICY
+#include "conn_policy.h"
+#endif
+
+static const char test_device_name[] = "ESP_GATTS_DEMO";
+
+static uint8_t own_addr_type;
+static uint16_t char_a_val_handle;
+
+// Only touched from the NimBLE host task
+static uint8_t char_a_write_buf[PREPARE_BUF_MAX_SIZE];
+VALUE_CACHE_DEFINE(s_char_a_cache, GATTS_DEMO_NOTIFY_BATCH_MAX, GATTS_DEMO_NOTIFY_DELTA);
+#if CONFIG_EXAMPLE_NOTIFY_SENSOR
+NOTIFY_COALESCE_DEFINE(s_char_a_coalesce, GATTS_DEMO_NOTIFY_BATCH_MAX);
+#endif
+INDICATE_QUEUE_DEFINE(s_char_a_ind, GATTS_DEMO_INDICATE_LEN_MAX, CONFIG_EXAMPLE_INDICATE_QUEUE_DEPTH);
+
+static int gatts_demo_gap_event(struct ble_gap_event *event, void *arg);
+
+static esp_err_t gatts_demo_notify_send(uint16_t conn_id, const uint8_t *pdu, uint16_t len, void *ctx)
+{
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(pdu, len);
+    if (om == NULL) {
+        ESP_LOGE(GATTS_TAG, "Notification no mem");
+        return ESP_ERR_NO_MEM;
+    }
+    // Consumes om, also on failure
+    return ble_gatts_notify_custom(conn_id, char_a_val_handle, om) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t gatts_demo_indicate_send(uint16_t conn_id, const uint8_t *value, uint16_t len, void *ctx)
+{
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(value, len);
+    if (om == NULL) {
+        ESP_LOGE(GATTS_TAG, "Indication no mem");
+        return ESP_ERR_NO_MEM;
+    }
+    // Consumes om, also on failure
+    return ble_gatts_indicate_custom(conn_id, char_a_val_handle, om) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static int gatts_demo_char_a_access(uint16_t conn_handle, uint16_t attr_handle,
+                                    struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    static const uint8_t read_val[] = {0xde, 0xed, 0xbe, 0xef};
+    uint16_t len = 0;
+
+    switch (ctxt->op) {
+    case BLE_GATT_ACCESS_OP_READ_CHR:
+        ESP_LOGI(GATTS_TAG, "Characteristic read, conn_handle %d, handle %d", conn_handle, attr_handle);
+        return os_mbuf_append(ctxt->om, read_val, sizeof(read_val)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    case BLE_GATT_ACCESS_OP_WRITE_CHR:
+        // NimBLE reassembles prepared writes itself, long values arrive here in one piece
+        if (ble_hs_mbuf_to_flat(ctxt->om, char_a_write_buf, sizeof(char_a_write_buf), &len) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        ESP_LOGI(GATTS_TAG, "Characteristic write, conn_handle %d, handle %d, value len %d",
+                 conn_handle, attr_handle, len);
+        ESP_LOG_BUFFER_HEX(GATTS_TAG, char_a_write_buf, len);
+        // Subscribers hear about the value only if it changed
+        if (len <= GATTS_DEMO_NOTIFY_LEN_MAX && value_cache_set(&s_char_a_cache, char_a_write_buf, len)) {
+            value_cache_flush(&s_char_a_cache, gatts_demo_notify_send, NULL);
+            indicate_queue_send_all(&s_char_a_ind, char_a_write_buf, len);
+        }
+        return 0;
+    default:
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+}
+
+static const struct ble_gatt_svc_def gatts_demo_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = BLE_UUID16_DECLARE(GATTS_SERVICE_UUID_TEST_A),
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = BLE_UUID16_DECLARE(GATTS_CHAR_UUID_TEST_A),
+                .access_cb = gatts_demo_char_a_access,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
+                .val_handle = &char_a_val_handle,
+            }, {
+                0, /* No more characteristics in this service */
+            }
+        },
+    },
+    {
+        0, /* No more services */
+    },
+};
+
+static void gatts_demo_advertise(void)
+{
+    struct ble_hs_adv_fields fields;
+    struct ble_gap_adv_params adv_params;
+    int rc;
+
+    memset(&fields, 0, sizeof(fields));
+    fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+    fields.name = (uint8_t *)test_device_name;
+    fields.name_len = strlen(test_device_name);
+    fields.name_is_complete = 1;
+    fields.uuids16 = (ble_uuid16_t[]) {
+        BLE_UUID16_INIT(GATTS_SERVICE_UUID_TEST_A)
+    };
+    fields.num_uuids16 = 1;
+    fields.uuids16_is_complete = 1;
+
+    rc = ble_gap_adv_set_fields(&fields);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "config adv data failed, error code = %d", rc);
+        return;
+    }
+
+    memset(&adv_params, 0, sizeof(adv_params));
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    adv_params.itvl_min = 0x20;
+    adv_params.itvl_max = 0x40;
+    rc = ble_gap_adv_start(own_addr_type, NULL, BLE_HS_FOREVER, &adv_params, gatts_demo_gap_event, NULL);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "Advertising start failed, error code = %d", rc);
+        return;
+    }
+    ESP_LOGI(GATTS_TAG, "Advertising start successfully");
+    ble_bench_adv_started();
+}
+
+static int gatts_demo_gap_event(struct ble_gap_event *event, void *arg)
+{
+    switch (event->type) {
+    case BLE_GAP_EVENT_CONNECT: {
+        if (event->connect.status != 0) {
+            ESP_LOGE(GATTS_TAG, "Connection failed, status %d", event->connect.status);
+            gatts_demo_advertise();
+            break;
+        }
+        ESP_LOGI(GATTS_TAG, "Connected, conn_handle %d", event->connect.conn_handle);
+        struct ble_gap_conn_desc desc;
+        ble_conn_t *conn = ble_conn_open(event->connect.conn_handle);
+        if (conn && ble_gap_conn_find(event->connect.conn_handle, &desc) == 0) {
+            conn->conn_interval = desc.conn_itvl;
+            conn->conn_latency = desc.conn_latency;
+        }
+#if CONFIG_EXAMPLE_CONN_POLICY
+        // The policy requests the connection parameters from here on
+        if (conn) {
+            conn_policy_on_connect(event->connect.conn_handle, conn->conn_interval, conn->conn_latency);
+        }
+#else
+        /* For the IOS system, please reference the apple official documents about the ble connection parameters restrictions. */
+        struct ble_gap_upd_params conn_params = {
+            .itvl_min = 0x10,               // min_int = 0x10*1.25ms = 20ms
+            .itvl_max = 0x20,               // max_int = 0x20*1.25ms = 40ms
+            .latency = 0,
+            .supervision_timeout = 400,     // timeout = 400*10ms = 4000ms
+        };
+        ble_gap_update_params(event->connect.conn_handle, &conn_params);
+#endif
+        // Ask for the largest LL payload, the controller settles on what the peer supports
+        ble_bench_link_update(BLE_CONN_DEFAULT_PHY, BLE_CONN_DEFAULT_TX_OCTETS);
+        if (ble_gap_set_data_len(event->connect.conn_handle, GATTS_DEMO_MAX_TX_OCTETS, GATTS_DEMO_MAX_TX_TIME) != 0) {
+            ESP_LOGW(GATTS_TAG, "Set data length failed");
+        }
+#if CONFIG_BT_NIMBLE_50_FEATURE_SUPPORT
+        // And for the 2M PHY, peers without it stay on 1M
+        if (ble_gap_set_prefered_le_phy(event->connect.conn_handle, BLE_GAP_LE_PHY_2M_MASK,
+                                        BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY) != 0) {
+            ESP_LOGW(GATTS_TAG, "Set preferred PHY failed");
+        }
+#endif
+        break;
+    }
+    case BLE_GAP_EVENT_DISCONNECT:
+        ESP_LOGI(GATTS_TAG, "Disconnected, conn_handle %d, reason 0x%02x",
+                 event->disconnect.conn.conn_handle, event->disconnect.reason);
+#if CONFIG_EXAMPLE_CONN_POLICY
+        conn_policy_on_disconnect(event->disconnect.conn.conn_handle);
+#endif
+        value_cache_unsubscribe(&s_char_a_cache, event->disconnect.conn.conn_handle);
+        indicate_queue_close(&s_char_a_ind, event->disconnect.conn.conn_handle);
+        gatts_demo_advertise();
+        break;
+    case BLE_GAP_EVENT_ADV_COMPLETE:
+        gatts_demo_advertise();
+        break;
+    case BLE_GAP_EVENT_CONN_UPDATE: {
+        ESP_LOGI(GATTS_TAG, "Connection params update, status %d", event->conn_update.status);
+        struct ble_gap_conn_desc desc;
+        ble_conn_t *conn = ble_conn_get(event->conn_update.conn_handle);
+        if (conn == NULL || ble_gap_conn_find(event->conn_update.conn_handle, &desc) != 0) {
+            break;
+        }
+        conn->conn_interval = desc.conn_itvl;
+        conn->conn_latency = desc.conn_latency;
+#if CONFIG_EXAMPLE_CONN_POLICY
+        conn_policy_on_update(event->conn_update.conn_handle, event->conn_update.status == 0,
+                              desc.conn_itvl, desc.conn_latency);
+#endif
+        break;
+    }
+    case BLE_GAP_EVENT_DATA_LEN_CHG: {
+        ESP_LOGI(GATTS_TAG, "Data length update, conn_handle %d, rx %d, tx %d", event->data_len_chg.conn_handle,
+                 event->data_len_chg.max_rx_octets, event->data_len_chg.max_tx_octets);
+        ble_conn_t *conn = ble_conn_get(event->data_len_chg.conn_handle);
+        if (conn) {
+            conn->tx_octets = event->data_len_chg.max_tx_octets;
+        }
+        ble_bench_link_update(0, event->data_len_chg.max_tx_octets);
+        break;
+    }
+    case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE: {
+        ESP_LOGI(GATTS_TAG, "PHY update, status %d, tx_phy %d, rx_phy %d", event->phy_updated.status,
+                 event->phy_updated.tx_phy, event->phy_updated.rx_phy);
+        if (event->phy_updated.status != 0) {
+            ESP_LOGW(GATTS_TAG, "Peer refused the 2M PHY, staying on 1M");
+            break;
+        }
+        ble_conn_t *conn = ble_conn_get(event->phy_updated.conn_handle);
+        if (conn) {
+            conn->phy = event->phy_updated.tx_phy;
+        }
+        ble_bench_link_update(event->phy_updated.tx_phy, 0);
+        break;
+    }
+    case BLE_GAP_EVENT_MTU: {
+        ESP_LOGI(GATTS_TAG, "MTU exchange, conn_handle %d, MTU %d", event->mtu.conn_handle, event->mtu.value);
+        ble_conn_t *conn = ble_conn_get(event->mtu.conn_handle);
+        if (conn) {
+            conn->mtu = event->mtu.value;
+        }
+        break;
+    }
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        if (event->notify_tx.attr_handle != char_a_val_handle) {
+            break;
+        }
+        if (!event->notify_tx.indication) {
+            // Reported once the notification is queued, a released buffer lets subscribers
+            // left behind catch up. Failures are reported too, their send already returned an
+            // error.
+            if (event->notify_tx.status == 0 && value_cache_confirm(&s_char_a_cache, event->notify_tx.conn_handle)) {
+                value_cache_flush(&s_char_a_cache, gatts_demo_notify_send, NULL);
+            }
+        } else if (event->notify_tx.status == BLE_HS_EDONE || event->notify_tx.status == BLE_HS_ETIMEOUT) {
+            // The indication is done with, confirmed or given up by the host after the ATT
+            // timeout, the next queued one can go out. Status 0 only reports it sent.
+            indicate_queue_confirm(&s_char_a_ind, event->notify_tx.conn_handle);
+        }
+        break;
+    case BLE_GAP_EVENT_SUBSCRIBE:
+        if (event->subscribe.attr_handle == char_a_val_handle) {
+            ble_conn_t *conn = ble_conn_get(event->subscribe.conn_handle);
+            if (conn) {
+                conn->cccd[BLE_CONN_CCCD_DEMO] = (event->subscribe.cur_notify ? 0x0001 : 0) |
+                                                 (event->subscribe.cur_indicate ? 0x0002 : 0);
+            }
+            if (event->subscribe.cur_notify) {
+                ESP_LOGI(GATTS_TAG, "Notification enable");
+                // A new subscriber is behind, the flush sends it the whole value
+                value_cache_subscribe(&s_char_a_cache, event->subscribe.conn_handle);
+                value_cache_flush(&s_char_a_cache, gatts_demo_notify_send, NULL);
+            } else {
+                value_cache_unsubscribe(&s_char_a_cache, event->subscribe.conn_handle);
+            }
+            if (event->subscribe.cur_indicate) {
+                static const uint8_t indicate_data[] = GATTS_DEMO_NOTIFY_INIT;
+
+                ESP_LOGI(GATTS_TAG, "Indication enable");
+                // Later indications wait for this one's confirmation
+                if (indicate_queue_open(&s_char_a_ind, event->subscribe.conn_handle) == ESP_OK) {
+                    indicate_queue_send(&s_char_a_ind, event->subscribe.conn_handle, indicate_data,
+                                        sizeof(indicate_data));
+                }
+            } else {
+                indicate_queue_close(&s_char_a_ind, event->subscribe.conn_handle);
+            }
+            if (!event->subscribe.cur_notify && !event->subscribe.cur_indicate) {
+                ESP_LOGI(GATTS_TAG, "Notification/Indication disable");
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+#if CONFIG_EXAMPLE_MDS_ENABLE
+    mds_nimble_gap_event(event);
+#endif
+#if CONFIG_EXAMPLE_INGEST_ENABLE
+    ingest_nimble_gap_event(event);
+#endif
+
+    // Every user has seen the disconnect, the context can go
+    if (event->type == BLE_GAP_EVENT_DISCONNECT) {
+        ble_conn_close(event->disconnect.conn.conn_handle);
+    }
+    return 0;
+}
+
+void example_char_a_stats_get(value_cache_stats_t *value, notify_coalesce_stats_t *coalesce,
+                              indicate_queue_stats_t *indicate)
+{
+    value_cache_stats_get(&s_char_a_cache, value);
+#if CONFIG_EXAMPLE_NOTIFY_SENSOR
+    notify_coalesce_stats_get(&s_char_a_coalesce, coalesce);
+#else
+    memset(coalesce, 0, sizeof(*coalesce));
+#endif
+    indicate_queue_stats_get(&s_char_a_ind, indicate);
+}
+
+#if CONFIG_EXAMPLE_CONN_POLICY
+esp_err_t conn_policy_port_update(uint16_t conn_id, const conn_policy_params_t *params)
+{
+    const struct ble_gap_upd_params conn_params = {
+        .itvl_min = params->min_int,
+        .itvl_max = params->max_int,
+        .latency = params->latency,
+        .supervision_timeout = params->timeout,
+    };
+
+    return ble_gap_update_params(conn_id, &conn_params) == 0 ? ESP_OK : ESP_FAIL;
+}
+#endif
+
+static void gatts_demo_on_reset(int reason)
+{
+    ESP_LOGE(GATTS_TAG, "Resetting state, reason %d", reason);
+}
+
+static void gatts_demo_on_sync(void)
+{
+    int rc = ble_hs_util_ensure_addr(0);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "ensure address failed, error code = %d", rc);
+        return;
+    }
+
+    rc = ble_hs_id_infer_auto(0, &own_addr_type);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "infer address type failed, error code = %d", rc);
+        return;
+    }
+
+    // NimBLE starts every registered service when the host syncs
+    ble_bench_service_ready("GATT server");
+    gatts_demo_advertise();
+}
+
+static void gatts_demo_host_task(void *param)
+{
+    nimble_port_run();
+    nimble_port_freertos_deinit();
+}
+
+esp_err_t ble_host_init(void)
+{
+    esp_err_t ret;
+    int rc;
+
+    ret = nimble_port_init();
+    if (ret) {
+        ESP_LOGE(GATTS_TAG, "%s init nimble failed: %s", __func__, esp_err_to_name(ret));
+        return ret;
+    }
+
+    ble_hs_cfg.reset_cb = gatts_demo_on_reset;
+    ble_hs_cfg.sync_cb = gatts_demo_on_sync;
+
+    ble_svc_gap_init();
+    ble_svc_gatt_init();
+
+    static const uint8_t notify_init[] = GATTS_DEMO_NOTIFY_INIT;
+    value_cache_set(&s_char_a_cache, notify_init, sizeof(notify_init));
+    indicate_queue_init(&s_char_a_ind, CONFIG_EXAMPLE_INDICATE_STALL_REPORT_MS, gatts_demo_indicate_send, NULL);
+#if CONFIG_EXAMPLE_NOTIFY_SENSOR
+    // Sensor updates reach the cache once per coalescing window
+    if (notify_coalesce_init(&s_char_a_coalesce, &s_char_a_cache, GATTS_DEMO_COALESCE_MODE,
+                             CONFIG_EXAMPLE_NOTIFY_WINDOW_MS, gatts_demo_notify_send, NULL) == ESP_OK) {
+        demo_sensor_start(&s_char_a_coalesce);
+    }
+#endif
+
+    rc = ble_gatts_count_cfg(gatts_demo_svcs);
+    if (rc == 0) {
+        rc = ble_gatts_add_svcs(gatts_demo_svcs);
+    }
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "add demo service failed, error code = %d", rc);
+        return ESP_FAIL;
+    }
+#if CONFIG_EXAMPLE_MDS_ENABLE
+    rc = mds_nimble_gatt_svr_init();
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "add mds service failed, error code = %d", rc);
+        return ESP_FAIL;
+    }
+#endif
+#if CONFIG_EXAMPLE_INGEST_ENABLE
+    rc = ingest_nimble_gatt_svr_init();
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "add ingest service failed, error code = %d", rc);
+        return ESP_FAIL;
+    }
+#endif
+#if CONFIG_EXAMPLE_DIS_ENABLE
+    rc = dis_nimble_gatt_svr_init();
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "add dis service failed, error code = %d", rc);
+        return ESP_FAIL;
+    }
+#endif
+
+    rc = ble_svc_gap_device_name_set(test_device_name);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "set device name failed, error code = %d", rc);
+    }
+    rc = ble_att_set_preferred_mtu(500);
+    if (rc != 0) {
+        ESP_LOGE(GATTS_TAG, "set local  MTU failed, error code = %d", rc);
+    }
+
+    nimble_port_freertos_init(gatts_demo_host_task);
+
+    return ESP_OK;
+}
@@ -0,0 +1,196 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Table-driven service registration. The whole attribute table goes to the BTC task in
+* one esp_ble_gatts_create_attr_tab() call and comes back as a single
+* ESP_GATTS_CREAT_ATTR_TAB_EVT carrying every handle, so a service costs one round trip
+* through the BTC queue instead of one per attribute.
+*
+* The same event fills a routing table indexed by attribute handle. Reads, writes and
+* confirmations are then dispatched with one array lookup to the owning service and the
+* index of the attribute in its table, instead of offering the event to every profile and
+* comparing handles one by one.
+*
+* Values that are fixed or change rarely are declared ESP_GATT_AUTO_RSP and kept in the
+* stack's attribute database, updated with gatts_table_value_set(). The stack answers their
+* reads, including Read Blob, without an event to the app or a response built on the BTC
+* task stack. Only values that depend on the connection or change all the time are answered
+* by the app.
+*
+****************************************************************************/
+
+#include <stdatomic.h>
+#include <string.h>
+#include "esp_cpu.h"
+#include "esp_log.h"
+
+#include "ble_bench.h"
+#include "gatts_demo.h"
+#include "gatts_table.h"
+
+const uint16_t gatts_table_uuid_pri_service = ESP_GATT_UUID_PRI_SERVICE;
+const uint16_t gatts_table_uuid_char_decl   = ESP_GATT_UUID_CHAR_DECLARE;
+const uint16_t gatts_table_uuid_cccd        = ESP_GATT_UUID_CHAR_CLIENT_CONFIG;
+
+// Routing entry of one attribute handle, svc is an index into s_route_svcs plus one, 0 if unrouted
+typedef struct {
+    uint8_t svc;
+    uint8_t attr_idx;
+} gatts_table_route_t;
+
+static gatts_table_route_t s_routes[GATTS_TABLE_MAX_HANDLE + 1];
+static const gatts_table_svc_t *s_route_svcs[GATTS_TABLE_MAX_SVC];
+static uint8_t s_route_svc_num;
+
+static struct {
+    atomic_uint routed;
+    atomic_uint route_cycles;
+    atomic_uint app_reads;
+    atomic_uint app_read_cycles;
+} s_stats;
+
+static bool gatts_table_route_add(const gatts_table_svc_t *svc)
+{
+    if (svc->attr_cb == NULL) {
+        return true;
+    }
+    if (s_route_svc_num == GATTS_TABLE_MAX_SVC) {
+        ESP_LOGE(GATTS_TAG, "%s not routed, more than %d services", svc->name, GATTS_TABLE_MAX_SVC);
+        return false;
+    }
+    for (int i = 0; i < svc->num_attr; i++) {
+        if (svc->handles[i] > GATTS_TABLE_MAX_HANDLE) {
+            ESP_LOGE(GATTS_TAG, "%s not routed, handle %d above GATTS_TABLE_MAX_HANDLE", svc->name, svc->handles[i]);
+            return false;
+        }
+    }
+
+    s_route_svcs[s_route_svc_num++] = svc;
+    for (int i = 0; i < svc->num_attr; i++) {
+        s_routes[svc->handles[i]] = (gatts_table_route_t) {
+            .svc = s_route_svc_num,
+            .attr_idx = i,
+        };
+    }
+    return true;
+}
+
+const gatts_table_svc_t *gatts_table_route(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t *param,
+                                           uint8_t *attr_idx)
+{
+    uint16_t handle;
+
+    switch (event) {
+    case ESP_GATTS_READ_EVT:
+        handle = param->read.handle;
+        break;
+    case ESP_GATTS_WRITE_EVT:
+        handle = param->write.handle;
+        break;
+    case ESP_GATTS_CONF_EVT:
+        handle = param->conf.handle;
+        break;
+    default:
+        return NULL;
+    }
+
+    if (handle > GATTS_TABLE_MAX_HANDLE || s_routes[handle].svc == 0) {
+        return NULL;
+    }
+    *attr_idx = s_routes[handle].attr_idx;
+    return s_route_svcs[s_routes[handle].svc - 1];
+}
+
+bool gatts_table_dispatch(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+    uint8_t attr_idx;
+    const uint32_t start = esp_cpu_get_cycle_count();
+    const gatts_table_svc_t *svc = gatts_table_route(event, param, &attr_idx);
+    if (svc == NULL) {
+        return false;
+    }
+
+    atomic_fetch_add(&s_stats.routed, 1);
+    atomic_fetch_add(&s_stats.route_cycles, esp_cpu_get_cycle_count() - start);
+    svc->attr_cb(event, gatts_if, param, attr_idx);
+    if (event == ESP_GATTS_READ_EVT) {
+        atomic_fetch_add(&s_stats.app_reads, 1);
+        atomic_fetch_add(&s_stats.app_read_cycles, esp_cpu_get_cycle_count() - start);
+    }
+    return true;
+}
+
+void gatts_table_stats_get(gatts_table_stats_t *stats)
+{
+    stats->routed = atomic_exchange(&s_stats.routed, 0);
+    stats->route_cycles = atomic_exchange(&s_stats.route_cycles, 0);
+    stats->app_reads = atomic_exchange(&s_stats.app_reads, 0);
+    stats->app_read_cycles = atomic_exchange(&s_stats.app_read_cycles, 0);
+}
+
+esp_err_t gatts_table_create(esp_gatt_if_t gatts_if, const gatts_table_svc_t *svc)
+{
+    esp_err_t ret = esp_ble_gatts_create_attr_tab(svc->db, gatts_if, svc->num_attr, svc->inst_id);
+    if (ret){
+        ESP_LOGE(GATTS_TAG, "%s create attr table failed, error code = %x", svc->name, ret);
+    }
+    return ret;
+}
+
+esp_err_t gatts_table_value_set(const gatts_table_svc_t *svc, uint8_t attr_idx, const void *value, uint16_t len)
+{
+    if (attr_idx >= svc->num_attr || svc->handles[attr_idx] == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (svc->db[attr_idx].attr_control.auto_rsp != ESP_GATT_AUTO_RSP || len > svc->db[attr_idx].att_desc.max_length) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return esp_ble_gatts_set_attr_value(svc->handles[attr_idx], len, value);
+}
+
+bool gatts_table_handle_event(const gatts_table_svc_t *svc, esp_gatts_cb_event_t event, esp_ble_gatts_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+        // Each profile has its own gatts_if, the instance id tells its tables apart
+        if (param->add_attr_tab.svc_inst_id != svc->inst_id) {
+            return false;
+        }
+        if (param->add_attr_tab.status != ESP_GATT_OK){
+            ESP_LOGE(GATTS_TAG, "%s create attribute table failed, error code=0x%x", svc->name, param->add_attr_tab.status);
+        } else if (param->add_attr_tab.num_handle != svc->num_attr){
+            ESP_LOGE(GATTS_TAG, "%s create attribute table abnormally, num_handle (%d) doesn't equal to %d",
+                     svc->name, param->add_attr_tab.num_handle, svc->num_attr);
+        } else {
+            ESP_LOGI(GATTS_TAG, "%s create attribute table successfully, the number handle = %d",
+                     svc->name, param->add_attr_tab.num_handle);
+            memcpy(svc->handles, param->add_attr_tab.handles, svc->num_attr * sizeof(uint16_t));
+            // A service that cannot be routed would never answer its reads, keep it stopped
+            if (gatts_table_route_add(svc)) {
+                // The stack handles the queued value updates before the start
+                if (svc->created_cb) {
+                    svc->created_cb();
+                }
+                esp_ble_gatts_start_service(svc->handles[0]);
+            }
+        }
+        return true;
+    case ESP_GATTS_START_EVT:
+        if (param->start.service_handle != svc->handles[0]) {
+            return false;
+        }
+        ESP_LOGI(GATTS_TAG, "%s service start, status %d, service_handle %d",
+                 svc->name, param->start.status, param->start.service_handle);
+        if (param->start.status == ESP_GATT_OK) {
+            ble_bench_service_ready(svc->name);
+        }
+        return true;
+    default:
+        return false;
+    }
+}
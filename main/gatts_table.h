@@ -0,0 +1,109 @@
+#ifndef GATTS_TABLE_H
+#define GATTS_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_gatts_api.h"
+
+// Highest attribute handle the routing table covers. Bluedroid hands out handles in
+// registration order from 1, the GATT and GAP services take the first twenty or so.
+#define GATTS_TABLE_MAX_HANDLE 128
+// Services that can be routed to
+#define GATTS_TABLE_MAX_SVC 8
+
+// Called for ESP_GATTS_READ_EVT, ESP_GATTS_WRITE_EVT and ESP_GATTS_CONF_EVT on an attribute of
+// the service, attr_idx is the index of the attribute in the service's db
+typedef void (*gatts_table_attr_cb_t)(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
+                                      esp_ble_gatts_cb_param_t *param, uint8_t attr_idx);
+
+// Declarative attribute table entries. Each expands to a designated initializer of an
+// esp_gatts_attr_db_t array indexed by the service's attribute enum, so a whole service is
+// one const table in flash whose size, and handle count, is the enum's last value. UUIDs
+// and properties are compile-time literals, nothing is built or parsed at runtime.
+extern const uint16_t gatts_table_uuid_pri_service;
+extern const uint16_t gatts_table_uuid_char_decl;
+extern const uint16_t gatts_table_uuid_cccd;
+
+#define GATTS_TABLE_ATTR(idx, rsp, uuid_len, uuid_p, perm, max_len, len, value) \
+    [idx] = {{rsp}, {uuid_len, (uint8_t *)(uuid_p), perm, max_len, len, (uint8_t *)(value)}}
+
+#define GATTS_TABLE_SERVICE16(idx, uuid16) \
+    GATTS_TABLE_ATTR(idx, ESP_GATT_AUTO_RSP, ESP_UUID_LEN_16, &gatts_table_uuid_pri_service, ESP_GATT_PERM_READ, \
+                     ESP_UUID_LEN_16, ESP_UUID_LEN_16, &(const uint16_t){ uuid16 })
+// The UUID bytes go last, least significant first
+#define GATTS_TABLE_SERVICE128(idx, ...) \
+    GATTS_TABLE_ATTR(idx, ESP_GATT_AUTO_RSP, ESP_UUID_LEN_16, &gatts_table_uuid_pri_service, ESP_GATT_PERM_READ, \
+                     ESP_UUID_LEN_128, ESP_UUID_LEN_128, ((const uint8_t[ESP_UUID_LEN_128]){ __VA_ARGS__ }))
+
+// Characteristic declaration with ESP_GATT_CHAR_PROP_BIT_* props, followed by its value
+#define GATTS_TABLE_CHAR_DECL(idx, props) \
+    GATTS_TABLE_ATTR(idx, ESP_GATT_AUTO_RSP, ESP_UUID_LEN_16, &gatts_table_uuid_char_decl, ESP_GATT_PERM_READ, \
+                     sizeof(uint8_t), sizeof(uint8_t), &(const uint8_t){ props })
+
+// Characteristic value answered by the app (ESP_GATT_RSP_BY_APP), up to max_len bytes
+#define GATTS_TABLE_VALUE16(idx, uuid16, perm, max_len) \
+    GATTS_TABLE_ATTR(idx, ESP_GATT_RSP_BY_APP, ESP_UUID_LEN_16, &(const uint16_t){ uuid16 }, perm, max_len, 0, NULL)
+#define GATTS_TABLE_VALUE128(idx, perm, max_len, ...) \
+    GATTS_TABLE_ATTR(idx, ESP_GATT_RSP_BY_APP, ESP_UUID_LEN_128, ((const uint8_t[ESP_UUID_LEN_128]){ __VA_ARGS__ }), \
+                     perm, max_len, 0, NULL)
+
+// Read-only value the stack answers itself (ESP_GATT_AUTO_RSP), reads never reach the app.
+// Starts out as len bytes at value, which may be 0 and NULL to fill it in with
+// gatts_table_value_set() once the service is created.
+#define GATTS_TABLE_STATIC16(idx, uuid16, max_len, len, value) \
+    GATTS_TABLE_ATTR(idx, ESP_GATT_AUTO_RSP, ESP_UUID_LEN_16, &(const uint16_t){ uuid16 }, ESP_GATT_PERM_READ, \
+                     max_len, len, value)
+
+// Client Characteristic Configuration descriptor, answered by the app
+#define GATTS_TABLE_CCCD(idx) \
+    GATTS_TABLE_ATTR(idx, ESP_GATT_RSP_BY_APP, ESP_UUID_LEN_16, &gatts_table_uuid_cccd, \
+                     ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, sizeof(uint16_t), 0, NULL)
+
+// A service created in one esp_ble_gatts_create_attr_tab() call instead of the
+// create_service -> add_char -> add_char_descr callback chain
+typedef struct {
+    const char *name;
+    const esp_gatts_attr_db_t *db;
+    uint8_t num_attr;
+    uint8_t inst_id;
+    // num_attr entries, indexed like db and filled from ESP_GATTS_CREAT_ATTR_TAB_EVT
+    uint16_t *handles;
+    // If set, attribute events are routed here by handle instead of through gl_profile_tab
+    gatts_table_attr_cb_t attr_cb;
+    // If set, called once the handles are known and before the service is started, to fill
+    // in values with gatts_table_value_set() before any client can read them
+    void (*created_cb)(void);
+} gatts_table_svc_t;
+
+// Queue creation of the whole service, call from ESP_GATTS_REG_EVT
+esp_err_t gatts_table_create(esp_gatt_if_t gatts_if, const gatts_table_svc_t *svc);
+
+// Handles ESP_GATTS_CREAT_ATTR_TAB_EVT (copy handles, call created_cb, start the service) and
+// ESP_GATTS_START_EVT for svc. Returns true if the event belonged to svc.
+bool gatts_table_handle_event(const gatts_table_svc_t *svc, esp_gatts_cb_event_t event, esp_ble_gatts_cb_param_t *param);
+
+// Replaces the value the stack serves for an ESP_GATT_AUTO_RSP attribute, for values that
+// change rarely. Fails with ESP_ERR_INVALID_STATE before the service is created.
+esp_err_t gatts_table_value_set(const gatts_table_svc_t *svc, uint8_t attr_idx, const void *value, uint16_t len);
+
+// Looks up the service and attribute index an attribute event is for, in constant time.
+// Returns NULL for other events and for handles of services without attr_cb.
+const gatts_table_svc_t *gatts_table_route(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t *param,
+                                           uint8_t *attr_idx);
+// Hands an attribute event to the attr_cb of the owning service, found with
+// gatts_table_route(). Returns false if no service takes the event.
+bool gatts_table_dispatch(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+
+// Counters since the previous gatts_table_stats_get()
+typedef struct {
+    uint32_t routed;            // Events gatts_table_dispatch() found a service for
+    uint32_t route_cycles;      // CPU cycles their lookups took
+    uint32_t app_reads;         // Reads of those answered by the app
+    uint32_t app_read_cycles;   // CPU cycles from the event to the response being queued
+} gatts_table_stats_t;
+
+// Fills stats, the counters restart with every call
+void gatts_table_stats_get(gatts_table_stats_t *stats);
+
+#endif // GATTS_TABLE_H
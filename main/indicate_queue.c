@@ -0,0 +1,291 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Per-connection indication queue, see indicate_queue.h. Stack-neutral, the host stack
+* backend supplies the send callback and reports confirmations. Each connection slot is a
+* ring of pool buffers, ring[head] is the one in flight once sent.
+*
+* One mutex covers every slot and the send callback, like conn_policy.c: sends are rare next
+* to notifications and must leave in queue order. One one-shot esp_timer watches the oldest
+* indication in flight across all connections and is re-armed for the next deadline when it
+* fires. A stall is only reported, the slot keeps waiting for the stack. The stacks report
+* confirmations from their own task, never from inside the send.
+*
+****************************************************************************/
+
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "indicate_queue.h"
+
+#define INDICATE_QUEUE_TAG "INDICATE_QUEUE"
+
+// Upper bounds of the confirmation latency buckets but the last
+static const uint32_t s_latency_ms[INDICATE_QUEUE_LATENCY_BUCKETS - 1] = {10, 30, 100, 300, 1000};
+
+// Accounts one indication done with, wait_us spent queued and latency_us from the send to its
+// confirmation or to the stall report. Called under the lock.
+static void indicate_queue_done(indicate_queue_t *q, int64_t wait_us, int64_t latency_us, bool stalled)
+{
+    int i = INDICATE_QUEUE_LATENCY_BUCKETS - 1;
+
+    if (!stalled) {
+        for (i = 0; i < INDICATE_QUEUE_LATENCY_BUCKETS - 1 && latency_us >= s_latency_ms[i] * 1000LL; i++) {
+        }
+    }
+    q->stats.latency[i]++;
+    if (stalled) {
+        q->stats.stalled++;
+    } else {
+        q->stats.confirmed++;
+    }
+    q->stats.wait_us += wait_us;
+}
+
+// Slot of conn_id, NULL if it is not open. Called under the lock.
+static indicate_queue_conn_t *indicate_queue_conn(indicate_queue_t *q, uint16_t conn_id)
+{
+    for (int i = 0; i < BLE_CONN_MAX; i++) {
+        if (q->conns[i].open && q->conns[i].conn_id == conn_id) {
+            return &q->conns[i];
+        }
+    }
+    return NULL;
+}
+
+// Drops the oldest entry of c. Called under the lock.
+static void indicate_queue_pop(indicate_queue_t *q, indicate_queue_conn_t *c)
+{
+    mem_pool_free(q->pool, c->ring[c->head]);
+    c->ring[c->head] = NULL;
+    c->head = (c->head + 1) % INDICATE_QUEUE_DEPTH_MAX;
+    c->count--;
+    c->in_flight = false;
+    c->stalled = false;
+}
+
+// Sends the oldest entry of c unless one is in flight, dropping the ones the stack refuses.
+// Called under the lock.
+static void indicate_queue_kick(indicate_queue_t *q, indicate_queue_conn_t *c)
+{
+    while (!c->in_flight && c->count) {
+        indicate_queue_entry_t *entry = c->ring[c->head];
+
+        if (q->send(c->conn_id, entry->data, entry->len, q->send_ctx) == ESP_OK) {
+            c->in_flight = true;
+            c->sent_us = esp_timer_get_time();
+            return;
+        }
+        ESP_LOGW(INDICATE_QUEUE_TAG, "%s: indication to conn_id %u failed, dropped", q->name, c->conn_id);
+        indicate_queue_pop(q, c);
+    }
+}
+
+// Arms the timer for the oldest indication in flight and not yet reported unless it already
+// runs. Called under the lock.
+static void indicate_queue_timer_arm(indicate_queue_t *q)
+{
+    if (esp_timer_is_active(q->timer)) {
+        return;
+    }
+
+    int64_t oldest_us = INT64_MAX;
+    for (int i = 0; i < BLE_CONN_MAX; i++) {
+        const indicate_queue_conn_t *c = &q->conns[i];
+
+        if (c->open && c->in_flight && !c->stalled && c->sent_us < oldest_us) {
+            oldest_us = c->sent_us;
+        }
+    }
+    if (oldest_us == INT64_MAX) {
+        return;
+    }
+
+    const int64_t at_us = oldest_us + q->stall_ms * 1000LL;
+    const int64_t now_us = esp_timer_get_time();
+    esp_timer_start_once(q->timer, at_us > now_us ? at_us - now_us : 0);
+}
+
+static void indicate_queue_timer_cb(void *arg)
+{
+    indicate_queue_t *q = arg;
+
+    xSemaphoreTake(q->lock, portMAX_DELAY);
+    const int64_t now_us = esp_timer_get_time();
+    for (int i = 0; i < BLE_CONN_MAX; i++) {
+        indicate_queue_conn_t *c = &q->conns[i];
+
+        if (!c->open || !c->in_flight || c->stalled || now_us - c->sent_us < q->stall_ms * 1000LL) {
+            continue;
+        }
+        // Still in flight for ATT, the next one may only go out once the stack is done with it
+        ESP_LOGW(INDICATE_QUEUE_TAG, "%s: conn_id %u stalled, no confirmation after %" PRIu32 " ms, %u queued",
+                 q->name, c->conn_id, q->stall_ms, c->count - 1);
+        indicate_queue_done(q, c->sent_us - c->ring[c->head]->queued_us, now_us - c->sent_us, true);
+        c->stalled = true;
+    }
+    indicate_queue_timer_arm(q);
+    xSemaphoreGive(q->lock);
+}
+
+esp_err_t indicate_queue_init(indicate_queue_t *q, uint32_t stall_ms, indicate_queue_send_t send, void *send_ctx)
+{
+    q->stall_ms = stall_ms;
+    q->send = send;
+    q->send_ctx = send_ctx;
+
+    q->lock = xSemaphoreCreateMutex();
+    if (q->lock == NULL) {
+        ESP_LOGE(INDICATE_QUEUE_TAG, "%s: create lock failed", q->name);
+        return ESP_ERR_NO_MEM;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = indicate_queue_timer_cb,
+        .arg = q,
+        .name = q->name,
+    };
+    esp_err_t ret = esp_timer_create(&timer_args, &q->timer);
+    if (ret != ESP_OK) {
+        ESP_LOGE(INDICATE_QUEUE_TAG, "%s: confirmation timer create failed: %s", q->name, esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+esp_err_t indicate_queue_open(indicate_queue_t *q, uint16_t conn_id)
+{
+    esp_err_t ret = ESP_ERR_NO_MEM;
+
+    xSemaphoreTake(q->lock, portMAX_DELAY);
+    if (indicate_queue_conn(q, conn_id)) {
+        ret = ESP_OK;
+    } else {
+        for (int i = 0; i < BLE_CONN_MAX; i++) {
+            indicate_queue_conn_t *c = &q->conns[i];
+
+            if (!c->open) {
+                memset(c, 0, sizeof(*c));
+                c->open = true;
+                c->conn_id = conn_id;
+                ret = ESP_OK;
+                break;
+            }
+        }
+    }
+    xSemaphoreGive(q->lock);
+    return ret;
+}
+
+void indicate_queue_close(indicate_queue_t *q, uint16_t conn_id)
+{
+    xSemaphoreTake(q->lock, portMAX_DELAY);
+    indicate_queue_conn_t *c = indicate_queue_conn(q, conn_id);
+    if (c) {
+        while (c->count) {
+            indicate_queue_pop(q, c);
+        }
+        c->open = false;
+    }
+    // The timer, if armed for c, finds nothing to drop and re-arms for the others
+    xSemaphoreGive(q->lock);
+}
+
+// Queues value on c, called under the lock
+static esp_err_t indicate_queue_push(indicate_queue_t *q, indicate_queue_conn_t *c, const void *value, uint16_t len)
+{
+    static const uint8_t bucket[] = {0, 1, 2, 2};
+    const unsigned ahead = c->count;
+
+    q->stats.depth[ahead < sizeof(bucket) ? bucket[ahead] : INDICATE_QUEUE_DEPTH_BUCKETS - 1]++;
+    indicate_queue_entry_t *entry = ahead < q->depth ? mem_pool_alloc(q->pool) : NULL;
+    if (entry == NULL) {
+        q->stats.refused++;
+        return ESP_ERR_NO_MEM;
+    }
+
+    entry->queued_us = esp_timer_get_time();
+    entry->len = len;
+    memcpy(entry->data, value, len);
+    c->ring[(c->head + c->count) % INDICATE_QUEUE_DEPTH_MAX] = entry;
+    c->count++;
+
+    indicate_queue_kick(q, c);
+    return ESP_OK;
+}
+
+esp_err_t indicate_queue_send(indicate_queue_t *q, uint16_t conn_id, const void *value, uint16_t len)
+{
+    if (len > q->max_len) {
+        ESP_LOGW(INDICATE_QUEUE_TAG, "%s: value of %u bytes refused, max %u", q->name, len, q->max_len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(q->lock, portMAX_DELAY);
+    indicate_queue_conn_t *c = indicate_queue_conn(q, conn_id);
+    const esp_err_t ret = c ? indicate_queue_push(q, c, value, len) : ESP_ERR_INVALID_STATE;
+    indicate_queue_timer_arm(q);
+    xSemaphoreGive(q->lock);
+
+    if (ret == ESP_ERR_NO_MEM) {
+        ESP_LOGW(INDICATE_QUEUE_TAG, "%s: queue of conn_id %u full, indication refused", q->name, conn_id);
+    }
+    return ret;
+}
+
+int indicate_queue_send_all(indicate_queue_t *q, const void *value, uint16_t len)
+{
+    int queued = 0;
+
+    if (len > q->max_len) {
+        ESP_LOGW(INDICATE_QUEUE_TAG, "%s: value of %u bytes refused, max %u", q->name, len, q->max_len);
+        return 0;
+    }
+
+    xSemaphoreTake(q->lock, portMAX_DELAY);
+    for (int i = 0; i < BLE_CONN_MAX; i++) {
+        if (q->conns[i].open && indicate_queue_push(q, &q->conns[i], value, len) == ESP_OK) {
+            queued++;
+        }
+    }
+    indicate_queue_timer_arm(q);
+    xSemaphoreGive(q->lock);
+    return queued;
+}
+
+void indicate_queue_confirm(indicate_queue_t *q, uint16_t conn_id)
+{
+    xSemaphoreTake(q->lock, portMAX_DELAY);
+    indicate_queue_conn_t *c = indicate_queue_conn(q, conn_id);
+    if (c && c->in_flight) {
+        const indicate_queue_entry_t *entry = c->ring[c->head];
+
+        // A stalled indication was already accounted for
+        if (!c->stalled) {
+            indicate_queue_done(q, c->sent_us - entry->queued_us, esp_timer_get_time() - c->sent_us, false);
+        }
+        indicate_queue_pop(q, c);
+        indicate_queue_kick(q, c);
+        indicate_queue_timer_arm(q);
+    }
+    xSemaphoreGive(q->lock);
+}
+
+void indicate_queue_stats_get(indicate_queue_t *q, indicate_queue_stats_t *stats)
+{
+    // Not initialized yet
+    if (q->lock == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    xSemaphoreTake(q->lock, portMAX_DELAY);
+    *stats = q->stats;
+    memset(&q->stats, 0, sizeof(q->stats));
+    xSemaphoreGive(q->lock);
+}
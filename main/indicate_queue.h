@@ -0,0 +1,121 @@
+#ifndef INDICATE_QUEUE_H
+#define INDICATE_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+
+#include "ble_conn.h"
+#include "mem_pool.h"
+
+// Per-connection queue of indications. ATT allows one indication in flight per connection,
+// the next may only go out once the client's Handle Value Confirmation has come back. Values
+// are copied into a pool buffer and queued in order, the queue sends the oldest as soon as
+// the previous one is confirmed (indicate_queue_confirm(), from Bluedroid ESP_GATTS_CONF_EVT
+// or NimBLE BLE_GAP_EVENT_NOTIFY_TX), so the application never waits for the round trip and
+// never has an indication refused by the stack for being early.
+//
+// An indication not confirmed after stall_ms is reported as stalled (log and stats), nothing
+// more: ATT forbids a second one before the stack reports the outcome of the first, so it
+// stays in flight. The bound is the ATT transaction timeout (30 s) and the disconnect it
+// triggers. NimBLE reports that timeout (BLE_HS_ETIMEOUT, which also ends in
+// indicate_queue_confirm()), on Bluedroid the queue of that connection waits until the link
+// drops.
+//
+// Each connection holds at most depth indications, queued and in flight. A full queue refuses
+// new ones, the caller decides whether the value can be dropped. All entry points run under
+// one mutex, the send callback included, so sends go out in queue order from any task.
+#define INDICATE_QUEUE_DEPTH_MAX    8
+// A buffer per queued indication, as far as the pool allows
+#define INDICATE_QUEUE_BUFS(depth)  ((depth) * BLE_CONN_MAX < MEM_POOL_MAX_BLOCKS ? \
+                                     (depth) * BLE_CONN_MAX : MEM_POOL_MAX_BLOCKS)
+
+// Indication waiting for its turn or its confirmation, a block of the queue's pool
+typedef struct {
+    int64_t queued_us;
+    uint16_t len;
+    uint8_t data[];
+} indicate_queue_entry_t;
+
+typedef struct {
+    bool open;              // Set while the client has indications enabled
+    bool in_flight;         // ring[head] was sent and awaits its confirmation
+    bool stalled;           // ... and was reported as not confirmed after stall_ms
+    uint16_t conn_id;
+    uint8_t head;
+    uint8_t count;          // Queued entries, the one in flight included
+    int64_t sent_us;
+    indicate_queue_entry_t *ring[INDICATE_QUEUE_DEPTH_MAX];
+} indicate_queue_conn_t;
+
+// Hands one indication to the stack. Return ESP_OK once it is queued there, the value is
+// then in flight until indicate_queue_confirm() or the disconnect. Anything else drops it.
+typedef esp_err_t (*indicate_queue_send_t)(uint16_t conn_id, const uint8_t *value, uint16_t len, void *ctx);
+
+// Queue depth an indication found on arrival: 0, 1, 2-3, 4+
+#define INDICATE_QUEUE_DEPTH_BUCKETS    4
+// Confirmation latency: <10, <30, <100, <300, <1000 ms, the rest and the stalled ones
+#define INDICATE_QUEUE_LATENCY_BUCKETS  6
+
+// Counters since the previous indicate_queue_stats_get()
+typedef struct {
+    uint32_t depth[INDICATE_QUEUE_DEPTH_BUCKETS];
+    uint32_t refused;           // Offered to a full queue
+    uint32_t confirmed;
+    uint32_t stalled;
+    uint32_t wait_us;           // Time the confirmed and stalled ones spent queued
+    uint32_t latency[INDICATE_QUEUE_LATENCY_BUCKETS];
+} indicate_queue_stats_t;
+
+typedef struct {
+    const char *name;
+    uint16_t max_len;
+    uint8_t depth;
+    uint32_t stall_ms;
+    indicate_queue_send_t send;
+    void *send_ctx;
+    SemaphoreHandle_t lock;
+    esp_timer_handle_t timer;
+    mem_pool_t *pool;
+    indicate_queue_conn_t conns[BLE_CONN_MAX];
+    indicate_queue_stats_t stats;   // Under the lock
+} indicate_queue_t;
+
+// Define a static queue `var` of up to depth indications of up to max_len bytes per connection
+#define INDICATE_QUEUE_DEFINE(var, max_len_, depth_)                                    \
+    _Static_assert((depth_) > 0 && (depth_) <= INDICATE_QUEUE_DEPTH_MAX, #var " depth"); \
+    MEM_POOL_DEFINE(var##_pool, sizeof(indicate_queue_entry_t) + (max_len_),           \
+                    INDICATE_QUEUE_BUFS(depth_));                                       \
+    static indicate_queue_t var = {                                                     \
+        .name = #var,                                                                   \
+        .max_len = (max_len_),                                                          \
+        .depth = (depth_),                                                              \
+        .pool = &var##_pool,                                                            \
+    }
+
+// Create the lock and the stall report timer, indications not confirmed after stall_ms are
+// reported
+esp_err_t indicate_queue_init(indicate_queue_t *q, uint32_t stall_ms, indicate_queue_send_t send, void *send_ctx);
+// Start accepting indications for conn_id, when the client enables them. Idempotent.
+esp_err_t indicate_queue_open(indicate_queue_t *q, uint16_t conn_id);
+// Stop indicating conn_id, on disable and disconnect. Whatever is still queued is dropped.
+// Unknown conn_ids are ignored.
+void indicate_queue_close(indicate_queue_t *q, uint16_t conn_id);
+// Queue one indication for conn_id, sent right away if nothing is in flight. Returns
+// ESP_ERR_INVALID_STATE if conn_id is not open, ESP_ERR_NO_MEM if its queue is full and
+// ESP_ERR_INVALID_SIZE for a value longer than max_len.
+esp_err_t indicate_queue_send(indicate_queue_t *q, uint16_t conn_id, const void *value, uint16_t len);
+// Queue the indication for every open connection, returns for how many it was queued
+int indicate_queue_send_all(indicate_queue_t *q, const void *value, uint16_t len);
+// The indication in flight on conn_id is done, confirmed or timed out by the stack, the next
+// one is sent
+void indicate_queue_confirm(indicate_queue_t *q, uint16_t conn_id);
+
+// Fills stats, the counters restart with every call
+void indicate_queue_stats_get(indicate_queue_t *q, indicate_queue_stats_t *stats);
+
+#endif // INDICATE_QUEUE_H
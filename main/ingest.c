@@ -0,0 +1,392 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Bulk ingest service core. Files arrive as Write Without Response on the Data
+* characteristic, so the client is not held to one ATT round trip per connection event, and
+* are written to a flash partition.
+*
+* The host task only copies each payload into one of two RAM buffers of
+* CONFIG_EXAMPLE_INGEST_BUF_SIZE bytes. A full buffer is queued to the flash writer task,
+* which erases and programs it while the host fills the other one. The window handed to the
+* client ends two buffers past what is in flash, so an accepted write always finds its buffer
+* free and the host never blocks or drops data.
+*
+* Every START, ABORT and disconnect bumps the session counter. The writer drops queued work
+* of older sessions, so a new transfer never waits for, or is confused by, a cancelled one.
+*
+****************************************************************************/
+
+#include <stdatomic.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+
+#include "ble_conn.h"
+#include "ingest.h"
+#if CONFIG_EXAMPLE_CONN_POLICY
+#include "conn_policy.h"
+#endif
+
+#define INGEST_SECTOR_SIZE 4096
+#define INGEST_BUF_SIZE    CONFIG_EXAMPLE_INGEST_BUF_SIZE
+#define INGEST_BUF_NB      2
+#define INGEST_QUEUE_LEN   (INGEST_BUF_NB + 2)
+
+_Static_assert(INGEST_BUF_SIZE % INGEST_SECTOR_SIZE == 0, "ingest buffers must hold whole flash sectors");
+
+typedef enum {
+    INGEST_MSG_START,
+    INGEST_MSG_BUF,
+} ingest_msg_type_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t buf_idx;
+    uint32_t session;
+    uint32_t len;       // START: file length, BUF: bytes in the buffer
+    uint32_t crc;       // START: expected CRC-32
+} ingest_msg_t;
+
+static struct {
+    const esp_partition_t *part;
+    QueueHandle_t queue;
+    TaskHandle_t task;
+
+    // Host task only
+    uint16_t conn_id;
+    uint32_t total;
+    uint32_t received;
+
+    // Shared. Changed under lock together with session, so the writer can never update the
+    // status of a transfer the host task has already ended.
+    portMUX_TYPE lock;
+    atomic_uint session;
+    atomic_uint status;
+    atomic_uint written;
+    atomic_uint window;
+
+    // Writer task only
+    uint32_t w_total;
+    uint32_t w_crc;
+    uint32_t w_crc_calc;
+    int64_t w_start_us;
+    int64_t w_flash_us;
+} s_ingest = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static uint8_t s_bufs[INGEST_BUF_NB][INGEST_BUF_SIZE] __attribute__((aligned(4)));
+
+static uint32_t ingest_get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void ingest_put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+void ingest_control_read(uint8_t *value)
+{
+    value[0] = atomic_load(&s_ingest.status);
+    ingest_put_le32(&value[1], atomic_load(&s_ingest.written));
+    ingest_put_le32(&value[5], atomic_load(&s_ingest.window));
+}
+
+static void ingest_notify(uint16_t conn_id)
+{
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    uint8_t value[INGEST_STATUS_LEN];
+
+    if (conn == NULL || !(conn->cccd[BLE_CONN_CCCD_INGEST] & 0x0001)) {
+        return;
+    }
+    ingest_control_read(value);
+    if (ingest_port_notify(conn_id, value, sizeof(value)) != ESP_OK) {
+        // The client can still read Control, or resend once the link drains
+        ESP_LOGW(INGEST_TAG, "Status notification failed");
+    }
+}
+
+static void ingest_busy_set(uint16_t conn_id, bool busy)
+{
+#if CONFIG_EXAMPLE_CONN_POLICY
+    conn_policy_busy_set(conn_id, CONN_POLICY_BUSY_INGEST, busy);
+#endif
+}
+
+// Writer side: publish progress of transfer session, false if it has ended meanwhile
+static bool ingest_update(uint32_t session, ingest_status_t status, uint32_t written, uint32_t window)
+{
+    bool current;
+
+    portENTER_CRITICAL(&s_ingest.lock);
+    current = session == atomic_load(&s_ingest.session);
+    if (current) {
+        atomic_store(&s_ingest.written, written);
+        atomic_store(&s_ingest.window, window);
+        atomic_store(&s_ingest.status, status);
+    }
+    portEXIT_CRITICAL(&s_ingest.lock);
+
+    if (current && status != INGEST_STATUS_RECEIVING) {
+        ingest_busy_set(s_ingest.conn_id, false);
+    }
+    return current;
+}
+
+// Host side: end the current transfer with status, queued work for it is dropped
+static void ingest_end(ingest_status_t status)
+{
+    portENTER_CRITICAL(&s_ingest.lock);
+    atomic_fetch_add(&s_ingest.session, 1);
+    atomic_store(&s_ingest.window, atomic_load(&s_ingest.written));
+    atomic_store(&s_ingest.status, status);
+    portEXIT_CRITICAL(&s_ingest.lock);
+
+    ingest_busy_set(s_ingest.conn_id, false);
+}
+
+__attribute__((weak)) void ingest_on_complete(uint32_t len)
+{
+    ESP_LOGI(INGEST_TAG, "%" PRIu32 " bytes ready in partition \"%s\"", len, s_ingest.part->label);
+}
+
+static void ingest_writer_start(const ingest_msg_t *msg)
+{
+    s_ingest.w_total = msg->len;
+    s_ingest.w_crc = msg->crc;
+    s_ingest.w_crc_calc = 0;
+    s_ingest.w_start_us = esp_timer_get_time();
+    s_ingest.w_flash_us = 0;
+
+    if (ingest_update(msg->session, INGEST_STATUS_RECEIVING, 0, MIN(msg->len, INGEST_BUF_NB * INGEST_BUF_SIZE))) {
+        ESP_LOGI(INGEST_TAG, "Receiving %" PRIu32 " bytes", msg->len);
+        ingest_notify(s_ingest.conn_id);
+    }
+}
+
+static void ingest_writer_buf(const ingest_msg_t *msg)
+{
+    const uint32_t offset = atomic_load(&s_ingest.written);
+    const uint8_t *buf = s_bufs[msg->buf_idx];
+
+    // Sectors are erased as they are reached, so erasing overlaps with the reception of
+    // the next buffer instead of delaying the start of the transfer
+    const int64_t start_us = esp_timer_get_time();
+    esp_err_t err = esp_partition_erase_range(s_ingest.part, offset,
+                                              (msg->len + INGEST_SECTOR_SIZE - 1) & ~(INGEST_SECTOR_SIZE - 1));
+    if (err == ESP_OK) {
+        err = esp_partition_write(s_ingest.part, offset, buf, msg->len);
+    }
+    s_ingest.w_flash_us += esp_timer_get_time() - start_us;
+
+    if (err != ESP_OK) {
+        ESP_LOGE(INGEST_TAG, "Flash write at 0x%" PRIx32 " failed: %s", offset, esp_err_to_name(err));
+        if (ingest_update(msg->session, INGEST_STATUS_ERR_FLASH, offset, offset)) {
+            ingest_notify(s_ingest.conn_id);
+        }
+        return;
+    }
+
+    s_ingest.w_crc_calc = esp_rom_crc32_le(s_ingest.w_crc_calc, buf, msg->len);
+    const uint32_t written = offset + msg->len;
+
+    if (written < s_ingest.w_total) {
+        if (ingest_update(msg->session, INGEST_STATUS_RECEIVING, written,
+                          MIN(s_ingest.w_total, written + INGEST_BUF_NB * INGEST_BUF_SIZE))) {
+            ingest_notify(s_ingest.conn_id);
+        }
+        return;
+    }
+
+    const int64_t elapsed_us = esp_timer_get_time() - s_ingest.w_start_us;
+    ESP_LOGI(INGEST_TAG, "Received %" PRIu32 " bytes in %" PRId64 " ms, %u B/s, flash busy %" PRId64 " ms",
+             written, elapsed_us / 1000, elapsed_us > 0 ? (unsigned)(written * 1000000ULL / elapsed_us) : 0,
+             s_ingest.w_flash_us / 1000);
+    const bool crc_ok = s_ingest.w_crc_calc == s_ingest.w_crc;
+    if (!crc_ok) {
+        ESP_LOGE(INGEST_TAG, "CRC mismatch: 0x%08" PRIx32 " expected, 0x%08" PRIx32 " received",
+                 s_ingest.w_crc, s_ingest.w_crc_calc);
+    }
+    if (!ingest_update(msg->session, crc_ok ? INGEST_STATUS_DONE : INGEST_STATUS_ERR_CRC, written, written)) {
+        return;
+    }
+    ingest_notify(s_ingest.conn_id);
+    if (crc_ok) {
+        ingest_on_complete(written);
+    }
+}
+
+static void ingest_writer_task(void *arg)
+{
+    ingest_msg_t msg;
+
+    for (;;) {
+        if (xQueueReceive(s_ingest.queue, &msg, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        // Work queued for a transfer that was restarted or cancelled since
+        if (msg.session != atomic_load(&s_ingest.session)) {
+            continue;
+        }
+
+        if (msg.type == INGEST_MSG_START) {
+            ingest_writer_start(&msg);
+        } else {
+            ingest_writer_buf(&msg);
+        }
+    }
+}
+
+static uint8_t ingest_start(uint16_t conn_id, uint32_t total, uint32_t crc)
+{
+    if (atomic_load(&s_ingest.status) == INGEST_STATUS_RECEIVING && conn_id != s_ingest.conn_id) {
+        ESP_LOGW(INGEST_TAG, "Transfer already running on conn_id %d", s_ingest.conn_id);
+        return INGEST_ATT_ERR_WRITE_NOT_PERMITTED;
+    }
+
+    ingest_end(INGEST_STATUS_IDLE);
+    s_ingest.conn_id = conn_id;
+    s_ingest.total = total;
+    s_ingest.received = 0;
+    if (total == 0 || total > s_ingest.part->size) {
+        ESP_LOGW(INGEST_TAG, "%" PRIu32 " bytes do not fit partition \"%s\" (%" PRIu32 " bytes)",
+                 total, s_ingest.part->label, s_ingest.part->size);
+        ingest_end(INGEST_STATUS_ERR_SIZE);
+        ingest_notify(conn_id);
+        return INGEST_ATT_ERR_NONE;
+    }
+
+    // The writer resets written and opens the window once older work is flushed out
+    const ingest_msg_t msg = {
+        .type = INGEST_MSG_START,
+        .session = atomic_load(&s_ingest.session),
+        .len = total,
+        .crc = crc,
+    };
+    if (xQueueSend(s_ingest.queue, &msg, 0) != pdTRUE) {
+        return INGEST_ATT_ERR_INSUFFICIENT_RES;
+    }
+    ingest_busy_set(conn_id, true);
+    return INGEST_ATT_ERR_NONE;
+}
+
+uint8_t ingest_control_write(uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    if (len < 1) {
+        return INGEST_ATT_ERR_INVALID_ATTR_LEN;
+    }
+
+    switch (value[0]) {
+    case INGEST_CMD_START:
+        if (len != 9) {
+            return INGEST_ATT_ERR_INVALID_ATTR_LEN;
+        }
+        return ingest_start(conn_id, ingest_get_le32(&value[1]), ingest_get_le32(&value[5]));
+    case INGEST_CMD_ABORT:
+        if (conn_id == s_ingest.conn_id) {
+            ingest_end(INGEST_STATUS_IDLE);
+            ingest_notify(conn_id);
+        }
+        return INGEST_ATT_ERR_NONE;
+    default:
+        return INGEST_ATT_ERR_WRITE_NOT_PERMITTED;
+    }
+}
+
+uint8_t ingest_data_write(uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    if (atomic_load(&s_ingest.status) != INGEST_STATUS_RECEIVING || conn_id != s_ingest.conn_id) {
+        return INGEST_ATT_ERR_WRITE_NOT_PERMITTED;
+    }
+    if (len < INGEST_DATA_HDR_LEN) {
+        return INGEST_ATT_ERR_INVALID_ATTR_LEN;
+    }
+
+    const uint8_t *payload = value + INGEST_DATA_HDR_LEN;
+    uint32_t n = len - INGEST_DATA_HDR_LEN;
+    if (ingest_get_le32(value) != s_ingest.received || s_ingest.received + n > atomic_load(&s_ingest.window)) {
+        ESP_LOGW(INGEST_TAG, "Data at %" PRIu32 " (%" PRIu32 " bytes) out of sequence, expected %" PRIu32 " below %u",
+                 ingest_get_le32(value), n, s_ingest.received, atomic_load(&s_ingest.window));
+        ingest_end(INGEST_STATUS_ERR_SEQUENCE);
+        ingest_notify(conn_id);
+        return INGEST_ATT_ERR_NONE;
+    }
+
+    const uint32_t session = atomic_load(&s_ingest.session);
+    while (n) {
+        const uint8_t idx = (s_ingest.received / INGEST_BUF_SIZE) % INGEST_BUF_NB;
+        const uint32_t pos = s_ingest.received % INGEST_BUF_SIZE;
+        const uint32_t chunk = MIN(n, INGEST_BUF_SIZE - pos);
+
+        memcpy(&s_bufs[idx][pos], payload, chunk);
+        s_ingest.received += chunk;
+        payload += chunk;
+        n -= chunk;
+
+        if (pos + chunk == INGEST_BUF_SIZE || s_ingest.received == s_ingest.total) {
+            const ingest_msg_t msg = {
+                .type = INGEST_MSG_BUF,
+                .buf_idx = idx,
+                .session = session,
+                .len = pos + chunk,
+            };
+            // The window keeps at most INGEST_BUF_NB buffers queued, this cannot fail
+            xQueueSend(s_ingest.queue, &msg, 0);
+        }
+    }
+    return INGEST_ATT_ERR_NONE;
+}
+
+void ingest_on_disconnect(uint16_t conn_id)
+{
+    if (conn_id != s_ingest.conn_id) {
+        return;
+    }
+    // Also covers a START the writer has not picked up yet
+    if (atomic_load(&s_ingest.status) == INGEST_STATUS_RECEIVING) {
+        ESP_LOGW(INGEST_TAG, "Transfer cancelled by disconnect at %" PRIu32 " bytes", s_ingest.received);
+    }
+    ingest_end(INGEST_STATUS_IDLE);
+}
+
+esp_err_t ingest_init(void)
+{
+    s_ingest.part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                             CONFIG_EXAMPLE_INGEST_PARTITION);
+    if (s_ingest.part == NULL) {
+        ESP_LOGE(INGEST_TAG, "No data partition \"%s\", see partitions_ingest.csv", CONFIG_EXAMPLE_INGEST_PARTITION);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    s_ingest.queue = xQueueCreate(INGEST_QUEUE_LEN, sizeof(ingest_msg_t));
+    if (s_ingest.queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    BaseType_t ret = xTaskCreate(ingest_writer_task, "ingest_writer", CONFIG_EXAMPLE_INGEST_TASK_STACK_SIZE, NULL,
+                                 CONFIG_EXAMPLE_INGEST_TASK_PRIORITY, &s_ingest.task);
+    if (ret != pdPASS) {
+        ESP_LOGE(INGEST_TAG, "%s create writer task failed", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
@@ -0,0 +1,90 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#if CONFIG_BT_BLUEDROID_ENABLED
+#include "esp_gatts_api.h"
+#elif CONFIG_BT_NIMBLE_ENABLED
+#include "host/ble_gap.h"
+#endif
+
+#define INGEST_TAG "INGEST"
+
+// Bulk ingest service, c0de0000-7b3a-4f5e-9d21-6a8e5c4b3f10, LSB first
+#define INGEST_UUID128_BYTES(id) 0x10, 0x3f, 0x4b, 0x5c, 0x8e, 0x6a, 0x21, 0x9d, \
+                                 0x5e, 0x4f, 0x3a, 0x7b, (id) & 0xff, ((id) >> 8) & 0xff, 0xde, 0xc0
+#define INGEST_UUID_SVC     0x0000
+#define INGEST_UUID_CONTROL 0x0001  // Read, write, notify: commands in, status and credit out
+#define INGEST_UUID_DATA    0x0002  // Write without response: offset (u32 LE) + payload
+
+// Protocol, all integers little endian:
+//
+// 1. The client subscribes to Control and writes START (0x01, length u32, CRC-32 u32). The
+//    CRC is the usual IEEE 802.3 one (zlib crc32()) over the whole file.
+// 2. The device answers with a status notification {status u8, written u32, window u32}.
+//    written is the number of bytes committed to flash, window the offset the client may
+//    send up to (exclusive). Each window update comes as another notification.
+// 3. The client sends Data writes of {offset u32, payload} in order, never past window.
+// 4. Once every byte is in flash and the CRC matches, the status turns DONE.
+//
+// ABORT (0x02) or a disconnect ends the transfer. A Data write out of order or beyond the
+// window ends it with INGEST_STATUS_ERR_SEQUENCE, the client then starts over.
+#define INGEST_CMD_START 0x01
+#define INGEST_CMD_ABORT 0x02
+
+typedef enum {
+    INGEST_STATUS_IDLE = 0x00,
+    INGEST_STATUS_RECEIVING = 0x01,
+    INGEST_STATUS_DONE = 0x02,
+    INGEST_STATUS_ERR_SEQUENCE = 0x80,  // Data write out of order or past the window
+    INGEST_STATUS_ERR_SIZE = 0x81,      // Larger than the partition
+    INGEST_STATUS_ERR_FLASH = 0x82,
+    INGEST_STATUS_ERR_CRC = 0x83,
+} ingest_status_t;
+
+#define INGEST_STATUS_LEN 9
+#define INGEST_DATA_HDR_LEN 4
+
+// ATT error codes returned by the core, values from the Core specification
+#define INGEST_ATT_ERR_NONE                 0x00
+#define INGEST_ATT_ERR_WRITE_NOT_PERMITTED  0x03
+#define INGEST_ATT_ERR_INVALID_ATTR_LEN     0x0d
+#define INGEST_ATT_ERR_UNLIKELY             0x0e
+#define INGEST_ATT_ERR_INSUFFICIENT_RES     0x11
+#define INGEST_ATT_ERR_CCC_IMPROPERLY_CONFIGURED 0xfd
+
+// Looks up the CONFIG_EXAMPLE_INGEST_PARTITION data partition and creates the flash writer
+// task. Must be called before the host stack registers the service.
+esp_err_t ingest_init(void);
+
+// Weak hook, called from the flash writer task once a transfer of len bytes is committed to
+// the partition and its CRC checked. The default only logs.
+void ingest_on_complete(uint32_t len);
+
+// Stack-neutral service logic, called by the host stack port. Return an ATT error code.
+uint8_t ingest_control_write(uint16_t conn_id, const uint8_t *value, uint16_t len);
+// Copies the current status value (INGEST_STATUS_LEN bytes) into value
+void ingest_control_read(uint8_t *value);
+uint8_t ingest_data_write(uint16_t conn_id, const uint8_t *value, uint16_t len);
+void ingest_on_disconnect(uint16_t conn_id);
+
+// Implemented by the host stack port (ingest_bluedroid.c / ingest_nimble.c): notify the
+// Control value to conn_id, called from the flash writer task and the host task
+esp_err_t ingest_port_notify(uint16_t conn_id, const uint8_t *value, uint16_t len);
+
+#if CONFIG_BT_BLUEDROID_ENABLED
+// Profile callback, hooked into gl_profile_tab so gatts_event_handler routes ingest events here
+void ingest_gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+#elif CONFIG_BT_NIMBLE_ENABLED
+// Adds the service to the NimBLE GATT server, call before the host is started
+int ingest_nimble_gatt_svr_init(void);
+// Forwarded from the connection's GAP event callback
+void ingest_nimble_gap_event(struct ble_gap_event *event);
+#endif
+
+#endif // INGEST_H
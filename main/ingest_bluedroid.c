@@ -0,0 +1,173 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Bluedroid port of the bulk ingest service. Registers as its own profile in gl_profile_tab
+* like MDS, the service comes from one attribute table through gatts_table.c, which routes
+* its reads and writes to ingest_gatts_attr_cb by attribute index. Every value is answered
+* from the stack-neutral core in ingest.c.
+*
+****************************************************************************/
+
+#include <string.h>
+#include "esp_log.h"
+
+#include "esp_gatts_api.h"
+#include "esp_gatt_common_api.h"
+
+#include "sdkconfig.h"
+
+#include "ble_conn.h"
+#include "gatts_table.h"
+#include "ingest.h"
+
+#define INGEST_SVC_INST_ID 0
+// Largest Data write the stack accepts, ATT_MTU 517 minus the Write Command header
+#define INGEST_DATA_MAX_LEN (ESP_GATT_MAX_MTU_SIZE - 3)
+
+// Attribute table indices, filled in from ESP_GATTS_CREAT_ATTR_TAB_EVT
+enum {
+    INGEST_IDX_SVC,
+
+    INGEST_IDX_CHAR_CONTROL,
+    INGEST_IDX_CHAR_VAL_CONTROL,
+    INGEST_IDX_CHAR_CFG_CONTROL,
+
+    INGEST_IDX_CHAR_DATA,
+    INGEST_IDX_CHAR_VAL_DATA,
+
+    INGEST_IDX_NB,
+};
+
+static esp_gatt_if_t s_gatts_if = ESP_GATT_IF_NONE;
+static uint16_t s_handle_table[INGEST_IDX_NB];
+
+static const esp_gatts_attr_db_t ingest_gatt_db[INGEST_IDX_NB] = {
+    GATTS_TABLE_SERVICE128(INGEST_IDX_SVC, INGEST_UUID128_BYTES(INGEST_UUID_SVC)),
+
+    GATTS_TABLE_CHAR_DECL(INGEST_IDX_CHAR_CONTROL,
+                          ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_NOTIFY),
+    GATTS_TABLE_VALUE128(INGEST_IDX_CHAR_VAL_CONTROL, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, INGEST_STATUS_LEN,
+                         INGEST_UUID128_BYTES(INGEST_UUID_CONTROL)),
+    GATTS_TABLE_CCCD(INGEST_IDX_CHAR_CFG_CONTROL),
+
+    GATTS_TABLE_CHAR_DECL(INGEST_IDX_CHAR_DATA, ESP_GATT_CHAR_PROP_BIT_WRITE_NR),
+    GATTS_TABLE_VALUE128(INGEST_IDX_CHAR_VAL_DATA, ESP_GATT_PERM_WRITE, INGEST_DATA_MAX_LEN,
+                         INGEST_UUID128_BYTES(INGEST_UUID_DATA)),
+};
+
+static void ingest_gatts_attr_cb(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
+                                 esp_ble_gatts_cb_param_t *param, uint8_t attr_idx);
+
+static const gatts_table_svc_t ingest_svc = {
+    .name = "INGEST",
+    .db = ingest_gatt_db,
+    .num_attr = INGEST_IDX_NB,
+    .inst_id = INGEST_SVC_INST_ID,
+    .handles = s_handle_table,
+    .attr_cb = ingest_gatts_attr_cb,
+};
+
+esp_err_t ingest_port_notify(uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    return esp_ble_gatts_send_indicate(s_gatts_if, conn_id, s_handle_table[INGEST_IDX_CHAR_VAL_CONTROL],
+                                       len, (uint8_t *)value, false);
+}
+
+static void ingest_handle_read(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param, uint8_t attr_idx)
+{
+    esp_gatt_status_t status = ESP_GATT_OK;
+    esp_gatt_rsp_t rsp;
+
+    memset(&rsp, 0, sizeof(esp_gatt_rsp_t));
+    rsp.attr_value.handle = param->read.handle;
+    if (param->read.offset != 0) {
+        status = ESP_GATT_INVALID_OFFSET;
+    } else if (attr_idx == INGEST_IDX_CHAR_VAL_CONTROL) {
+        ingest_control_read(rsp.attr_value.value);
+        rsp.attr_value.len = INGEST_STATUS_LEN;
+    } else if (attr_idx == INGEST_IDX_CHAR_CFG_CONTROL) {
+        const ble_conn_t *conn = ble_conn_get(param->read.conn_id);
+        const uint16_t value = conn ? conn->cccd[BLE_CONN_CCCD_INGEST] : 0;
+
+        rsp.attr_value.value[0] = value & 0xff;
+        rsp.attr_value.value[1] = value >> 8;
+        rsp.attr_value.len = sizeof(uint16_t);
+    } else {
+        status = ESP_GATT_READ_NOT_PERMIT;
+    }
+    esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id, status, &rsp);
+}
+
+static void ingest_handle_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param, uint8_t attr_idx)
+{
+    esp_gatt_status_t status;
+
+    if (param->write.is_prep || param->write.offset != 0) {
+        status = ESP_GATT_NOT_LONG;
+    } else if (attr_idx == INGEST_IDX_CHAR_VAL_DATA) {
+        // Hot path: a Write Command, need_rsp is false and nothing goes back to the client
+        status = ingest_data_write(param->write.conn_id, param->write.value, param->write.len);
+    } else if (attr_idx == INGEST_IDX_CHAR_VAL_CONTROL) {
+        status = ingest_control_write(param->write.conn_id, param->write.value, param->write.len);
+    } else if (attr_idx == INGEST_IDX_CHAR_CFG_CONTROL) {
+        ble_conn_t *conn = ble_conn_get(param->write.conn_id);
+
+        if (param->write.len != sizeof(uint16_t)) {
+            status = ESP_GATT_INVALID_ATTR_LEN;
+        } else if (conn == NULL) {
+            status = ESP_GATT_INSUF_RESOURCE;
+        } else {
+            conn->cccd[BLE_CONN_CCCD_INGEST] = param->write.value[1] << 8 | param->write.value[0];
+            status = ESP_GATT_OK;
+        }
+    } else {
+        status = ESP_GATT_WRITE_NOT_PERMIT;
+    }
+
+    if (param->write.need_rsp) {
+        esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, NULL);
+    }
+}
+
+static void ingest_gatts_attr_cb(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
+                                 esp_ble_gatts_cb_param_t *param, uint8_t attr_idx)
+{
+    switch (event) {
+    case ESP_GATTS_READ_EVT:
+        ingest_handle_read(gatts_if, param, attr_idx);
+        break;
+    case ESP_GATTS_WRITE_EVT:
+        ingest_handle_write(gatts_if, param, attr_idx);
+        break;
+    default:
+        break;
+    }
+}
+
+void ingest_gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_GATTS_REG_EVT:
+        s_gatts_if = gatts_if;
+        gatts_table_create(gatts_if, &ingest_svc);
+        break;
+    case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+    case ESP_GATTS_START_EVT:
+        gatts_table_handle_event(&ingest_svc, event, param);
+        break;
+    case ESP_GATTS_EXEC_WRITE_EVT:
+        // No long-writable attributes, prepared writes were already rejected
+        esp_ble_gatts_send_response(gatts_if, param->exec_write.conn_id, param->exec_write.trans_id, ESP_GATT_OK, NULL);
+        break;
+    case ESP_GATTS_DISCONNECT_EVT:
+        ingest_on_disconnect(param->disconnect.conn_id);
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,133 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* NimBLE port of the bulk ingest service. NimBLE manages the CCCD itself, subscriptions
+* arrive as BLE_GAP_EVENT_SUBSCRIBE and are mirrored into the connection context the core
+* reads. Data writes are flattened out of the mbuf chain into one static buffer, all access
+* callbacks run in the host task.
+*
+****************************************************************************/
+
+#include <stdint.h>
+#include "esp_log.h"
+
+#include "host/ble_hs.h"
+#include "host/ble_uuid.h"
+
+#include "ble_conn.h"
+#include "ingest.h"
+
+static uint16_t s_control_val_handle;
+
+// Largest attribute value NimBLE accepts, the header included
+static uint8_t s_rx_buf[BLE_ATT_ATTR_MAX_LEN];
+
+static const ble_uuid128_t ingest_svc_uuid     = BLE_UUID128_INIT(INGEST_UUID128_BYTES(INGEST_UUID_SVC));
+static const ble_uuid128_t ingest_control_uuid = BLE_UUID128_INIT(INGEST_UUID128_BYTES(INGEST_UUID_CONTROL));
+static const ble_uuid128_t ingest_data_uuid    = BLE_UUID128_INIT(INGEST_UUID128_BYTES(INGEST_UUID_DATA));
+
+static int ingest_nimble_control_access(uint16_t conn_handle, uint16_t attr_handle,
+                                        struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t value[INGEST_STATUS_LEN];
+    uint16_t len;
+
+    switch (ctxt->op) {
+    case BLE_GATT_ACCESS_OP_READ_CHR:
+        ingest_control_read(value);
+        return os_mbuf_append(ctxt->om, value, sizeof(value)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    case BLE_GATT_ACCESS_OP_WRITE_CHR:
+        if (ble_hs_mbuf_to_flat(ctxt->om, value, sizeof(value), &len) != 0) {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        return ingest_control_write(conn_handle, value, len);
+    default:
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+}
+
+static int ingest_nimble_data_access(uint16_t conn_handle, uint16_t attr_handle,
+                                     struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint16_t len;
+
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    if (ble_hs_mbuf_to_flat(ctxt->om, s_rx_buf, sizeof(s_rx_buf), &len) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    return ingest_data_write(conn_handle, s_rx_buf, len);
+}
+
+static const struct ble_gatt_svc_def ingest_gatt_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = &ingest_svc_uuid.u,
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = &ingest_control_uuid.u,
+                .access_cb = ingest_nimble_control_access,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &s_control_val_handle,
+            }, {
+                .uuid = &ingest_data_uuid.u,
+                .access_cb = ingest_nimble_data_access,
+                .flags = BLE_GATT_CHR_F_WRITE_NO_RSP,
+            }, {
+                0, /* No more characteristics in this service */
+            }
+        },
+    },
+    {
+        0, /* No more services */
+    },
+};
+
+esp_err_t ingest_port_notify(uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(value, len);
+    if (om == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Consumes om, also on failure
+    return ble_gatts_notify_custom(conn_id, s_control_val_handle, om) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+int ingest_nimble_gatt_svr_init(void)
+{
+    int rc = ble_gatts_count_cfg(ingest_gatt_svcs);
+    if (rc != 0) {
+        return rc;
+    }
+
+    return ble_gatts_add_svcs(ingest_gatt_svcs);
+}
+
+void ingest_nimble_gap_event(struct ble_gap_event *event)
+{
+    switch (event->type) {
+    case BLE_GAP_EVENT_SUBSCRIBE:
+        if (event->subscribe.attr_handle == s_control_val_handle) {
+            ble_conn_t *conn = ble_conn_get(event->subscribe.conn_handle);
+
+            if (conn) {
+                conn->cccd[BLE_CONN_CCCD_INGEST] = event->subscribe.cur_notify ? 0x0001 : 0x0000;
+            }
+        }
+        break;
+    case BLE_GAP_EVENT_DISCONNECT:
+        ingest_on_disconnect(event->disconnect.conn.conn_handle);
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,143 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Long write sink. Fragments are packed back to back into fixed-size segments, a fragment
+* that does not fit the tail segment is split across the next one. Segments a fragment
+* needs are all taken before any byte is copied, so a full pool leaves the chain as it was.
+*
+****************************************************************************/
+
+#include <stdatomic.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "long_write.h"
+
+#define LONG_WRITE_TAG "LONG_WRITE"
+
+#define LONG_WRITE_SEG_SIZE CONFIG_EXAMPLE_LONG_WRITE_SEG_SIZE
+
+MEM_POOL_DEFINE(s_seg_pool, sizeof(long_write_seg_t) + LONG_WRITE_SEG_SIZE, CONFIG_EXAMPLE_LONG_WRITE_SEG_COUNT);
+
+static struct {
+    atomic_uint executed;
+    atomic_uint bytes;
+    atomic_uint fragments;
+    atomic_uint elapsed_ms;
+} s_stats;
+
+static void long_write_seg_free_chain(long_write_seg_t *seg)
+{
+    while (seg) {
+        long_write_seg_t *next = seg->next;
+        mem_pool_free(&s_seg_pool, seg);
+        seg = next;
+    }
+}
+
+esp_gatt_status_t long_write_prepare(ble_conn_prepare_t *lw, uint16_t handle, uint16_t offset,
+                                     const uint8_t *value, uint16_t len, uint32_t max_len)
+{
+    esp_gatt_status_t status = ESP_GATT_OK;
+
+    if (lw->head && handle != lw->handle) {
+        // One attribute per long write keeps execution in order, reliable writes are not supported
+        status = ESP_GATT_REQ_NOT_SUPPORTED;
+    } else if (offset != lw->len) {
+        status = ESP_GATT_INVALID_OFFSET;
+    } else if (offset + len > max_len) {
+        status = ESP_GATT_INVALID_ATTR_LEN;
+    }
+    if (status != ESP_GATT_OK) {
+        ESP_LOGW(LONG_WRITE_TAG, "Prepare write to handle %u offset %u len %u refused: 0x%x",
+                 handle, offset, len, status);
+        long_write_cancel(lw);
+        return status;
+    }
+
+    // Take every segment the fragment spills into before touching the chain
+    const uint16_t room = lw->tail ? LONG_WRITE_SEG_SIZE - lw->tail->len : 0;
+    long_write_seg_t *spill = NULL;
+    long_write_seg_t **link = &spill;
+    for (int needed = len - room; needed > 0; needed -= LONG_WRITE_SEG_SIZE) {
+        long_write_seg_t *seg = mem_pool_alloc(&s_seg_pool);
+        if (seg == NULL) {
+            ESP_LOGW(LONG_WRITE_TAG, "All %d long write segments in use", CONFIG_EXAMPLE_LONG_WRITE_SEG_COUNT);
+            long_write_seg_free_chain(spill);
+            long_write_cancel(lw);
+            return ESP_GATT_PREPARE_Q_FULL;
+        }
+        seg->next = NULL;
+        seg->len = 0;
+        *link = seg;
+        link = &seg->next;
+    }
+
+    if (lw->head == NULL) {
+        lw->handle = handle;
+        lw->start_us = esp_timer_get_time();
+    }
+    if (lw->tail) {
+        lw->tail->next = spill;
+    } else {
+        lw->head = spill;
+    }
+
+    long_write_seg_t *seg = lw->tail ? lw->tail : spill;
+    while (len) {
+        if (seg->len == LONG_WRITE_SEG_SIZE) {
+            seg = seg->next;
+        }
+        const uint16_t n = len < LONG_WRITE_SEG_SIZE - seg->len ? len : LONG_WRITE_SEG_SIZE - seg->len;
+        memcpy(seg->data + seg->len, value, n);
+        seg->len += n;
+        value += n;
+        len -= n;
+        lw->len += n;
+    }
+    lw->tail = seg;
+    lw->fragments++;
+
+    return ESP_GATT_OK;
+}
+
+esp_gatt_status_t long_write_execute(ble_conn_prepare_t *lw, uint16_t conn_id, long_write_sink_t sink, void *arg)
+{
+    esp_gatt_status_t status = ESP_GATT_OK;
+    uint32_t offset = 0;
+
+    for (const long_write_seg_t *seg = lw->head; seg && status == ESP_GATT_OK; seg = seg->next) {
+        status = sink(conn_id, lw->handle, offset, seg->data, seg->len, seg->next == NULL, arg);
+        offset += seg->len;
+    }
+    if (lw->head) {
+        atomic_fetch_add(&s_stats.executed, 1);
+        atomic_fetch_add(&s_stats.bytes, lw->len);
+        atomic_fetch_add(&s_stats.fragments, lw->fragments);
+        atomic_fetch_add(&s_stats.elapsed_ms, (esp_timer_get_time() - lw->start_us) / 1000);
+    }
+
+    long_write_cancel(lw);
+    return status;
+}
+
+void long_write_cancel(ble_conn_prepare_t *lw)
+{
+    long_write_seg_free_chain(lw->head);
+    memset(lw, 0, sizeof(*lw));
+}
+
+void long_write_stats_get(long_write_stats_t *stats)
+{
+    mem_pool_stats_get(&s_seg_pool, &stats->segs);
+    stats->executed = atomic_exchange(&s_stats.executed, 0);
+    stats->bytes = atomic_exchange(&s_stats.bytes, 0);
+    stats->fragments = atomic_exchange(&s_stats.fragments, 0);
+    stats->elapsed_ms = atomic_exchange(&s_stats.elapsed_ms, 0);
+}
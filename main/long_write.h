@@ -0,0 +1,54 @@
+#ifndef LONG_WRITE_H
+#define LONG_WRITE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_gatt_defs.h"
+
+#include "ble_conn.h"
+#include "mem_pool.h"
+
+// Long (prepared) write sink. Each Prepare Write Request is appended to a chain of segments
+// taken from a static pool of CONFIG_EXAMPLE_LONG_WRITE_SEG_COUNT blocks, so a long write
+// can be larger than any single buffer and no heap is used. Fragments are checked as they
+// arrive and the segments are handed to a consumer on Execute Write, in place, without
+// gathering them into one flat buffer first.
+
+typedef struct long_write_seg {
+    struct long_write_seg *next;
+    uint16_t len;
+    uint8_t data[];     // CONFIG_EXAMPLE_LONG_WRITE_SEG_SIZE bytes
+} long_write_seg_t;
+
+// Consumer of an executed long write, called once per segment in offset order. last is set
+// on the final segment. Anything but ESP_GATT_OK stops the delivery and is returned by
+// long_write_execute(), to be sent in the Execute Write Response.
+typedef esp_gatt_status_t (*long_write_sink_t)(uint16_t conn_id, uint16_t handle, uint32_t offset,
+                                               const uint8_t *data, uint16_t len, bool last, void *arg);
+
+// Append a Prepare Write Request. All fragments of a long write must target the same handle
+// and follow each other (offset equals the bytes received so far), and the total may not
+// exceed max_len. Returns the status for the Prepare Write Response, on error the long write
+// is dropped.
+esp_gatt_status_t long_write_prepare(ble_conn_prepare_t *lw, uint16_t handle, uint16_t offset,
+                                     const uint8_t *value, uint16_t len, uint32_t max_len);
+// Deliver the long write to sink and release it
+esp_gatt_status_t long_write_execute(ble_conn_prepare_t *lw, uint16_t conn_id, long_write_sink_t sink, void *arg);
+// Drop the long write (cancelled, or the connection went away)
+void long_write_cancel(ble_conn_prepare_t *lw);
+
+typedef struct {
+    mem_pool_stats_t segs;
+    // Long writes executed since the previous long_write_stats_get(), their bytes and Prepare
+    // Write Requests, and the time from the first request to execution summed over them
+    uint32_t executed;
+    uint32_t bytes;
+    uint32_t fragments;
+    uint32_t elapsed_ms;
+} long_write_stats_t;
+
+// Fills stats, the counters restart with every call
+void long_write_stats_get(long_write_stats_t *stats);
+
+#endif // LONG_WRITE_H
@@ -0,0 +1,1135 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Memfault Diagnostic GATT Service (MDS), stack-neutral core.
+*
+* Port of the Nordic (nordic_mds.c) and Dialog (dialog_mds.c) implementations. The GATT
+* attribute layout and event plumbing live in the host stack ports, mds_bluedroid.c and
+* mds_nimble.c, which call into the mds_value_get/mds_*_write/mds_on_* functions below and
+* provide the mds_port_* functions.
+*
+* The four read-only values never change while running, so mds_init serializes them once
+* into s_mds_values and reads (including Read Blob at an offset) are served straight from
+* that table, without formatting anything in the host task.
+*
+* Chunks are sent as notifications by a dedicated pump task. Like the Nordic port, up to
+* CONFIG_EXAMPLE_MDS_PIPELINE_COUNT notifications are kept in flight: every completed
+* notification wakes the pump, so each connection event can carry several chunks. The window
+* is sized at runtime: notifications in flight plus the packets the controller can still
+* take (mds_port_tx_sendable), capped at the Kconfig value, so every connection event is
+* filled without piling data up in host buffers. The chosen depth and the measured
+* notifications per connection event are exposed by mds_stats_get. Chunks are sized to end
+* on an LL PDU boundary of the negotiated data length (mds_port_tx_octets_get), so no
+* notification drags a nearly empty PDU behind it. The pump also pauses while the port
+* reports the subscriber link congested (mds_on_congest) and resumes when it drains. Sends
+* that fail keep their chunk in the ring for the retry. A sent chunk also stays in the ring
+* until its notification completed. A notification the stack reports as failed rewinds the
+* pump to that chunk once the ones sent after it have completed too, and everything from
+* there is sent again with the same sequence numbers.
+*
+* The packetizer itself does not run on the send path. A lower priority producer task keeps
+* a single-producer/single-consumer ring of MTU-sized chunks topped up while streaming is
+* enabled, and the pump only copies the head entry into a TX buffer lent by the port
+* (mds_port_tx_buf_get) and sends it. An entry is only released once its notification
+* completed, so chunks survive failed sends and reconnections.
+*
+* The producer is woken by mds_data_available(), called from Memfault event storage as soon
+* as an event is committed, so the data-to-gateway delay depends on the link and not on a
+* timer. CONFIG_EXAMPLE_MDS_POLL_INTERVAL_MS is only a safety net while streaming.
+*
+* With CONFIG_EXAMPLE_MDS_MULTI_PACKET_CHUNKS a Memfault message is one multi-packet chunk
+* spread over consecutive notifications, all but the last flagged with
+* MDS_DATA_EXPORT_HDR_MORE_DATA. The ring releases entries a whole chunk at a time, so when
+* a subscriber goes away mid-chunk the next one gets that chunk again from its first packet.
+* The packetizer has already consumed the message by then. A message only becomes one chunk
+* if all its packets fit the ring, larger ones go as single-packet chunks. An entry
+* prefetched for a link with a larger MTU than the next subscriber's goes as several packets
+* flagged with "more data", which the gateway joins like any other. Without multi-packet
+* chunks such an entry can't be cut: it waits for the MTU exchange and is dropped if it
+* still does not fit.
+*
+* The producer reports the ring turning non-empty and draining through the weak
+* mds_backlog_changed hook, which the connection parameter policy (conn_policy.c) uses to
+* keep the link fast only while there is something to drain.
+*
+* CONFIG_EXAMPLE_MDS_COMPRESSION adds LZSS compression (mds_lz.c) of whole multi-packet
+* chunks for gateways that enable streaming with MDS_DATA_EXPORT_MODE_STREAMING_COMPRESSED.
+* The producer latches the mode at the start of each chunk and flags every packet of a
+* compressed chunk with MDS_DATA_EXPORT_HDR_COMPRESSED, so the stream stays self-describing.
+* Only messages that fit the compressor window are compressed, and the window keeps the
+* input of a compressed chunk until a gateway took it. When the pump has to drop the chunk
+* for a gateway that did not opt in, the producer sends it again uncompressed from there.
+*
+****************************************************************************/
+
+#include <stdatomic.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "sdkconfig.h"
+
+#include "memfault/components.h"
+
+#include "ble_conn.h"
+#include "mds.h"
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+#include "esp_cpu.h"
+#include "mds_lz.h"
+#endif
+
+#if !defined(MEMFAULT_PROJECT_KEY) && defined(CONFIG_MEMFAULT_PROJECT_KEY)
+#define MEMFAULT_PROJECT_KEY CONFIG_MEMFAULT_PROJECT_KEY
+#endif
+
+#if !defined(MEMFAULT_PROJECT_KEY)
+#error "Memfault Project Key not configured, set CONFIG_MEMFAULT_PROJECT_KEY (see sdkconfig.mds)"
+#endif
+
+#define MDS_URI_BASE \
+    MEMFAULT_HTTP_APIS_DEFAULT_SCHEME "://" MEMFAULT_HTTP_CHUNKS_API_HOST "/api/v0/chunks/"
+
+#define MDS_AUTH_KEY "Memfault-Project-Key:" MEMFAULT_PROJECT_KEY
+
+#define MDS_URI_BASE_LENGTH (sizeof(MDS_URI_BASE) - 1)
+
+// Notifications carry at most (ATT_MTU - 3) bytes
+#define MDS_ATT_HEADER_OVERHEAD 3
+#define MDS_ATT_MAX_MTU 517
+#define MDS_ATT_DEFAULT_MTU 23
+// Each ATT PDU travels behind an L2CAP basic header, split into LL PDUs of the negotiated
+// data length
+#define MDS_L2CAP_HEADER_OVERHEAD 4
+
+// Valid sequence numbers used when sending data are 0-31
+#define MDS_CHUNK_NUMBER_MASK 0x1f
+// More notifications of the same multi-packet chunk follow
+#define MDS_DATA_EXPORT_HDR_MORE_DATA 0x20
+// The multi-packet chunk is LZSS compressed, set on each of its notifications
+#define MDS_DATA_EXPORT_HDR_COMPRESSED 0x40
+
+// Bits of the "MDS Supported Features Characteristic" value
+#define MDS_SUPPORTED_FEATURE_MULTI_PACKET_CHUNKS 0x01
+#define MDS_SUPPORTED_FEATURE_COMPRESSION         0x02
+
+#define MAX_PIPELINE CONFIG_EXAMPLE_MDS_PIPELINE_COUNT
+
+#define MDS_PREFETCH_DEPTH CONFIG_EXAMPLE_MDS_PREFETCH_DEPTH
+#define MDS_CHUNK_MAX_SIZE (MDS_ATT_MAX_MTU - MDS_ATT_HEADER_OVERHEAD - sizeof(mds_data_export_nfy_t))
+
+typedef enum {
+    MDS_DATA_EXPORT_MODE_STREAMING_DISABLE = 0x00,
+    MDS_DATA_EXPORT_MODE_STREAMING_ENABLE  = 0x01,
+    MDS_DATA_EXPORT_MODE_STREAMING_COMPRESSED = 0x02,
+} mds_data_export_mode_t;
+
+typedef struct {
+    // bit 7: rsvd for future use
+    // bit 6: compressed, only with MDS_SUPPORTED_FEATURE_COMPRESSION
+    // bit 5: more data, only with MDS_SUPPORTED_FEATURE_MULTI_PACKET_CHUNKS
+    // bits 0-4: sequence number
+    uint8_t hdr;
+    uint8_t data[];
+} __attribute__((packed)) mds_data_export_nfy_t;
+
+typedef struct {
+    // MDS only allows one active subscriber at any given time
+    bool subscribed;
+    uint16_t conn_id;
+    atomic_bool stream_enabled;
+    atomic_bool congested;
+    // Prefetched chunks are waiting, reported through mds_backlog_changed
+    atomic_bool backlog;
+    // The subscriber accepts compressed chunks
+    atomic_bool compress;
+
+    uint8_t chunk_number;
+
+    // Raised on subscriber reset, handled by the pump task
+    atomic_bool resync;
+    // The pump dropped packets of a compressed chunk, the producer sends it again uncompressed
+    atomic_bool lz_dropped;
+
+    TaskHandle_t pump_task;
+    TaskHandle_t producer_task;
+} mds_t;
+
+typedef struct {
+    uint16_t len;
+    // Multi-packet chunks: more packets of this chunk follow
+    bool more;
+    bool compressed;
+    // Sequence number the chunk was last sent with
+    uint8_t seq;
+    // Multi-packet chunks: bytes already sent in earlier notifications, as the entry was
+    // prefetched for a link with a larger MTU than the current one
+    uint16_t off;
+    uint8_t data[MDS_CHUNK_MAX_SIZE];
+} mds_chunk_t;
+
+// head is only written by the producer task. Entries from tail to sent are in flight, from
+// sent to head waiting to be sent. tail and sent are written by the pump task, done counts
+// completed notifications from sent's point of view and is advanced by mds_on_tx_done. The
+// pump releases entries by moving tail up to done, or only up to fail_at after a failed
+// notification, and never past the first packet of a multi-packet chunk whose last packet has
+// not completed. All indices run freely, the fill level is (head - tail). split_len is the
+// length of a notification in flight that carries only part of the entry at sent, which does
+// not count in done.
+typedef struct {
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_uint sent;
+    atomic_uint done;
+    atomic_uint fail_at;
+    atomic_bool failed;
+    atomic_uint split_len;
+    mds_chunk_t chunks[MDS_PREFETCH_DEPTH];
+} mds_chunk_ring_t;
+
+typedef struct {
+    const uint8_t *value;
+    uint16_t len;
+} mds_value_t;
+
+static mds_t s_mds;
+
+static mds_chunk_ring_t s_chunk_ring;
+
+static struct {
+    atomic_uint depth;
+    atomic_uint tx_done;
+    int64_t last_get_us;
+
+    atomic_uint congest_episodes;
+    atomic_uint congest_paused_ms;
+    int64_t congest_start_us;
+
+    atomic_uint tx_bytes;
+    atomic_uint tx_chunks;
+    atomic_uint tx_copied;
+    atomic_uint compress_raw;
+    atomic_uint compress_out;
+    atomic_uint compress_cycles;
+} s_stats;
+
+#if CONFIG_EXAMPLE_MDS_MULTI_PACKET_CHUNKS
+// Only touched from the producer task
+static struct {
+    // A multi-packet chunk is being read, all its packets but the last have packet_size bytes
+    bool mid_chunk;
+    size_t packet_size;
+    // The current message goes as single-packet chunks, as one chunk it would not fit the ring
+    bool single;
+} s_packetizer;
+#endif
+
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+// Only touched from the producer task
+static struct {
+    mds_lz_t lz;
+    uint8_t raw[MDS_LZ_BLOCK_SIZE];
+    // Compressed bytes not yet cut into packets
+    uint8_t out[MDS_CHUNK_MAX_SIZE + MDS_LZ_OUT_MAX(MDS_LZ_BLOCK_SIZE) + MDS_LZ_GROUP_MAX_SIZE];
+    size_t out_len;
+    // A compressed chunk is in progress / fully compressed
+    bool active;
+    bool chunk_end;
+    // The window holds the input of the last compressed chunk, which ends before ring index end
+    bool kept;
+    unsigned end;
+    // That input is being sent again uncompressed, up to replay_off so far
+    bool replay;
+    size_t replay_off;
+} s_lz;
+#endif
+
+// Payload returned via a read to "MDS Supported Features Characteristic"
+static const uint8_t s_mds_supported_features[] = {
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+    MDS_SUPPORTED_FEATURE_MULTI_PACKET_CHUNKS | MDS_SUPPORTED_FEATURE_COMPRESSION,
+#elif CONFIG_EXAMPLE_MDS_MULTI_PACKET_CHUNKS
+    MDS_SUPPORTED_FEATURE_MULTI_PACKET_CHUNKS,
+#else
+    0x0
+#endif
+};
+
+// Data URI, the device identifier is served from its tail
+static char s_data_uri[CONFIG_EXAMPLE_MDS_MAX_URI_LENGTH];
+
+static mds_value_t s_mds_values[MDS_CHAR_NB] = {
+    [MDS_CHAR_SUPPORTED_FEATURES] = { s_mds_supported_features, sizeof(s_mds_supported_features) },
+    [MDS_CHAR_AUTHORIZATION]      = { (const uint8_t *)MDS_AUTH_KEY, sizeof(MDS_AUTH_KEY) - 1 },
+    // MDS_CHAR_DEVICE_IDENTIFIER and MDS_CHAR_DATA_URI are filled in by mds_values_init()
+};
+
+__attribute__((weak)) bool mds_access_enabled(uint16_t conn_id)
+{
+    return true;
+}
+
+__attribute__((weak)) void mds_backlog_changed(uint16_t conn_id, bool pending)
+{
+}
+
+static void mds_backlog_set(bool pending)
+{
+    if (atomic_exchange(&s_mds.backlog, pending) != pending) {
+        mds_backlog_changed(s_mds.conn_id, pending);
+    }
+}
+
+static void mds_pump_wakeup(void)
+{
+    if (s_mds.pump_task) {
+        xTaskNotifyGive(s_mds.pump_task);
+    }
+}
+
+static void mds_producer_wakeup(void)
+{
+    if (s_mds.producer_task) {
+        xTaskNotifyGive(s_mds.producer_task);
+    }
+}
+
+void mds_data_available(void)
+{
+    if (!atomic_load(&s_mds.stream_enabled) || s_mds.producer_task == NULL) {
+        return;
+    }
+
+    if (xPortInIsrContext()) {
+        BaseType_t higher_prio_woken = pdFALSE;
+        vTaskNotifyGiveFromISR(s_mds.producer_task, &higher_prio_woken);
+        portYIELD_FROM_ISR(higher_prio_woken);
+    } else {
+        xTaskNotifyGive(s_mds.producer_task);
+    }
+}
+
+#if CONFIG_EXAMPLE_MDS_EVENT_STORAGE_HOOK
+// Invoked by Memfault event storage every time a new event has been written
+void memfault_event_storage_request_persist_callback(const sMemfaultEventStoragePersistCbStatus *status)
+{
+    mds_data_available();
+}
+#endif
+
+static void mds_stream_enable(void)
+{
+    if (atomic_exchange(&s_mds.stream_enabled, true)) {
+        return;
+    }
+    ESP_LOGI(MDS_TAG, "Data export streaming enabled, conn_id %u", s_mds.conn_id);
+    mds_producer_wakeup();
+    mds_pump_wakeup();
+}
+
+static void mds_stream_disable(void)
+{
+    if (atomic_exchange(&s_mds.stream_enabled, false)) {
+        ESP_LOGI(MDS_TAG, "Data export streaming disabled, conn_id %u", s_mds.conn_id);
+    }
+    mds_backlog_set(false);
+}
+
+static void mds_congest_set(bool congested)
+{
+    if (atomic_exchange(&s_mds.congested, congested) == congested) {
+        return;
+    }
+
+    const int64_t now_us = esp_timer_get_time();
+    if (congested) {
+        atomic_fetch_add(&s_stats.congest_episodes, 1);
+        s_stats.congest_start_us = now_us;
+        ESP_LOGD(MDS_TAG, "Link congested, data export paused");
+    } else {
+        atomic_fetch_add(&s_stats.congest_paused_ms, (now_us - s_stats.congest_start_us) / 1000);
+        ESP_LOGD(MDS_TAG, "Link uncongested, data export resumed");
+    }
+}
+
+static void mds_subscriber_reset(void)
+{
+    mds_congest_set(false);
+    mds_stream_disable();
+    s_mds.subscribed = false;
+    atomic_store(&s_mds.compress, false);
+    atomic_store(&s_mds.resync, true);
+}
+
+/* Largest chunk that fits a notification on conn_id. With pdu_aligned the notification is
+ * trimmed to end on an LL PDU boundary, so e.g. MTU 500 over 251 byte PDUs sends 2 full PDUs
+ * instead of 2 full ones and a 2 byte one.
+ */
+static size_t mds_chunk_data_length_get(uint16_t conn_id, bool pdu_aligned)
+{
+    size_t length = mds_port_mtu_get(conn_id);
+
+    if (length > MDS_ATT_MAX_MTU) {
+        length = MDS_ATT_MAX_MTU;
+    }
+    if (length < MDS_ATT_HEADER_OVERHEAD + sizeof(mds_data_export_nfy_t) + 1) {
+        ESP_LOGE(MDS_TAG, "MTU value too low: %u", (unsigned)length);
+        return 0;
+    }
+
+    // A port that does not know the data length yet reports 0, assume the default
+    size_t tx_octets = mds_port_tx_octets_get(conn_id);
+    if (tx_octets == 0) {
+        tx_octets = BLE_CONN_DEFAULT_TX_OCTETS;
+    }
+    const size_t pdu_count = (length + MDS_L2CAP_HEADER_OVERHEAD) / tx_octets;
+    if (pdu_aligned && pdu_count > 0) {
+        length = pdu_count * tx_octets - MDS_L2CAP_HEADER_OVERHEAD;
+    }
+
+    length -= MDS_ATT_HEADER_OVERHEAD;
+    length -= sizeof(mds_data_export_nfy_t);
+
+    return length;
+}
+
+// Next entry to send, NULL if none is prefetched
+static mds_chunk_t *mds_chunk_ring_peek(void)
+{
+    unsigned sent = atomic_load_explicit(&s_chunk_ring.sent, memory_order_relaxed);
+
+    // Acquire pairs with the release in mds_chunk_ring_fill, the entry is complete
+    if (atomic_load_explicit(&s_chunk_ring.head, memory_order_acquire) == sent) {
+        return NULL;
+    }
+    return &s_chunk_ring.chunks[sent % MDS_PREFETCH_DEPTH];
+}
+
+static int mds_chunk_ring_in_flight(void)
+{
+    return atomic_load(&s_chunk_ring.sent) - atomic_load(&s_chunk_ring.done);
+}
+
+static void mds_chunk_ring_release(unsigned tail)
+{
+    if (atomic_load_explicit(&s_chunk_ring.tail, memory_order_relaxed) != tail) {
+        // Release hands the entries back to the producer only after we are done reading them
+        atomic_store_explicit(&s_chunk_ring.tail, tail, memory_order_release);
+        mds_producer_wakeup();
+    }
+}
+
+// First packet of the chunk index belongs to, or index itself when it starts a chunk. Entries
+// before it may be released.
+static unsigned mds_chunk_ring_boundary(unsigned index)
+{
+    unsigned boundary = atomic_load_explicit(&s_chunk_ring.tail, memory_order_relaxed);
+
+    for (unsigned i = boundary; i != index; i++) {
+        if (!s_chunk_ring.chunks[i % MDS_PREFETCH_DEPTH].more) {
+            boundary = i + 1;
+        }
+    }
+    return boundary;
+}
+
+// Moves the send position back to index, the chunks from there on are sent again. Only with
+// nothing in flight, so no completion races the reset of done.
+static void mds_chunk_ring_rewind(unsigned index)
+{
+    atomic_store(&s_chunk_ring.sent, index);
+    atomic_store(&s_chunk_ring.done, index);
+    atomic_store(&s_chunk_ring.failed, false);
+    mds_chunk_ring_release(mds_chunk_ring_boundary(index));
+}
+
+// Drops the next entry without sending it, only with nothing in flight
+static void mds_chunk_ring_skip(void)
+{
+    mds_chunk_ring_rewind(atomic_load(&s_chunk_ring.sent) + 1);
+}
+
+/* Releases the entries whose notifications completed. Returns false while a failed
+ * notification waits for the ones sent after it to complete, the pump then rewinds to it.
+ */
+static bool mds_chunk_ring_complete(void)
+{
+    // A new subscriber gets the unconfirmed chunks again, a multi-packet chunk the earlier one
+    // did not receive completely from its first packet. Completions for the earlier one are no
+    // longer counted.
+    if (atomic_exchange(&s_mds.resync, false)) {
+        const unsigned done = atomic_load(&s_chunk_ring.failed) ? atomic_load(&s_chunk_ring.fail_at) :
+                              atomic_load(&s_chunk_ring.done);
+        const unsigned sent = atomic_load(&s_chunk_ring.sent);
+        const unsigned boundary = mds_chunk_ring_boundary(done);
+
+        // Split entries go to the new subscriber whole, cut for its MTU
+        for (unsigned i = boundary; i != sent + 1; i++) {
+            s_chunk_ring.chunks[i % MDS_PREFETCH_DEPTH].off = 0;
+        }
+        atomic_store(&s_chunk_ring.split_len, 0);
+        mds_chunk_ring_rewind(boundary);
+        s_mds.chunk_number = 0;
+        return true;
+    }
+
+    if (!atomic_load(&s_chunk_ring.failed)) {
+        mds_chunk_ring_release(mds_chunk_ring_boundary(atomic_load(&s_chunk_ring.done)));
+        return true;
+    }
+
+    const unsigned fail_at = atomic_load(&s_chunk_ring.fail_at);
+    mds_chunk_ring_release(mds_chunk_ring_boundary(fail_at));
+    if (mds_chunk_ring_in_flight() != 0) {
+        return false;
+    }
+
+    ESP_LOGW(MDS_TAG, "Resending %u chunk(s) from the failed one",
+             atomic_load(&s_chunk_ring.sent) - fail_at);
+    mds_chunk_ring_rewind(fail_at);
+    s_mds.chunk_number = s_chunk_ring.chunks[fail_at % MDS_PREFETCH_DEPTH].seq;
+    return true;
+}
+
+#if CONFIG_EXAMPLE_MDS_MULTI_PACKET_CHUNKS
+/* Starts the next message, returns false when there is none. It only becomes one multi-packet
+ * chunk if all its packets fit the ring (capacity bytes), which keeps a chunk until its last
+ * packet completed. A larger message goes as single-packet chunks, which a new subscriber can
+ * take one by one. compress is cleared unless the message can be a compressed chunk.
+ */
+static bool mds_packetizer_begin(size_t capacity, bool *compress)
+{
+    sPacketizerConfig cfg = {
+        .enable_multi_packet_chunk = true,
+    };
+    sPacketizerMetadata metadata;
+
+    if (!memfault_packetizer_begin(&cfg, &metadata)) {
+        return false;
+    }
+    // Next single-packet chunk of a message that is already being sent
+    if (metadata.send_in_progress) {
+        *compress = false;
+        return true;
+    }
+
+    const size_t len = metadata.single_chunk_message_length;
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+    // The whole input must stay in the window to send the chunk again uncompressed
+    *compress = *compress && len <= MDS_LZ_WINDOW_SIZE && MDS_LZ_OUT_MAX(len) <= capacity;
+#endif
+    s_packetizer.single = len > capacity;
+    if (!s_packetizer.single) {
+        return true;
+    }
+
+    ESP_LOGD(MDS_TAG, "Message of %u bytes sent as single-packet chunks",
+             (unsigned)metadata.single_chunk_message_length);
+    memfault_packetizer_abort();
+    cfg.enable_multi_packet_chunk = false;
+    return memfault_packetizer_begin(&cfg, &metadata);
+}
+
+/* Reads the next packet of the current message, returns false when there is no data */
+static bool mds_packetizer_next(uint8_t *buf, size_t *len, bool *more)
+{
+    eMemfaultPacketizerStatus status = memfault_packetizer_get_next(buf, len);
+    if (status == kMemfaultPacketizerStatus_NoMoreData) {
+        s_packetizer.mid_chunk = false;
+        return false;
+    }
+
+    *more = status == kMemfaultPacketizerStatus_MoreDataForChunk;
+    s_packetizer.mid_chunk = *more;
+    return true;
+}
+#endif
+
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+static bool mds_compressed_read(mds_chunk_t *chunk, size_t *chunk_size)
+{
+    // Compress until a full packet is staged or the whole chunk went through the compressor
+    while (s_lz.out_len < *chunk_size && !s_lz.chunk_end) {
+        size_t raw_len = sizeof(s_lz.raw);
+        bool more;
+
+        if (!mds_packetizer_next(s_lz.raw, &raw_len, &more)) {
+            break;
+        }
+
+        const uint32_t start = esp_cpu_get_cycle_count();
+        size_t out_len = mds_lz_compress(&s_lz.lz, s_lz.raw, raw_len, &s_lz.out[s_lz.out_len]);
+        if (!more) {
+            out_len += mds_lz_flush(&s_lz.lz, &s_lz.out[s_lz.out_len + out_len]);
+            s_lz.chunk_end = true;
+        }
+        atomic_fetch_add(&s_stats.compress_cycles, esp_cpu_get_cycle_count() - start);
+        atomic_fetch_add(&s_stats.compress_raw, raw_len);
+        atomic_fetch_add(&s_stats.compress_out, out_len);
+        s_lz.out_len += out_len;
+    }
+
+    if (s_lz.out_len == 0) {
+        return false;
+    }
+
+    const size_t len = s_lz.out_len < *chunk_size ? s_lz.out_len : *chunk_size;
+    memcpy(chunk->data, s_lz.out, len);
+    s_lz.out_len -= len;
+    memmove(s_lz.out, &s_lz.out[len], s_lz.out_len);
+    *chunk_size = len;
+
+    chunk->compressed = true;
+    chunk->more = !(s_lz.chunk_end && s_lz.out_len == 0);
+    if (!chunk->more) {
+        s_lz.active = false;
+        s_lz.chunk_end = false;
+        s_lz.kept = true;
+        s_lz.end = atomic_load_explicit(&s_chunk_ring.head, memory_order_relaxed) + 1;
+    }
+    return true;
+}
+
+/* Waits for a gateway to take the last compressed chunk before the window is reused. Returns
+ * false while it has not, and true once the chunk is gone. If the pump dropped it, its input
+ * is then sent again uncompressed (mds_compressed_replay).
+ */
+static bool mds_compressed_release(void)
+{
+    // tail first, the pump raises lz_dropped before it releases the dropped entries
+    if ((int)(atomic_load(&s_chunk_ring.tail) - s_lz.end) < 0) {
+        return false;
+    }
+    s_lz.kept = false;
+    s_lz.replay = atomic_exchange(&s_mds.lz_dropped, false);
+    s_lz.replay_off = 0;
+    if (s_lz.replay) {
+        ESP_LOGI(MDS_TAG, "Sending a compressed chunk again uncompressed");
+    }
+    return true;
+}
+
+/* Reads the next packet of the uncompressed copy of a dropped compressed chunk, cut like the
+ * chunk itself so it fits the ring the same way
+ */
+static void mds_compressed_replay(mds_chunk_t *chunk, size_t *chunk_size)
+{
+    size_t raw_len;
+    const uint8_t *raw = mds_lz_input_get(&s_lz.lz, &raw_len);
+    const size_t left = raw_len - s_lz.replay_off;
+    const size_t len = left < s_packetizer.packet_size ? left : s_packetizer.packet_size;
+
+    memcpy(chunk->data, &raw[s_lz.replay_off], len);
+    s_lz.replay_off += len;
+    *chunk_size = len;
+    chunk->more = s_lz.replay_off < raw_len;
+    s_lz.replay = chunk->more;
+}
+#endif
+
+/* Reads the next packet from the Memfault packetizer into chunk, returns false when there
+ * is no data.
+ */
+static bool mds_packetizer_read(mds_chunk_t *chunk, size_t *chunk_size)
+{
+    chunk->compressed = false;
+
+#if CONFIG_EXAMPLE_MDS_MULTI_PACKET_CHUNKS
+    bool more;
+
+    // Every packet of a chunk has the size the ring was checked against at its start
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+    if (s_lz.active) {
+        *chunk_size = s_packetizer.packet_size;
+        return mds_compressed_read(chunk, chunk_size);
+    }
+    if (s_lz.kept && !mds_compressed_release()) {
+        return false;
+    }
+    if (s_lz.replay) {
+        mds_compressed_replay(chunk, chunk_size);
+        return true;
+    }
+    // The mode is latched for a whole chunk when it starts
+    bool compress = atomic_load(&s_mds.compress);
+#else
+    bool compress = false;
+#endif
+
+    if (s_packetizer.mid_chunk) {
+        *chunk_size = s_packetizer.packet_size;
+    } else {
+        s_packetizer.packet_size = *chunk_size;
+        if (!mds_packetizer_begin(MDS_PREFETCH_DEPTH * *chunk_size, &compress)) {
+            return false;
+        }
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+        if (compress) {
+            mds_lz_init(&s_lz.lz);
+            s_lz.active = true;
+            return mds_compressed_read(chunk, chunk_size);
+        }
+#endif
+    }
+
+    if (!mds_packetizer_next(chunk->data, chunk_size, &more)) {
+        return false;
+    }
+    chunk->more = more;
+    return true;
+#else
+    chunk->more = false;
+    return memfault_packetizer_get_chunk(chunk->data, chunk_size);
+#endif
+}
+
+static void mds_chunk_ring_fill(void)
+{
+    unsigned head = atomic_load_explicit(&s_chunk_ring.head, memory_order_relaxed);
+
+    while (atomic_load(&s_mds.stream_enabled) &&
+           head - atomic_load_explicit(&s_chunk_ring.tail, memory_order_acquire) < MDS_PREFETCH_DEPTH) {
+        mds_chunk_t *chunk = &s_chunk_ring.chunks[head % MDS_PREFETCH_DEPTH];
+        size_t chunk_size = mds_chunk_data_length_get(s_mds.conn_id, true);
+
+        if (chunk_size == 0 || !mds_packetizer_read(chunk, &chunk_size)) {
+            return;
+        }
+        chunk->len = chunk_size;
+        chunk->off = 0;
+
+        atomic_store_explicit(&s_chunk_ring.head, ++head, memory_order_release);
+        mds_pump_wakeup();
+    }
+}
+
+/* Returns the number of chunk bytes sent, 0 when no chunk is prefetched and a negative
+ * value when the chunk could not be handed to the stack.
+ */
+static int mds_data_send(void)
+{
+    mds_data_export_nfy_t *nfy;
+    mds_tx_buf_t tx;
+    uint16_t conn_id = s_mds.conn_id;
+    mds_chunk_t *chunk;
+
+    // Compressed chunks prefetched for an earlier gateway can't go to one that didn't opt in,
+    // the producer sends them again uncompressed. Entries are only dropped with nothing in
+    // flight, the last completion wakes us up again.
+    while ((chunk = mds_chunk_ring_peek()) != NULL && chunk->compressed && !atomic_load(&s_mds.compress)) {
+        if (mds_chunk_ring_in_flight() != 0) {
+            return 0;
+        }
+        atomic_store(&s_mds.lz_dropped, true);
+        mds_chunk_ring_skip();
+    }
+    if (chunk == NULL) {
+        return 0;
+    }
+
+    const size_t max_len = mds_chunk_data_length_get(conn_id, false);
+    if (max_len == 0) {
+        return -1;
+    }
+
+    // Chunks prefetched on an earlier connection may not fit the MTU of this one
+    const uint16_t off = chunk->off;
+    uint16_t len = chunk->len - off;
+    bool more = chunk->more;
+#if CONFIG_EXAMPLE_MDS_MULTI_PACKET_CHUNKS
+    // The gateway reassembles packets flagged with "more data" into one chunk, so the entry goes
+    // as several notifications. One at a time with nothing else in flight, a failed one is sent
+    // again from its offset with its sequence number. The completion wakes us up again.
+    if (atomic_load(&s_chunk_ring.split_len) != 0) {
+        return 0;
+    }
+    if (len > max_len) {
+        if (mds_chunk_ring_in_flight() != 0) {
+            return 0;
+        }
+        len = max_len;
+        more = true;
+    }
+#else
+    // A Memfault chunk can't be cut, wait for the MTU exchange (mds_on_mtu_changed). A link
+    // that exchanged a smaller MTU than the one the entry was prefetched for will never take
+    // it, it is dropped.
+    if (len > max_len) {
+        if (mds_port_mtu_get(conn_id) <= MDS_ATT_DEFAULT_MTU) {
+            ESP_LOGD(MDS_TAG, "Prefetched chunk of %u bytes waits for the MTU exchange", len);
+            return 0;
+        }
+        if (mds_chunk_ring_in_flight() != 0) {
+            return 0;
+        }
+        ESP_LOGE(MDS_TAG, "Prefetched chunk of %u bytes exceeds MTU %u, dropped", len,
+                 mds_port_mtu_get(conn_id));
+        mds_chunk_ring_skip();
+        return 0;
+    }
+#endif
+    const bool split = off + len < chunk->len;
+
+    esp_err_t err = mds_port_tx_buf_get(conn_id, sizeof(*nfy) + len, &tx);
+    if (err != ESP_OK) {
+        ESP_LOGW(MDS_TAG, "No TX buffer for Memfault diagnostic chunk, err %x", err);
+        return -1;
+    }
+
+    nfy = (mds_data_export_nfy_t *)tx.data;
+    nfy->hdr = s_mds.chunk_number & MDS_CHUNK_NUMBER_MASK;
+    if (more) {
+        nfy->hdr |= MDS_DATA_EXPORT_HDR_MORE_DATA;
+    }
+    if (chunk->compressed) {
+        nfy->hdr |= MDS_DATA_EXPORT_HDR_COMPRESSED;
+    }
+    memcpy(nfy->data, &chunk->data[off], len);
+    mds_on_tx_copy(len);
+    chunk->seq = s_mds.chunk_number;
+
+    // In flight before the stack has it, its completion may arrive before the send returns
+    const unsigned index = atomic_load(&s_chunk_ring.sent);
+    if (split) {
+        atomic_store(&s_chunk_ring.split_len, len);
+    } else {
+        atomic_store(&s_chunk_ring.sent, index + 1);
+    }
+
+    err = mds_port_tx_buf_send(conn_id, &tx, sizeof(*nfy) + len);
+    if (err != ESP_OK) {
+        // Keep the entry, the same chunk is sent again on the next attempt. A port that
+        // completes inside the send (NimBLE) already reported it failed, the pump then
+        // rewinds to it like to any failed notification.
+        if (split) {
+            atomic_store(&s_chunk_ring.split_len, 0);
+        } else if ((int)(atomic_load(&s_chunk_ring.done) - index) <= 0) {
+            atomic_store(&s_chunk_ring.sent, index);
+        }
+        ESP_LOGW(MDS_TAG, "Failed to send Memfault diagnostic chunk, err %x", err);
+        return -1;
+    }
+
+    const int sent = len;
+
+    ESP_LOGD(MDS_TAG, "Memfault diagnostic data chunk %u sent, %u bytes",
+             s_mds.chunk_number, (unsigned)sent);
+    s_mds.chunk_number = (s_mds.chunk_number + 1) & MDS_CHUNK_NUMBER_MASK;
+    atomic_fetch_add(&s_stats.tx_bytes, sent);
+    atomic_fetch_add(&s_stats.tx_chunks, 1);
+
+    return sent;
+}
+
+/* In-flight window for the next send: what is already in flight plus what the controller
+ * can take right now. At least one, so a send is always attempted and its completion
+ * re-evaluates the window.
+ */
+static int mds_window_get(uint16_t conn_id)
+{
+    const int in_flight = mds_chunk_ring_in_flight();
+    const uint16_t sendable = mds_port_tx_sendable(conn_id);
+    int window = sendable >= MAX_PIPELINE ? MAX_PIPELINE : in_flight + sendable;
+
+    if (window > MAX_PIPELINE) {
+        window = MAX_PIPELINE;
+    } else if (window < 1) {
+        window = 1;
+    }
+    atomic_store(&s_stats.depth, window);
+    return window;
+}
+
+static void mds_pump(void)
+{
+    // A failed notification stops sending until everything in flight has completed
+    if (!mds_chunk_ring_complete()) {
+        return;
+    }
+
+    while (atomic_load(&s_mds.stream_enabled)) {
+        // mds_on_congest wakes us up again when the link drains
+        if (atomic_load(&s_mds.congested)) {
+            return;
+        }
+
+        // Window is full, the next completed notification wakes us up again
+        if (mds_chunk_ring_in_flight() >= mds_window_get(s_mds.conn_id)) {
+            return;
+        }
+
+        if (mds_data_send() <= 0) {
+            return;
+        }
+    }
+}
+
+static void mds_pump_task(void *arg)
+{
+    for (;;) {
+        // Woken by the producer, completed notifications and streaming being enabled
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        mds_pump();
+    }
+}
+
+static void mds_producer_task(void *arg)
+{
+    for (;;) {
+        // Woken when streaming is enabled, new data is committed or the pump frees an entry.
+        // The poll only backs up data sources that don't signal, and idle links never wake.
+        ulTaskNotifyTake(pdTRUE, atomic_load(&s_mds.stream_enabled) ?
+                         pdMS_TO_TICKS(CONFIG_EXAMPLE_MDS_POLL_INTERVAL_MS) : portMAX_DELAY);
+        mds_chunk_ring_fill();
+
+        // The fill only stops short of a full ring when the packetizer ran dry, so an empty
+        // ring here means the backlog is drained, the last notification included
+        const bool pending = atomic_load(&s_mds.stream_enabled) &&
+                             atomic_load(&s_chunk_ring.head) != atomic_load(&s_chunk_ring.tail);
+        mds_backlog_set(pending);
+
+        // Also retries a pump that gave up on a failed send with nothing left in flight
+        if (pending) {
+            mds_pump_wakeup();
+        }
+    }
+}
+
+uint8_t mds_value_get(uint16_t conn_id, mds_read_char_t chr, uint16_t offset, const uint8_t **value, uint16_t *len)
+{
+    if (!mds_access_enabled(conn_id)) {
+        return MDS_ATT_ERR_READ_NOT_PERMITTED;
+    }
+
+    if (chr >= MDS_CHAR_NB) {
+        return MDS_ATT_ERR_READ_NOT_PERMITTED;
+    }
+
+    const mds_value_t *entry = &s_mds_values[chr];
+    if (offset > entry->len) {
+        return MDS_ATT_ERR_INVALID_OFFSET;
+    }
+
+    *value = entry->value + offset;
+    *len = entry->len - offset;
+
+    return MDS_ATT_ERR_NONE;
+}
+
+uint8_t mds_cccd_write(uint16_t conn_id, uint16_t value)
+{
+    if (!mds_access_enabled(conn_id)) {
+        return MDS_ATT_ERR_WRITE_NOT_PERMITTED;
+    }
+
+    if (value != 0x0000 && value != 0x0001) {
+        return MDS_ATT_ERR_CCC_IMPROPERLY_CONFIGURED;
+    }
+
+    // Allow only one subscription to the Memfault Data Export characteristic
+    if (s_mds.subscribed && s_mds.conn_id != conn_id) {
+        ESP_LOGW(MDS_TAG, "Memfault Data Export characteristic is already subscribed");
+        return MDS_ATT_ERR_CLIENT_ALREADY_SUBSCRIBED;
+    }
+
+    if (value == 0x0001) {
+        s_mds.conn_id = conn_id;
+        s_mds.subscribed = true;
+    } else if (s_mds.subscribed) {
+        mds_subscriber_reset();
+    }
+
+    return MDS_ATT_ERR_NONE;
+}
+
+uint8_t mds_data_export_write(uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    if (!mds_access_enabled(conn_id)) {
+        return MDS_ATT_ERR_WRITE_NOT_PERMITTED;
+    }
+
+    if (!s_mds.subscribed || s_mds.conn_id != conn_id) {
+        ESP_LOGD(MDS_TAG, "MDS Data Export notifications are disabled");
+        return MDS_ATT_ERR_CLIENT_NOT_SUBSCRIBED;
+    }
+
+    if (len != sizeof(uint8_t)) {
+        return MDS_ATT_ERR_INVALID_ATTR_LEN;
+    }
+
+    switch ((mds_data_export_mode_t)value[0]) {
+    case MDS_DATA_EXPORT_MODE_STREAMING_ENABLE:
+        atomic_store(&s_mds.compress, false);
+        mds_stream_enable();
+        break;
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+    case MDS_DATA_EXPORT_MODE_STREAMING_COMPRESSED:
+        atomic_store(&s_mds.compress, true);
+        mds_stream_enable();
+        break;
+#endif
+    case MDS_DATA_EXPORT_MODE_STREAMING_DISABLE:
+        mds_stream_disable();
+        break;
+    default:
+        ESP_LOGW(MDS_TAG, "MDS Data Export characteristic write invalid value");
+        return MDS_ATT_ERR_OUT_OF_RANGE;
+    }
+
+    return MDS_ATT_ERR_NONE;
+}
+
+void mds_on_disconnect(uint16_t conn_id)
+{
+    if (s_mds.subscribed && s_mds.conn_id == conn_id) {
+        mds_subscriber_reset();
+    }
+}
+
+void mds_on_mtu_changed(uint16_t conn_id)
+{
+    if (s_mds.subscribed && s_mds.conn_id == conn_id) {
+        mds_pump_wakeup();
+    }
+}
+
+void mds_on_tx_done(uint16_t conn_id, int status)
+{
+    // Notifications sent to an earlier subscriber are sent again on resync
+    if (!s_mds.subscribed || s_mds.conn_id != conn_id) {
+        return;
+    }
+
+    const unsigned sent = atomic_load(&s_chunk_ring.sent);
+
+    // Part of an entry that did not fit the link, the pump sends the next part or this one again
+    // once split_len is cleared
+    const unsigned split_len = atomic_load(&s_chunk_ring.split_len);
+    if (split_len != 0) {
+        if (status != 0) {
+            ESP_LOGW(MDS_TAG, "Chunk notification failed, status %d", status);
+            atomic_store(&s_chunk_ring.fail_at, sent);
+            atomic_store(&s_chunk_ring.failed, true);
+        } else {
+            atomic_fetch_add(&s_stats.tx_done, 1);
+            s_chunk_ring.chunks[sent % MDS_PREFETCH_DEPTH].off += split_len;
+        }
+        atomic_store(&s_chunk_ring.split_len, 0);
+        mds_pump_wakeup();
+        return;
+    }
+
+    const unsigned done = atomic_load(&s_chunk_ring.done);
+    if (done == sent) {
+        return;
+    }
+
+    // Notifications complete in order, the pump rewinds to the first one that failed
+    if (status != 0) {
+        ESP_LOGW(MDS_TAG, "Chunk notification failed, status %d", status);
+        if (!atomic_load(&s_chunk_ring.failed)) {
+            atomic_store(&s_chunk_ring.fail_at, done);
+            atomic_store(&s_chunk_ring.failed, true);
+        }
+    } else {
+        atomic_fetch_add(&s_stats.tx_done, 1);
+    }
+    atomic_store(&s_chunk_ring.done, done + 1);
+    mds_pump_wakeup();
+}
+
+void mds_on_congest(uint16_t conn_id, bool congested)
+{
+    if (!s_mds.subscribed || s_mds.conn_id != conn_id) {
+        return;
+    }
+
+    mds_congest_set(congested);
+    if (!congested) {
+        mds_pump_wakeup();
+    }
+}
+
+void mds_stats_get(mds_stats_t *stats)
+{
+    const int64_t now_us = esp_timer_get_time();
+    const int64_t elapsed_us = now_us - s_stats.last_get_us;
+
+    s_stats.last_get_us = now_us;
+    stats->depth = atomic_load(&s_stats.depth);
+    stats->max_depth = MAX_PIPELINE;
+    stats->conn_interval = s_mds.subscribed ? mds_port_conn_interval_get(s_mds.conn_id) : 0;
+    stats->tx_done = atomic_exchange(&s_stats.tx_done, 0);
+
+    // Connection interval is in 1.25 ms units
+    const int64_t events = stats->conn_interval ? elapsed_us * 4 / (stats->conn_interval * 5000) : 0;
+    stats->pkts_per_event_x100 = events ? stats->tx_done * 100ULL / events : 0;
+    stats->congest_episodes = atomic_load(&s_stats.congest_episodes);
+    stats->congest_paused_ms = atomic_load(&s_stats.congest_paused_ms);
+    stats->tx_bytes = atomic_exchange(&s_stats.tx_bytes, 0);
+    stats->tx_chunks = atomic_exchange(&s_stats.tx_chunks, 0);
+    stats->tx_copied = atomic_exchange(&s_stats.tx_copied, 0);
+    stats->compress_raw = atomic_exchange(&s_stats.compress_raw, 0);
+    stats->compress_out = atomic_exchange(&s_stats.compress_out, 0);
+    stats->compress_cycles = atomic_exchange(&s_stats.compress_cycles, 0);
+}
+
+void mds_on_tx_copy(size_t bytes)
+{
+    atomic_fetch_add(&s_stats.tx_copied, bytes);
+}
+
+static esp_err_t mds_values_init(void)
+{
+    sMemfaultDeviceInfo info;
+
+    memfault_platform_get_device_info(&info);
+
+    const size_t sn_length = strlen(info.device_serial);
+    if (MDS_URI_BASE_LENGTH + sn_length > sizeof(s_data_uri)) {
+        ESP_LOGE(MDS_TAG, "Too long URI, increase CONFIG_EXAMPLE_MDS_MAX_URI_LENGTH to %u",
+                 (unsigned)(MDS_URI_BASE_LENGTH + sn_length));
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    memcpy(s_data_uri, MDS_URI_BASE, MDS_URI_BASE_LENGTH);
+    memcpy(&s_data_uri[MDS_URI_BASE_LENGTH], info.device_serial, sn_length);
+
+    s_mds_values[MDS_CHAR_DATA_URI].value = (const uint8_t *)s_data_uri;
+    s_mds_values[MDS_CHAR_DATA_URI].len = MDS_URI_BASE_LENGTH + sn_length;
+    s_mds_values[MDS_CHAR_DEVICE_IDENTIFIER].value = (const uint8_t *)&s_data_uri[MDS_URI_BASE_LENGTH];
+    s_mds_values[MDS_CHAR_DEVICE_IDENTIFIER].len = sn_length;
+
+    return ESP_OK;
+}
+
+esp_err_t mds_init(void)
+{
+    esp_err_t err = mds_values_init();
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    BaseType_t ret = xTaskCreate(mds_pump_task, "mds_pump", CONFIG_EXAMPLE_MDS_TASK_STACK_SIZE, NULL,
+                                 CONFIG_EXAMPLE_MDS_TASK_PRIORITY, &s_mds.pump_task);
+    if (ret != pdPASS) {
+        ESP_LOGE(MDS_TAG, "%s create pump task failed", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ret = xTaskCreate(mds_producer_task, "mds_producer", CONFIG_EXAMPLE_MDS_TASK_STACK_SIZE, NULL,
+                      CONFIG_EXAMPLE_MDS_PRODUCER_TASK_PRIORITY, &s_mds.producer_task);
+    if (ret != pdPASS) {
+        ESP_LOGE(MDS_TAG, "%s create producer task failed", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
@@ -0,0 +1,144 @@
+#ifndef MDS_H
+#define MDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#if CONFIG_BT_BLUEDROID_ENABLED
+#include "esp_gatts_api.h"
+#elif CONFIG_BT_NIMBLE_ENABLED
+#include "host/ble_gap.h"
+#endif
+
+#define MDS_TAG "MDS"
+
+// Memfault Diagnostic Service, 54220000-f6a5-4007-a371-722f4ebd8436, LSB first
+#define MDS_UUID128_BYTES(id) 0x36, 0x84, 0xbd, 0x4e, 0x2f, 0x72, 0x71, 0xa3, \
+                              0x07, 0x40, 0xa5, 0xf6, (id) & 0xff, ((id) >> 8) & 0xff, 0x22, 0x54
+
+// Largest value any MDS read characteristic may return, see "Long attribute values"
+// in Vol 3, Part F, Section 3.2.9 of the Core specification
+#define MDS_MAX_READ_LEN 512
+
+// ATT error codes returned by the MDS core. The numeric values are the ones from the
+// Core specification, so both host stacks can pass them through unchanged.
+#define MDS_ATT_ERR_NONE                      0x00
+#define MDS_ATT_ERR_READ_NOT_PERMITTED        0x02
+#define MDS_ATT_ERR_WRITE_NOT_PERMITTED       0x03
+#define MDS_ATT_ERR_INVALID_OFFSET            0x07
+#define MDS_ATT_ERR_INVALID_ATTR_LEN          0x0d
+#define MDS_ATT_ERR_CCC_IMPROPERLY_CONFIGURED 0xfd
+#define MDS_ATT_ERR_OUT_OF_RANGE              0xff
+// Application error codes defined by the MDS, Vol 3, Part F, Section 3.4.1
+#define MDS_ATT_ERR_CLIENT_ALREADY_SUBSCRIBED 0x80
+#define MDS_ATT_ERR_CLIENT_NOT_SUBSCRIBED     0x81
+
+typedef enum {
+    MDS_CHAR_SUPPORTED_FEATURES,
+    MDS_CHAR_DEVICE_IDENTIFIER,
+    MDS_CHAR_DATA_URI,
+    MDS_CHAR_AUTHORIZATION,
+
+    MDS_CHAR_NB,
+} mds_read_char_t;
+
+// Serializes the read-only characteristic values and creates the task that pumps Memfault
+// chunks out as notifications. Must be called before the host stack registers the service.
+esp_err_t mds_init(void);
+
+// Data export pipeline statistics
+typedef struct {
+    // In-flight window last chosen by the pipeline controller and its upper bound
+    uint8_t depth;
+    uint8_t max_depth;
+    // Connection interval of the subscriber in 1.25 ms units, 0 when unknown
+    uint16_t conn_interval;
+    // Notifications completed since the previous mds_stats_get and how many that makes per
+    // connection event, times 100
+    uint32_t tx_done;
+    uint32_t pkts_per_event_x100;
+    // Since boot: congestion episodes on the subscriber link and time the pump spent paused
+    uint32_t congest_episodes;
+    uint32_t congest_paused_ms;
+    // Since the previous mds_stats_get: chunk bytes sent as notifications, in how many, and
+    // the bytes copied on the way to the stack (mds_on_tx_copy)
+    uint32_t tx_bytes;
+    uint32_t tx_chunks;
+    uint32_t tx_copied;
+    // Since the previous mds_stats_get: raw bytes compressed, into how many, taking how many
+    // CPU cycles (CONFIG_EXAMPLE_MDS_COMPRESSION)
+    uint32_t compress_raw;
+    uint32_t compress_out;
+    uint32_t compress_cycles;
+} mds_stats_t;
+
+// Fills stats, the counters restart with every call
+void mds_stats_get(mds_stats_t *stats);
+
+// Signals that new Memfault data was committed, so the producer task drains it now instead of
+// at the next poll. Cheap and safe to call from tasks and ISRs, a no-op unless streaming.
+void mds_data_available(void);
+
+// Weak hook, return false to deny a connection access to the service. The default allows
+// everyone, production applications should override it (e.g. require a bonded link).
+bool mds_access_enabled(uint16_t conn_id);
+
+// Weak hook, called from the MDS tasks when prefetched chunks start waiting for conn_id
+// (pending) and again when the backlog has drained or streaming stopped. The default does
+// nothing, conn_policy.c uses it to pick the connection parameters.
+void mds_backlog_changed(uint16_t conn_id, bool pending);
+
+// Stack-neutral service logic, called by the host stack port. Return an ATT error code.
+// mds_value_get points value at the precomputed value of chr, starting at offset.
+uint8_t mds_value_get(uint16_t conn_id, mds_read_char_t chr, uint16_t offset, const uint8_t **value, uint16_t *len);
+uint8_t mds_cccd_write(uint16_t conn_id, uint16_t value);
+uint8_t mds_data_export_write(uint16_t conn_id, const uint8_t *value, uint16_t len);
+void mds_on_disconnect(uint16_t conn_id);
+// The ATT MTU of conn_id was exchanged, larger prefetched chunks may fit now
+void mds_on_mtu_changed(uint16_t conn_id);
+// A data export notification left the host, in the order they were sent. status 0 on
+// success, anything else sends that chunk and the ones after it again. May be called from
+// inside mds_port_tx_buf_send, also for a send that then returns an error.
+void mds_on_tx_done(uint16_t conn_id, int status);
+// The stack's TX path of conn_id became congested / drained again
+void mds_on_congest(uint16_t conn_id, bool congested);
+// The port or the stack copied bytes of a notification that was sent, once per copy after
+// the one into the lent buffer, for mds_stats_t tx_copied
+void mds_on_tx_copy(size_t bytes);
+
+// Notification buffer lent by the host stack port, the core assembles the notification
+// (header and chunk) straight into data
+typedef struct {
+    uint8_t *data;
+    void *priv;
+} mds_tx_buf_t;
+
+// Implemented by the host stack port (mds_bluedroid.c / mds_nimble.c)
+// mds_port_tx_buf_get lends a buffer for a notification of up to len bytes, which must then
+// be handed back through either mds_port_tx_buf_send (also on failure) or _release.
+esp_err_t mds_port_tx_buf_get(uint16_t conn_id, uint16_t len, mds_tx_buf_t *buf);
+esp_err_t mds_port_tx_buf_send(uint16_t conn_id, mds_tx_buf_t *buf, uint16_t len);
+void mds_port_tx_buf_release(mds_tx_buf_t *buf);
+uint16_t mds_port_mtu_get(uint16_t conn_id);
+// Negotiated LL TX payload size (Data Length Extension) of conn_id, 27 without DLE
+uint16_t mds_port_tx_octets_get(uint16_t conn_id);
+// Number of packets the controller can take for conn_id right now, UINT16_MAX if the stack
+// can't tell
+uint16_t mds_port_tx_sendable(uint16_t conn_id);
+// Current connection interval of conn_id in 1.25 ms units, 0 when unknown
+uint16_t mds_port_conn_interval_get(uint16_t conn_id);
+
+#if CONFIG_BT_BLUEDROID_ENABLED
+// Profile callback, hooked into gl_profile_tab so gatts_event_handler routes MDS events here
+void mds_gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+#elif CONFIG_BT_NIMBLE_ENABLED
+// Adds the service to the NimBLE GATT server, call before the host is started
+int mds_nimble_gatt_svr_init(void);
+// Forwarded from the connection's GAP event callback
+void mds_nimble_gap_event(struct ble_gap_event *event);
+#endif
+
+#endif // MDS_H
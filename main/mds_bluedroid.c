@@ -0,0 +1,287 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Bluedroid port of the Memfault Diagnostic Service.
+*
+* The service registers as its own profile in gl_profile_tab, so gatts_event_handler routes
+* every event for its gatts_if to mds_gatts_event_handler. The service is created from one
+* attribute table through gatts_table.c, which routes reads, writes and confirmations to
+* mds_gatts_attr_cb by attribute index. Every value is ESP_GATT_RSP_BY_APP
+* and answered from the stack-neutral core in mds.c. MTU, connection interval, data length
+* and congestion are read from the per-connection contexts gatts_demo.c keeps in ble_conn.c.
+*
+****************************************************************************/
+
+#include <string.h>
+#include <sys/param.h>
+#include "esp_log.h"
+
+#include "esp_gatts_api.h"
+#include "esp_gatt_common_api.h"
+
+#include "sdkconfig.h"
+
+#include "ble_conn.h"
+#include "gatts_demo.h"
+#include "gatts_table.h"
+#include "mds.h"
+
+#define MDS_SVC_INST_ID 0
+
+// Attribute table indices, filled in from ESP_GATTS_CREAT_ATTR_TAB_EVT
+enum {
+    MDS_IDX_SVC,
+
+    MDS_IDX_CHAR_SUPPORTED_FEATURES,
+    MDS_IDX_CHAR_VAL_SUPPORTED_FEATURES,
+
+    MDS_IDX_CHAR_DEVICE_IDENTIFIER,
+    MDS_IDX_CHAR_VAL_DEVICE_IDENTIFIER,
+
+    MDS_IDX_CHAR_DATA_URI,
+    MDS_IDX_CHAR_VAL_DATA_URI,
+
+    MDS_IDX_CHAR_AUTHORIZATION,
+    MDS_IDX_CHAR_VAL_AUTHORIZATION,
+
+    MDS_IDX_CHAR_DATA_EXPORT,
+    MDS_IDX_CHAR_VAL_DATA_EXPORT,
+    MDS_IDX_CHAR_CFG_DATA_EXPORT,
+
+    MDS_IDX_NB,
+};
+
+static esp_gatt_if_t s_gatts_if = ESP_GATT_IF_NONE;
+static uint16_t s_handle_table[MDS_IDX_NB];
+
+// Bluedroid has no zero-copy path: the core copies each chunk into this buffer and
+// esp_ble_gatts_send_indicate copies the notification into its own packet once more. mds.c
+// counts the first copy, mds_port_tx_buf_send the second. Only the MDS pump task sends
+// notifications, so a single static buffer can be lent out.
+static uint8_t s_tx_buf[ESP_GATT_MAX_MTU_SIZE - 3];
+static bool s_tx_buf_lent;
+
+static const esp_gatts_attr_db_t mds_gatt_db[MDS_IDX_NB] = {
+    GATTS_TABLE_SERVICE128(MDS_IDX_SVC, MDS_UUID128_BYTES(0x0000)),
+
+    GATTS_TABLE_CHAR_DECL(MDS_IDX_CHAR_SUPPORTED_FEATURES, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_VALUE128(MDS_IDX_CHAR_VAL_SUPPORTED_FEATURES, ESP_GATT_PERM_READ, MDS_MAX_READ_LEN,
+                         MDS_UUID128_BYTES(0x0001)),
+
+    GATTS_TABLE_CHAR_DECL(MDS_IDX_CHAR_DEVICE_IDENTIFIER, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_VALUE128(MDS_IDX_CHAR_VAL_DEVICE_IDENTIFIER, ESP_GATT_PERM_READ, MDS_MAX_READ_LEN,
+                         MDS_UUID128_BYTES(0x0002)),
+
+    GATTS_TABLE_CHAR_DECL(MDS_IDX_CHAR_DATA_URI, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_VALUE128(MDS_IDX_CHAR_VAL_DATA_URI, ESP_GATT_PERM_READ, MDS_MAX_READ_LEN,
+                         MDS_UUID128_BYTES(0x0003)),
+
+    GATTS_TABLE_CHAR_DECL(MDS_IDX_CHAR_AUTHORIZATION, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_VALUE128(MDS_IDX_CHAR_VAL_AUTHORIZATION, ESP_GATT_PERM_READ, MDS_MAX_READ_LEN,
+                         MDS_UUID128_BYTES(0x0004)),
+
+    GATTS_TABLE_CHAR_DECL(MDS_IDX_CHAR_DATA_EXPORT, ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_NOTIFY),
+    GATTS_TABLE_VALUE128(MDS_IDX_CHAR_VAL_DATA_EXPORT, ESP_GATT_PERM_WRITE, sizeof(uint8_t),
+                         MDS_UUID128_BYTES(0x0005)),
+    GATTS_TABLE_CCCD(MDS_IDX_CHAR_CFG_DATA_EXPORT),
+};
+
+static void mds_gatts_attr_cb(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
+                              esp_ble_gatts_cb_param_t *param, uint8_t attr_idx);
+
+static const gatts_table_svc_t mds_svc = {
+    .name = "MDS",
+    .db = mds_gatt_db,
+    .num_attr = MDS_IDX_NB,
+    .inst_id = MDS_SVC_INST_ID,
+    .handles = s_handle_table,
+    .attr_cb = mds_gatts_attr_cb,
+};
+
+esp_err_t mds_port_tx_buf_get(uint16_t conn_id, uint16_t len, mds_tx_buf_t *buf)
+{
+    if (len > sizeof(s_tx_buf)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    if (s_tx_buf_lent || conn == NULL || conn->congested) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    s_tx_buf_lent = true;
+    buf->data = s_tx_buf;
+    buf->priv = NULL;
+    return ESP_OK;
+}
+
+esp_err_t mds_port_tx_buf_send(uint16_t conn_id, mds_tx_buf_t *buf, uint16_t len)
+{
+    esp_err_t ret = esp_ble_gatts_send_indicate(s_gatts_if, conn_id, s_handle_table[MDS_IDX_CHAR_VAL_DATA_EXPORT],
+                                                len, buf->data, false);
+    if (ret == ESP_OK) {
+        mds_on_tx_copy(len);
+    }
+    mds_port_tx_buf_release(buf);
+    return ret;
+}
+
+void mds_port_tx_buf_release(mds_tx_buf_t *buf)
+{
+    buf->data = NULL;
+    s_tx_buf_lent = false;
+}
+
+uint16_t mds_port_tx_sendable(uint16_t conn_id)
+{
+    return esp_ble_get_cur_sendable_packets_num(conn_id);
+}
+
+uint16_t mds_port_conn_interval_get(uint16_t conn_id)
+{
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    return conn ? conn->conn_interval : 0;
+}
+
+uint16_t mds_port_tx_octets_get(uint16_t conn_id)
+{
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    return conn ? conn->tx_octets : BLE_CONN_DEFAULT_TX_OCTETS;
+}
+
+uint16_t mds_port_mtu_get(uint16_t conn_id)
+{
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    return conn ? conn->mtu : ESP_GATT_DEF_BLE_MTU_SIZE;
+}
+
+static void mds_handle_read(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param, uint8_t attr_idx)
+{
+    esp_gatt_status_t status;
+    const uint16_t handle = param->read.handle;
+    const uint8_t *value = NULL;
+    uint16_t len = 0;
+
+    switch (attr_idx) {
+    case MDS_IDX_CHAR_VAL_SUPPORTED_FEATURES:
+        status = mds_value_get(param->read.conn_id, MDS_CHAR_SUPPORTED_FEATURES, param->read.offset, &value, &len);
+        break;
+    case MDS_IDX_CHAR_VAL_DEVICE_IDENTIFIER:
+        status = mds_value_get(param->read.conn_id, MDS_CHAR_DEVICE_IDENTIFIER, param->read.offset, &value, &len);
+        break;
+    case MDS_IDX_CHAR_VAL_DATA_URI:
+        status = mds_value_get(param->read.conn_id, MDS_CHAR_DATA_URI, param->read.offset, &value, &len);
+        break;
+    case MDS_IDX_CHAR_VAL_AUTHORIZATION:
+        status = mds_value_get(param->read.conn_id, MDS_CHAR_AUTHORIZATION, param->read.offset, &value, &len);
+        break;
+    default:
+        status = ESP_GATT_READ_NOT_PERMIT;
+        break;
+    }
+
+    // Long values are fetched by the client with Read Blob requests of (ATT_MTU - 1)
+    len = MIN(len, MIN(mds_port_mtu_get(param->read.conn_id) - 1, ESP_GATT_MAX_ATTR_LEN));
+
+    esp_gatt_rsp_t *rsp = example_rsp_alloc();
+    if (rsp == NULL) {
+        esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id,
+                                    ESP_GATT_NO_RESOURCES, NULL);
+        return;
+    }
+    rsp->attr_value.handle = handle;
+    rsp->attr_value.offset = param->read.offset;
+    rsp->attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
+    rsp->attr_value.len = len;
+    if (len) {
+        memcpy(rsp->attr_value.value, value, len);
+    }
+    esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id, status, rsp);
+    example_rsp_free(rsp);
+}
+
+static void mds_handle_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param, uint8_t attr_idx)
+{
+    esp_gatt_status_t status;
+
+    if (param->write.is_prep || param->write.offset != 0) {
+        status = ESP_GATT_NOT_LONG;
+    } else if (attr_idx == MDS_IDX_CHAR_CFG_DATA_EXPORT) {
+        if (param->write.len != sizeof(uint16_t)) {
+            status = ESP_GATT_INVALID_ATTR_LEN;
+        } else {
+            const uint16_t value = param->write.value[1] << 8 | param->write.value[0];
+            ble_conn_t *conn = ble_conn_get(param->write.conn_id);
+
+            status = mds_cccd_write(param->write.conn_id, value);
+            if (status == ESP_GATT_OK && conn) {
+                conn->cccd[BLE_CONN_CCCD_MDS] = value;
+            }
+        }
+    } else if (attr_idx == MDS_IDX_CHAR_VAL_DATA_EXPORT) {
+        status = mds_data_export_write(param->write.conn_id, param->write.value, param->write.len);
+    } else {
+        status = ESP_GATT_WRITE_NOT_PERMIT;
+    }
+
+    if (param->write.need_rsp) {
+        esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, NULL);
+    }
+}
+
+static void mds_gatts_attr_cb(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
+                              esp_ble_gatts_cb_param_t *param, uint8_t attr_idx)
+{
+    switch (event) {
+    case ESP_GATTS_READ_EVT:
+        mds_handle_read(gatts_if, param, attr_idx);
+        break;
+    case ESP_GATTS_WRITE_EVT:
+        mds_handle_write(gatts_if, param, attr_idx);
+        break;
+    case ESP_GATTS_CONF_EVT:
+        if (attr_idx == MDS_IDX_CHAR_VAL_DATA_EXPORT) {
+            // The notification was queued despite the congestion, only a real failure resends
+            const esp_gatt_status_t status = param->conf.status == ESP_GATT_CONGESTED ? ESP_GATT_OK :
+                                             param->conf.status;
+            mds_on_tx_done(param->conf.conn_id, status);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void mds_gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+    switch (event) {
+    case ESP_GATTS_REG_EVT:
+        s_gatts_if = gatts_if;
+        gatts_table_create(gatts_if, &mds_svc);
+        break;
+    case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+    case ESP_GATTS_START_EVT:
+        gatts_table_handle_event(&mds_svc, event, param);
+        break;
+    case ESP_GATTS_EXEC_WRITE_EVT:
+        // MDS has no long-writable attributes, prepared writes were already rejected
+        esp_ble_gatts_send_response(gatts_if, param->exec_write.conn_id, param->exec_write.trans_id, ESP_GATT_OK, NULL);
+        break;
+    case ESP_GATTS_MTU_EVT:
+        // The MTU, like the other link state, is cached in the ble_conn.c context
+        mds_on_mtu_changed(param->mtu.conn_id);
+        break;
+    case ESP_GATTS_DISCONNECT_EVT:
+        mds_on_disconnect(param->disconnect.conn_id);
+        break;
+    case ESP_GATTS_CONGEST_EVT:
+        mds_on_congest(param->congest.conn_id, param->congest.congested);
+        break;
+    default:
+        break;
+    }
+}
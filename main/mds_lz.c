@@ -0,0 +1,132 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* LZSS compressor for MDS chunk streams, see mds_lz.h for the stream format.
+*
+* Greedy single-probe matcher: one hash head per 3-byte prefix, no chains, so the cost per
+* input byte is constant and RAM stays at the window plus a 512 entry table. Coredumps and
+* logs are dominated by zero runs and repeated strings, which this catches well enough.
+*
+****************************************************************************/
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "mds_lz.h"
+
+static inline uint32_t mds_lz_hash(const uint8_t *p)
+{
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - MDS_LZ_HASH_BITS);
+}
+
+static size_t mds_lz_group_emit(mds_lz_t *lz, uint8_t *out)
+{
+    size_t len = lz->group_len;
+
+    memcpy(out, lz->group, len);
+    lz->group[0] = 0;
+    lz->group_len = 1;
+    lz->group_items = 0;
+    return len;
+}
+
+static size_t mds_lz_item_add(mds_lz_t *lz, const uint8_t *item, size_t item_len, bool match, uint8_t *out)
+{
+    if (match) {
+        lz->group[0] |= 1 << lz->group_items;
+    }
+    memcpy(&lz->group[lz->group_len], item, item_len);
+    lz->group_len += item_len;
+
+    if (++lz->group_items == 8) {
+        return mds_lz_group_emit(lz, out);
+    }
+    return 0;
+}
+
+void mds_lz_init(mds_lz_t *lz)
+{
+    lz->hist_len = 0;
+    memset(lz->head, 0xff, sizeof(lz->head));
+    lz->group[0] = 0;
+    lz->group_len = 1;
+    lz->group_items = 0;
+}
+
+size_t mds_lz_compress(mds_lz_t *lz, const uint8_t *in, size_t len, uint8_t *out)
+{
+    const size_t end = lz->hist_len + len;
+    size_t pos = lz->hist_len;
+    size_t written = 0;
+
+    memcpy(&lz->buf[lz->hist_len], in, len);
+
+    while (pos < end) {
+        size_t best_len = 0;
+        size_t dist = 0;
+
+        if (end - pos >= MDS_LZ_MIN_MATCH) {
+            const uint32_t h = mds_lz_hash(&lz->buf[pos]);
+            const int cand = lz->head[h];
+
+            lz->head[h] = pos;
+            if (cand >= 0 && pos - cand <= MDS_LZ_WINDOW_SIZE) {
+                const size_t max = end - pos < MDS_LZ_MAX_MATCH ? end - pos : MDS_LZ_MAX_MATCH;
+
+                while (best_len < max && lz->buf[cand + best_len] == lz->buf[pos + best_len]) {
+                    best_len++;
+                }
+                dist = pos - cand;
+            }
+        }
+
+        if (best_len >= MDS_LZ_MIN_MATCH) {
+            const uint16_t word = (dist - 1) | ((best_len - MDS_LZ_MIN_MATCH) << 10);
+            const uint8_t item[2] = { word & 0xff, word >> 8 };
+
+            written += mds_lz_item_add(lz, item, sizeof(item), true, &out[written]);
+            for (size_t i = 1; i < best_len; i++) {
+                if (end - (pos + i) >= MDS_LZ_MIN_MATCH) {
+                    lz->head[mds_lz_hash(&lz->buf[pos + i])] = pos + i;
+                }
+            }
+            pos += best_len;
+        } else {
+            written += mds_lz_item_add(lz, &lz->buf[pos], 1, false, &out[written]);
+            pos++;
+        }
+    }
+
+    // Slide the window so the next block lands right behind the last MDS_LZ_WINDOW_SIZE bytes
+    const size_t keep = end < MDS_LZ_WINDOW_SIZE ? end : MDS_LZ_WINDOW_SIZE;
+    const size_t shift = end - keep;
+    if (shift) {
+        memmove(lz->buf, &lz->buf[shift], keep);
+        for (size_t i = 0; i < sizeof(lz->head) / sizeof(lz->head[0]); i++) {
+            lz->head[i] = lz->head[i] >= (int)shift ? lz->head[i] - (int)shift : -1;
+        }
+    }
+    lz->hist_len = keep;
+
+    return written;
+}
+
+size_t mds_lz_flush(mds_lz_t *lz, uint8_t *out)
+{
+    if (lz->group_items == 0) {
+        return 0;
+    }
+    return mds_lz_group_emit(lz, out);
+}
+
+const uint8_t *mds_lz_input_get(const mds_lz_t *lz, size_t *len)
+{
+    *len = lz->hist_len;
+    return lz->buf;
+}
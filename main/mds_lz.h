@@ -0,0 +1,58 @@
+#ifndef MDS_LZ_H
+#define MDS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming LZSS compressor with bounded RAM (about 2.3 KiB per instance) for MDS chunks.
+//
+// Stream format, decodable with a few lines on the gateway: a sequence of groups, each a
+// flag byte followed by up to 8 items. Bit i of the flag byte (LSB first) describes item i:
+//   0: literal, 1 byte copied to the output
+//   1: match, 2 bytes little endian, bits 0-9 = distance - 1, bits 10-15 = length - 3.
+//      Copy length bytes byte by byte starting distance bytes back in the output (the
+//      source may overlap the bytes being written).
+// Only the last group of a stream may hold fewer than 8 items, decoding stops at the end
+// of the input.
+
+#define MDS_LZ_WINDOW_SIZE 1024
+#define MDS_LZ_MIN_MATCH   3
+#define MDS_LZ_MAX_MATCH   (MDS_LZ_MIN_MATCH + 63)
+#define MDS_LZ_HASH_BITS   9
+
+// Largest input accepted by one mds_lz_compress call
+#define MDS_LZ_BLOCK_SIZE 256
+
+// Output space mds_lz_compress needs for len input bytes, including a group held back from
+// an earlier call. mds_lz_flush writes at most MDS_LZ_GROUP_MAX_SIZE bytes.
+#define MDS_LZ_GROUP_MAX_SIZE (1 + 8 * 2)
+#define MDS_LZ_OUT_MAX(len) ((len) + (len) / 8 + 2 * MDS_LZ_GROUP_MAX_SIZE)
+
+typedef struct {
+    // History window followed by the block being compressed
+    uint8_t buf[MDS_LZ_WINDOW_SIZE + MDS_LZ_BLOCK_SIZE];
+    uint16_t hist_len;
+    // Most recent position in buf of each 3-byte hash, -1 when unused
+    int16_t head[1 << MDS_LZ_HASH_BITS];
+
+    // Current group, only complete groups are written to the output before mds_lz_flush
+    uint8_t group[MDS_LZ_GROUP_MAX_SIZE];
+    uint8_t group_len;
+    uint8_t group_items;
+} mds_lz_t;
+
+// Start a new stream, every stream decodes on its own
+void mds_lz_init(mds_lz_t *lz);
+
+// Compress len (at most MDS_LZ_BLOCK_SIZE) bytes, matches may refer to earlier calls of the
+// same stream. Returns the number of bytes written to out.
+size_t mds_lz_compress(mds_lz_t *lz, const uint8_t *in, size_t len, uint8_t *out);
+
+// End the stream, writes the last partial group. Returns the number of bytes written to out.
+size_t mds_lz_flush(mds_lz_t *lz, uint8_t *out);
+
+// Input of the current stream, all of it as long as that is at most MDS_LZ_WINDOW_SIZE bytes.
+// Valid until the next mds_lz_init or mds_lz_compress.
+const uint8_t *mds_lz_input_get(const mds_lz_t *lz, size_t *len);
+
+#endif // MDS_LZ_H
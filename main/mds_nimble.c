@@ -0,0 +1,298 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* NimBLE port of the Memfault Diagnostic Service.
+*
+* The service is a static ble_gatt_svc_def table. NimBLE manages the CCCD itself, so
+* subscriptions arrive as BLE_GAP_EVENT_SUBSCRIBE and a second subscriber can only be
+* ignored rather than rejected.
+*
+* For a notification, BLE_GAP_EVENT_NOTIFY_TX means queued rather than completed: NimBLE
+* raises it from inside ble_gatts_notify_custom, for failures too. The core's in-flight
+* window therefore never exceeds one here, what bounds the data queued in the host is the
+* msys pool. NimBLE has no congestion event, running out of mbufs is reported as congestion
+* instead. Nothing signals the controller handing blocks back, so a retry timer polls the
+* msys pool every MDS_NIMBLE_CONGEST_RETRY_MS and clears congestion as soon as blocks are
+* free again.
+*
+* MTU, connection interval and data length are read from the per-connection contexts
+* gatts_demo_nimble.c keeps in ble_conn.c instead of asking the host on every chunk.
+*
+* TX buffers are ATT packet mbufs, the core writes the chunk right behind the space NimBLE
+* reserves for its headers and the mbuf is passed to ble_gatts_notify_custom as is. When
+* the chunk does not fit the first msys block (CONFIG_BT_NIMBLE_MSYS_1_BLOCK_SIZE), it is
+* assembled in a bounce buffer and appended instead.
+*
+****************************************************************************/
+
+#include <stdint.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "host/ble_hs.h"
+#include "host/ble_uuid.h"
+
+#include "ble_conn.h"
+#include "mds.h"
+
+// How often a congested link checks the msys pool for free blocks again
+#define MDS_NIMBLE_CONGEST_RETRY_MS 10
+
+static uint16_t s_data_export_val_handle;
+
+// Polls the msys pool while the link of s_congest_conn_handle is congested
+static esp_timer_handle_t s_congest_timer;
+static uint16_t s_congest_conn_handle;
+
+// Fallback for chunks larger than one msys block, only the MDS pump task sends notifications
+static uint8_t s_tx_bounce_buf[MDS_MAX_READ_LEN];
+
+static const ble_uuid128_t mds_svc_uuid                = BLE_UUID128_INIT(MDS_UUID128_BYTES(0x0000));
+static const ble_uuid128_t mds_supported_features_uuid = BLE_UUID128_INIT(MDS_UUID128_BYTES(0x0001));
+static const ble_uuid128_t mds_device_identifier_uuid  = BLE_UUID128_INIT(MDS_UUID128_BYTES(0x0002));
+static const ble_uuid128_t mds_data_uri_uuid           = BLE_UUID128_INIT(MDS_UUID128_BYTES(0x0003));
+static const ble_uuid128_t mds_authorization_uuid      = BLE_UUID128_INIT(MDS_UUID128_BYTES(0x0004));
+static const ble_uuid128_t mds_data_export_uuid        = BLE_UUID128_INIT(MDS_UUID128_BYTES(0x0005));
+
+static int mds_nimble_read_access(uint16_t conn_handle, uint16_t attr_handle,
+                                  struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    const uint8_t *value;
+    uint16_t len;
+
+    if (ctxt->op != BLE_GATT_ACCESS_OP_READ_CHR) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    // NimBLE applies the Read Blob offset itself, always hand it the whole value
+    uint8_t status = mds_value_get(conn_handle, (mds_read_char_t)(intptr_t)arg, 0, &value, &len);
+    if (status != MDS_ATT_ERR_NONE) {
+        return status;
+    }
+
+    return os_mbuf_append(ctxt->om, value, len) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int mds_nimble_data_export_access(uint16_t conn_handle, uint16_t attr_handle,
+                                         struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t value[sizeof(uint16_t)];
+    uint16_t len;
+
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    if (ble_hs_mbuf_to_flat(ctxt->om, value, sizeof(value), &len) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    return mds_data_export_write(conn_handle, value, len);
+}
+
+static const struct ble_gatt_svc_def mds_gatt_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = &mds_svc_uuid.u,
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = &mds_supported_features_uuid.u,
+                .access_cb = mds_nimble_read_access,
+                .arg = (void *)MDS_CHAR_SUPPORTED_FEATURES,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                .uuid = &mds_device_identifier_uuid.u,
+                .access_cb = mds_nimble_read_access,
+                .arg = (void *)MDS_CHAR_DEVICE_IDENTIFIER,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                .uuid = &mds_data_uri_uuid.u,
+                .access_cb = mds_nimble_read_access,
+                .arg = (void *)MDS_CHAR_DATA_URI,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                .uuid = &mds_authorization_uuid.u,
+                .access_cb = mds_nimble_read_access,
+                .arg = (void *)MDS_CHAR_AUTHORIZATION,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                .uuid = &mds_data_export_uuid.u,
+                .access_cb = mds_nimble_data_export_access,
+                .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &s_data_export_val_handle,
+            }, {
+                0, /* No more characteristics in this service */
+            }
+        },
+    },
+    {
+        0, /* No more services */
+    },
+};
+
+static void mds_nimble_congest_set(uint16_t conn_handle, bool congested)
+{
+    ble_conn_t *conn = ble_conn_get(conn_handle);
+
+    if (conn) {
+        conn->congested = congested;
+    }
+    mds_on_congest(conn_handle, congested);
+
+    if (congested && s_congest_timer && !esp_timer_is_active(s_congest_timer)) {
+        s_congest_conn_handle = conn_handle;
+        esp_timer_start_once(s_congest_timer, MDS_NIMBLE_CONGEST_RETRY_MS * 1000);
+    }
+}
+
+static void mds_nimble_congest_retry(void *arg)
+{
+    // Still no block to send with, look again later
+    if (os_msys_num_free() == 0) {
+        esp_timer_start_once(s_congest_timer, MDS_NIMBLE_CONGEST_RETRY_MS * 1000);
+        return;
+    }
+    // Wakes the pump, which sets congestion again if its send still fails
+    mds_nimble_congest_set(s_congest_conn_handle, false);
+}
+
+esp_err_t mds_port_tx_buf_get(uint16_t conn_id, uint16_t len, mds_tx_buf_t *buf)
+{
+    if (len > sizeof(s_tx_bounce_buf)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    struct os_mbuf *om = ble_hs_mbuf_att_pkt();
+    if (om == NULL) {
+        // Out of msys blocks, NimBLE's equivalent of a congested link
+        mds_nimble_congest_set(conn_id, true);
+        return ESP_ERR_NO_MEM;
+    }
+
+    buf->data = os_mbuf_extend(om, len);
+    if (buf->data == NULL) {
+        buf->data = s_tx_bounce_buf;
+    }
+    buf->priv = om;
+    return ESP_OK;
+}
+
+esp_err_t mds_port_tx_buf_send(uint16_t conn_id, mds_tx_buf_t *buf, uint16_t len)
+{
+    struct os_mbuf *om = buf->priv;
+
+    if (buf->data == s_tx_bounce_buf) {
+        if (os_mbuf_append(om, s_tx_bounce_buf, len) != 0) {
+            mds_port_tx_buf_release(buf);
+            mds_nimble_congest_set(conn_id, true);
+            return ESP_ERR_NO_MEM;
+        }
+        mds_on_tx_copy(len);
+    } else {
+        // Trim the part of the reserved length the chunk did not use
+        os_mbuf_adj(om, len - OS_MBUF_PKTLEN(om));
+    }
+    buf->priv = NULL;
+
+    // Consumes om, also on failure
+    int rc = ble_gatts_notify_custom(conn_id, s_data_export_val_handle, om);
+    if (rc == BLE_HS_ENOMEM) {
+        mds_nimble_congest_set(conn_id, true);
+        return ESP_ERR_NO_MEM;
+    }
+    return rc == 0 ? ESP_OK : ESP_FAIL;
+}
+
+void mds_port_tx_buf_release(mds_tx_buf_t *buf)
+{
+    if (buf->priv) {
+        os_mbuf_free_chain(buf->priv);
+        buf->priv = NULL;
+    }
+    buf->data = NULL;
+}
+
+uint16_t mds_port_mtu_get(uint16_t conn_id)
+{
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    return conn ? conn->mtu : BLE_ATT_MTU_DFLT;
+}
+
+uint16_t mds_port_tx_sendable(uint16_t conn_id)
+{
+    // NimBLE keeps the controller buffer count to itself, let the Kconfig cap decide
+    return UINT16_MAX;
+}
+
+uint16_t mds_port_conn_interval_get(uint16_t conn_id)
+{
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    return conn ? conn->conn_interval : 0;
+}
+
+uint16_t mds_port_tx_octets_get(uint16_t conn_id)
+{
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    return conn ? conn->tx_octets : BLE_CONN_DEFAULT_TX_OCTETS;
+}
+
+int mds_nimble_gatt_svr_init(void)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback = mds_nimble_congest_retry,
+        .name = "mds_congest",
+    };
+    if (esp_timer_create(&timer_args, &s_congest_timer) != ESP_OK) {
+        ESP_LOGE(MDS_TAG, "Congestion retry timer create failed");
+        return BLE_HS_ENOMEM;
+    }
+
+    int rc = ble_gatts_count_cfg(mds_gatt_svcs);
+    if (rc != 0) {
+        return rc;
+    }
+
+    return ble_gatts_add_svcs(mds_gatt_svcs);
+}
+
+void mds_nimble_gap_event(struct ble_gap_event *event)
+{
+    switch (event->type) {
+    case BLE_GAP_EVENT_SUBSCRIBE:
+        if (event->subscribe.attr_handle == s_data_export_val_handle) {
+            const uint16_t value = event->subscribe.cur_notify ? 0x0001 : 0x0000;
+            ble_conn_t *conn = ble_conn_get(event->subscribe.conn_handle);
+
+            uint8_t status = mds_cccd_write(event->subscribe.conn_handle, value);
+            if (status != MDS_ATT_ERR_NONE) {
+                ESP_LOGW(MDS_TAG, "Subscription from conn_handle %d ignored, status 0x%02x",
+                         event->subscribe.conn_handle, status);
+            } else if (conn) {
+                conn->cccd[BLE_CONN_CCCD_MDS] = value;
+            }
+        }
+        break;
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        // Raised inside the send, a failed one also returns an error there
+        if (event->notify_tx.attr_handle == s_data_export_val_handle && !event->notify_tx.indication) {
+            mds_on_tx_done(event->notify_tx.conn_handle, event->notify_tx.status);
+        }
+        break;
+    case BLE_GAP_EVENT_MTU:
+        mds_on_mtu_changed(event->mtu.conn_handle);
+        break;
+    case BLE_GAP_EVENT_DISCONNECT:
+        if (event->disconnect.conn.conn_handle == s_congest_conn_handle) {
+            esp_timer_stop(s_congest_timer);
+        }
+        mds_on_disconnect(event->disconnect.conn.conn_handle);
+        break;
+    default:
+        break;
+    }
+}
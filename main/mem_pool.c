@@ -0,0 +1,77 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Fixed-size block pool. The free blocks are a bitmask, taking one is a count-trailing-zeros
+* and returning one sets its bit back, both under a spinlock held for a few instructions.
+*
+****************************************************************************/
+
+#include "esp_log.h"
+
+#include "mem_pool.h"
+
+#define MEM_POOL_TAG "MEM_POOL"
+
+void *mem_pool_alloc(mem_pool_t *pool)
+{
+    void *block = NULL;
+
+    portENTER_CRITICAL(&pool->lock);
+    if (pool->free_mask) {
+        const unsigned idx = __builtin_ctz(pool->free_mask);
+
+        pool->free_mask &= ~(1U << idx);
+        block = pool->blocks + idx * pool->block_size;
+        pool->allocs++;
+        if (++pool->in_use > pool->high_water) {
+            pool->high_water = pool->in_use;
+        }
+    } else {
+        pool->failures++;
+    }
+    portEXIT_CRITICAL(&pool->lock);
+
+    return block;
+}
+
+void mem_pool_free(mem_pool_t *pool, void *block)
+{
+    if (block == NULL) {
+        return;
+    }
+
+    const size_t offset = (uint8_t *)block - pool->blocks;
+    const unsigned idx = offset / pool->block_size;
+    if ((uint8_t *)block < pool->blocks || idx >= pool->count || offset % pool->block_size) {
+        ESP_LOGE(MEM_POOL_TAG, "%p is not a block of pool %p", block, pool);
+        return;
+    }
+
+    portENTER_CRITICAL(&pool->lock);
+    if (pool->free_mask & (1U << idx)) {
+        portEXIT_CRITICAL(&pool->lock);
+        ESP_LOGE(MEM_POOL_TAG, "Block %u of pool %p freed twice", idx, pool);
+        return;
+    }
+    pool->free_mask |= 1U << idx;
+    pool->in_use--;
+    portEXIT_CRITICAL(&pool->lock);
+}
+
+void mem_pool_stats_get(mem_pool_t *pool, mem_pool_stats_t *stats)
+{
+    portENTER_CRITICAL(&pool->lock);
+    stats->count = pool->count;
+    stats->in_use = pool->in_use;
+    stats->high_water = pool->high_water;
+    stats->allocs = pool->allocs;
+    stats->failures = pool->failures;
+    pool->allocs = 0;
+    pool->failures = 0;
+    portEXIT_CRITICAL(&pool->lock);
+}
@@ -0,0 +1,57 @@
+#ifndef MEM_POOL_H
+#define MEM_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+// Fixed-size block pool over static storage, for buffers the data path would otherwise
+// malloc and free per event. Allocation is O(1) and never touches the heap, so long-running
+// links cannot fragment it.
+#define MEM_POOL_MAX_BLOCKS 32
+#define MEM_POOL_ALIGN      8
+#define MEM_POOL_BLOCK_SIZE(size) (((size) + MEM_POOL_ALIGN - 1) & ~(size_t)(MEM_POOL_ALIGN - 1))
+
+typedef struct {
+    uint8_t *blocks;
+    size_t block_size;
+    uint16_t count;
+    uint32_t free_mask;     // Bit n set while block n is free
+    portMUX_TYPE lock;
+
+    uint16_t in_use;
+    uint16_t high_water;
+    uint32_t allocs;
+    uint32_t failures;
+} mem_pool_t;
+
+typedef struct {
+    uint16_t count;
+    uint16_t in_use;
+    uint16_t high_water;    // Since boot, to size the pool
+    // Since the last call
+    uint32_t allocs;
+    uint32_t failures;      // Allocations refused because every block was taken
+} mem_pool_stats_t;
+
+// Define a static pool `name` of n blocks of at least size bytes
+#define MEM_POOL_DEFINE(name, size, n)                                                      \
+    _Static_assert((n) > 0 && (n) <= MEM_POOL_MAX_BLOCKS, #name " block count");            \
+    static uint8_t name##_storage[(n) * MEM_POOL_BLOCK_SIZE(size)]                          \
+        __attribute__((aligned(MEM_POOL_ALIGN)));                                           \
+    static mem_pool_t name = {                                                              \
+        .blocks = name##_storage,                                                           \
+        .block_size = MEM_POOL_BLOCK_SIZE(size),                                            \
+        .count = (n),                                                                       \
+        .free_mask = UINT32_MAX >> (MEM_POOL_MAX_BLOCKS - (n)),                             \
+        .lock = portMUX_INITIALIZER_UNLOCKED,                                               \
+    }
+
+// Take a block, NULL when the pool is exhausted. Callable from any task.
+void *mem_pool_alloc(mem_pool_t *pool);
+// Return a block taken from pool, NULL is ignored
+void mem_pool_free(mem_pool_t *pool, void *block);
+void mem_pool_stats_get(mem_pool_t *pool, mem_pool_stats_t *stats);
+
+#endif // MEM_POOL_H
@@ -0,0 +1,125 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Notification coalescing window, see notify_coalesce.h. The first update of a window arms a
+* one-shot esp_timer, updates until it fires only touch the batch buffer under a spinlock.
+* The timer callback swaps the batch out, hands it to the value cache and flushes, so a
+* producer at any rate costs the stack one notification per subscriber and window.
+*
+****************************************************************************/
+
+#include <string.h>
+#include "esp_log.h"
+
+#include "notify_coalesce.h"
+
+#define NOTIFY_COALESCE_TAG "NOTIFY_COALESCE"
+
+static uint64_t notify_coalesce_window_us(notify_coalesce_t *co)
+{
+    if (co->window_ms) {
+        return co->window_ms * 1000ULL;
+    }
+
+    const uint64_t interval_us = value_cache_conn_interval_max(co->cache) * 1250ULL;
+    return interval_us > NOTIFY_COALESCE_WINDOW_MIN_US ? interval_us : NOTIFY_COALESCE_WINDOW_MIN_US;
+}
+
+static void notify_coalesce_window_end(void *arg)
+{
+    notify_coalesce_t *co = arg;
+
+    portENTER_CRITICAL(&co->lock);
+    const uint16_t len = co->batch_len;
+    const int64_t batch_us = co->batch_us;
+    memcpy(co->out, co->batch, len);
+    co->batch_len = 0;
+    co->armed = false;
+    portEXIT_CRITICAL(&co->lock);
+
+    value_cache_set(co->cache, co->out, len);
+    const int sent = value_cache_flush(co->cache, co->send, co->send_ctx);
+    const uint32_t latency_us = esp_timer_get_time() - batch_us;
+
+    portENTER_CRITICAL(&co->lock);
+    co->stats.windows++;
+    co->stats.notifications += sent;
+    co->stats.latency_us += latency_us;
+    if (latency_us > co->stats.latency_max_us) {
+        co->stats.latency_max_us = latency_us;
+    }
+    portEXIT_CRITICAL(&co->lock);
+}
+
+esp_err_t notify_coalesce_init(notify_coalesce_t *co, value_cache_t *cache, notify_coalesce_mode_t mode,
+                               uint32_t window_ms, value_cache_send_t send, void *send_ctx)
+{
+    co->cache = cache;
+    co->mode = mode;
+    co->window_ms = window_ms;
+    co->send = send;
+    co->send_ctx = send_ctx;
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = notify_coalesce_window_end,
+        .arg = co,
+        .name = cache->name,
+    };
+    esp_err_t ret = esp_timer_create(&timer_args, &co->timer);
+    if (ret != ESP_OK) {
+        ESP_LOGE(NOTIFY_COALESCE_TAG, "%s: window timer create failed: %s", cache->name, esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+esp_err_t notify_coalesce_submit(notify_coalesce_t *co, const void *update, uint16_t len)
+{
+    // Taken before the lock, the cache has a lock of its own
+    const uint16_t limit = co->mode == NOTIFY_COALESCE_APPEND ? value_cache_payload_max(co->cache)
+                                                              : co->cache->max_len;
+    esp_err_t ret = ESP_OK;
+    bool superseded = false;
+    bool arm = false;
+
+    portENTER_CRITICAL(&co->lock);
+    if (co->mode == NOTIFY_COALESCE_LATEST && len <= limit) {
+        superseded = co->batch_len != 0;
+        memcpy(co->batch, update, len);
+        co->batch_len = len;
+        co->batch_us = esp_timer_get_time();
+    } else if (co->mode == NOTIFY_COALESCE_APPEND && co->batch_len + len <= limit) {
+        if (co->batch_len == 0) {
+            co->batch_us = esp_timer_get_time();
+        }
+        memcpy(&co->batch[co->batch_len], update, len);
+        co->batch_len += len;
+    } else {
+        ret = ESP_ERR_INVALID_SIZE;
+    }
+    if (co->batch_len && !co->armed) {
+        co->armed = true;
+        arm = true;
+    }
+    co->stats.updates++;
+    co->stats.superseded += superseded;
+    co->stats.dropped += ret != ESP_OK;
+    portEXIT_CRITICAL(&co->lock);
+
+    if (arm) {
+        esp_timer_start_once(co->timer, notify_coalesce_window_us(co));
+    }
+    return ret;
+}
+
+void notify_coalesce_stats_get(notify_coalesce_t *co, notify_coalesce_stats_t *stats)
+{
+    portENTER_CRITICAL(&co->lock);
+    *stats = co->stats;
+    memset(&co->stats, 0, sizeof(co->stats));
+    portEXIT_CRITICAL(&co->lock);
+}
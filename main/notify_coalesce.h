@@ -0,0 +1,77 @@
+#ifndef NOTIFY_COALESCE_H
+#define NOTIFY_COALESCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+
+#include "value_cache.h"
+
+// Coalescing window in front of a value cache, for values updated faster than a link can
+// notify them. Updates are collected for one window and the window's result becomes the
+// cached value, so each subscriber gets at most one notification per window carrying the
+// newest data. With the default window of one connection interval (of the slowest
+// subscriber) that is at most one notification per connection event.
+typedef enum {
+    NOTIFY_COALESCE_LATEST,     // The newest update of the window wins, older ones are superseded
+    NOTIFY_COALESCE_APPEND,     // Updates are concatenated as long as every subscriber's ATT_MTU
+                                // takes them, the ones that no longer fit are dropped
+} notify_coalesce_mode_t;
+
+// Window used while no subscriber has reported a connection interval, 7.5 ms is the shortest
+// interval there is
+#define NOTIFY_COALESCE_WINDOW_MIN_US 7500
+
+// Counters since the previous notify_coalesce_stats_get()
+typedef struct {
+    uint32_t updates;
+    uint32_t superseded;        // Replaced by a newer update of the same window
+    uint32_t dropped;           // Refused in append mode
+    uint32_t windows;
+    uint32_t notifications;     // Sent at the end of the windows
+    uint32_t latency_us;        // From the oldest update a window delivers to its flush, summed
+    uint32_t latency_max_us;
+} notify_coalesce_stats_t;
+
+typedef struct {
+    value_cache_t *cache;
+    value_cache_send_t send;
+    void *send_ctx;
+    notify_coalesce_mode_t mode;
+    uint32_t window_ms;         // 0 follows the subscribers' connection interval
+    esp_timer_handle_t timer;
+
+    uint8_t *batch;             // cache->max_len, the window being collected
+    uint8_t *out;               // cache->max_len, the window being delivered
+    uint16_t batch_len;
+    int64_t batch_us;           // Arrival of the oldest update the batch delivers
+    bool armed;
+    portMUX_TYPE lock;
+    notify_coalesce_stats_t stats;  // Under the lock
+} notify_coalesce_t;
+
+// Define a static coalescer `var` for a cache of values of up to max_len bytes
+#define NOTIFY_COALESCE_DEFINE(var, max_len_)                                           \
+    static uint8_t var##_batch[(max_len_)];                                             \
+    static uint8_t var##_out[(max_len_)];                                               \
+    static notify_coalesce_t var = {                                                    \
+        .batch = var##_batch,                                                           \
+        .out = var##_out,                                                               \
+        .lock = portMUX_INITIALIZER_UNLOCKED,                                           \
+    }
+
+// Attach co to cache and create its window timer. At the end of each window the batch is
+// stored with value_cache_set() and flushed through send, from the esp_timer task.
+esp_err_t notify_coalesce_init(notify_coalesce_t *co, value_cache_t *cache, notify_coalesce_mode_t mode,
+                               uint32_t window_ms, value_cache_send_t send, void *send_ctx);
+// Add one update to the current window, opening one if none is. Callable from any task.
+// Returns ESP_ERR_INVALID_SIZE for an update dropped in append mode.
+esp_err_t notify_coalesce_submit(notify_coalesce_t *co, const void *update, uint16_t len);
+
+// Fills stats, the counters restart with every call
+void notify_coalesce_stats_get(notify_coalesce_t *co, notify_coalesce_stats_t *stats);
+
+#endif // NOTIFY_COALESCE_H
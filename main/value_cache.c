@@ -0,0 +1,350 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Versioned characteristic value cache, see value_cache.h. Stack-neutral, the host stack
+* backend supplies the send callback and reports confirmations. A subscriber slot is taken
+* per connection in the cache itself, so caches can be added without growing ble_conn_t.
+*
+* The spinlock covers the value, the version, the subscribers and the buffers in flight. A
+* flush builds each notification under it into a pool buffer, registers the buffer as in
+* flight with every recipient's bit set and sends after releasing the lock. Notifications on
+* one connection are confirmed in order, so a confirmation clears the connection's bit in the
+* oldest buffer that still has it.
+*
+****************************************************************************/
+
+#include <string.h>
+#include "esp_log.h"
+
+#include "value_cache.h"
+
+#define VALUE_CACHE_TAG "VALUE_CACHE"
+
+// Slot of conn_id among the subscribers, -1 if it is not subscribed. Called under the lock.
+static int value_cache_slot(value_cache_t *cache, uint16_t conn_id)
+{
+    for (uint32_t mask = cache->subscribed; mask; mask &= mask - 1) {
+        const int i = __builtin_ctz(mask);
+
+        if (cache->subs[i].conn_id == conn_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint16_t value_cache_conn_payload(uint16_t conn_id)
+{
+    const ble_conn_t *conn = ble_conn_get(conn_id);
+    return (conn ? conn->mtu : BLE_CONN_DEFAULT_MTU) - 3;
+}
+
+// Drops the references in mask from tx, unlinking it once none is left. Called under the
+// lock, returns true if the caller must free tx after releasing it.
+static bool value_cache_tx_put(value_cache_t *cache, value_cache_tx_t *tx, uint32_t mask)
+{
+    tx->pending &= ~mask;
+    if (tx->pending) {
+        return false;
+    }
+
+    for (int i = 0; i < cache->inflight_count; i++) {
+        if (cache->inflight[i] == tx) {
+            memmove(&cache->inflight[i], &cache->inflight[i + 1],
+                    (cache->inflight_count - i - 1) * sizeof(cache->inflight[0]));
+            cache->inflight_count--;
+            break;
+        }
+    }
+    return true;
+}
+
+bool value_cache_set(value_cache_t *cache, const void *value, uint16_t len)
+{
+    if (len > cache->max_len) {
+        ESP_LOGW(VALUE_CACHE_TAG, "%s: value of %u bytes refused, max %u", cache->name, len, cache->max_len);
+        return false;
+    }
+
+    portENTER_CRITICAL(&cache->lock);
+    const bool changed = len != cache->len || memcmp(cache->value, value, len) != 0;
+    if (changed) {
+        memcpy(cache->value, value, len);
+        cache->len = len;
+        cache->version++;
+    }
+    cache->stats.updates++;
+    cache->stats.unchanged += !changed;
+    portEXIT_CRITICAL(&cache->lock);
+
+    return changed;
+}
+
+esp_err_t value_cache_subscribe(value_cache_t *cache, uint16_t conn_id)
+{
+    esp_err_t ret = ESP_OK;
+
+    portENTER_CRITICAL(&cache->lock);
+    const uint32_t free_slots = ~cache->subscribed & (UINT32_MAX >> (32 - BLE_CONN_MAX));
+    if (value_cache_slot(cache, conn_id) >= 0) {
+        // Already subscribed
+    } else if (free_slots == 0) {
+        ret = ESP_ERR_NO_MEM;
+    } else {
+        const int i = __builtin_ctz(free_slots);
+        value_cache_sub_t *sub = &cache->subs[i];
+        const uint8_t epoch = sub->epoch + 1;
+
+        memset(sub, 0, sizeof(*sub));
+        sub->epoch = epoch;
+        sub->conn_id = conn_id;
+        sub->snapshot = cache->delta ? &cache->snapshots[i * cache->max_len] : NULL;
+        cache->subscribed |= 1U << i;
+    }
+    portEXIT_CRITICAL(&cache->lock);
+    return ret;
+}
+
+void value_cache_unsubscribe(value_cache_t *cache, uint16_t conn_id)
+{
+    value_cache_tx_t *released[VALUE_CACHE_TX_DEPTH * BLE_CONN_MAX];
+    int n_released = 0;
+
+    portENTER_CRITICAL(&cache->lock);
+    const int i = value_cache_slot(cache, conn_id);
+    if (i >= 0) {
+        cache->subscribed &= ~(1U << i);
+        // Its confirmations may never come, walk backwards as buffers unlink
+        for (int j = cache->inflight_count - 1; j >= 0; j--) {
+            value_cache_tx_t *tx = cache->inflight[j];
+
+            if ((tx->pending & (1U << i)) && value_cache_tx_put(cache, tx, 1U << i)) {
+                released[n_released++] = tx;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&cache->lock);
+
+    while (n_released) {
+        mem_pool_free(cache->tx_pool, released[--n_released]);
+    }
+}
+
+bool value_cache_confirm(value_cache_t *cache, uint16_t conn_id)
+{
+    value_cache_tx_t *released = NULL;
+
+    portENTER_CRITICAL(&cache->lock);
+    const int i = value_cache_slot(cache, conn_id);
+    for (int j = 0; i >= 0 && j < cache->inflight_count; j++) {
+        value_cache_tx_t *tx = cache->inflight[j];
+
+        if (tx->pending & (1U << i)) {
+            if (value_cache_tx_put(cache, tx, 1U << i)) {
+                released = tx;
+            }
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&cache->lock);
+
+    mem_pool_free(cache->tx_pool, released);
+    return released != NULL;
+}
+
+// Builds the delta notification for sub into pdu: the byte range that differs from the
+// snapshot, the whole value while the client holds none. Called under the lock.
+static uint16_t value_cache_delta_build(value_cache_t *cache, const value_cache_sub_t *sub, uint8_t *pdu)
+{
+    uint16_t lo = 0;
+    uint16_t hi = cache->len;
+
+    if (sub->synced) {
+        const uint16_t common = sub->len < cache->len ? sub->len : cache->len;
+
+        while (lo < common && sub->snapshot[lo] == cache->value[lo]) {
+            lo++;
+        }
+        if (cache->len <= sub->len) {
+            // Nothing grew, trim the unchanged tail
+            while (hi > lo && sub->snapshot[hi - 1] == cache->value[hi - 1]) {
+                hi--;
+            }
+        }
+    }
+
+    pdu[0] = lo & 0xff;
+    pdu[1] = lo >> 8;
+    pdu[2] = cache->len & 0xff;
+    pdu[3] = cache->len >> 8;
+    memcpy(&pdu[VALUE_CACHE_DELTA_HDR_LEN], &cache->value[lo], hi - lo);
+    return VALUE_CACHE_DELTA_HDR_LEN + hi - lo;
+}
+
+// Sends one buffer: the current value to every subscriber that is behind, or with delta the
+// range of the first one not in *tried. Returns the number sent, -1 when there is nobody
+// left to send to or no buffer.
+static int value_cache_flush_tx(value_cache_t *cache, uint32_t *tried, value_cache_send_t send, void *ctx)
+{
+    value_cache_tx_t *tx = mem_pool_alloc(cache->tx_pool);
+    if (tx == NULL) {
+        return -1;
+    }
+
+    uint16_t conn_ids[BLE_CONN_MAX];
+    uint8_t epochs[BLE_CONN_MAX];
+    uint32_t targets = 0;
+
+    portENTER_CRITICAL(&cache->lock);
+    for (uint32_t mask = cache->subscribed & ~*tried; mask; mask &= mask - 1) {
+        const int i = __builtin_ctz(mask);
+        const value_cache_sub_t *sub = &cache->subs[i];
+
+        if (!sub->synced || sub->version != cache->version) {
+            targets |= 1U << i;
+            conn_ids[i] = sub->conn_id;
+            epochs[i] = sub->epoch;
+            if (cache->delta) {
+                tx->len = value_cache_delta_build(cache, sub, tx->data);
+                break;
+            }
+        }
+    }
+    const uint32_t version = cache->version;
+    const uint16_t value_len = cache->len;
+    if (targets) {
+        if (cache->delta) {
+            memcpy(cache->sent, cache->value, value_len);
+        } else {
+            memcpy(tx->data, cache->value, value_len);
+            tx->len = value_len;
+        }
+        tx->pending = targets | VALUE_CACHE_TX_FLUSHING;
+        cache->inflight[cache->inflight_count++] = tx;
+        cache->stats.tx_bufs++;
+    }
+    portEXIT_CRITICAL(&cache->lock);
+
+    if (targets == 0) {
+        mem_pool_free(cache->tx_pool, tx);
+        return -1;
+    }
+    *tried |= targets;
+
+    uint32_t failed = 0;
+    int sent = 0;
+    for (uint32_t mask = targets; mask; mask &= mask - 1) {
+        const int i = __builtin_ctz(mask);
+
+        if (tx->len > value_cache_conn_payload(conn_ids[i]) || send(conn_ids[i], tx->data, tx->len, ctx) != ESP_OK) {
+            failed |= 1U << i;
+        } else {
+            sent++;
+        }
+    }
+
+    portENTER_CRITICAL(&cache->lock);
+    cache->stats.notifications += sent;
+    cache->stats.bytes += sent * tx->len;
+    cache->stats.full_bytes += sent * value_len;
+    for (uint32_t mask = targets & ~failed & cache->subscribed; mask; mask &= mask - 1) {
+        const int i = __builtin_ctz(mask);
+        value_cache_sub_t *sub = &cache->subs[i];
+
+        if (sub->epoch == epochs[i]) {
+            sub->synced = true;
+            sub->version = version;
+            if (cache->delta) {
+                memcpy(sub->snapshot, cache->sent, value_len);
+                sub->len = value_len;
+            }
+        }
+    }
+    const bool release = value_cache_tx_put(cache, tx, failed | VALUE_CACHE_TX_FLUSHING);
+    portEXIT_CRITICAL(&cache->lock);
+
+    if (release) {
+        mem_pool_free(cache->tx_pool, tx);
+    }
+    return sent;
+}
+
+int value_cache_flush(value_cache_t *cache, value_cache_send_t send, void *ctx)
+{
+    int sent = 0;
+
+    portENTER_CRITICAL(&cache->lock);
+    if (cache->flushing) {
+        cache->flush_again = true;
+        portEXIT_CRITICAL(&cache->lock);
+        return 0;
+    }
+    cache->flushing = true;
+    portEXIT_CRITICAL(&cache->lock);
+
+    for (;;) {
+        // One buffer for everybody, or one per subscriber with delta
+        uint32_t tried = 0;
+        int n;
+        while ((n = value_cache_flush_tx(cache, &tried, send, ctx)) >= 0) {
+            sent += n;
+        }
+
+        portENTER_CRITICAL(&cache->lock);
+        if (!cache->flush_again) {
+            cache->flushing = false;
+            portEXIT_CRITICAL(&cache->lock);
+            return sent;
+        }
+        cache->flush_again = false;
+        portEXIT_CRITICAL(&cache->lock);
+    }
+}
+
+uint16_t value_cache_payload_max(value_cache_t *cache)
+{
+    uint16_t max = cache->max_len;
+
+    portENTER_CRITICAL(&cache->lock);
+    for (uint32_t mask = cache->subscribed; mask; mask &= mask - 1) {
+        uint16_t payload = value_cache_conn_payload(cache->subs[__builtin_ctz(mask)].conn_id);
+
+        if (cache->delta) {
+            payload -= VALUE_CACHE_DELTA_HDR_LEN;
+        }
+        if (payload < max) {
+            max = payload;
+        }
+    }
+    portEXIT_CRITICAL(&cache->lock);
+    return max;
+}
+
+uint16_t value_cache_conn_interval_max(value_cache_t *cache)
+{
+    uint16_t max = 0;
+
+    portENTER_CRITICAL(&cache->lock);
+    for (uint32_t mask = cache->subscribed; mask; mask &= mask - 1) {
+        const ble_conn_t *conn = ble_conn_get(cache->subs[__builtin_ctz(mask)].conn_id);
+
+        if (conn && conn->conn_interval > max) {
+            max = conn->conn_interval;
+        }
+    }
+    portEXIT_CRITICAL(&cache->lock);
+    return max;
+}
+
+void value_cache_stats_get(value_cache_t *cache, value_cache_stats_t *stats)
+{
+    portENTER_CRITICAL(&cache->lock);
+    *stats = cache->stats;
+    memset(&cache->stats, 0, sizeof(cache->stats));
+    portEXIT_CRITICAL(&cache->lock);
+}
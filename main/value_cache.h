@@ -0,0 +1,144 @@
+#ifndef VALUE_CACHE_H
+#define VALUE_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#include "ble_conn.h"
+#include "mem_pool.h"
+
+// Versioned copy of a notified characteristic value. Every change bumps the version, each
+// subscribed connection remembers the version it was last sent, so a flush notifies only the
+// connections that are behind and an update that changes nothing costs no airtime. Updates
+// coming faster than the link drains them collapse into the latest value.
+//
+// With delta set, every notification is {offset u16, length u16, bytes} (little endian): the
+// client writes bytes at offset into its copy and truncates or extends that copy to length.
+// The first notification after subscribing carries the whole value at offset 0, later ones
+// only the changed byte range. A subscriber's last-sent snapshot is kept for the comparison.
+//
+// A flush builds the notification once into a buffer from the cache's pool and sends it to
+// every subscriber that is behind. The buffer's reference count is the bitmap of subscribers
+// whose send the stack has not confirmed yet (value_cache_confirm()), it goes back to the
+// pool with the last confirmation. Without delta a broadcast therefore takes one buffer
+// however many clients there are, with delta one per subscriber as the ranges differ. While
+// every buffer is in flight the subscribers stay behind, the flush after the next
+// confirmation sends them the latest value.
+//
+// Callable from any task. The state is under a spinlock, the send callback runs outside it
+// and only one flush runs at a time: a flush requested meanwhile is done by the running one
+// before it returns. Notifications are not fragmented, a subscriber whose ATT_MTU is too
+// small for the current value stays behind until a value fits.
+#define VALUE_CACHE_DELTA_HDR_LEN 4
+// Broadcasts in flight without delta, two keep the stack busy while the next one is built
+#define VALUE_CACHE_TX_DEPTH      2
+#define VALUE_CACHE_TX_BUFS(delta) ((delta) ? VALUE_CACHE_TX_DEPTH * BLE_CONN_MAX : VALUE_CACHE_TX_DEPTH)
+
+// Notification payload in flight, a block of the cache's pool
+typedef struct {
+    uint32_t pending;       // Subscriber slots still to confirm, the reference count
+    uint16_t len;
+    uint8_t data[];
+} value_cache_tx_t;
+
+typedef struct {
+    bool synced;            // The client holds the value of version, snapshot included
+    uint8_t epoch;          // Bumped per subscription, a flush racing a resubscribe notices
+    uint16_t conn_id;
+    uint32_t version;
+    uint16_t len;           // Snapshot length
+    uint8_t *snapshot;      // max_len bytes, delta caches only
+} value_cache_sub_t;
+
+// Counters since the previous value_cache_stats_get()
+typedef struct {
+    uint32_t updates;       // value_cache_set() calls
+    uint32_t unchanged;     // ... that left the value as it was
+    uint32_t tx_bufs;       // Notification payloads built, each shared by its recipients
+    uint32_t notifications;
+    uint32_t bytes;         // Notification payload bytes sent
+    uint32_t full_bytes;    // Bytes of the full values those notifications stood for
+} value_cache_stats_t;
+
+typedef struct {
+    const char *name;
+    uint16_t max_len;
+    bool delta;
+    uint8_t *value;
+    uint16_t len;
+    uint32_t version;
+    uint8_t *snapshots;     // BLE_CONN_MAX * max_len, delta caches only
+    uint8_t *sent;          // max_len, the value the running flush sends
+    bool flushing;
+    bool flush_again;
+    portMUX_TYPE lock;
+
+    uint32_t subscribed;    // Bit n set while subs[n] has notifications enabled
+    value_cache_sub_t subs[BLE_CONN_MAX];
+
+    mem_pool_t *tx_pool;
+    value_cache_tx_t *inflight[VALUE_CACHE_TX_DEPTH * BLE_CONN_MAX];   // Oldest first
+    uint8_t inflight_count;
+
+    value_cache_stats_t stats;  // Under the lock
+} value_cache_t;
+
+// Reference the running flush holds on its buffer while sending, so a confirmation arriving
+// from inside the send callback cannot release it underneath
+#define VALUE_CACHE_TX_FLUSHING   (1U << 31)
+_Static_assert(BLE_CONN_MAX < 32, "value_cache subscriber bitmap");
+
+// Define a static cache `var` for values of up to max_len bytes
+#define VALUE_CACHE_DEFINE(var, max_len_, delta_)                                       \
+    static uint8_t var##_value[(max_len_)];                                             \
+    static uint8_t var##_snapshots[(delta_) ? BLE_CONN_MAX * (max_len_) : 1];           \
+    static uint8_t var##_sent[(max_len_)];                                              \
+    MEM_POOL_DEFINE(var##_tx_pool, sizeof(value_cache_tx_t) + (max_len_) +              \
+                    VALUE_CACHE_DELTA_HDR_LEN, VALUE_CACHE_TX_BUFS(delta_));            \
+    static value_cache_t var = {                                                        \
+        .name = #var,                                                                   \
+        .max_len = (max_len_),                                                          \
+        .delta = (delta_),                                                              \
+        .value = var##_value,                                                           \
+        .snapshots = var##_snapshots,                                                   \
+        .sent = var##_sent,                                                             \
+        .lock = portMUX_INITIALIZER_UNLOCKED,                                           \
+        .tx_pool = &var##_tx_pool,                                                      \
+    }
+
+// Hands one notification to the stack. Return ESP_OK once it is queued, anything else leaves
+// the connection behind and the next flush tries again. Every ESP_OK must be followed by a
+// value_cache_confirm() for conn_id once the stack is done with it.
+typedef esp_err_t (*value_cache_send_t)(uint16_t conn_id, const uint8_t *pdu, uint16_t len, void *ctx);
+
+// Store a new value. Returns true if it differs from the cached one, the version is bumped
+// only then. A value longer than max_len is refused with false.
+bool value_cache_set(value_cache_t *cache, const void *value, uint16_t len);
+// Start notifying conn_id, the next flush sends it the whole value. Idempotent.
+esp_err_t value_cache_subscribe(value_cache_t *cache, uint16_t conn_id);
+// Stop notifying conn_id, on unsubscribe and disconnect. Drops its references to the buffers
+// in flight. Unknown conn_ids are ignored.
+void value_cache_unsubscribe(value_cache_t *cache, uint16_t conn_id);
+// Notify every subscriber that does not hold the current version yet, returns how many were
+// sent. Call after value_cache_set(), when a connection can send again and when
+// value_cache_confirm() released a buffer.
+int value_cache_flush(value_cache_t *cache, value_cache_send_t send, void *ctx);
+// The stack is done with the oldest notification sent to conn_id (Bluedroid
+// ESP_GATTS_CONF_EVT, NimBLE BLE_GAP_EVENT_NOTIFY_TX). Returns true if that released a
+// buffer, subscribers left behind for want of one can be flushed now.
+bool value_cache_confirm(value_cache_t *cache, uint16_t conn_id);
+
+// Largest value every subscriber can be notified in one PDU: the smallest ATT_MTU - 3 (less
+// the delta header), at most max_len. max_len while nobody is subscribed.
+uint16_t value_cache_payload_max(value_cache_t *cache);
+// Longest connection interval among the subscribers in 1.25 ms units, 0 without subscribers
+uint16_t value_cache_conn_interval_max(value_cache_t *cache);
+
+// Fills stats, the counters restart with every call
+void value_cache_stats_get(value_cache_t *cache, value_cache_stats_t *stats);
+
+#endif // VALUE_CACHE_H
@@ -0,0 +1,46 @@
+#ifndef LZ_DECODE_H
+#define LZ_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mds_lz.h"
+
+// Gateway side decoder of the stream format described in mds_lz.h. Returns the number of
+// bytes written to out, SIZE_MAX if the stream is malformed or does not fit out_max bytes.
+static inline size_t lz_decode(const uint8_t *in, size_t len, uint8_t *out, size_t out_max)
+{
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < len) {
+        const uint8_t flags = in[i++];
+
+        for (int item = 0; item < 8 && i < len; item++) {
+            if (flags & (1 << item)) {
+                if (i + 2 > len) {
+                    return SIZE_MAX;
+                }
+                const uint16_t word = in[i] | (in[i + 1] << 8);
+                const size_t dist = (word & 0x3ff) + 1;
+                const size_t n = (word >> 10) + MDS_LZ_MIN_MATCH;
+
+                i += 2;
+                if (dist > o || o + n > out_max) {
+                    return SIZE_MAX;
+                }
+                for (size_t k = 0; k < n; k++, o++) {
+                    out[o] = out[o - dist];
+                }
+            } else {
+                if (o >= out_max) {
+                    return SIZE_MAX;
+                }
+                out[o++] = in[i++];
+            }
+        }
+    }
+    return o;
+}
+
+#endif // LZ_DECODE_H
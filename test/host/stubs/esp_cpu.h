@@ -0,0 +1,12 @@
+#ifndef ESP_CPU_H
+#define ESP_CPU_H
+
+#include <stdint.h>
+
+// No cycle counter on the host
+static inline uint32_t esp_cpu_get_cycle_count(void)
+{
+    return 0;
+}
+
+#endif // ESP_CPU_H
@@ -0,0 +1,55 @@
+#ifndef ESP_GATT_DEFS_H
+#define ESP_GATT_DEFS_H
+
+#include <stdint.h>
+
+// The ATT status codes the modules under test return
+typedef enum {
+    ESP_GATT_OK = 0x0,
+    ESP_GATT_REQ_NOT_SUPPORTED = 0x6,
+    ESP_GATT_INVALID_OFFSET = 0x7,
+    ESP_GATT_PREPARE_Q_FULL = 0x9,
+    ESP_GATT_INVALID_ATTR_LEN = 0xd,
+    ESP_GATT_ERROR = 0x85,
+} esp_gatt_status_t;
+
+typedef uint8_t esp_gatt_if_t;
+
+// Attribute table types and constants of gatts_table.h, with the values of ESP-IDF
+#define ESP_UUID_LEN_16     2
+#define ESP_UUID_LEN_128    16
+
+#define ESP_GATT_UUID_PRI_SERVICE           0x2800
+#define ESP_GATT_UUID_CHAR_DECLARE          0x2803
+#define ESP_GATT_UUID_CHAR_CLIENT_CONFIG    0x2902
+
+#define ESP_GATT_PERM_READ  (1 << 0)
+#define ESP_GATT_PERM_WRITE (1 << 4)
+
+#define ESP_GATT_CHAR_PROP_BIT_READ     (1 << 1)
+#define ESP_GATT_CHAR_PROP_BIT_WRITE    (1 << 3)
+#define ESP_GATT_CHAR_PROP_BIT_NOTIFY   (1 << 4)
+#define ESP_GATT_CHAR_PROP_BIT_INDICATE (1 << 5)
+
+#define ESP_GATT_RSP_BY_APP 0
+#define ESP_GATT_AUTO_RSP   1
+
+typedef struct {
+    uint8_t auto_rsp;
+} esp_attr_control_t;
+
+typedef struct {
+    uint16_t uuid_length;
+    uint8_t *uuid_p;
+    uint16_t perm;
+    uint16_t max_length;
+    uint16_t length;
+    uint8_t *value;
+} esp_attr_desc_t;
+
+typedef struct {
+    esp_attr_control_t attr_control;
+    esp_attr_desc_t att_desc;
+} esp_gatts_attr_db_t;
+
+#endif // ESP_GATT_DEFS_H
@@ -0,0 +1,25 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define portMAX_DELAY ((TickType_t)-1)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+// Single threaded host, critical sections are no-ops
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) do { (void)(mux); } while (0)
+#define portEXIT_CRITICAL(mux) do { (void)(mux); } while (0)
+
+#define xPortInIsrContext() 0
+#define portYIELD_FROM_ISR(woken) do { (void)(woken); } while (0)
+
+#endif // FREERTOS_H
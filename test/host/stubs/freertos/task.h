@@ -0,0 +1,24 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+// Tasks never run on the host, the tests call their bodies directly
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+static inline BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                     UBaseType_t prio, TaskHandle_t *handle)
+{
+    *handle = (TaskHandle_t)fn;
+    return pdPASS;
+}
+
+static inline void xTaskNotifyGive(TaskHandle_t task) {}
+static inline void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken) {}
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    return 0;
+}
+
+#endif // TASK_H
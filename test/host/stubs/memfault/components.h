@@ -0,0 +1,39 @@
+#ifndef MEMFAULT_COMPONENTS_H
+#define MEMFAULT_COMPONENTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The parts of the Memfault firmware SDK mds.c uses, implemented by the tests
+#define MEMFAULT_HTTP_APIS_DEFAULT_SCHEME "https"
+#define MEMFAULT_HTTP_CHUNKS_API_HOST "chunks.memfault.com"
+
+typedef struct MemfaultDeviceInfo {
+    const char *device_serial;
+    const char *software_type;
+    const char *software_version;
+    const char *hardware_version;
+} sMemfaultDeviceInfo;
+
+typedef struct {
+    bool enable_multi_packet_chunk;
+} sPacketizerConfig;
+
+typedef struct {
+    size_t single_chunk_message_length;
+    bool send_in_progress;
+} sPacketizerMetadata;
+
+typedef enum {
+    kMemfaultPacketizerStatus_NoMoreData = 0,
+    kMemfaultPacketizerStatus_EndOfChunk,
+    kMemfaultPacketizerStatus_MoreDataForChunk,
+} eMemfaultPacketizerStatus;
+
+void memfault_platform_get_device_info(sMemfaultDeviceInfo *info);
+bool memfault_packetizer_get_chunk(void *buf, size_t *buf_len);
+bool memfault_packetizer_begin(const sPacketizerConfig *cfg, sPacketizerMetadata *metadata);
+eMemfaultPacketizerStatus memfault_packetizer_get_next(void *buf, size_t *buf_len);
+void memfault_packetizer_abort(void);
+
+#endif // MEMFAULT_COMPONENTS_H
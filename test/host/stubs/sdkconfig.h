@@ -0,0 +1,23 @@
+// Configuration the host tests are built with, a subset of the firmware's sdkconfig
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+#define CONFIG_MEMFAULT_PROJECT_KEY "host-test"
+#define CONFIG_EXAMPLE_MDS_ENABLE 1
+#define CONFIG_EXAMPLE_MDS_PIPELINE_COUNT 4
+#define CONFIG_EXAMPLE_MDS_PREFETCH_DEPTH 8
+#define CONFIG_EXAMPLE_MDS_POLL_INTERVAL_MS 1000
+#define CONFIG_EXAMPLE_MDS_MAX_URI_LENGTH 128
+#define CONFIG_EXAMPLE_MDS_TASK_STACK_SIZE 4096
+#define CONFIG_EXAMPLE_MDS_TASK_PRIORITY 6
+#define CONFIG_EXAMPLE_MDS_PRODUCER_TASK_PRIORITY 5
+
+#define CONFIG_BT_ACL_CONNECTIONS 4
+#define CONFIG_EXAMPLE_CONN_POLICY 1
+#define CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS 2000
+#define CONFIG_EXAMPLE_CONN_POLICY_RETRY_MS 5000
+#define CONFIG_EXAMPLE_PREPARE_BUF_SIZE 16384
+#define CONFIG_EXAMPLE_LONG_WRITE_SEG_SIZE 512
+#define CONFIG_EXAMPLE_LONG_WRITE_SEG_COUNT 32
+
+#endif // SDKCONFIG_H
@@ -0,0 +1,300 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Host test of the connection parameter policy (conn_policy.c) on several connections at
+* once, against simulated one-shot timers and a simulated central.
+*
+* The central records every request per connection and the test answers it through
+* conn_policy_on_update, accepting, rejecting or ignoring it. Time only moves in
+* time_advance, which fires the timers that expire on the way.
+*
+****************************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ble_conn.h"
+#include "conn_policy.h"
+
+#define TEST_CONN_A 0
+#define TEST_CONN_B 1
+#define TEST_TIMER_MAX 8
+
+// Interval the central connects with, 30 ms
+#define TEST_CONN_INTERVAL 24
+
+int64_t host_time_us;
+
+struct esp_timer {
+    bool used;
+    bool armed;
+    int64_t at_us;
+    esp_timer_create_args_t args;
+};
+
+static struct esp_timer s_timers[TEST_TIMER_MAX];
+
+// Requests the central received per connection, the last one is the one to answer
+static struct {
+    unsigned count;
+    conn_policy_params_t last;
+} s_central[BLE_CONN_MAX];
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    for (int i = 0; i < TEST_TIMER_MAX; i++) {
+        if (!s_timers[i].used) {
+            s_timers[i] = (struct esp_timer) {
+                .used = true,
+                .args = *args,
+            };
+            *handle = &s_timers[i];
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    CHECK(timer->used);
+    if (timer->armed) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = true;
+    timer->at_us = host_time_us + timeout_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    CHECK(timer->used);
+    if (!timer->armed) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    CHECK(timer->used && !timer->armed);
+    timer->used = false;
+    return ESP_OK;
+}
+
+esp_err_t conn_policy_port_update(uint16_t conn_id, const conn_policy_params_t *params)
+{
+    s_central[conn_id].count++;
+    s_central[conn_id].last = *params;
+    return ESP_OK;
+}
+
+// Moves the clock forward by ms, firing the timers that expire on the way in order
+static void time_advance(uint32_t ms)
+{
+    const int64_t end_us = host_time_us + ms * 1000LL;
+
+    for (;;) {
+        struct esp_timer *next = NULL;
+
+        for (int i = 0; i < TEST_TIMER_MAX; i++) {
+            if (s_timers[i].used && s_timers[i].armed && s_timers[i].at_us <= end_us &&
+                (next == NULL || s_timers[i].at_us < next->at_us)) {
+                next = &s_timers[i];
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        host_time_us = next->at_us > host_time_us ? next->at_us : host_time_us;
+        next->armed = false;
+        next->args.callback(next->args.arg);
+    }
+    host_time_us = end_us;
+}
+
+static unsigned timers_used(void)
+{
+    unsigned used = 0;
+
+    for (int i = 0; i < TEST_TIMER_MAX; i++) {
+        used += s_timers[i].used;
+    }
+    return used;
+}
+
+static void connect(uint16_t conn_id)
+{
+    CHECK(ble_conn_open(conn_id) != NULL);
+    conn_policy_on_connect(conn_id, TEST_CONN_INTERVAL, 0);
+}
+
+static void disconnect(uint16_t conn_id)
+{
+    conn_policy_on_disconnect(conn_id);
+    ble_conn_close(conn_id);
+}
+
+// The central answers the last request on conn_id with an interval inside its range
+static void central_accept(uint16_t conn_id)
+{
+    const conn_policy_params_t *params = &s_central[conn_id].last;
+
+    conn_policy_on_update(conn_id, true, params->max_int, params->latency);
+}
+
+static uint8_t profile_get(uint16_t conn_id)
+{
+    return ble_conn_get(conn_id)->policy.profile;
+}
+
+// A new link asks for the fast profile, steps down once idle and back up while busy
+static void test_transitions(void)
+{
+    connect(TEST_CONN_A);
+    CHECK(s_central[TEST_CONN_A].count == 1);
+    CHECK(s_central[TEST_CONN_A].last.latency == 0);
+    central_accept(TEST_CONN_A);
+
+    // Busy keeps the link fast past the idle delay, the delay only starts once it is quiet
+    conn_policy_busy_set(TEST_CONN_A, CONN_POLICY_BUSY_MDS, true);
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS * 3);
+    CHECK(s_central[TEST_CONN_A].count == 1);
+    conn_policy_busy_set(TEST_CONN_A, CONN_POLICY_BUSY_MDS, false);
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS - 1);
+    CHECK(s_central[TEST_CONN_A].count == 1);
+    time_advance(1);
+    CHECK(s_central[TEST_CONN_A].count == 2);
+    CHECK(s_central[TEST_CONN_A].last.latency > 0);
+    central_accept(TEST_CONN_A);
+
+    conn_policy_busy_set(TEST_CONN_A, CONN_POLICY_BUSY_LONG_WRITE, true);
+    CHECK(s_central[TEST_CONN_A].count == 3);
+    CHECK(s_central[TEST_CONN_A].last.latency == 0);
+    central_accept(TEST_CONN_A);
+    conn_policy_busy_set(TEST_CONN_A, CONN_POLICY_BUSY_LONG_WRITE, false);
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS);
+    CHECK(s_central[TEST_CONN_A].count == 4);
+    central_accept(TEST_CONN_A);
+    CHECK(profile_get(TEST_CONN_A) == 1);
+}
+
+// A second connection runs its own policy: it goes fast and idle while the first one stays
+// idle, and a rejection on one does not hold back the other
+static void test_two_connections(void)
+{
+    const unsigned requests_a = s_central[TEST_CONN_A].count;
+
+    connect(TEST_CONN_B);
+    CHECK(s_central[TEST_CONN_B].count == 1);
+    central_accept(TEST_CONN_B);
+    CHECK(profile_get(TEST_CONN_B) == 0);
+    CHECK(profile_get(TEST_CONN_A) == 1);
+
+    conn_policy_busy_set(TEST_CONN_B, CONN_POLICY_BUSY_INGEST, true);
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS * 2);
+    conn_policy_busy_set(TEST_CONN_B, CONN_POLICY_BUSY_INGEST, false);
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS);
+    CHECK(s_central[TEST_CONN_B].count == 2);
+    conn_policy_on_update(TEST_CONN_B, false, TEST_CONN_INTERVAL, 0);
+    CHECK(profile_get(TEST_CONN_B) == 0);
+
+    // A only hears from its own busy reasons
+    conn_policy_busy_set(TEST_CONN_A, CONN_POLICY_BUSY_MDS, true);
+    CHECK(s_central[TEST_CONN_A].count == requests_a + 1);
+    central_accept(TEST_CONN_A);
+    CHECK(profile_get(TEST_CONN_A) == 0);
+    conn_policy_busy_set(TEST_CONN_A, CONN_POLICY_BUSY_MDS, false);
+
+    // B retries after its backoff, A steps down after its idle delay
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_RETRY_MS);
+    CHECK(s_central[TEST_CONN_A].count == requests_a + 2);
+    CHECK(s_central[TEST_CONN_B].count == 3);
+    central_accept(TEST_CONN_A);
+    central_accept(TEST_CONN_B);
+    CHECK(profile_get(TEST_CONN_A) == 1);
+    CHECK(profile_get(TEST_CONN_B) == 1);
+}
+
+// Rejections back off with a doubling delay, an unanswered request counts as one
+static void test_backoff(void)
+{
+    const unsigned requests = s_central[TEST_CONN_B].count;
+
+    conn_policy_busy_set(TEST_CONN_B, CONN_POLICY_BUSY_MDS, true);
+    CHECK(s_central[TEST_CONN_B].count == requests + 1);
+    conn_policy_on_update(TEST_CONN_B, false, 0, 0);
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_RETRY_MS - 1);
+    CHECK(s_central[TEST_CONN_B].count == requests + 1);
+    time_advance(1);
+    CHECK(s_central[TEST_CONN_B].count == requests + 2);
+
+    // An interval outside the range is a rejection too
+    conn_policy_on_update(TEST_CONN_B, true, 0x90, 0);
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_RETRY_MS * 2 - 1);
+    CHECK(s_central[TEST_CONN_B].count == requests + 2);
+    time_advance(1);
+    CHECK(s_central[TEST_CONN_B].count == requests + 3);
+
+    // No answer within 30 s
+    time_advance(30000);
+    CHECK(s_central[TEST_CONN_B].count == requests + 3);
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_RETRY_MS * 4);
+    CHECK(s_central[TEST_CONN_B].count == requests + 4);
+    central_accept(TEST_CONN_B);
+    CHECK(profile_get(TEST_CONN_B) == 0);
+    conn_policy_busy_set(TEST_CONN_B, CONN_POLICY_BUSY_MDS, false);
+}
+
+// A disconnected link releases its timer and ignores late events, the other one carries on
+static void test_disconnect(void)
+{
+    const unsigned requests = s_central[TEST_CONN_B].count;
+    conn_policy_stats_t stats;
+
+    CHECK(timers_used() == 2);
+    disconnect(TEST_CONN_B);
+    CHECK(timers_used() == 1);
+    conn_policy_busy_set(TEST_CONN_B, CONN_POLICY_BUSY_MDS, true);
+    conn_policy_on_update(TEST_CONN_B, true, TEST_CONN_INTERVAL, 0);
+    time_advance(CONFIG_EXAMPLE_CONN_POLICY_IDLE_DELAY_MS * 2);
+    CHECK(s_central[TEST_CONN_B].count == requests);
+
+    conn_policy_stats_get(&stats);
+    time_advance(1000);
+    conn_policy_stats_get(&stats);
+    CHECK(stats.idle_ms == 1000);
+    CHECK(stats.fast_ms == 0);
+    // 210 ms with latency 4, listens every 1050 ms
+    CHECK(stats.conn_events == 0 || stats.conn_events == 1);
+
+    disconnect(TEST_CONN_A);
+    CHECK(timers_used() == 0);
+}
+
+int main(void)
+{
+    CHECK(conn_policy_init() == ESP_OK);
+
+    test_transitions();
+    test_two_connections();
+    test_backoff();
+    test_disconnect();
+
+    printf("test_conn_policy: ok\n");
+    return 0;
+}
@@ -0,0 +1,384 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Host test and benchmark of the attribute event routing of gatts_table.c.
+*
+* Services are registered one at a time through ESP_GATTS_CREAT_ATTR_TAB_EVT, with handles
+* handed out in order like Bluedroid does. After each one, a read, a write and a confirmation
+* of every routed attribute must reach the attr_cb of the owning service with the index of the
+* attribute in its table. The test then times gatts_table_dispatch() against the per-profile
+* handle comparisons it replaced, for 1 to GATTS_TABLE_MAX_SVC services.
+*
+* A service of ESP_GATT_AUTO_RSP values, like the Device Information Service, must have its
+* values handed to the stack before it is started, and only reads answered by the app may be
+* counted as such.
+*
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gatts_table.h"
+
+#define TEST_GATTS_IF 3
+// Handles of the GATT and GAP services come first
+#define TEST_FIRST_HANDLE 20
+#define TEST_TIMING_ROUNDS 20000
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+enum {
+    TEST_IDX_SVC,
+    TEST_IDX_CHAR_A,
+    TEST_IDX_CHAR_A_VAL,
+    TEST_IDX_CHAR_A_CCCD,
+    TEST_IDX_CHAR_B,
+    TEST_IDX_CHAR_B_VAL,
+    TEST_IDX_CHAR_C,
+    TEST_IDX_CHAR_C_VAL,
+    TEST_IDX_NB,
+};
+
+static const esp_gatts_attr_db_t s_db[TEST_IDX_NB] = {
+    GATTS_TABLE_SERVICE16(TEST_IDX_SVC, 0x1234),
+    GATTS_TABLE_CHAR_DECL(TEST_IDX_CHAR_A, ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_NOTIFY),
+    GATTS_TABLE_VALUE16(TEST_IDX_CHAR_A_VAL, 0x1235, ESP_GATT_PERM_READ, 20),
+    GATTS_TABLE_CCCD(TEST_IDX_CHAR_A_CCCD),
+    GATTS_TABLE_CHAR_DECL(TEST_IDX_CHAR_B, ESP_GATT_CHAR_PROP_BIT_WRITE),
+    GATTS_TABLE_VALUE16(TEST_IDX_CHAR_B_VAL, 0x1236, ESP_GATT_PERM_WRITE, 20),
+    GATTS_TABLE_CHAR_DECL(TEST_IDX_CHAR_C, ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_WRITE),
+    GATTS_TABLE_VALUE16(TEST_IDX_CHAR_C_VAL, 0x1237, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, 20),
+};
+
+static void attr_cb(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param,
+                    uint8_t attr_idx);
+
+enum {
+    TEST_STATIC_IDX_SVC,
+    TEST_STATIC_IDX_CHAR_A,
+    TEST_STATIC_IDX_CHAR_A_VAL,
+    TEST_STATIC_IDX_CHAR_B,
+    TEST_STATIC_IDX_CHAR_B_VAL,
+    TEST_STATIC_IDX_NB,
+};
+
+#define TEST_STATIC_A       "Memfault"
+#define TEST_STATIC_B       "1.2.3"
+#define TEST_STATIC_B_MAX   16
+
+static const esp_gatts_attr_db_t s_static_db[TEST_STATIC_IDX_NB] = {
+    GATTS_TABLE_SERVICE16(TEST_STATIC_IDX_SVC, 0x180a),
+    GATTS_TABLE_CHAR_DECL(TEST_STATIC_IDX_CHAR_A, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_STATIC16(TEST_STATIC_IDX_CHAR_A_VAL, 0x2a29, sizeof(TEST_STATIC_A) - 1, sizeof(TEST_STATIC_A) - 1,
+                         TEST_STATIC_A),
+    GATTS_TABLE_CHAR_DECL(TEST_STATIC_IDX_CHAR_B, ESP_GATT_CHAR_PROP_BIT_READ),
+    GATTS_TABLE_STATIC16(TEST_STATIC_IDX_CHAR_B_VAL, 0x2a26, TEST_STATIC_B_MAX, 0, NULL),
+};
+
+#define TEST_SVC(n) { .name = "svc" #n, .db = s_db, .num_attr = TEST_IDX_NB, .inst_id = n, \
+                      .handles = s_handles[n], .attr_cb = attr_cb }
+
+static uint16_t s_handles[GATTS_TABLE_MAX_SVC + 3][TEST_IDX_NB];
+// One more than can be routed
+static const gatts_table_svc_t s_svcs[GATTS_TABLE_MAX_SVC + 1] = {
+    TEST_SVC(0), TEST_SVC(1), TEST_SVC(2), TEST_SVC(3), TEST_SVC(4), TEST_SVC(5), TEST_SVC(6), TEST_SVC(7),
+    TEST_SVC(8),
+};
+// Takes handles but has no attr_cb, its events stay with the profile
+static const gatts_table_svc_t s_unrouted_svc = {
+    .name = "unrouted", .db = s_db, .num_attr = TEST_IDX_NB, .inst_id = GATTS_TABLE_MAX_SVC + 1,
+    .handles = s_handles[GATTS_TABLE_MAX_SVC + 1],
+};
+
+static void static_created(void);
+
+// Filled in once created, answered by the stack
+static const gatts_table_svc_t s_static_svc = {
+    .name = "static", .db = s_static_db, .num_attr = TEST_STATIC_IDX_NB, .inst_id = GATTS_TABLE_MAX_SVC + 2,
+    .handles = s_handles[GATTS_TABLE_MAX_SVC + 2], .created_cb = static_created,
+};
+
+static uint16_t s_next_handle = TEST_FIRST_HANDLE;
+
+// What the last attr_cb call received and the services the stack was asked to start
+static struct {
+    unsigned calls;
+    const uint16_t *handles;
+    esp_gatts_cb_event_t event;
+    esp_gatt_if_t gatts_if;
+    uint8_t attr_idx;
+} s_last;
+static uint16_t s_started[GATTS_TABLE_MAX_SVC + 3];
+static unsigned s_started_num;
+// Last value handed to the stack, and how many services were started by then
+static struct {
+    unsigned calls;
+    uint16_t handle;
+    uint16_t len;
+    uint8_t value[TEST_STATIC_B_MAX];
+    unsigned started_num;
+} s_set;
+
+esp_err_t esp_ble_gatts_create_attr_tab(const esp_gatts_attr_db_t *gatts_attr_db, esp_gatt_if_t gatts_if,
+                                        uint16_t max_nb_attr, uint8_t srvc_inst_id)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_set_attr_value(uint16_t attr_handle, uint16_t length, const uint8_t *value)
+{
+    CHECK(length <= sizeof(s_set.value));
+    s_set.calls++;
+    s_set.handle = attr_handle;
+    s_set.len = length;
+    memcpy(s_set.value, value, length);
+    s_set.started_num = s_started_num;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_start_service(uint16_t service_handle)
+{
+    s_started[s_started_num++] = service_handle;
+    return ESP_OK;
+}
+
+static void attr_cb(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param,
+                    uint8_t attr_idx)
+{
+    uint8_t idx;
+
+    s_last.calls++;
+    s_last.handles = gatts_table_route(event, param, &idx)->handles;
+    s_last.event = event;
+    s_last.gatts_if = gatts_if;
+    s_last.attr_idx = attr_idx;
+}
+
+static void static_created(void)
+{
+    CHECK(gatts_table_value_set(&s_static_svc, TEST_STATIC_IDX_CHAR_B_VAL, TEST_STATIC_B,
+                                sizeof(TEST_STATIC_B) - 1) == ESP_OK);
+}
+
+// Hands out the next num_attr handles to svc like the stack, returns whether it was started
+static bool svc_create(const gatts_table_svc_t *svc)
+{
+    uint16_t handles[TEST_IDX_NB];
+    const unsigned started = s_started_num;
+
+    for (int i = 0; i < svc->num_attr; i++) {
+        handles[i] = s_next_handle++;
+    }
+    esp_ble_gatts_cb_param_t param = {
+        .add_attr_tab = {
+            .status = ESP_GATT_OK,
+            .svc_inst_id = svc->inst_id,
+            .num_handle = svc->num_attr,
+            .handles = handles,
+        },
+    };
+
+    // Only the service the table was created for takes the event
+    for (int i = 0; i <= GATTS_TABLE_MAX_SVC; i++) {
+        if (&s_svcs[i] != svc) {
+            CHECK(!gatts_table_handle_event(&s_svcs[i], ESP_GATTS_CREAT_ATTR_TAB_EVT, &param));
+        }
+    }
+    CHECK(gatts_table_handle_event(svc, ESP_GATTS_CREAT_ATTR_TAB_EVT, &param));
+    CHECK(memcmp(svc->handles, handles, svc->num_attr * sizeof(uint16_t)) == 0);
+    return s_started_num > started && s_started[s_started_num - 1] == handles[0];
+}
+
+static esp_ble_gatts_cb_param_t event_param(esp_gatts_cb_event_t event, uint16_t handle)
+{
+    esp_ble_gatts_cb_param_t param;
+
+    memset(&param, 0, sizeof(param));
+    switch (event) {
+    case ESP_GATTS_READ_EVT:
+        param.read.handle = handle;
+        break;
+    case ESP_GATTS_WRITE_EVT:
+        param.write.handle = handle;
+        break;
+    default:
+        param.conf.handle = handle;
+        break;
+    }
+    return param;
+}
+
+// Every attribute event of the first svc_num services reaches its attr_cb with its index
+static void check_routes(int svc_num)
+{
+    static const esp_gatts_cb_event_t events[] = {ESP_GATTS_READ_EVT, ESP_GATTS_WRITE_EVT, ESP_GATTS_CONF_EVT};
+
+    for (int s = 0; s < svc_num; s++) {
+        for (int i = 0; i < TEST_IDX_NB; i++) {
+            for (size_t e = 0; e < sizeof(events) / sizeof(events[0]); e++) {
+                esp_ble_gatts_cb_param_t param = event_param(events[e], s_svcs[s].handles[i]);
+                const unsigned calls = s_last.calls;
+
+                CHECK(gatts_table_dispatch(events[e], TEST_GATTS_IF, &param));
+                CHECK(s_last.calls == calls + 1 && s_last.handles == s_svcs[s].handles);
+                CHECK(s_last.event == events[e] && s_last.gatts_if == TEST_GATTS_IF && s_last.attr_idx == i);
+            }
+        }
+    }
+
+    // Handles of no service, or of a service without attr_cb, and other events are not taken
+    const unsigned calls = s_last.calls;
+    esp_ble_gatts_cb_param_t param = event_param(ESP_GATTS_READ_EVT, TEST_FIRST_HANDLE - 1);
+    CHECK(!gatts_table_dispatch(ESP_GATTS_READ_EVT, TEST_GATTS_IF, &param));
+    param = event_param(ESP_GATTS_READ_EVT, s_unrouted_svc.handles[TEST_IDX_CHAR_A_VAL]);
+    CHECK(!gatts_table_dispatch(ESP_GATTS_READ_EVT, TEST_GATTS_IF, &param));
+    param = event_param(ESP_GATTS_READ_EVT, GATTS_TABLE_MAX_HANDLE + 1);
+    CHECK(!gatts_table_dispatch(ESP_GATTS_READ_EVT, TEST_GATTS_IF, &param));
+    param.start.service_handle = s_svcs[0].handles[0];
+    CHECK(!gatts_table_dispatch(ESP_GATTS_START_EVT, TEST_GATTS_IF, &param));
+    CHECK(s_last.calls == calls);
+}
+
+// What the profile callbacks did before the routing table: offer the event to every profile,
+// each comparing the handle against those of its attributes
+static bool linear_dispatch(int svc_num, esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
+                            esp_ble_gatts_cb_param_t *param)
+{
+    const uint16_t handle = param->read.handle;
+
+    for (int s = 0; s < svc_num; s++) {
+        for (int i = 0; i < s_svcs[s].num_attr; i++) {
+            if (s_svcs[s].handles[i] == handle) {
+                s_svcs[s].attr_cb(event, gatts_if, param, i);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static double elapsed_ns(const struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+// Host time per read of a value in the last of svc_num services, the worst case of the scan
+static void bench(int svc_num)
+{
+    esp_ble_gatts_cb_param_t param = event_param(ESP_GATTS_READ_EVT,
+                                                 s_svcs[svc_num - 1].handles[TEST_IDX_CHAR_C_VAL]);
+    struct timespec start;
+    gatts_table_stats_t stats;
+
+    gatts_table_stats_get(&stats);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < TEST_TIMING_ROUNDS; i++) {
+        CHECK(gatts_table_dispatch(ESP_GATTS_READ_EVT, TEST_GATTS_IF, &param));
+    }
+    const double table_ns = elapsed_ns(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < TEST_TIMING_ROUNDS; i++) {
+        CHECK(linear_dispatch(svc_num, ESP_GATTS_READ_EVT, TEST_GATTS_IF, &param));
+    }
+    const double linear_ns = elapsed_ns(&start);
+
+    gatts_table_stats_get(&stats);
+    CHECK(stats.routed == TEST_TIMING_ROUNDS && stats.app_reads == TEST_TIMING_ROUNDS);
+    printf("test_gatts_table: %u service(s), %2u attributes: %.1f ns per read routed, %.1f ns scanned\n",
+           svc_num, svc_num * TEST_IDX_NB, table_ns / TEST_TIMING_ROUNDS, linear_ns / TEST_TIMING_ROUNDS);
+}
+
+// Values answered by the stack are declared for it and set before the service starts
+static void test_static_values(void)
+{
+    const esp_gatts_attr_db_t *a = &s_static_db[TEST_STATIC_IDX_CHAR_A_VAL];
+    const esp_gatts_attr_db_t *b = &s_static_db[TEST_STATIC_IDX_CHAR_B_VAL];
+
+    CHECK(a->attr_control.auto_rsp == ESP_GATT_AUTO_RSP && a->att_desc.perm == ESP_GATT_PERM_READ);
+    CHECK(a->att_desc.length == sizeof(TEST_STATIC_A) - 1 && a->att_desc.max_length == a->att_desc.length);
+    CHECK(memcmp(a->att_desc.value, TEST_STATIC_A, a->att_desc.length) == 0);
+    CHECK(b->attr_control.auto_rsp == ESP_GATT_AUTO_RSP && b->att_desc.length == 0 && b->att_desc.value == NULL);
+    CHECK(s_db[TEST_IDX_CHAR_C_VAL].attr_control.auto_rsp == ESP_GATT_RSP_BY_APP);
+
+    // No handle to address yet
+    CHECK(gatts_table_value_set(&s_static_svc, TEST_STATIC_IDX_CHAR_B_VAL, "x", 1) == ESP_ERR_INVALID_STATE);
+
+    const unsigned started = s_started_num;
+    CHECK(svc_create(&s_static_svc));
+    CHECK(s_set.calls == 1 && s_set.started_num == started);
+    CHECK(s_set.handle == s_static_svc.handles[TEST_STATIC_IDX_CHAR_B_VAL]);
+    CHECK(s_set.len == sizeof(TEST_STATIC_B) - 1 && memcmp(s_set.value, TEST_STATIC_B, s_set.len) == 0);
+
+    // The stack keeps the value only for attributes it answers, and only up to max_length
+    static const uint8_t full[TEST_STATIC_B_MAX + 1];
+    CHECK(gatts_table_value_set(&s_static_svc, TEST_STATIC_IDX_CHAR_B_VAL, full, TEST_STATIC_B_MAX) == ESP_OK);
+    CHECK(s_set.calls == 2 && s_set.len == TEST_STATIC_B_MAX);
+    CHECK(gatts_table_value_set(&s_static_svc, TEST_STATIC_IDX_CHAR_B_VAL, full, sizeof(full)) == ESP_ERR_INVALID_ARG);
+    CHECK(gatts_table_value_set(&s_static_svc, TEST_STATIC_IDX_CHAR_A, full, 1) == ESP_OK);
+    CHECK(gatts_table_value_set(&s_static_svc, TEST_STATIC_IDX_NB, full, 1) == ESP_ERR_INVALID_STATE);
+    CHECK(s_set.calls == 3);
+
+    // Nothing of it is routed to the app
+    esp_ble_gatts_cb_param_t param = event_param(ESP_GATTS_READ_EVT, s_static_svc.handles[TEST_STATIC_IDX_CHAR_A_VAL]);
+    CHECK(!gatts_table_dispatch(ESP_GATTS_READ_EVT, TEST_GATTS_IF, &param));
+}
+
+// Only reads count as answered by the app, writes and confirmations are routed all the same
+static void test_app_reads(void)
+{
+    static const esp_gatts_cb_event_t events[] = {ESP_GATTS_READ_EVT, ESP_GATTS_WRITE_EVT, ESP_GATTS_CONF_EVT};
+    gatts_table_stats_t stats;
+
+    gatts_table_stats_get(&stats);
+    for (size_t e = 0; e < sizeof(events) / sizeof(events[0]); e++) {
+        esp_ble_gatts_cb_param_t param = event_param(events[e], s_svcs[0].handles[TEST_IDX_CHAR_C_VAL]);
+        CHECK(gatts_table_dispatch(events[e], TEST_GATTS_IF, &param));
+    }
+    esp_ble_gatts_cb_param_t param = event_param(ESP_GATTS_READ_EVT, s_static_svc.handles[TEST_STATIC_IDX_CHAR_B_VAL]);
+    CHECK(!gatts_table_dispatch(ESP_GATTS_READ_EVT, TEST_GATTS_IF, &param));
+
+    gatts_table_stats_get(&stats);
+    CHECK(stats.routed == 3 && stats.app_reads == 1);
+    gatts_table_stats_get(&stats);
+    CHECK(stats.routed == 0 && stats.app_reads == 0);
+    // Values answered by the app are not kept by the stack
+    CHECK(gatts_table_value_set(&s_svcs[0], TEST_IDX_CHAR_C_VAL, "x", 1) == ESP_ERR_INVALID_ARG);
+}
+
+int main(void)
+{
+    test_static_values();
+    CHECK(svc_create(&s_unrouted_svc));
+
+    for (int n = 1; n <= GATTS_TABLE_MAX_SVC; n++) {
+        CHECK(svc_create(&s_svcs[n - 1]));
+        check_routes(n);
+        bench(n);
+    }
+
+    // A service that cannot be routed would never answer its reads and is not started
+    CHECK(!svc_create(&s_svcs[GATTS_TABLE_MAX_SVC]));
+    esp_ble_gatts_cb_param_t param = event_param(ESP_GATTS_READ_EVT, s_svcs[GATTS_TABLE_MAX_SVC].handles[0]);
+    CHECK(!gatts_table_dispatch(ESP_GATTS_READ_EVT, TEST_GATTS_IF, &param));
+    check_routes(GATTS_TABLE_MAX_SVC);
+    test_app_reads();
+
+    printf("test_gatts_table: ok\n");
+    return 0;
+}
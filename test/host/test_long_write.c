@@ -0,0 +1,370 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Stress test of the long write sink (long_write.c) and its segment pool (mem_pool.c).
+*
+* Several simulated connections run long writes at once and their Prepare Write Requests
+* are interleaved at random, with random fragment sizes, so they compete for the shared
+* segment pool. Now and then a client sends a bad fragment, cancels or disconnects. After
+* every step the pool must account for exactly the segments the live long writes hold, and
+* every executed long write must reach the sink byte for byte.
+*
+* Before that, one long write takes the whole pool and the next one must be refused, and
+* 4 KiB and 16 KiB long writes are timed through the sink. malloc and free are wrapped at
+* link time: neither the sink nor the pool may call them.
+*
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "long_write.h"
+
+#define TEST_CONNS 4
+#define TEST_STEPS 200000
+#define TEST_SEED 0x2545f491u
+#define TEST_HANDLE 42
+#define TEST_MAX_LEN CONFIG_EXAMPLE_PREPARE_BUF_SIZE
+#define TEST_SEG_SIZE CONFIG_EXAMPLE_LONG_WRITE_SEG_SIZE
+// Largest Prepare Write Request value at the largest ATT_MTU
+#define TEST_FRAGMENT_MAX (517 - 5)
+#define TEST_TIMING_ROUNDS 2000
+
+int64_t host_time_us;
+
+typedef struct {
+    ble_conn_prepare_t lw;
+    // What the client has written so far, and how long its long write is going to be
+    uint8_t data[TEST_MAX_LEN];
+    uint32_t target;
+    // Sink progress during execution
+    uint32_t delivered;
+    bool last_seen;
+} test_conn_t;
+
+static test_conn_t s_conns[TEST_CONNS];
+static uint32_t s_rand = TEST_SEED;
+
+static struct {
+    unsigned executed;
+    unsigned queue_full;
+    unsigned refused;
+    unsigned cancelled;
+    unsigned executed_bytes;
+    unsigned executed_fragments;
+} s_counts;
+
+// Sum of what long_write_stats_get() reported during the soak, peak pool usage included
+static long_write_stats_t s_stats;
+
+// Heap calls made by the code under test, through the -Wl,--wrap options
+static unsigned s_heap_calls;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    s_heap_calls++;
+    return __real_malloc(size);
+}
+
+void __wrap_free(void *ptr)
+{
+    s_heap_calls++;
+    __real_free(ptr);
+}
+
+// xorshift32, so every run sees the same sequence
+static uint32_t rand_next(void)
+{
+    s_rand ^= s_rand << 13;
+    s_rand ^= s_rand >> 17;
+    s_rand ^= s_rand << 5;
+    return s_rand;
+}
+
+static uint32_t rand_range(uint32_t lo, uint32_t hi)
+{
+    return lo + rand_next() % (hi - lo + 1);
+}
+
+static esp_gatt_status_t test_sink(uint16_t conn_id, uint16_t handle, uint32_t offset,
+                                   const uint8_t *data, uint16_t len, bool last, void *arg)
+{
+    test_conn_t *c = &s_conns[conn_id];
+
+    CHECK(handle == TEST_HANDLE);
+    CHECK(!c->last_seen);
+    CHECK(offset == c->delivered);
+    CHECK(len > 0 && len <= TEST_SEG_SIZE);
+    CHECK(offset + len <= c->lw.len);
+    CHECK(memcmp(data, &c->data[offset], len) == 0);
+    c->delivered += len;
+    c->last_seen = last;
+    return ESP_GATT_OK;
+}
+
+static void conn_reset(test_conn_t *c)
+{
+    c->target = rand_range(1, TEST_MAX_LEN);
+}
+
+// The pool holds exactly the segments of the live long writes, each one full but the last
+static void check_pool(void)
+{
+    unsigned held = 0;
+
+    for (int i = 0; i < TEST_CONNS; i++) {
+        const ble_conn_prepare_t *lw = &s_conns[i].lw;
+        uint32_t len = 0;
+        unsigned segs = 0;
+
+        for (const long_write_seg_t *seg = lw->head; seg; seg = seg->next) {
+            CHECK(seg->len > 0 && seg->len <= TEST_SEG_SIZE);
+            CHECK(seg->next == NULL || seg->len == TEST_SEG_SIZE);
+            CHECK(memcmp(seg->data, &s_conns[i].data[len], seg->len) == 0);
+            if (seg->next == NULL) {
+                CHECK(seg == lw->tail);
+            }
+            len += seg->len;
+            segs++;
+        }
+        CHECK(len == lw->len);
+        CHECK((lw->head == NULL) == (lw->tail == NULL));
+        held += segs;
+    }
+
+    long_write_stats_t stats;
+    long_write_stats_get(&stats);
+    CHECK(stats.segs.count == CONFIG_EXAMPLE_LONG_WRITE_SEG_COUNT);
+    CHECK(stats.segs.in_use == held);
+    s_stats.segs.allocs += stats.segs.allocs;
+    s_stats.segs.failures += stats.segs.failures;
+    if (stats.segs.high_water > s_stats.segs.high_water) {
+        s_stats.segs.high_water = stats.segs.high_water;
+    }
+    s_stats.executed += stats.executed;
+    s_stats.bytes += stats.bytes;
+    s_stats.fragments += stats.fragments;
+}
+
+// One Prepare Write Request from conn i, sometimes a bad one
+static void step_prepare(int i)
+{
+    test_conn_t *c = &s_conns[i];
+    uint16_t handle = TEST_HANDLE;
+    uint32_t offset = c->lw.len;
+    uint32_t len = rand_range(1, TEST_FRAGMENT_MAX);
+    esp_gatt_status_t expect = ESP_GATT_OK;
+
+    if (offset + len > c->target) {
+        len = c->target - offset;
+    }
+
+    switch (rand_next() % 64) {
+    case 0:
+        if (offset) {
+            handle = TEST_HANDLE + 1;
+            expect = ESP_GATT_REQ_NOT_SUPPORTED;
+        }
+        break;
+    case 1:
+        offset += 1;
+        expect = ESP_GATT_INVALID_OFFSET;
+        break;
+    case 2:
+        len = TEST_MAX_LEN - offset + 1;
+        expect = ESP_GATT_INVALID_ATTR_LEN;
+        break;
+    default:
+        break;
+    }
+
+    uint8_t value[TEST_MAX_LEN + 1];
+    for (uint32_t n = 0; n < len; n++) {
+        value[n] = rand_next();
+    }
+
+    const esp_gatt_status_t status = long_write_prepare(&c->lw, handle, offset, value, len, TEST_MAX_LEN);
+    if (expect != ESP_GATT_OK) {
+        CHECK(status == expect);
+    } else {
+        CHECK(status == ESP_GATT_OK || status == ESP_GATT_PREPARE_Q_FULL);
+    }
+
+    if (status == ESP_GATT_OK) {
+        memcpy(&c->data[offset], value, len);
+        CHECK(c->lw.len == offset + len);
+    } else {
+        // Any refused fragment drops the whole long write
+        CHECK(c->lw.head == NULL && c->lw.len == 0);
+        if (status == ESP_GATT_PREPARE_Q_FULL) {
+            s_counts.queue_full++;
+        } else {
+            s_counts.refused++;
+        }
+        conn_reset(c);
+    }
+}
+
+static void step_execute(int i)
+{
+    test_conn_t *c = &s_conns[i];
+    const uint32_t len = c->lw.len;
+    const uint32_t fragments = c->lw.fragments;
+
+    c->delivered = 0;
+    c->last_seen = false;
+    CHECK(long_write_execute(&c->lw, i, test_sink, NULL) == ESP_GATT_OK);
+    CHECK(c->delivered == len);
+    CHECK(c->last_seen == (len > 0));
+    CHECK(c->lw.head == NULL && c->lw.len == 0);
+    s_counts.executed++;
+    s_counts.executed_bytes += len;
+    s_counts.executed_fragments += fragments;
+    conn_reset(c);
+}
+
+static esp_gatt_status_t count_sink(uint16_t conn_id, uint16_t handle, uint32_t offset,
+                                    const uint8_t *data, uint16_t len, bool last, void *arg)
+{
+    *(uint32_t *)arg += len;
+    return ESP_GATT_OK;
+}
+
+// Prepares len bytes of value on lw in fragments of at most TEST_FRAGMENT_MAX bytes
+static esp_gatt_status_t prepare_all(ble_conn_prepare_t *lw, const uint8_t *value, uint32_t len)
+{
+    esp_gatt_status_t status = ESP_GATT_OK;
+
+    for (uint32_t off = 0; off < len && status == ESP_GATT_OK; off += TEST_FRAGMENT_MAX) {
+        const uint32_t n = len - off < TEST_FRAGMENT_MAX ? len - off : TEST_FRAGMENT_MAX;
+        status = long_write_prepare(lw, TEST_HANDLE, off, &value[off], n, TEST_MAX_LEN);
+    }
+    return status;
+}
+
+// A long write of the largest size takes every segment, a second connection is refused with
+// Prepare Queue Full until the first one is done
+static void test_pool_exhaustion(void)
+{
+    static uint8_t value[TEST_MAX_LEN];
+    ble_conn_prepare_t a = {0};
+    ble_conn_prepare_t b = {0};
+    long_write_stats_t stats;
+
+    _Static_assert(CONFIG_EXAMPLE_LONG_WRITE_SEG_COUNT * TEST_SEG_SIZE == TEST_MAX_LEN, "pool holds one long write");
+    long_write_stats_get(&stats);
+
+    CHECK(prepare_all(&a, value, sizeof(value)) == ESP_GATT_OK);
+    CHECK(long_write_prepare(&b, TEST_HANDLE, 0, value, 1, TEST_MAX_LEN) == ESP_GATT_PREPARE_Q_FULL);
+    CHECK(b.head == NULL && b.len == 0);
+
+    long_write_stats_get(&stats);
+    CHECK(stats.segs.in_use == stats.segs.count && stats.segs.high_water == stats.segs.count);
+    CHECK(stats.segs.allocs == stats.segs.count && stats.segs.failures == 1);
+
+    long_write_cancel(&a);
+    CHECK(long_write_prepare(&b, TEST_HANDLE, 0, value, 1, TEST_MAX_LEN) == ESP_GATT_OK);
+    long_write_cancel(&b);
+    long_write_stats_get(&stats);
+    CHECK(stats.segs.in_use == 0 && stats.segs.failures == 0 && stats.executed == 0);
+}
+
+// Host time of the sink path for 4 KiB and 16 KiB long writes in the largest fragments
+static void test_throughput(void)
+{
+    static const uint32_t lens[] = {4096, TEST_MAX_LEN};
+    static uint8_t value[TEST_MAX_LEN];
+    long_write_stats_t stats;
+
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        ble_conn_prepare_t lw = {0};
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int round = 0; round < TEST_TIMING_ROUNDS; round++) {
+            uint32_t delivered = 0;
+
+            CHECK(prepare_all(&lw, value, lens[i]) == ESP_GATT_OK);
+            CHECK(long_write_execute(&lw, 0, count_sink, &delivered) == ESP_GATT_OK);
+            CHECK(delivered == lens[i]);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+        long_write_stats_get(&stats);
+        const unsigned fragments = (lens[i] + TEST_FRAGMENT_MAX - 1) / TEST_FRAGMENT_MAX;
+        CHECK(stats.executed == TEST_TIMING_ROUNDS && stats.bytes == TEST_TIMING_ROUNDS * lens[i]);
+        CHECK(stats.fragments == TEST_TIMING_ROUNDS * fragments);
+        printf("test_long_write: %u B in %u prepare write(s), %.1f us through the sink on the host, %.0f MB/s\n",
+               (unsigned)lens[i], fragments, ns / TEST_TIMING_ROUNDS / 1000, lens[i] * TEST_TIMING_ROUNDS * 1e3 / ns);
+    }
+}
+
+static void test_soak(void)
+{
+    for (int i = 0; i < TEST_CONNS; i++) {
+        conn_reset(&s_conns[i]);
+    }
+
+    for (int step = 0; step < TEST_STEPS; step++) {
+        const int i = rand_next() % TEST_CONNS;
+        test_conn_t *c = &s_conns[i];
+
+        host_time_us += 1000;
+        if (rand_next() % 256 == 0) {
+            // Execute Write with the cancel flag, or a disconnect
+            long_write_cancel(&c->lw);
+            s_counts.cancelled++;
+            conn_reset(c);
+        } else if (c->lw.len == c->target) {
+            step_execute(i);
+        } else {
+            step_prepare(i);
+        }
+        check_pool();
+    }
+
+    for (int i = 0; i < TEST_CONNS; i++) {
+        long_write_cancel(&s_conns[i].lw);
+    }
+    check_pool();
+
+    CHECK(s_stats.executed == s_counts.executed);
+    CHECK(s_stats.bytes == s_counts.executed_bytes);
+    CHECK(s_stats.fragments == s_counts.executed_fragments);
+    CHECK(s_stats.segs.failures == s_counts.queue_full);
+
+    // The mix must have exercised every path
+    CHECK(s_counts.executed > 0 && s_counts.queue_full > 0 && s_counts.refused > 0 && s_counts.cancelled > 0);
+    printf("test_long_write: %u executed, %u queue full, %u refused, %u cancelled; %u segment(s) taken, "
+           "peak %u/%u\n", s_counts.executed, s_counts.queue_full, s_counts.refused, s_counts.cancelled,
+           (unsigned)s_stats.segs.allocs, s_stats.segs.high_water, CONFIG_EXAMPLE_LONG_WRITE_SEG_COUNT);
+}
+
+int main(void)
+{
+    test_pool_exhaustion();
+    test_throughput();
+    test_soak();
+    CHECK(s_heap_calls == 0);
+
+    printf("test_long_write: ok\n");
+    return 0;
+}
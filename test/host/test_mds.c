@@ -0,0 +1,527 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Host test of the MDS core (mds.c) against a simulated port and packetizer.
+*
+* The tasks never run, the test plays the producer (mds_chunk_ring_fill) and the pump
+* (mds_pump) itself and completes notifications one by one like a host stack would. mds.c is
+* included so those static functions can be called directly.
+*
+****************************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mds.c"
+
+#define TEST_CONN_ID 3
+#define TEST_MTU 247
+#define TEST_CHUNKS 200
+// Connection interval the port reports, 24 * 1.25 ms
+#define TEST_CONN_EVENT_MS 30
+// Slow packetizer: each chunk takes 1 ms, every 16th stalls for 25 ms more
+#define TEST_SLOW_CHUNK_MS 1
+#define TEST_SLOW_STALL_EVERY 16
+#define TEST_SLOW_STALL_MS 25
+
+int64_t host_time_us;
+
+// Notifications handed to the simulated stack and not completed yet, oldest first
+static struct {
+    uint8_t hdr[64];
+    uint32_t chunk[64];
+    unsigned head;
+    unsigned count;
+} s_air;
+
+// The gateway: the chunk index and sequence number it expects next. Chunks that arrive out of
+// order are discarded, as after a notification that was lost.
+static struct {
+    uint16_t conn_id;
+    uint32_t chunk;
+    uint8_t seq;
+    unsigned discarded;
+} s_gw;
+
+// Behavior of the simulated stack
+static struct {
+    // Complete every notification inside the send, as NimBLE does
+    bool sync;
+    // Fail that many sends, reporting the failure as a completion first if report_failure
+    int fail_sends;
+    bool report_failure;
+    // Copy every notification once more into a packet of its own, as Bluedroid does
+    bool copy;
+} s_port;
+
+static uint32_t s_next_chunk;
+static uint32_t s_chunk_limit;
+// Size of the chunks the packetizer hands out, their index is in the first bytes
+static size_t s_chunk_len = sizeof(uint32_t);
+static uint16_t s_mtu = TEST_MTU;
+static uint16_t s_tx_octets = 251;
+static uint8_t s_tx_buf[MDS_ATT_MAX_MTU];
+// While set, the packetizer only hands out a chunk once it has worked on it long enough
+static struct {
+    bool on;
+    int64_t ready_us;
+} s_slow;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+void memfault_platform_get_device_info(sMemfaultDeviceInfo *info)
+{
+    *info = (sMemfaultDeviceInfo) {
+        .device_serial = "HOST0001",
+    };
+}
+
+// Every chunk carries its own index, so the test can check order and completeness
+bool memfault_packetizer_get_chunk(void *buf, size_t *buf_len)
+{
+    if (s_next_chunk >= s_chunk_limit || *buf_len < sizeof(s_next_chunk)) {
+        return false;
+    }
+    if (s_slow.on) {
+        if (s_slow.ready_us == 0) {
+            const bool stall = s_next_chunk % TEST_SLOW_STALL_EVERY == 0;
+            s_slow.ready_us = host_time_us + (TEST_SLOW_CHUNK_MS + (stall ? TEST_SLOW_STALL_MS : 0)) * 1000;
+        }
+        if (host_time_us < s_slow.ready_us) {
+            return false;
+        }
+        s_slow.ready_us = 0;
+    }
+    memset(buf, 0, *buf_len);
+    memcpy(buf, &s_next_chunk, sizeof(s_next_chunk));
+    *buf_len = *buf_len < s_chunk_len ? *buf_len : s_chunk_len;
+    s_next_chunk++;
+    return true;
+}
+
+esp_err_t mds_port_tx_buf_get(uint16_t conn_id, uint16_t len, mds_tx_buf_t *buf)
+{
+    CHECK(len <= sizeof(s_tx_buf));
+    buf->data = s_tx_buf;
+    buf->priv = NULL;
+    return ESP_OK;
+}
+
+static void air_complete(int status);
+
+esp_err_t mds_port_tx_buf_send(uint16_t conn_id, mds_tx_buf_t *buf, uint16_t len)
+{
+    CHECK(conn_id == s_gw.conn_id);
+    CHECK(len <= s_mtu - MDS_ATT_HEADER_OVERHEAD);
+    if (s_port.fail_sends) {
+        s_port.fail_sends--;
+        if (s_port.report_failure) {
+            mds_on_tx_done(conn_id, ESP_FAIL);
+        }
+        return ESP_FAIL;
+    }
+
+    CHECK(s_air.count < sizeof(s_air.hdr));
+    const unsigned slot = (s_air.head + s_air.count++) % sizeof(s_air.hdr);
+    s_air.hdr[slot] = buf->data[0];
+    memcpy(&s_air.chunk[slot], &buf->data[1], sizeof(uint32_t));
+    if (s_port.copy) {
+        mds_on_tx_copy(len);
+    }
+    if (s_port.sync) {
+        air_complete(0);
+    }
+    return ESP_OK;
+}
+
+void mds_port_tx_buf_release(mds_tx_buf_t *buf)
+{
+}
+
+uint16_t mds_port_mtu_get(uint16_t conn_id)
+{
+    return s_mtu;
+}
+
+uint16_t mds_port_tx_octets_get(uint16_t conn_id)
+{
+    return s_tx_octets;
+}
+
+uint16_t mds_port_tx_sendable(uint16_t conn_id)
+{
+    return UINT16_MAX;
+}
+
+uint16_t mds_port_conn_interval_get(uint16_t conn_id)
+{
+    return 24;
+}
+
+// One round of both tasks, as after a wakeup: the pump releases entries, the producer refills
+// them and the pump sends
+static void tasks_run(void)
+{
+    mds_pump();
+    mds_chunk_ring_fill();
+    mds_pump();
+}
+
+// The stack reports the oldest notification done with status. A failed one never reaches
+// the gateway.
+static void air_complete(int status)
+{
+    CHECK(s_air.count > 0);
+    const unsigned slot = s_air.head;
+    s_air.head = (s_air.head + 1) % sizeof(s_air.hdr);
+    s_air.count--;
+
+    if (status == 0) {
+        if (s_air.chunk[slot] == s_gw.chunk) {
+            CHECK((s_air.hdr[slot] & MDS_CHUNK_NUMBER_MASK) == s_gw.seq);
+            s_gw.chunk++;
+            s_gw.seq = (s_gw.seq + 1) & MDS_CHUNK_NUMBER_MASK;
+        } else {
+            s_gw.discarded++;
+        }
+    }
+    mds_on_tx_done(s_gw.conn_id, status);
+}
+
+static void subscribe(uint16_t conn_id)
+{
+    const uint8_t enable = MDS_DATA_EXPORT_MODE_STREAMING_ENABLE;
+
+    s_gw.conn_id = conn_id;
+    s_gw.seq = 0;
+    CHECK(mds_cccd_write(conn_id, 0x0001) == MDS_ATT_ERR_NONE);
+    CHECK(mds_data_export_write(conn_id, &enable, sizeof(enable)) == MDS_ATT_ERR_NONE);
+    tasks_run();
+}
+
+// Completes everything in flight, and what the pump sends meanwhile, until the packetizer is
+// dry and every chunk was received
+static void drain(void)
+{
+    for (int rounds = 0; s_air.count || s_gw.chunk < s_chunk_limit; rounds++) {
+        CHECK(rounds < 10 * TEST_CHUNKS);
+        if (s_air.count) {
+            air_complete(0);
+        }
+        tasks_run();
+    }
+    // The wakeup of the last completion releases its entry
+    tasks_run();
+    CHECK(s_gw.chunk == s_chunk_limit);
+    CHECK(mds_chunk_ring_in_flight() == 0);
+    CHECK(atomic_load(&s_chunk_ring.tail) == atomic_load(&s_chunk_ring.head));
+}
+
+// Under a steady stream of completions the pipeline stays full at the configured depth
+static void test_pipeline_full(void)
+{
+    s_chunk_limit += TEST_CHUNKS;
+    subscribe(TEST_CONN_ID);
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+
+    while (s_next_chunk < s_chunk_limit) {
+        air_complete(0);
+        tasks_run();
+        CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+        CHECK(mds_chunk_ring_in_flight() == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+
+        mds_stats_t stats;
+        mds_stats_get(&stats);
+        CHECK(stats.depth == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+    }
+
+    drain();
+    CHECK(s_gw.discarded == 0);
+}
+
+// A failed notification is sent again, with the ones after it, once those have completed
+static void test_failure_resend(void)
+{
+    s_chunk_limit += TEST_CHUNKS;
+    mds_chunk_ring_fill();
+    tasks_run();
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+
+    const unsigned discarded = s_gw.discarded;
+    const uint32_t failed = s_air.chunk[s_air.head];
+    air_complete(ESP_FAIL);
+    tasks_run();
+    // Nothing new goes out while the rest of the window is still in flight
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT - 1);
+
+    for (int i = 1; i < CONFIG_EXAMPLE_MDS_PIPELINE_COUNT; i++) {
+        air_complete(0);
+        tasks_run();
+    }
+    // The window was refilled from the failed chunk on
+    CHECK(s_gw.discarded - discarded == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT - 1);
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+    CHECK(s_air.chunk[s_air.head] == failed);
+
+    drain();
+}
+
+// Completions reported for another connection don't release anything
+static void test_foreign_completion(void)
+{
+    s_chunk_limit += TEST_CHUNKS;
+    mds_chunk_ring_fill();
+    tasks_run();
+    CHECK(mds_chunk_ring_in_flight() == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+
+    mds_on_tx_done(TEST_CONN_ID + 1, 0);
+    mds_on_tx_done(TEST_CONN_ID + 1, ESP_FAIL);
+    tasks_run();
+    CHECK(mds_chunk_ring_in_flight() == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+    CHECK(!atomic_load(&s_chunk_ring.failed));
+
+    drain();
+}
+
+// Chunks still unconfirmed when the subscriber goes away go to the next one
+static void test_resubscribe(void)
+{
+    const unsigned discarded = s_gw.discarded;
+    s_chunk_limit += TEST_CHUNKS;
+    mds_chunk_ring_fill();
+    tasks_run();
+    air_complete(0);
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT - 1);
+
+    mds_on_disconnect(TEST_CONN_ID);
+    // The stack flushes the notifications of the dropped link
+    while (s_air.count) {
+        air_complete(ESP_FAIL);
+    }
+    tasks_run();
+
+    subscribe(TEST_CONN_ID + 1);
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+    CHECK((s_air.hdr[s_air.head] & MDS_CHUNK_NUMBER_MASK) == 0);
+
+    // The new gateway picks up right after the last chunk the old one received
+    drain();
+    CHECK(s_gw.discarded == discarded);
+}
+
+// A send the port refuses keeps its chunk for the next attempt
+static void test_send_error(void)
+{
+    s_chunk_limit += TEST_CHUNKS;
+    mds_chunk_ring_fill();
+    tasks_run();
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+
+    const unsigned discarded = s_gw.discarded;
+    const uint32_t expect = s_air.chunk[(s_air.head + s_air.count - 1) % sizeof(s_air.hdr)] + 1;
+    air_complete(0);
+    s_port.fail_sends = 1;
+    mds_pump();
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT - 1);
+    CHECK(mds_chunk_ring_in_flight() == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT - 1);
+
+    tasks_run();
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+    CHECK(s_air.chunk[(s_air.head + s_air.count - 1) % sizeof(s_air.hdr)] == expect);
+
+    drain();
+    CHECK(s_gw.discarded == discarded);
+}
+
+// A port that reports the failure as a completion from inside the send, like NimBLE, and then
+// returns the error: the chunk is still sent again and the window accounting stays sane
+static void test_send_error_reported(void)
+{
+    s_port.sync = true;
+    s_chunk_limit += TEST_CHUNKS;
+    s_port.fail_sends = 1;
+    s_port.report_failure = true;
+    mds_chunk_ring_fill();
+    mds_pump();
+    CHECK(mds_chunk_ring_in_flight() >= 0);
+    CHECK(s_air.count == 0);
+
+    const uint32_t expect = s_gw.chunk;
+    const unsigned discarded = s_gw.discarded;
+    tasks_run();
+    CHECK(mds_chunk_ring_in_flight() == 0);
+    CHECK(s_gw.chunk > expect);
+
+    drain();
+    CHECK(s_gw.discarded == discarded);
+    s_port.sync = false;
+    s_port.report_failure = false;
+}
+
+// Nothing is sent while the link is congested, the full window goes out once it drains
+static void test_congestion(void)
+{
+    mds_stats_t stats;
+
+    mds_stats_get(&stats);
+    const uint32_t episodes = stats.congest_episodes;
+
+    s_chunk_limit += TEST_CHUNKS;
+    mds_chunk_ring_fill();
+    tasks_run();
+    mds_on_congest(s_gw.conn_id, true);
+    while (s_air.count) {
+        air_complete(0);
+        tasks_run();
+    }
+    CHECK(mds_chunk_ring_in_flight() == 0);
+
+    host_time_us += 20000;
+    mds_on_congest(s_gw.conn_id, false);
+    tasks_run();
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+
+    mds_stats_get(&stats);
+    CHECK(stats.congest_episodes == episodes + 1);
+    CHECK(stats.congest_paused_ms >= 20);
+
+    drain();
+}
+
+// Chunks end on an LL PDU boundary, also while the port does not know the data length yet
+static void test_chunk_size(void)
+{
+    // One PDU of 251 bytes behind the L2CAP, ATT and MDS headers
+    CHECK(mds_chunk_data_length_get(TEST_CONN_ID, true) == 251 - 4 - 3 - 1);
+    s_tx_octets = 0;
+    CHECK(mds_chunk_data_length_get(TEST_CONN_ID, true) == 9 * BLE_CONN_DEFAULT_TX_OCTETS - 4 - 3 - 1);
+    s_tx_octets = 251;
+}
+
+// Each chunk is copied once, from the ring into the buffer the port lends, plus once per copy
+// the port reports. Prints the bytes copied per chunk for both kinds of port.
+static void test_tx_copies(void)
+{
+    const size_t chunk_len = 200;
+    mds_stats_t stats;
+    unsigned per_chunk[2];
+
+    s_chunk_len = chunk_len;
+    for (int copy = 0; copy < 2; copy++) {
+        s_port.copy = copy;
+        mds_stats_get(&stats);
+        s_chunk_limit += TEST_CHUNKS;
+        drain();
+
+        mds_stats_get(&stats);
+        CHECK(stats.tx_chunks == TEST_CHUNKS);
+        CHECK(stats.tx_bytes == TEST_CHUNKS * s_chunk_len);
+        // The port copies the one-byte MDS header too
+        CHECK(stats.tx_copied == (copy ? 2 * stats.tx_bytes + stats.tx_chunks : stats.tx_bytes));
+        per_chunk[copy] = stats.tx_copied / stats.tx_chunks;
+    }
+    s_port.copy = false;
+    s_chunk_len = sizeof(uint32_t);
+
+    printf("test_mds: %u B chunks, %u bytes copied per chunk into a lent buffer, %u with a copying port\n",
+           (unsigned)chunk_len, per_chunk[0], per_chunk[1]);
+}
+
+// The packetizer runs in the producer task, so its stalls don't reach the link: with chunks
+// prefetched, every connection event carries a full window. Time moves in 1 ms steps, the
+// producer runs every step and the stack sends what is in flight at each connection event.
+static void test_slow_packetizer(void)
+{
+    const unsigned events = 100;
+    unsigned min = UINT32_MAX;
+    unsigned max = 0;
+    uint32_t sent = 0;
+
+    s_chunk_limit += 3 * TEST_CHUNKS;
+    s_slow.on = true;
+    for (unsigned ms = 1; ms <= events * TEST_CONN_EVENT_MS; ms++) {
+        host_time_us += 1000;
+        mds_chunk_ring_fill();
+        if (ms % TEST_CONN_EVENT_MS) {
+            continue;
+        }
+
+        while (s_air.count) {
+            air_complete(0);
+        }
+        tasks_run();
+        // The first event finds the ring still filling
+        if (ms > TEST_CONN_EVENT_MS) {
+            min = s_air.count < min ? s_air.count : min;
+            max = s_air.count > max ? s_air.count : max;
+            sent += s_air.count;
+        }
+    }
+    s_slow.on = false;
+    CHECK(min == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT && max == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+    // The stalls were hit
+    CHECK(sent > 2 * TEST_SLOW_STALL_EVERY);
+
+    printf("test_mds: packetizer stalling %d ms every %d chunks, %u-%u notifications per %d ms "
+           "connection event\n", TEST_SLOW_STALL_MS, TEST_SLOW_STALL_EVERY, min, max, TEST_CONN_EVENT_MS);
+    drain();
+}
+
+// Chunks prefetched for a link with a larger MTU wait for the MTU exchange of the next one.
+// They can't be cut, so the ones that still don't fit are dropped and the rest goes through.
+static void test_smaller_mtu(void)
+{
+    const unsigned discarded = s_gw.discarded;
+
+    s_chunk_len = 100;
+    s_chunk_limit += TEST_CHUNKS;
+    tasks_run();
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+
+    mds_on_disconnect(s_gw.conn_id);
+    while (s_air.count) {
+        air_complete(ESP_FAIL);
+    }
+    tasks_run();
+    s_gw.chunk = s_next_chunk;
+
+    s_mtu = MDS_ATT_DEFAULT_MTU;
+    subscribe(TEST_CONN_ID + 2);
+    CHECK(s_air.count == 0);
+
+    s_mtu = 64;
+    mds_on_mtu_changed(TEST_CONN_ID + 2);
+    drain();
+    CHECK(s_gw.discarded == discarded);
+}
+
+int main(void)
+{
+    CHECK(mds_init() == ESP_OK);
+
+    test_pipeline_full();
+    test_failure_resend();
+    test_foreign_completion();
+    test_send_error();
+    test_send_error_reported();
+    test_congestion();
+    test_resubscribe();
+    test_chunk_size();
+    test_tx_copies();
+    test_slow_packetizer();
+    test_smaller_mtu();
+
+    printf("test_mds: ok\n");
+    return 0;
+}
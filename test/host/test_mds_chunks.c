@@ -0,0 +1,511 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Host test of MDS multi-packet chunks (CONFIG_EXAMPLE_MDS_MULTI_PACKET_CHUNKS) against a
+* simulated port, packetizer and gateway. Built a second time with
+* CONFIG_EXAMPLE_MDS_COMPRESSION.
+*
+* The packetizer holds messages of known sizes and marks one read as soon as its last byte
+* was handed out, like the Memfault SDK. The gateway reassembles chunks by the "more data"
+* bit, decompresses them if it opted in, and uploads each complete one. Whatever happens to
+* the link, the uploads must add up to exactly the messages written, in order. mds.c is
+* included so the producer and pump task bodies can be called directly.
+*
+****************************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mds.c"
+#include "lz_decode.h"
+
+#define TEST_CONN_ID 3
+// 60 byte chunks, the ring holds a message of up to 8 * 60 bytes as one chunk
+#define TEST_MTU 64
+#define TEST_MSG_MAX 64
+#define TEST_STREAM_MAX 32768
+#define TEST_AIR_MAX 64
+
+int64_t host_time_us;
+
+// Messages written to Memfault storage and the packetizer's read position
+static struct {
+    uint16_t len[TEST_MSG_MAX];
+    // Content repeats every 48 bytes and compresses well, otherwise it hardly compresses
+    bool repetitive[TEST_MSG_MAX];
+    unsigned count;
+    unsigned next;
+    size_t offset;
+    bool active;
+    bool multi;
+} s_pkt;
+
+// Notifications handed to the simulated stack and not completed yet, oldest first
+static struct {
+    uint8_t data[TEST_AIR_MAX][MDS_ATT_MAX_MTU];
+    uint16_t len[TEST_AIR_MAX];
+    unsigned head;
+    unsigned count;
+} s_air;
+
+// The gateway: the sequence number it expects next and the chunk it is reassembling. A
+// notification that arrives out of order is discarded, the device sends it again.
+static struct {
+    uint16_t conn_id;
+    bool compress;
+    uint8_t seq;
+    uint8_t partial[TEST_STREAM_MAX];
+    size_t partial_len;
+    unsigned partial_packets;
+    bool partial_compressed;
+    unsigned chunks;
+    unsigned multi_packet_chunks;
+    unsigned compressed_chunks;
+} s_gw;
+
+// What the gateways uploaded, and what was written to storage
+static uint8_t s_uploaded[TEST_STREAM_MAX];
+static size_t s_uploaded_len;
+static size_t s_written_len;
+
+static uint8_t s_tx_buf[MDS_ATT_MAX_MTU];
+static uint16_t s_mtu = TEST_MTU;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static uint8_t msg_byte(unsigned msg, size_t offset)
+{
+    if (s_pkt.repetitive[msg]) {
+        return (uint8_t)(msg * 37 + (offset % 48) * 5);
+    }
+    return (uint8_t)(msg * 37 + offset * 7 + (offset >> 8));
+}
+
+static uint8_t stream_byte(size_t pos)
+{
+    unsigned msg = 0;
+
+    while (pos >= s_pkt.len[msg]) {
+        pos -= s_pkt.len[msg++];
+    }
+    return msg_byte(msg, pos);
+}
+
+static void msg_write(uint16_t len, bool repetitive)
+{
+    CHECK(s_pkt.count < TEST_MSG_MAX);
+    s_pkt.repetitive[s_pkt.count] = repetitive;
+    s_pkt.len[s_pkt.count++] = len;
+    s_written_len += len;
+    CHECK(s_written_len <= TEST_STREAM_MAX);
+}
+
+void memfault_platform_get_device_info(sMemfaultDeviceInfo *info)
+{
+    *info = (sMemfaultDeviceInfo) {
+        .device_serial = "HOST0001",
+    };
+}
+
+bool memfault_packetizer_get_chunk(void *buf, size_t *buf_len)
+{
+    CHECK(false);
+    return false;
+}
+
+// The configuration only applies when a new message is loaded
+bool memfault_packetizer_begin(const sPacketizerConfig *cfg, sPacketizerMetadata *metadata)
+{
+    if (!s_pkt.active) {
+        if (s_pkt.next == s_pkt.count) {
+            return false;
+        }
+        s_pkt.active = true;
+        s_pkt.multi = cfg->enable_multi_packet_chunk;
+        s_pkt.offset = 0;
+    }
+    metadata->single_chunk_message_length = s_pkt.len[s_pkt.next];
+    metadata->send_in_progress = s_pkt.offset != 0;
+    return true;
+}
+
+eMemfaultPacketizerStatus memfault_packetizer_get_next(void *buf, size_t *buf_len)
+{
+    if (!s_pkt.active) {
+        return kMemfaultPacketizerStatus_NoMoreData;
+    }
+
+    const size_t left = s_pkt.len[s_pkt.next] - s_pkt.offset;
+    const size_t len = left < *buf_len ? left : *buf_len;
+    for (size_t i = 0; i < len; i++) {
+        ((uint8_t *)buf)[i] = msg_byte(s_pkt.next, s_pkt.offset + i);
+    }
+    s_pkt.offset += len;
+    *buf_len = len;
+
+    // The message is gone from storage once its last byte was read
+    if (s_pkt.offset == s_pkt.len[s_pkt.next]) {
+        s_pkt.active = false;
+        s_pkt.next++;
+        return kMemfaultPacketizerStatus_EndOfChunk;
+    }
+    return s_pkt.multi ? kMemfaultPacketizerStatus_MoreDataForChunk : kMemfaultPacketizerStatus_EndOfChunk;
+}
+
+void memfault_packetizer_abort(void)
+{
+    s_pkt.active = false;
+}
+
+esp_err_t mds_port_tx_buf_get(uint16_t conn_id, uint16_t len, mds_tx_buf_t *buf)
+{
+    CHECK(len <= sizeof(s_tx_buf));
+    buf->data = s_tx_buf;
+    buf->priv = NULL;
+    return ESP_OK;
+}
+
+esp_err_t mds_port_tx_buf_send(uint16_t conn_id, mds_tx_buf_t *buf, uint16_t len)
+{
+    CHECK(conn_id == s_gw.conn_id);
+    CHECK(len <= s_mtu - MDS_ATT_HEADER_OVERHEAD);
+    CHECK(s_air.count < TEST_AIR_MAX);
+
+    const unsigned slot = (s_air.head + s_air.count++) % TEST_AIR_MAX;
+    memcpy(s_air.data[slot], buf->data, len);
+    s_air.len[slot] = len;
+    return ESP_OK;
+}
+
+void mds_port_tx_buf_release(mds_tx_buf_t *buf)
+{
+}
+
+uint16_t mds_port_mtu_get(uint16_t conn_id)
+{
+    return s_mtu;
+}
+
+uint16_t mds_port_tx_octets_get(uint16_t conn_id)
+{
+    return 251;
+}
+
+uint16_t mds_port_tx_sendable(uint16_t conn_id)
+{
+    return UINT16_MAX;
+}
+
+uint16_t mds_port_conn_interval_get(uint16_t conn_id)
+{
+    return 24;
+}
+
+static void tasks_run(void)
+{
+    mds_pump();
+    mds_chunk_ring_fill();
+    mds_pump();
+}
+
+static void gw_chunk_upload(void)
+{
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+    if (s_gw.partial_compressed) {
+        CHECK(s_gw.compress);
+        const size_t len = lz_decode(s_gw.partial, s_gw.partial_len, &s_uploaded[s_uploaded_len],
+                                     sizeof(s_uploaded) - s_uploaded_len);
+        CHECK(len != SIZE_MAX);
+        s_uploaded_len += len;
+        s_gw.compressed_chunks++;
+    } else
+#endif
+    {
+        CHECK(!s_gw.partial_compressed);
+        CHECK(s_uploaded_len + s_gw.partial_len <= sizeof(s_uploaded));
+        memcpy(&s_uploaded[s_uploaded_len], s_gw.partial, s_gw.partial_len);
+        s_uploaded_len += s_gw.partial_len;
+    }
+
+    s_gw.chunks++;
+    if (s_gw.partial_packets > 1) {
+        s_gw.multi_packet_chunks++;
+    }
+    s_gw.partial_len = 0;
+    s_gw.partial_packets = 0;
+}
+
+static void gw_receive(const uint8_t *data, uint16_t len)
+{
+    const uint8_t hdr = data[0];
+
+    if ((hdr & MDS_CHUNK_NUMBER_MASK) != s_gw.seq) {
+        return;
+    }
+    s_gw.seq = (s_gw.seq + 1) & MDS_CHUNK_NUMBER_MASK;
+
+    // Every packet of a chunk carries the same compressed bit
+    const bool compressed = hdr & MDS_DATA_EXPORT_HDR_COMPRESSED;
+    CHECK(s_gw.partial_packets == 0 || compressed == s_gw.partial_compressed);
+    s_gw.partial_compressed = compressed;
+
+    CHECK(s_gw.partial_len + len - 1 <= sizeof(s_gw.partial));
+    memcpy(&s_gw.partial[s_gw.partial_len], &data[1], len - 1);
+    s_gw.partial_len += len - 1;
+    s_gw.partial_packets++;
+    if (!(hdr & MDS_DATA_EXPORT_HDR_MORE_DATA)) {
+        gw_chunk_upload();
+    }
+}
+
+// The stack reports the oldest notification done with status. A failed one never reaches
+// the gateway.
+static void air_complete(int status)
+{
+    CHECK(s_air.count > 0);
+    const unsigned slot = s_air.head;
+    s_air.head = (s_air.head + 1) % TEST_AIR_MAX;
+    s_air.count--;
+
+    if (status == 0) {
+        gw_receive(s_air.data[slot], s_air.len[slot]);
+    }
+    mds_on_tx_done(s_gw.conn_id, status);
+}
+
+// A new gateway starts with nothing reassembled
+static void subscribe(uint16_t conn_id, uint8_t mode)
+{
+    const uint8_t enable = mode;
+
+    s_gw.conn_id = conn_id;
+    s_gw.compress = mode == MDS_DATA_EXPORT_MODE_STREAMING_COMPRESSED;
+    s_gw.seq = 0;
+    s_gw.partial_len = 0;
+    s_gw.partial_packets = 0;
+    CHECK(mds_cccd_write(conn_id, 0x0001) == MDS_ATT_ERR_NONE);
+    CHECK(mds_data_export_write(conn_id, &enable, sizeof(enable)) == MDS_ATT_ERR_NONE);
+    tasks_run();
+}
+
+// The link drops with notifications still in flight, the stack flushes them
+static void disconnect(void)
+{
+    mds_on_disconnect(s_gw.conn_id);
+    while (s_air.count) {
+        air_complete(ESP_FAIL);
+    }
+    tasks_run();
+}
+
+// Completes notifications until everything written was uploaded, then checks it was
+// uploaded exactly once and in order
+static void drain(void)
+{
+    for (int rounds = 0; s_air.count || s_uploaded_len < s_written_len; rounds++) {
+        CHECK(rounds < 10000);
+        if (s_air.count) {
+            air_complete(0);
+        }
+        tasks_run();
+    }
+    tasks_run();
+
+    CHECK(s_uploaded_len == s_written_len);
+    for (size_t i = 0; i < s_uploaded_len; i++) {
+        CHECK(s_uploaded[i] == stream_byte(i));
+    }
+    CHECK(s_gw.partial_len == 0);
+    CHECK(mds_chunk_ring_in_flight() == 0);
+    CHECK(atomic_load(&s_chunk_ring.tail) == atomic_load(&s_chunk_ring.head));
+}
+
+// Messages that fit the ring go as one chunk each, larger ones as single-packet chunks
+static void test_messages(void)
+{
+    const unsigned chunks = s_gw.chunks;
+    const unsigned multi_packet_chunks = s_gw.multi_packet_chunks;
+
+    msg_write(30, false);
+    msg_write(200, false);
+    msg_write(MDS_PREFETCH_DEPTH * 60, false);
+    msg_write(2000, false);
+    msg_write(10, false);
+    subscribe(TEST_CONN_ID, MDS_DATA_EXPORT_MODE_STREAMING_ENABLE);
+
+    drain();
+    CHECK(s_gw.multi_packet_chunks - multi_packet_chunks == 2);
+    CHECK(s_gw.chunks - chunks == 1 + 1 + 1 + (2000 + 59) / 60 + 1);
+}
+
+// A gateway that goes away mid-chunk only received part of it, the next one gets the whole
+// chunk although the packetizer already consumed the message
+static void test_resync_mid_chunk(void)
+{
+    msg_write(450, false);
+    tasks_run();
+    CHECK(s_pkt.next == s_pkt.count);
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+
+    air_complete(0);
+    air_complete(0);
+    CHECK(s_gw.partial_packets == 2);
+    disconnect();
+
+    subscribe(TEST_CONN_ID + 1, MDS_DATA_EXPORT_MODE_STREAMING_ENABLE);
+    CHECK(s_air.count == CONFIG_EXAMPLE_MDS_PIPELINE_COUNT);
+    CHECK(s_air.data[s_air.head][0] == MDS_DATA_EXPORT_HDR_MORE_DATA);
+    CHECK(s_air.data[s_air.head][1] == msg_byte(s_pkt.count - 1, 0));
+
+    drain();
+}
+
+// A failed notification in the middle of a chunk is sent again, the chunk stays whole
+static void test_failure_mid_chunk(void)
+{
+    const unsigned chunks = s_gw.chunks;
+
+    msg_write(400, false);
+    tasks_run();
+    air_complete(0);
+    air_complete(ESP_FAIL);
+    tasks_run();
+
+    drain();
+    CHECK(s_gw.chunks - chunks == 1);
+}
+
+// Single-packet chunks of a large message continue where the earlier gateway stopped
+static void test_resync_single_packet(void)
+{
+    msg_write(1000, false);
+    tasks_run();
+    air_complete(0);
+    air_complete(0);
+    disconnect();
+
+    subscribe(TEST_CONN_ID, MDS_DATA_EXPORT_MODE_STREAMING_ENABLE);
+    drain();
+}
+
+// Entries prefetched for a link with a larger MTU go to the next gateway as several packets
+// each, one at a time. A failed one is sent again.
+static void test_smaller_mtu(void)
+{
+    const unsigned multi_packet_chunks = s_gw.multi_packet_chunks;
+
+    disconnect();
+    s_mtu = 2 * TEST_MTU;
+    subscribe(TEST_CONN_ID, MDS_DATA_EXPORT_MODE_STREAMING_ENABLE);
+    msg_write(450, false);
+    msg_write(600, false);
+    msg_write(1000, false);
+    tasks_run();
+    air_complete(0);
+    CHECK(s_gw.partial_packets == 1);
+    disconnect();
+
+    s_mtu = TEST_MTU;
+    subscribe(TEST_CONN_ID + 1, MDS_DATA_EXPORT_MODE_STREAMING_ENABLE);
+    CHECK(s_air.count == 1);
+    air_complete(0);
+    tasks_run();
+    CHECK(s_air.count == 1);
+    air_complete(ESP_FAIL);
+    tasks_run();
+
+    drain();
+    CHECK(s_gw.multi_packet_chunks - multi_packet_chunks >= 2);
+}
+
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+// Messages that fit the compressor window and the ring are compressed, others go as before
+static void test_compressed(void)
+{
+    const unsigned compressed_chunks = s_gw.compressed_chunks;
+
+    disconnect();
+    subscribe(TEST_CONN_ID, MDS_DATA_EXPORT_MODE_STREAMING_COMPRESSED);
+    msg_write(300, true);
+    msg_write(2000, true);
+    msg_write(300, false);
+    msg_write(60, true);
+    tasks_run();
+
+    drain();
+    CHECK(s_gw.compressed_chunks - compressed_chunks == 3);
+}
+
+// A compressed chunk the packetizer already consumed, partly received by a gateway that
+// opted in, goes uncompressed to the next gateway that did not
+static void test_compressed_downgrade(void)
+{
+    const unsigned compressed_chunks = s_gw.compressed_chunks;
+
+    msg_write(380, false);
+    tasks_run();
+    CHECK(s_pkt.next == s_pkt.count);
+    CHECK(s_air.data[s_air.head][0] & MDS_DATA_EXPORT_HDR_COMPRESSED);
+    air_complete(0);
+    air_complete(0);
+    disconnect();
+
+    subscribe(TEST_CONN_ID + 1, MDS_DATA_EXPORT_MODE_STREAMING_ENABLE);
+    drain();
+    CHECK(s_gw.compressed_chunks == compressed_chunks);
+}
+
+// A gateway that switches to uncompressed streaming gets the chunks prefetched for it
+// compressed uncompressed instead
+static void test_compressed_mode_switch(void)
+{
+    const uint8_t enable = MDS_DATA_EXPORT_MODE_STREAMING_ENABLE;
+    const unsigned compressed_chunks = s_gw.compressed_chunks;
+
+    disconnect();
+    subscribe(TEST_CONN_ID, MDS_DATA_EXPORT_MODE_STREAMING_COMPRESSED);
+    mds_on_congest(s_gw.conn_id, true);
+    msg_write(200, true);
+    tasks_run();
+    CHECK(s_air.count == 0);
+    CHECK(s_chunk_ring.chunks[atomic_load(&s_chunk_ring.tail) % MDS_PREFETCH_DEPTH].compressed);
+
+    CHECK(mds_data_export_write(s_gw.conn_id, &enable, sizeof(enable)) == MDS_ATT_ERR_NONE);
+    s_gw.compress = false;
+    mds_on_congest(s_gw.conn_id, false);
+    tasks_run();
+
+    drain();
+    CHECK(s_gw.compressed_chunks == compressed_chunks);
+}
+#endif
+
+int main(void)
+{
+    CHECK(mds_init() == ESP_OK);
+
+    test_messages();
+    test_resync_mid_chunk();
+    test_failure_mid_chunk();
+    test_resync_single_packet();
+    test_smaller_mtu();
+#if CONFIG_EXAMPLE_MDS_COMPRESSION
+    test_compressed();
+    test_compressed_downgrade();
+    test_compressed_mode_switch();
+#endif
+
+    printf("test_mds_chunks: ok\n");
+    return 0;
+}
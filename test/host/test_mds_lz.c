@@ -0,0 +1,175 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Host benchmark of the MDS chunk compressor (mds_lz.c) on samples shaped like what MDS
+* exports: a task stack from a coredump, a log capture and, as the worst case, random bytes.
+*
+* Each sample is one message of 1 KiB, the largest that is compressed, fed to the compressor
+* in MDS_LZ_BLOCK_SIZE blocks like the producer task does. The output must decode back to the
+* sample. The test prints the ratio, the host time per byte and how long a gateway takes to
+* drain the message at common MTUs, raw and compressed, with CONFIG_EXAMPLE_MDS_PIPELINE_COUNT
+* notifications per 30 ms connection event. The CONFIG_EXAMPLE_BLE_BENCH report gives the
+* CPU cycles per byte on the device.
+*
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdkconfig.h"
+#include "mds_lz.h"
+#include "lz_decode.h"
+
+#define TEST_SAMPLE_LEN 1024
+#define TEST_SEED 0x2545f491u
+#define TEST_TIMING_ROUNDS 2000
+#define TEST_CONN_EVENT_MS 30
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static const uint16_t s_mtus[] = {23, 185, 247};
+
+static mds_lz_t s_lz;
+static uint32_t s_rand = TEST_SEED;
+
+// xorshift32, so every run sees the same samples
+static uint32_t rand_next(void)
+{
+    s_rand ^= s_rand << 13;
+    s_rand ^= s_rand >> 17;
+    s_rand ^= s_rand << 5;
+    return s_rand;
+}
+
+static void word_put(uint8_t *p, uint32_t word)
+{
+    memcpy(p, &word, sizeof(word));
+}
+
+// Register frame, the unused part of a stack still holding the FreeRTOS fill pattern, the
+// used part with return addresses, stack pointers and small values, and some zeroed .bss
+static void sample_coredump(uint8_t *buf)
+{
+    size_t i = 0;
+
+    for (; i < 256; i += 4) {
+        const uint32_t r = rand_next();
+        const uint32_t words[] = {0x400d0000 | (r & 0xfffc), 0x3ffb0000 | (r & 0xfff0), r & 0xff, 0};
+        word_put(&buf[i], words[r >> 30]);
+    }
+    for (; i < 640; i += 4) {
+        word_put(&buf[i], 0xa5a5a5a5);
+    }
+    for (; i < 896; i += 4) {
+        const uint32_t r = rand_next();
+        const uint32_t words[] = {0x400d2000 | (r & 0x0ffc), 0x3ffb8000 | (i & 0x0ff0), r & 0x3, 0};
+        word_put(&buf[i], words[r >> 30]);
+    }
+    for (; i < TEST_SAMPLE_LEN; i += 4) {
+        word_put(&buf[i], rand_next() % 8 == 0 ? rand_next() & 0xffff : 0);
+    }
+}
+
+static void sample_log(uint8_t *buf)
+{
+    char line[96];
+    size_t len = 0;
+    unsigned ms = 52310;
+
+    while (len < TEST_SAMPLE_LEN) {
+        ms += rand_next() % 40;
+        const int n = rand_next() % 4 ?
+                      snprintf(line, sizeof(line), "I (%u) MDS: Memfault diagnostic data chunk %u sent, %u bytes\n",
+                               ms, (unsigned)(rand_next() % 32), 243) :
+                      snprintf(line, sizeof(line), "W (%u) GATTS_DEMO: conn_id %u congested\n", ms,
+                               (unsigned)(rand_next() % 4));
+        const size_t take = len + n <= TEST_SAMPLE_LEN ? (size_t)n : TEST_SAMPLE_LEN - len;
+        memcpy(&buf[len], line, take);
+        len += take;
+    }
+}
+
+static void sample_random(uint8_t *buf)
+{
+    for (size_t i = 0; i < TEST_SAMPLE_LEN; i++) {
+        buf[i] = rand_next();
+    }
+}
+
+// One stream, in blocks like the producer task
+static size_t compress(const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t out_len = 0;
+
+    mds_lz_init(&s_lz);
+    for (size_t off = 0; off < len; off += MDS_LZ_BLOCK_SIZE) {
+        const size_t n = len - off < MDS_LZ_BLOCK_SIZE ? len - off : MDS_LZ_BLOCK_SIZE;
+        out_len += mds_lz_compress(&s_lz, &in[off], n, &out[out_len]);
+    }
+    return out_len + mds_lz_flush(&s_lz, &out[out_len]);
+}
+
+// Time to drain len bytes through notifications of MTU - 3 ATT - 1 MDS header bytes
+static unsigned drain_ms(size_t len, uint16_t mtu)
+{
+    const size_t payload = mtu - 3 - 1;
+    const size_t notifications = (len + payload - 1) / payload;
+    const size_t events = (notifications + CONFIG_EXAMPLE_MDS_PIPELINE_COUNT - 1) / CONFIG_EXAMPLE_MDS_PIPELINE_COUNT;
+
+    return events * TEST_CONN_EVENT_MS;
+}
+
+// Returns the compression ratio times 100
+static unsigned bench(const char *name, void (*sample)(uint8_t *buf))
+{
+    static uint8_t in[TEST_SAMPLE_LEN];
+    static uint8_t out[MDS_LZ_OUT_MAX(TEST_SAMPLE_LEN)];
+    static uint8_t decoded[TEST_SAMPLE_LEN];
+
+    sample(in);
+    const size_t out_len = compress(in, sizeof(in), out);
+    CHECK(out_len <= sizeof(out));
+    CHECK(lz_decode(out, out_len, decoded, sizeof(decoded)) == sizeof(in));
+    CHECK(memcmp(in, decoded, sizeof(in)) == 0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < TEST_TIMING_ROUNDS; i++) {
+        CHECK(compress(in, sizeof(in), out) == out_len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+    const unsigned ratio_x100 = sizeof(in) * 100 / out_len;
+    printf("test_mds_lz: %-8s %u -> %4u B, ratio %u.%02u, %.1f ns/B on the host; drain at MTU",
+           name, (unsigned)sizeof(in), (unsigned)out_len, ratio_x100 / 100, ratio_x100 % 100,
+           ns / TEST_TIMING_ROUNDS / sizeof(in));
+    for (size_t i = 0; i < sizeof(s_mtus) / sizeof(s_mtus[0]); i++) {
+        printf(" %u: %u -> %u ms%s", s_mtus[i], drain_ms(sizeof(in), s_mtus[i]), drain_ms(out_len, s_mtus[i]),
+               i + 1 < sizeof(s_mtus) / sizeof(s_mtus[0]) ? "," : "\n");
+    }
+    return ratio_x100;
+}
+
+int main(void)
+{
+    // Coredumps and logs at least halve, random data grows by at most the flag bytes
+    CHECK(bench("coredump", sample_coredump) >= 200);
+    CHECK(bench("log", sample_log) >= 200);
+    CHECK(bench("random", sample_random) >= 100 * 8 / 9);
+
+    printf("test_mds_lz: ok\n");
+    return 0;
+}
@@ -0,0 +1,295 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Memfault, Inc.
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/****************************************************************************
+*
+* Host test of the notification coalescing window (notify_coalesce.c) in front of a value
+* cache, fed like the demo sensor at 1 kHz, against simulated one-shot timers.
+*
+* Subscribers are connections of the ble_conn.h pool with their ATT_MTU and connection
+* interval. Sends are recorded per connection and confirmed at the next millisecond. In latest
+* mode each subscriber must get one notification per window, carrying the newest record, no
+* later than one window after it was submitted. In append mode a window carries the records
+* that fit the smallest ATT_MTU, in order, and drops the rest. The test prints the update,
+* window and notification counts and the latency for each case.
+*
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ble_conn.h"
+#include "notify_coalesce.h"
+
+#define TEST_CONN_A 0
+#define TEST_CONN_B 1
+#define TEST_TIMER_MAX 4
+// Like the demo: sequence number and sample, a batch fills a 251-byte LL payload
+#define TEST_RECORD_LEN 4
+#define TEST_VALUE_MAX (251 - 4 - 3)
+#define TEST_UPDATES 1000
+
+int64_t host_time_us;
+
+struct esp_timer {
+    bool used;
+    bool armed;
+    int64_t at_us;
+    esp_timer_create_args_t args;
+};
+
+static struct esp_timer s_timers[TEST_TIMER_MAX];
+
+// Notifications per connection since the last reset, and the stack's unconfirmed ones
+static struct {
+    unsigned count;
+    unsigned unconfirmed;
+    uint16_t len;
+    uint8_t pdu[TEST_VALUE_MAX];
+} s_sent[BLE_CONN_MAX];
+
+static uint16_t s_seq;
+static uint8_t s_last_record[TEST_RECORD_LEN];
+
+VALUE_CACHE_DEFINE(s_cache, TEST_VALUE_MAX, false);
+NOTIFY_COALESCE_DEFINE(s_co, TEST_VALUE_MAX);
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+    for (int i = 0; i < TEST_TIMER_MAX; i++) {
+        if (!s_timers[i].used) {
+            s_timers[i] = (struct esp_timer) {
+                .used = true,
+                .args = *args,
+            };
+            *handle = &s_timers[i];
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    CHECK(timer->used);
+    if (timer->armed) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = true;
+    timer->at_us = host_time_us + timeout_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    CHECK(timer->used);
+    if (!timer->armed) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    CHECK(timer->used && !timer->armed);
+    timer->used = false;
+    return ESP_OK;
+}
+
+// Moves the clock forward by ms, firing the timers that expire on the way in order
+static void time_advance(uint32_t ms)
+{
+    const int64_t end_us = host_time_us + ms * 1000LL;
+
+    for (;;) {
+        struct esp_timer *next = NULL;
+
+        for (int i = 0; i < TEST_TIMER_MAX; i++) {
+            if (s_timers[i].used && s_timers[i].armed && s_timers[i].at_us <= end_us &&
+                (next == NULL || s_timers[i].at_us < next->at_us)) {
+                next = &s_timers[i];
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        host_time_us = next->at_us > host_time_us ? next->at_us : host_time_us;
+        next->armed = false;
+        next->args.callback(next->args.arg);
+    }
+    host_time_us = end_us;
+}
+
+static esp_err_t notify_send(uint16_t conn_id, const uint8_t *pdu, uint16_t len, void *ctx)
+{
+    CHECK(conn_id < BLE_CONN_MAX && len <= TEST_VALUE_MAX);
+    s_sent[conn_id].count++;
+    s_sent[conn_id].unconfirmed++;
+    s_sent[conn_id].len = len;
+    memcpy(s_sent[conn_id].pdu, pdu, len);
+    return ESP_OK;
+}
+
+// The stack is done with everything sent so far
+static void confirm_all(void)
+{
+    for (uint16_t conn_id = 0; conn_id < BLE_CONN_MAX; conn_id++) {
+        for (; s_sent[conn_id].unconfirmed; s_sent[conn_id].unconfirmed--) {
+            value_cache_confirm(&s_cache, conn_id);
+        }
+    }
+}
+
+static void subscribe(uint16_t conn_id, uint16_t mtu, uint16_t conn_interval)
+{
+    ble_conn_t *conn = ble_conn_open(conn_id);
+
+    CHECK(conn != NULL);
+    conn->mtu = mtu;
+    conn->conn_interval = conn_interval;
+    CHECK(value_cache_subscribe(&s_cache, conn_id) == ESP_OK);
+}
+
+static void unsubscribe(uint16_t conn_id)
+{
+    value_cache_unsubscribe(&s_cache, conn_id);
+    ble_conn_close(conn_id);
+}
+
+// Numbered record like demo_sensor.c, every one differs from the previous
+static esp_err_t submit_next(void)
+{
+    const uint16_t sample = s_seq / 16;
+    const uint8_t record[TEST_RECORD_LEN] = {
+        s_seq & 0xff, s_seq >> 8, sample & 0xff, sample >> 8,
+    };
+
+    memcpy(s_last_record, record, sizeof(record));
+    s_seq++;
+    return notify_coalesce_submit(&s_co, record, sizeof(record));
+}
+
+// One update per millisecond for TEST_UPDATES ms, then the last window runs out
+static void feed_1khz(notify_coalesce_stats_t *stats, uint32_t window_ms)
+{
+    memset(s_sent, 0, sizeof(s_sent));
+    notify_coalesce_stats_get(&s_co, stats);
+
+    for (int i = 0; i < TEST_UPDATES; i++) {
+        submit_next();
+        time_advance(1);
+        confirm_all();
+    }
+    time_advance(window_ms);
+    confirm_all();
+    notify_coalesce_stats_get(&s_co, stats);
+}
+
+static void report(const char *name, const notify_coalesce_stats_t *stats, uint32_t window_ms)
+{
+    printf("test_notify_coalesce: %-14s %u ms window: %u updates -> %u windows, %u superseded, %u dropped, "
+           "%u notifications, latency %u us avg, %u us max\n", name, window_ms, (unsigned)stats->updates,
+           (unsigned)stats->windows, (unsigned)stats->superseded, (unsigned)stats->dropped,
+           (unsigned)stats->notifications, (unsigned)(stats->latency_us / stats->windows),
+           (unsigned)stats->latency_max_us);
+}
+
+// One notification per subscriber and window, with the newest record and at most one window
+// after it was submitted. The window follows the slowest subscriber's connection interval.
+static void test_latest(void)
+{
+    notify_coalesce_stats_t stats;
+
+    CHECK(notify_coalesce_init(&s_co, &s_cache, NOTIFY_COALESCE_LATEST, 0, notify_send, NULL) == ESP_OK);
+    subscribe(TEST_CONN_A, 247, 24);    // 30 ms
+    subscribe(TEST_CONN_B, 23, 40);     // 50 ms
+
+    for (int pass = 0; pass < 2; pass++) {
+        const uint32_t window_ms = pass == 0 ? 50 : 30;
+        const unsigned windows = (TEST_UPDATES + window_ms - 1) / window_ms;
+
+        feed_1khz(&stats, window_ms);
+        CHECK(stats.updates == TEST_UPDATES && stats.dropped == 0);
+        CHECK(stats.windows == windows && stats.superseded == TEST_UPDATES - windows);
+        CHECK(stats.latency_max_us <= window_ms * 1000);
+        CHECK(s_sent[TEST_CONN_A].count == windows);
+        CHECK(s_sent[TEST_CONN_A].len == TEST_RECORD_LEN);
+        CHECK(memcmp(s_sent[TEST_CONN_A].pdu, s_last_record, TEST_RECORD_LEN) == 0);
+        if (pass == 0) {
+            CHECK(s_sent[TEST_CONN_B].count == windows && stats.notifications == 2 * windows);
+            report("latest, 2 subs", &stats, window_ms);
+            // The 50 ms subscriber leaves, the next windows follow the 30 ms one
+            unsubscribe(TEST_CONN_B);
+        } else {
+            CHECK(s_sent[TEST_CONN_B].count == 0 && stats.notifications == windows);
+            report("latest, 1 sub", &stats, window_ms);
+        }
+    }
+
+    // Every record sent was the newest one when its window ended
+    value_cache_stats_t cache;
+    value_cache_stats_get(&s_cache, &cache);
+    CHECK(cache.unchanged == 0);
+    unsubscribe(TEST_CONN_A);
+}
+
+// Records collect in order until the smallest ATT_MTU is full, the rest of the window is dropped
+static void test_append(void)
+{
+    const uint32_t window_ms = 30;
+    const unsigned per_window = (23 - 3) / TEST_RECORD_LEN;
+    const unsigned windows = (TEST_UPDATES + window_ms - 1) / window_ms;
+    notify_coalesce_stats_t stats;
+
+    s_co.mode = NOTIFY_COALESCE_APPEND;
+    subscribe(TEST_CONN_A, 247, 24);
+    subscribe(TEST_CONN_B, 23, 24);
+
+    // The first window ends with the last record of its batch
+    const uint16_t first_seq = s_seq;
+    submit_next();
+    time_advance(window_ms);
+    confirm_all();
+    CHECK(s_sent[TEST_CONN_B].len == TEST_RECORD_LEN);
+
+    feed_1khz(&stats, window_ms);
+    CHECK(stats.updates == TEST_UPDATES && stats.superseded == 0);
+    CHECK(stats.windows == windows && stats.dropped == TEST_UPDATES - windows * per_window);
+    CHECK(stats.notifications == 2 * windows && s_sent[TEST_CONN_B].count == windows);
+    // Append latency runs from the first record of the window
+    CHECK(stats.latency_max_us == window_ms * 1000);
+
+    // The last window holds the records that followed its first one
+    const uint8_t *pdu = s_sent[TEST_CONN_A].pdu;
+    CHECK(s_sent[TEST_CONN_A].len == per_window * TEST_RECORD_LEN);
+    for (unsigned i = 1; i < per_window; i++) {
+        CHECK((uint16_t)(pdu[i * TEST_RECORD_LEN] | pdu[i * TEST_RECORD_LEN + 1] << 8) ==
+              (uint16_t)((pdu[0] | pdu[1] << 8) + i));
+    }
+    CHECK((uint16_t)(pdu[0] | pdu[1] << 8) == (uint16_t)(first_seq + 1 + (windows - 1) * window_ms));
+    report("append, MTU 23", &stats, window_ms);
+
+    unsubscribe(TEST_CONN_A);
+    unsubscribe(TEST_CONN_B);
+}
+
+int main(void)
+{
+    test_latest();
+    test_append();
+
+    printf("test_notify_coalesce: ok\n");
+    return 0;
+}